@@ -22,6 +22,7 @@
 #include <stdbool.h>
 #include <strings.h>
 #include "kernel-shared/volumes.h"
+#include "kernel-shared/disk-io.h"
 #include "crypto/hash.h"
 #include "common/cpu-utils.h"
 #include "common/utils.h"
@@ -30,6 +31,7 @@
 #include "common/box.h"
 #include "common/messages.h"
 #include "cmds/commands.h"
+#include "image/metadump-reader.h"
 
 static const char * const btrfs_cmd_group_usage[] = {
 	/*
@@ -443,6 +445,8 @@ int main(int argc, char **argv)
 	handle_help_options_next_level(cmd, argc, argv);
 	cpu_detect_flags();
 	hash_init_accel();
+	/* Allow to open metadump images directly, eg. by check or dump-tree */
+	btrfs_image_ops = &metadump_image_ops;
 	fixup_argv0(argv, cmd->token);
 
 	ret = cmd_execute(cmd, argc, argv);
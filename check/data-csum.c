@@ -0,0 +1,589 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Data checksum verification pipeline for 'btrfs check --check-data-csum'.
+ *
+ * The csum tree is walked by the caller, each csum item is split at stripe
+ * boundaries and each part is queued once per mirror, the same way the
+ * sequential verification reads it. There is one reader thread per device,
+ * reading the queued ranges in the order of their physical offset. Read data
+ * is passed to a pool of hashing threads and the results are collected and
+ * printed by the caller in the order the parts were queued, so the reports
+ * are the same as from the sequential verification. Verification stops at
+ * the first read error.
+ */
+
+#include "kerncompat.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kernel-lib/sizes.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/extent_io.h"
+#include "kernel-shared/volumes.h"
+#include "common/device-utils.h"
+#include "common/messages.h"
+#include "common/utils.h"
+#include "check/data-csum.h"
+
+/* Upper limit of data read but not yet collected */
+#define DATA_CSUM_MAX_INFLIGHT		(SZ_256M)
+
+enum data_csum_job_state {
+	DATA_CSUM_JOB_READING,
+	DATA_CSUM_JOB_HASHING,
+	DATA_CSUM_JOB_DONE,
+};
+
+struct data_csum_job {
+	/* Device queue or hash queue */
+	struct list_head list;
+	/* All jobs in the order of submission */
+	struct list_head order;
+
+	u64 seq;
+	u64 bytenr;
+	u64 len;
+	/* Used to sort the device queue */
+	u64 physical;
+	int mirror;
+	/* Last mirror of the last part of a csum item */
+	bool last_job;
+
+	enum data_csum_job_state state;
+	int ret;
+	/* Message for a failed read, printed by the collector */
+	char error[64];
+
+	u8 *data;
+	u8 *expected;
+	u8 *result;
+};
+
+struct data_csum_reader {
+	struct data_csum_pipeline *pipe;
+	u64 devid;
+	/* Jobs sorted by physical offset */
+	struct list_head queue;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+struct data_csum_pipeline {
+	struct btrfs_fs_info *fs_info;
+
+	pthread_mutex_t lock;
+	pthread_cond_t hash_cond;
+	pthread_cond_t done_cond;
+	bool stop;
+
+	struct list_head hash_queue;
+	struct list_head jobs;
+	u64 inflight;
+	u64 next_seq;
+	/* Jobs queued after a failed read are not read at all */
+	u64 failed_seq;
+
+	int nr_readers;
+	int nr_started_readers;
+	struct data_csum_reader *readers;
+	int nr_hashers;
+	int nr_started_hashers;
+	pthread_t *hashers;
+
+	/* Collector state, only touched by the caller */
+	bool item_mismatch;
+	bool fatal;
+};
+
+static void free_job(struct data_csum_job *job)
+{
+	free(job->data);
+	free(job->expected);
+	free(job->result);
+	free(job);
+}
+
+/*
+ * Same as read_data_from_disk(), but the error messages are stored in the job
+ * so they're printed in order by the collector and not by the reader thread.
+ * The job does not cross a stripe boundary.
+ */
+static int read_job(struct btrfs_fs_info *fs_info, struct data_csum_job *job)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	struct btrfs_device *device;
+	u64 read_len = job->len;
+	u64 physical;
+	u64 *raid_map = NULL;
+	int ret;
+
+	if (fs_info->image)
+		return fs_info->image_ops->read(fs_info->image, job->data,
+						job->bytenr, job->len);
+
+	ret = btrfs_map_block(fs_info, READ, job->bytenr, &read_len, &multi,
+			      job->mirror, &raid_map);
+	if (ret) {
+		snprintf(job->error, sizeof(job->error),
+			 "Couldn't map the block %llu", job->bytenr);
+		return -EIO;
+	}
+	free(raid_map);
+
+	/* Rebuilding from P/Q does not print anything once the block is mapped */
+	if (job->mirror > 1 && multi->type & BTRFS_BLOCK_GROUP_RAID56_MASK) {
+		kfree(multi);
+		read_len = job->len;
+		return read_data_from_disk(fs_info, job->data, job->bytenr,
+					   &read_len, job->mirror);
+	}
+	device = multi->stripes[0].dev;
+	physical = multi->stripes[0].physical;
+	kfree(multi);
+
+	if (device->fd <= 0)
+		return -EIO;
+
+	ret = btrfs_pread(device->fd, job->data, job->len, physical,
+			  fs_info->zoned);
+	if (ret < 0) {
+		snprintf(job->error, sizeof(job->error),
+			 "Error reading %llu, %d", job->bytenr, ret);
+		return ret;
+	}
+	if (ret != job->len) {
+		snprintf(job->error, sizeof(job->error),
+			 "Short read for %llu, read %d, read_len %llu",
+			 job->bytenr, ret, job->len);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct data_csum_reader *reader = arg;
+	struct data_csum_pipeline *pipe = reader->pipe;
+	struct data_csum_job *job;
+
+	pthread_mutex_lock(&pipe->lock);
+	while (1) {
+		while (list_empty(&reader->queue) && !pipe->stop)
+			pthread_cond_wait(&reader->cond, &pipe->lock);
+		if (pipe->stop)
+			break;
+
+		job = list_first_entry(&reader->queue, struct data_csum_job, list);
+		list_del_init(&job->list);
+		if (job->seq > pipe->failed_seq) {
+			job->ret = -ECANCELED;
+			job->state = DATA_CSUM_JOB_DONE;
+			pthread_cond_signal(&pipe->done_cond);
+			continue;
+		}
+		pthread_mutex_unlock(&pipe->lock);
+
+		job->ret = read_job(pipe->fs_info, job);
+
+		pthread_mutex_lock(&pipe->lock);
+		if (job->ret) {
+			pipe->failed_seq = min(pipe->failed_seq, job->seq);
+			job->state = DATA_CSUM_JOB_DONE;
+			pthread_cond_signal(&pipe->done_cond);
+		} else {
+			job->state = DATA_CSUM_JOB_HASHING;
+			list_add_tail(&job->list, &pipe->hash_queue);
+			pthread_cond_signal(&pipe->hash_cond);
+		}
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+}
+
+static void *hasher_thread(void *arg)
+{
+	struct data_csum_pipeline *pipe = arg;
+	struct btrfs_fs_info *fs_info = pipe->fs_info;
+	const u32 sectorsize = fs_info->sectorsize;
+	struct data_csum_job *job;
+
+	pthread_mutex_lock(&pipe->lock);
+	while (1) {
+		while (list_empty(&pipe->hash_queue) && !pipe->stop)
+			pthread_cond_wait(&pipe->hash_cond, &pipe->lock);
+		if (pipe->stop)
+			break;
+
+		job = list_first_entry(&pipe->hash_queue, struct data_csum_job,
+				       list);
+		list_del_init(&job->list);
+		pthread_mutex_unlock(&pipe->lock);
+
+		btrfs_csum_data_multi(fs_info, fs_info->csum_type, job->data,
+				      job->result, sectorsize,
+				      job->len / sectorsize);
+
+		pthread_mutex_lock(&pipe->lock);
+		job->state = DATA_CSUM_JOB_DONE;
+		pthread_cond_signal(&pipe->done_cond);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+}
+
+/*
+ * Report the result of one job.
+ *
+ * Return <0 for read error.
+ * Return 1 if the job finishes a csum item that had a mismatch in any mirror.
+ * Return 0 otherwise.
+ */
+static int report_job(struct data_csum_pipeline *pipe,
+		      struct data_csum_job *job)
+{
+	struct btrfs_fs_info *fs_info = pipe->fs_info;
+	const u16 csum_size = fs_info->csum_size;
+	u64 nr_sectors = job->len / fs_info->sectorsize;
+	u64 i;
+	int ret = 0;
+
+	if (job->ret) {
+		if (job->error[0])
+			fprintf(stderr, "%s\n", job->error);
+		return job->ret;
+	}
+
+	for (i = 0; i < nr_sectors; i++) {
+		u8 *found = job->result + i * csum_size;
+		u8 *expected = job->expected + i * csum_size;
+		char found_str[BTRFS_CSUM_STRING_LEN];
+		char want_str[BTRFS_CSUM_STRING_LEN];
+
+		if (memcmp(found, expected, csum_size) == 0)
+			continue;
+
+		pipe->item_mismatch = true;
+		btrfs_format_csum(fs_info->csum_type, found, found_str);
+		btrfs_format_csum(fs_info->csum_type, expected, want_str);
+		fprintf(stderr,
+			"mirror %d bytenr %llu csum %s expected csum %s\n",
+			job->mirror, job->bytenr + i * fs_info->sectorsize,
+			found_str, want_str);
+	}
+
+	if (job->last_job) {
+		ret = pipe->item_mismatch;
+		pipe->item_mismatch = false;
+	}
+	return ret;
+}
+
+/*
+ * Collect finished jobs in the order of submission, waiting until the amount
+ * of data in flight drops to @limit. After a failed read all jobs up to the
+ * failed one are collected.
+ *
+ * Return <0 for fatal error, otherwise the number of csum items with mismatch.
+ */
+static int collect_jobs(struct data_csum_pipeline *pipe, u64 limit)
+{
+	struct data_csum_job *job;
+	int mismatches = 0;
+	int ret;
+
+	pthread_mutex_lock(&pipe->lock);
+	while (!list_empty(&pipe->jobs)) {
+		job = list_first_entry(&pipe->jobs, struct data_csum_job, order);
+		if (job->state != DATA_CSUM_JOB_DONE) {
+			if (pipe->inflight <= limit &&
+			    pipe->failed_seq == (u64)-1)
+				break;
+			pthread_cond_wait(&pipe->done_cond, &pipe->lock);
+			continue;
+		}
+		list_del(&job->order);
+		pipe->inflight -= job->len;
+		pthread_mutex_unlock(&pipe->lock);
+
+		ret = report_job(pipe, job);
+		free_job(job);
+		if (ret < 0) {
+			pipe->fatal = true;
+			return ret;
+		}
+		mismatches += ret;
+
+		pthread_mutex_lock(&pipe->lock);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return mismatches;
+}
+
+/*
+ * Find the reader of the device of @job and shorten the job to end at the
+ * stripe boundary.
+ */
+static struct data_csum_reader *pick_reader(struct data_csum_pipeline *pipe,
+					    struct data_csum_job *job)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	u64 *raid_map = NULL;
+	u64 len = job->len;
+	u64 devid;
+	int ret;
+	int i;
+
+	/* The image is not mapped, unmappable ranges fail in the reader */
+	if (pipe->fs_info->image)
+		return &pipe->readers[0];
+	ret = btrfs_map_block(pipe->fs_info, READ, job->bytenr, &len, &multi,
+			      job->mirror, &raid_map);
+	if (ret)
+		return &pipe->readers[0];
+
+	devid = multi->stripes[0].dev->devid;
+	job->physical = multi->stripes[0].physical;
+	job->len = min(job->len, len);
+	kfree(multi);
+	free(raid_map);
+
+	for (i = 0; i < pipe->nr_readers; i++) {
+		if (pipe->readers[i].devid == devid)
+			return &pipe->readers[i];
+	}
+	return &pipe->readers[0];
+}
+
+static void queue_job(struct data_csum_reader *reader,
+		      struct data_csum_job *job)
+{
+	struct list_head *pos;
+	struct data_csum_job *tmp;
+
+	/* Ranges mostly come in ascending order, search from the tail */
+	list_for_each_prev(pos, &reader->queue) {
+		tmp = list_entry(pos, struct data_csum_job, list);
+		if (tmp->physical <= job->physical)
+			break;
+	}
+	list_add(&job->list, pos);
+}
+
+/*
+ * Queue verification of data csums for [@bytenr, @bytenr + @num_bytes), the
+ * expected csums are at @leaf_offset of @leaf.
+ *
+ * Return <0 for fatal error (fails to read data or allocate memory).
+ * Return the number of csum items with mismatch that were collected
+ * meanwhile otherwise.
+ */
+int data_csum_pipeline_queue(struct data_csum_pipeline *pipe, u64 bytenr,
+			     u64 num_bytes, struct extent_buffer *leaf,
+			     unsigned long leaf_offset)
+{
+	struct btrfs_fs_info *fs_info = pipe->fs_info;
+	const u32 sectorsize = fs_info->sectorsize;
+	const u16 csum_size = fs_info->csum_size;
+	struct data_csum_reader *reader;
+	struct data_csum_job *job;
+	u64 offset = 0;
+	u64 read_len = 0;
+	u64 csums_len;
+	u64 limit;
+	int mismatches = 0;
+	int num_copies;
+	int mirror;
+	int ret;
+
+	if (num_bytes % sectorsize)
+		return -EINVAL;
+
+	limit = DATA_CSUM_MAX_INFLIGHT - min_t(u64, num_bytes,
+					       DATA_CSUM_MAX_INFLIGHT);
+	num_copies = btrfs_num_copies(fs_info, bytenr, num_bytes);
+	while (offset < num_bytes) {
+		for (mirror = 1; mirror <= num_copies; mirror++) {
+			ret = collect_jobs(pipe, limit);
+			if (ret < 0)
+				return ret;
+			mismatches += ret;
+
+			job = calloc(1, sizeof(*job));
+			if (!job)
+				return -ENOMEM;
+			INIT_LIST_HEAD(&job->list);
+			job->bytenr = bytenr + offset;
+			job->len = num_bytes - offset;
+			job->mirror = mirror;
+			job->state = DATA_CSUM_JOB_READING;
+			reader = pick_reader(pipe, job);
+			/* Advance by the last mirror like the sequential check */
+			read_len = job->len;
+			job->last_job = (mirror == num_copies &&
+					 offset + read_len == num_bytes);
+
+			csums_len = job->len / sectorsize * csum_size;
+			job->data = malloc(job->len);
+			job->expected = malloc(csums_len);
+			job->result = malloc(csums_len);
+			if (!job->data || !job->expected || !job->result) {
+				free_job(job);
+				return -ENOMEM;
+			}
+			read_extent_buffer(leaf, job->expected,
+				leaf_offset + offset / sectorsize * csum_size,
+				csums_len);
+
+			pthread_mutex_lock(&pipe->lock);
+			job->seq = pipe->next_seq++;
+			queue_job(reader, job);
+			list_add_tail(&job->order, &pipe->jobs);
+			pipe->inflight += job->len;
+			pthread_cond_signal(&reader->cond);
+			pthread_mutex_unlock(&pipe->lock);
+		}
+		offset += read_len;
+	}
+	return mismatches;
+}
+
+static void stop_threads(struct data_csum_pipeline *pipe)
+{
+	int i;
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe->stop = true;
+	for (i = 0; i < pipe->nr_readers; i++)
+		pthread_cond_broadcast(&pipe->readers[i].cond);
+	pthread_cond_broadcast(&pipe->hash_cond);
+	pthread_mutex_unlock(&pipe->lock);
+
+	for (i = 0; i < pipe->nr_started_readers; i++)
+		pthread_join(pipe->readers[i].thread, NULL);
+	for (i = 0; i < pipe->nr_started_hashers; i++)
+		pthread_join(pipe->hashers[i], NULL);
+}
+
+static void free_pipeline(struct data_csum_pipeline *pipe)
+{
+	struct data_csum_job *job;
+	int i;
+
+	while (!list_empty(&pipe->jobs)) {
+		job = list_first_entry(&pipe->jobs, struct data_csum_job, order);
+		list_del(&job->order);
+		free_job(job);
+	}
+	for (i = 0; i < pipe->nr_readers; i++)
+		pthread_cond_destroy(&pipe->readers[i].cond);
+	pthread_cond_destroy(&pipe->hash_cond);
+	pthread_cond_destroy(&pipe->done_cond);
+	pthread_mutex_destroy(&pipe->lock);
+	free(pipe->readers);
+	free(pipe->hashers);
+	free(pipe);
+}
+
+/*
+ * Wait for all queued jobs, report them and release the pipeline.
+ *
+ * Return <0 for fatal error, otherwise the number of csum items with mismatch
+ * that were not reported by data_csum_pipeline_queue() yet.
+ */
+int data_csum_pipeline_finish(struct data_csum_pipeline *pipe)
+{
+	int ret = 0;
+
+	if (!pipe->fatal)
+		ret = collect_jobs(pipe, 0);
+	stop_threads(pipe);
+	free_pipeline(pipe);
+	return ret;
+}
+
+struct data_csum_pipeline *data_csum_pipeline_start(struct btrfs_fs_info *fs_info,
+						    int nr_hashers)
+{
+	struct data_csum_pipeline *pipe;
+	struct btrfs_device *device;
+	int nr_devices = 0;
+	int ret;
+	int i;
+
+#if CRYPTOPROVIDER_LIBKCAPI == 1
+	/* The libkcapi hash handles are shared and not thread safe */
+	nr_hashers = 1;
+#endif
+
+	pipe = calloc(1, sizeof(*pipe));
+	if (!pipe)
+		return NULL;
+
+	list_for_each_entry(device, &fs_info->fs_devices->devices, dev_list)
+		nr_devices++;
+	pipe->fs_info = fs_info;
+	pipe->nr_readers = max(nr_devices, 1);
+	pipe->nr_hashers = nr_hashers;
+	pipe->readers = calloc(pipe->nr_readers, sizeof(*pipe->readers));
+	pipe->hashers = calloc(pipe->nr_hashers, sizeof(*pipe->hashers));
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->hash_cond, NULL);
+	pthread_cond_init(&pipe->done_cond, NULL);
+	INIT_LIST_HEAD(&pipe->hash_queue);
+	INIT_LIST_HEAD(&pipe->jobs);
+	pipe->failed_seq = (u64)-1;
+	if (!pipe->readers || !pipe->hashers) {
+		pipe->nr_readers = 0;
+		free_pipeline(pipe);
+		return NULL;
+	}
+
+	i = 0;
+	list_for_each_entry(device, &fs_info->fs_devices->devices, dev_list)
+		pipe->readers[i++].devid = device->devid;
+	for (i = 0; i < pipe->nr_readers; i++) {
+		pipe->readers[i].pipe = pipe;
+		INIT_LIST_HEAD(&pipe->readers[i].queue);
+		pthread_cond_init(&pipe->readers[i].cond, NULL);
+	}
+
+	for (i = 0; i < pipe->nr_readers; i++) {
+		ret = pthread_create(&pipe->readers[i].thread, NULL,
+				     reader_thread, &pipe->readers[i]);
+		if (ret)
+			goto fail;
+		pipe->nr_started_readers++;
+	}
+	for (i = 0; i < pipe->nr_hashers; i++) {
+		ret = pthread_create(&pipe->hashers[i], NULL, hasher_thread,
+				     pipe);
+		if (ret)
+			goto fail;
+		pipe->nr_started_hashers++;
+	}
+	return pipe;
+
+fail:
+	errno = ret;
+	error("failed to start data csum verification thread: %m");
+	stop_threads(pipe);
+	free_pipeline(pipe);
+	return NULL;
+}
@@ -0,0 +1,33 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_CHECK_DATA_CSUM_H__
+#define __BTRFS_CHECK_DATA_CSUM_H__
+
+#include "kerncompat.h"
+
+struct btrfs_fs_info;
+struct extent_buffer;
+struct data_csum_pipeline;
+
+struct data_csum_pipeline *data_csum_pipeline_start(struct btrfs_fs_info *fs_info,
+						    int nr_hashers);
+int data_csum_pipeline_queue(struct data_csum_pipeline *pipe, u64 bytenr,
+			     u64 num_bytes, struct extent_buffer *leaf,
+			     unsigned long leaf_offset);
+int data_csum_pipeline_finish(struct data_csum_pipeline *pipe);
+
+#endif
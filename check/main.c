@@ -56,6 +56,7 @@
 #include "common/help.h"
 #include "common/open-utils.h"
 #include "common/string-utils.h"
+#include "common/tree-reada.h"
 #include "cmds/commands.h"
 #include "mkfs/common.h"
 #include "check/common.h"
@@ -65,6 +66,7 @@
 #include "check/mode-lowmem.h"
 #include "check/qgroup-verify.h"
 #include "check/clear-cache.h"
+#include "check/data-csum.h"
 
 /* Global context variables */
 struct btrfs_fs_info *gfs_info;
@@ -83,6 +85,7 @@ int no_holes = 0;
 static int is_free_space_tree = 0;
 int init_extent_tree = 0;
 int check_data_csum = 0;
+static int check_threads = 1;
 struct cache_tree *roots_info_cache = NULL;
 
 enum btrfs_check_mode {
@@ -5377,7 +5380,8 @@ static int process_device_item(struct rb_root *dev_cache,
 	rec->bad_block_dev_size = false;
 
 	device = btrfs_find_device_by_devid(gfs_info->fs_devices, rec->devid, 0);
-	if (device && device->fd >= 0) {
+	/* The size of an image file says nothing about the device */
+	if (device && device->fd >= 0 && !gfs_info->image) {
 		struct stat st;
 		u64 block_dev_size;
 
@@ -5695,8 +5699,8 @@ static int check_extent_csums(struct btrfs_root *root, u64 bytenr,
 	u16 csum_size = gfs_info->csum_size;
 	u16 csum_type = gfs_info->csum_type;
 	u8 *data;
+	u8 *results;
 	unsigned long csum_offset;
-	u8 result[BTRFS_CSUM_SIZE];
 	u8 csum_expected[BTRFS_CSUM_SIZE];
 	u64 read_len;
 	u64 data_checked = 0;
@@ -5710,8 +5714,12 @@ static int check_extent_csums(struct btrfs_root *root, u64 bytenr,
 		return -EINVAL;
 
 	data = malloc(num_bytes);
-	if (!data)
+	results = malloc(num_bytes / gfs_info->sectorsize * csum_size);
+	if (!data || !results) {
+		free(data);
+		free(results);
 		return -ENOMEM;
+	}
 
 	num_copies = btrfs_num_copies(gfs_info, bytenr, num_bytes);
 	while (offset < num_bytes) {
@@ -5728,14 +5736,20 @@ static int check_extent_csums(struct btrfs_root *root, u64 bytenr,
 			if (ret)
 				goto out;
 
+			ret = btrfs_csum_data_multi(gfs_info, csum_type,
+					data + offset, results,
+					gfs_info->sectorsize,
+					read_len / gfs_info->sectorsize);
+			if (ret < 0)
+				goto out;
+
 			data_checked = 0;
 			/* verify every 4k data's checksum */
 			while (data_checked < read_len) {
-				tmp = offset + data_checked;
-
-				btrfs_csum_data(gfs_info, csum_type, data + tmp,
-						result, gfs_info->sectorsize);
+				u8 *result = results + data_checked /
+					     gfs_info->sectorsize * csum_size;
 
+				tmp = offset + data_checked;
 				csum_offset = leaf_offset +
 					 tmp / gfs_info->sectorsize * csum_size;
 				read_extent_buffer(eb, (char *)&csum_expected,
@@ -5759,6 +5773,7 @@ static int check_extent_csums(struct btrfs_root *root, u64 bytenr,
 	}
 out:
 	free(data);
+	free(results);
 	if (!ret && csum_mismatch)
 		ret = 1;
 	return ret;
@@ -5920,6 +5935,7 @@ static int check_csum_root(struct btrfs_root *root)
 	u64 data_len;
 	unsigned long leaf_offset;
 	bool verify_csum = !!check_data_csum;
+	struct data_csum_pipeline *pipe = NULL;
 	u16 num_entries, max_entries;
 
 	max_entries = ((BTRFS_LEAF_DATA_SIZE(gfs_info) -
@@ -5955,6 +5971,9 @@ static int check_csum_root(struct btrfs_root *root)
 		verify_csum = false;
 	}
 
+	if (verify_csum && check_threads > 1)
+		pipe = data_csum_pipeline_start(gfs_info, check_threads);
+
 	while (1) {
 		g_task_ctx.item_count++;
 		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
@@ -5996,15 +6015,23 @@ static int check_csum_root(struct btrfs_root *root)
 		if (!verify_csum)
 			goto skip_csum_check;
 		leaf_offset = btrfs_item_ptr_offset(leaf, path.slots[0]);
-		ret = check_extent_csums(root, key.offset, data_len,
-					 leaf_offset, leaf);
+		if (pipe)
+			ret = data_csum_pipeline_queue(pipe, key.offset,
+						       data_len, leaf,
+						       leaf_offset);
+		else
+			ret = check_extent_csums(root, key.offset, data_len,
+						 leaf_offset, leaf);
 		/*
 		 * Only break for fatal errors, if mismatch is found, continue
 		 * checking until all extents are checked.
 		 */
 		if (ret < 0)
 			break;
-		if (ret > 0)
+		/* The pipeline returns the number of items with mismatch */
+		if (pipe)
+			errors += ret;
+		else if (ret > 0)
 			errors++;
 skip_csum_check:
 		if (!num_bytes) {
@@ -6025,6 +6052,11 @@ skip_csum_check:
 		path.slots[0]++;
 	}
 
+	if (pipe) {
+		ret = data_csum_pipeline_finish(pipe);
+		if (ret > 0)
+			errors += ret;
+	}
 	btrfs_release_path(&path);
 	return errors;
 }
@@ -6235,6 +6267,7 @@ static int run_next_block(struct btrfs_root *root,
 		return 1;
 
 	if (!reada_bits) {
+		btrfs_tree_reada_plug(gfs_info);
 		for (i = 0; i < nritems; i++) {
 			ret = add_cache_extent(reada, bits[i].start,
 					       bits[i].size);
@@ -6244,6 +6277,7 @@ static int run_next_block(struct btrfs_root *root,
 			/* fixme, get the parent transid */
 			readahead_tree_block(gfs_info, bits[i].start, 0);
 		}
+		btrfs_tree_reada_unplug(gfs_info);
 	}
 	*last = bits[0].start;
 	bytenr = bits[0].start;
@@ -9976,6 +10010,7 @@ static const char * const cmd_check_usage[] = {
 	OPTLINE("-Q|--qgroup-report", "print a report on qgroup consistency"),
 	OPTLINE("-E|--subvol-extents <subvolid>", "print subvolume extents and sharing state"),
 	OPTLINE("-p|--progress", "indicate progress"),
+	OPTLINE("--threads <N>", "read and verify tree blocks and data using N threads (read-only mode)"),
 	NULL
 };
 
@@ -10010,7 +10045,8 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			GETOPT_VAL_INIT_EXTENT, GETOPT_VAL_CHECK_CSUM,
 			GETOPT_VAL_READONLY, GETOPT_VAL_CHUNK_TREE,
 			GETOPT_VAL_MODE, GETOPT_VAL_CLEAR_SPACE_CACHE,
-			GETOPT_VAL_CLEAR_INO_CACHE, GETOPT_VAL_FORCE };
+			GETOPT_VAL_CLEAR_INO_CACHE, GETOPT_VAL_FORCE,
+			GETOPT_VAL_THREADS };
 		static const struct option long_options[] = {
 			{ "super", required_argument, NULL, 's' },
 			{ "repair", no_argument, NULL, GETOPT_VAL_REPAIR },
@@ -10035,6 +10071,8 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			{ "clear-ino-cache", no_argument , NULL,
 				GETOPT_VAL_CLEAR_INO_CACHE},
 			{ "force", no_argument, NULL, GETOPT_VAL_FORCE },
+			{ "threads", required_argument, NULL,
+				GETOPT_VAL_THREADS },
 			{ NULL, 0, NULL, 0}
 		};
 
@@ -10126,6 +10164,16 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			case GETOPT_VAL_FORCE:
 				force = 1;
 				break;
+			case GETOPT_VAL_THREADS:
+				num = arg_strtou64(optarg);
+				if (num == 0 || num > BTRFS_TREE_READA_MAX_THREADS) {
+					error(
+				"number of threads out of range, must be 1 to %d",
+						BTRFS_TREE_READA_MAX_THREADS);
+					exit(1);
+				}
+				check_threads = num;
+				break;
 		}
 	}
 
@@ -10143,6 +10191,12 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		exit(1);
 	}
 
+	if (check_threads > 1 && (opt_check_repair || clear_space_cache ||
+			       clear_ino_cache)) {
+		error("--threads is only supported in read-only mode");
+		exit(1);
+	}
+
 	if (opt_check_repair && !force) {
 		int delay = 10;
 
@@ -10171,6 +10225,7 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 
 	cache_tree_init(&root_cache);
 	qgroup_set_item_count_ptr(&g_task_ctx.item_count);
+	qgroup_set_nr_threads(check_threads);
 
 	ret = check_mounted(argv[optind]);
 	if (!force) {
@@ -10235,6 +10290,14 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		goto close_out;
 	}
 
+	if (check_threads > 1) {
+		ret = btrfs_tree_reada_start(gfs_info, check_threads);
+		if (ret < 0) {
+			err |= !!ret;
+			goto close_out;
+		}
+	}
+
 	if (clear_space_cache) {
 		ret = do_clear_free_space_cache(gfs_info, clear_space_cache);
 		err |= !!ret;
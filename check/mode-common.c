@@ -32,6 +32,7 @@
 #include "common/internal.h"
 #include "common/messages.h"
 #include "common/utils.h"
+#include "common/tree-reada.h"
 #include "check/mode-common.h"
 #include "check/repair.h"
 
@@ -532,11 +533,13 @@ void reada_walk_down(struct btrfs_root *root, struct extent_buffer *node,
 		return;
 
 	nritems = btrfs_header_nritems(node);
+	btrfs_tree_reada_plug(gfs_info);
 	for (i = slot; i < nritems; i++) {
 		bytenr = btrfs_node_blockptr(node, i);
 		ptr_gen = btrfs_node_ptr_generation(node, i);
 		readahead_tree_block(gfs_info, bytenr, ptr_gen);
 	}
+	btrfs_tree_reada_unplug(gfs_info);
 }
 
 /*
@@ -1205,26 +1208,30 @@ error:
 	return ret;
 }
 
+/* Size of the buffer for populate_csum(), data are read and hashed in batches */
+#define POPULATE_CSUM_BATCH	(SZ_1M)
+
 static int populate_csum(struct btrfs_trans_handle *trans,
 			 struct btrfs_root *csum_root, char *buf, u64 start,
 			 u64 len)
 {
 	struct btrfs_fs_info *fs_info = trans->fs_info;
 	u64 offset = 0;
-	u64 sectorsize = fs_info->sectorsize;
+	u64 read_len;
 	int ret = 0;
 
 	while (offset < len) {
+		read_len = min_t(u64, len - offset, POPULATE_CSUM_BATCH);
 		ret = read_data_from_disk(fs_info, buf, start + offset,
-					  &sectorsize, 0);
+					  &read_len, 0);
 		if (ret)
 			break;
-		ret = btrfs_csum_file_block(trans, start + offset,
+		ret = btrfs_csum_file_range(trans, start + offset, read_len,
 					    BTRFS_EXTENT_CSUM_OBJECTID,
 					    fs_info->csum_type, buf);
 		if (ret)
 			break;
-		offset += sectorsize;
+		offset += read_len;
 	}
 	return ret;
 }
@@ -1244,7 +1251,7 @@ static int fill_csum_tree_from_one_fs_root(struct btrfs_trans_handle *trans,
 	int slot = 0;
 	int ret = 0;
 
-	buf = malloc(gfs_info->sectorsize);
+	buf = malloc(POPULATE_CSUM_BATCH);
 	if (!buf)
 		return -ENOMEM;
 
@@ -1504,7 +1511,7 @@ static int fill_csum_tree_from_extent(struct btrfs_trans_handle *trans,
 		return ret;
 	}
 
-	buf = malloc(gfs_info->sectorsize);
+	buf = malloc(POPULATE_CSUM_BATCH);
 	if (!buf) {
 		btrfs_release_path(&path);
 		return -ENOMEM;
@@ -4610,7 +4610,8 @@ next:
 	check_dev_size_alignment(dev_id, total_bytes, gfs_info->sectorsize);
 
 	dev = btrfs_find_device_by_devid(gfs_info->fs_devices, dev_id, 0);
-	if (!dev || dev->fd < 0)
+	/* The size of an image file says nothing about the device */
+	if (!dev || dev->fd < 0 || gfs_info->image)
 		return 0;
 
 	ret = fstat(dev->fd, &st);
@@ -21,27 +21,38 @@
 #include "kerncompat.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include "kernel-lib/bitops.h"
 #include "kernel-lib/list.h"
 #include "kernel-lib/rbtree.h"
 #include "kernel-lib/rbtree_types.h"
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/ulist.h"
 #include "kernel-shared/extent_io.h"
 #include "kernel-shared/transaction.h"
+#include "common/internal.h"
 #include "common/messages.h"
 #include "common/rbtree-utils.h"
 #include "check/repair.h"
 #include "check/qgroup-verify.h"
 
 static u64 *qgroup_item_count;
+static int qgroup_nr_threads = 1;
 
 void qgroup_set_item_count_ptr(u64 *item_count_ptr)
 {
 	qgroup_item_count = item_count_ptr;
 }
 
+void qgroup_set_nr_threads(int nr_threads)
+{
+	qgroup_nr_threads = max(nr_threads, 1);
+}
+
 /*#define QGROUP_VERIFY_DEBUG*/
 static unsigned long tot_extents_scanned = 0;
 
@@ -75,7 +86,8 @@ struct qgroup_count {
 	 */
 	struct list_head members;
 
-	u64 cur_refcnt;
+	/* Slot of the group in the per-thread accounting arrays */
+	unsigned int index;
 
 	struct list_head bad_list;
 };
@@ -103,26 +115,52 @@ struct btrfs_qgroup_list {
 	struct qgroup_count *member;
 };
 
-/* Allow us to reset ref counts during accounting without zeroing each group. */
-static u64 qgroup_seq = 1ULL;
+/* Number of parent bytenrs whose resolved roots are remembered per thread */
+#define QGROUP_ROOTS_CACHE_SLOTS	(4096)
+
+/* Roots resolved for a shared tree block, see find_parent_roots() */
+struct roots_cache_entry {
+	u64 bytenr;
+	u64 *roots;
+	unsigned int nr_roots;
+};
+
+/*
+ * Accounting state of one thread, the ref counts and the accounted bytes of
+ * the qgroups are indexed by qgroup_count::index. The bytes are added to the
+ * qgroup counts once all extents are accounted.
+ */
+struct qgroup_account {
+	/* Allow us to reset ref counts during accounting without zeroing each group. */
+	u64 seq;
+	u64 *cur_refcnt;
+	struct qgroup_info *info;
+	struct roots_cache_entry *roots_cache;
+};
 
-static inline void update_cur_refcnt(struct qgroup_count *c)
+static inline void update_cur_refcnt(struct qgroup_account *acc,
+				     struct qgroup_count *c)
 {
-	if (c->cur_refcnt < qgroup_seq)
-		c->cur_refcnt = qgroup_seq;
-	c->cur_refcnt++;
+	u64 *refcnt = &acc->cur_refcnt[c->index];
+
+	if (*refcnt < acc->seq)
+		*refcnt = acc->seq;
+	(*refcnt)++;
 }
 
-static inline u64 group_get_cur_refcnt(struct qgroup_count *c)
+static inline u64 group_get_cur_refcnt(struct qgroup_account *acc,
+				       struct qgroup_count *c)
 {
-	if (c->cur_refcnt < qgroup_seq)
+	u64 refcnt = acc->cur_refcnt[c->index];
+
+	if (refcnt < acc->seq)
 		return 0;
-	return c->cur_refcnt - qgroup_seq;
+	return refcnt - acc->seq;
 }
 
-static void inc_qgroup_seq(int root_count)
+static void inc_qgroup_seq(struct qgroup_account *acc, int root_count)
 {
-	qgroup_seq += root_count + 1;
+	acc->seq += root_count + 1;
 }
 
 /*
@@ -324,10 +362,14 @@ static void free_ref_node(struct rb_node *node)
 
 FREE_RB_BASED_TREE(ref, free_ref_node);
 
+static int find_parent_roots(struct qgroup_account *acc, struct ulist *roots,
+			     u64 parent);
+
 /*
  * Resolves all the possible roots for the ref at parent.
  */
-static int find_parent_roots(struct ulist *roots, u64 parent)
+static int resolve_parent_roots(struct qgroup_account *acc, struct ulist *roots,
+				u64 parent)
 {
 	struct ref *ref;
 	struct rb_node *node;
@@ -380,11 +422,12 @@ static int find_parent_roots(struct ulist *roots, u64 parent)
 			}
 		} else if (ref->parent == ref->bytenr) {
 			/*
-			 * Special loop case for tree reloc tree
+			 * Special loop case for tree reloc tree, there's no
+			 * root to account. The ref is left as is, the tree is
+			 * shared by all accounting threads.
 			 */
-			ref->root = BTRFS_TREE_RELOC_OBJECTID;
 		} else {
-			ret = find_parent_roots(roots, ref->parent);
+			ret = find_parent_roots(acc, roots, ref->parent);
 			if (ret < 0)
 				goto out;
 		}
@@ -399,7 +442,68 @@ out:
 	return ret;
 }
 
-static int account_one_extent(struct ulist *roots, u64 bytenr, u64 num_bytes)
+/*
+ * Add the roots of the shared tree block at @parent to @roots.
+ *
+ * The roots are resolved by walking up the shared refs, which is repeated
+ * for every extent below the same tree block. The result is remembered in a
+ * direct mapped cache of fixed size, so the memory stays bounded regardless
+ * of the number of tree blocks. The roots are added in the same order as if
+ * they were resolved again.
+ */
+static int find_parent_roots(struct qgroup_account *acc, struct ulist *roots,
+			     u64 parent)
+{
+	struct roots_cache_entry *entry;
+	struct ulist_iterator uiter;
+	struct ulist_node *unode;
+	struct ulist *found;
+	unsigned int slot;
+	unsigned int i;
+	u64 *cached;
+	int ret;
+
+	slot = (parent / SZ_4K) % QGROUP_ROOTS_CACHE_SLOTS;
+	entry = &acc->roots_cache[slot];
+	if (entry->bytenr != parent) {
+		found = ulist_alloc(0);
+		if (!found)
+			return -ENOMEM;
+		ret = resolve_parent_roots(acc, found, parent);
+		if (ret < 0) {
+			ulist_free(found);
+			return ret;
+		}
+		cached = malloc(max_t(unsigned long, found->nnodes, 1) *
+				sizeof(u64));
+		if (!cached) {
+			ulist_free(found);
+			return -ENOMEM;
+		}
+		i = 0;
+		ULIST_ITER_INIT(&uiter);
+		while ((unode = ulist_next(found, &uiter)))
+			cached[i++] = unode->val;
+		ulist_free(found);
+
+		/* The recursion may have used the same slot meanwhile */
+		entry = &acc->roots_cache[slot];
+		free(entry->roots);
+		entry->bytenr = parent;
+		entry->roots = cached;
+		entry->nr_roots = i;
+	}
+
+	for (i = 0; i < entry->nr_roots; i++) {
+		ret = ulist_add(roots, entry->roots[i], 0, 0);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int account_one_extent(struct qgroup_account *acc, struct ulist *roots,
+			      u64 bytenr, u64 num_bytes)
 {
 	int ret;
 	u64 id, nr_roots, nr_refs;
@@ -449,7 +553,7 @@ static int account_one_extent(struct ulist *roots, u64 bytenr, u64 num_bytes)
 		while ((tmp_unode = ulist_next(tmp, &tmp_uiter))) {
 			/* Bump the refcount on a node every time we see it. */
 			count = u64_to_ptr(tmp_unode->aux);
-			update_cur_refcnt(count);
+			update_cur_refcnt(acc, count);
 
 			list_for_each_entry(glist, &count->groups, next_group) {
 				struct qgroup_count *parent;
@@ -477,16 +581,19 @@ static int account_one_extent(struct ulist *roots, u64 bytenr, u64 num_bytes)
 	nr_roots = roots->nnodes;
 	ULIST_ITER_INIT(&uiter);
 	while ((unode = ulist_next(counts, &uiter))) {
+		struct qgroup_info *info;
+
 		count = u64_to_ptr(unode->aux);
+		info = &acc->info[count->index];
 
-		nr_refs = group_get_cur_refcnt(count);
+		nr_refs = group_get_cur_refcnt(acc, count);
 		if (nr_refs) {
-			count->info.referenced += num_bytes;
-			count->info.referenced_compressed += num_bytes;
+			info->referenced += num_bytes;
+			info->referenced_compressed += num_bytes;
 
 			if (nr_refs == nr_roots) {
-				count->info.exclusive += num_bytes;
-				count->info.exclusive_compressed += num_bytes;
+				info->exclusive += num_bytes;
+				info->exclusive_compressed += num_bytes;
 			}
 		}
 #ifdef QGROUP_VERIFY_DEBUG
@@ -494,12 +601,12 @@ static int account_one_extent(struct ulist *roots, u64 bytenr, u64 num_bytes)
 		       " excl %llu, refs %llu, roots %llu\n", bytenr, num_bytes,
 		       btrfs_qgroup_level(count->qgroupid),
 		       btrfs_qgroup_subvolid(count->qgroupid),
-		       count->info.referenced, count->info.exclusive, nr_refs,
+		       info->referenced, info->exclusive, nr_refs,
 		       nr_roots);
 #endif
 	}
 
-	inc_qgroup_seq(roots->nnodes);
+	inc_qgroup_seq(acc, roots->nnodes);
 	ret = 0;
 out:
 	ulist_free(counts);
@@ -509,9 +616,58 @@ out:
 
 static void print_subvol_info(u64 subvolid, u64 bytenr, u64 num_bytes,
 			      struct ulist *roots);
+
+/* Extents claimed at once by an accounting thread */
+#define QGROUP_ACCOUNT_BATCH		(1024)
+
+struct account_refs_ctl {
+	pthread_mutex_t lock;
+	/* The first ref of each extent, in the order of bytenr */
+	struct ref **extents;
+	u64 nr_extents;
+	/* Next extent to be claimed by a thread */
+	u64 next;
+	int do_qgroups;
+	u64 search_subvol;
+	/* First error of any thread */
+	int ret;
+};
+
+struct account_worker {
+	struct account_refs_ctl *ctl;
+	struct qgroup_account acc;
+	pthread_t thread;
+	bool started;
+};
+
+static int init_qgroup_account(struct qgroup_account *acc,
+			       unsigned int nr_groups)
+{
+	acc->seq = 1ULL;
+	acc->cur_refcnt = calloc(max(nr_groups, 1U), sizeof(u64));
+	acc->info = calloc(max(nr_groups, 1U), sizeof(struct qgroup_info));
+	acc->roots_cache = calloc(QGROUP_ROOTS_CACHE_SLOTS,
+				  sizeof(struct roots_cache_entry));
+	if (!acc->cur_refcnt || !acc->info || !acc->roots_cache)
+		return -ENOMEM;
+	return 0;
+}
+
+static void release_qgroup_account(struct qgroup_account *acc)
+{
+	int i;
+
+	if (acc->roots_cache) {
+		for (i = 0; i < QGROUP_ROOTS_CACHE_SLOTS; i++)
+			free(acc->roots_cache[i].roots);
+	}
+	free(acc->roots_cache);
+	free(acc->cur_refcnt);
+	free(acc->info);
+}
+
 /*
- * Account each ref. Walk the refs, for each set of refs in a
- * given bytenr:
+ * Account one extent. Walk the refs of the extent starting at @ref:
  *
  * - add the roots for direct refs to the ref roots ulist
  *
@@ -521,67 +677,212 @@ static void print_subvol_info(u64 subvolid, u64 bytenr, u64 num_bytes,
  * - With all roots resolved we can account the ref - this is done in
  *   account_one_extent().
  */
-static int account_all_refs(int do_qgroups, u64 search_subvol)
+static int account_extent_refs(struct qgroup_account *acc,
+			       struct account_refs_ctl *ctl,
+			       struct ulist *roots, struct ref *ref)
 {
-	struct ref *ref;
-	struct rb_node *node;
-	u64 bytenr, num_bytes;
-	struct ulist *roots = ulist_alloc(0);
+	struct rb_node *node = &ref->bytenr_node;
+	u64 bytenr = ref->bytenr;
+	u64 num_bytes = ref->num_bytes;
 	int ret;
 
-	node = rb_first(&by_bytenr);
-	while (node) {
-		ulist_reinit(roots);
+	ulist_reinit(roots);
 
-		ref = rb_entry(node, struct ref, bytenr_node);
-		/*
-		 * Walk forward through the list of refs for this
-		 * bytenr, adding roots to our ulist. If it's a full
-		 * ref, then we have the easy case. Otherwise we need
-		 * to search for roots.
-		 */
-		bytenr = ref->bytenr;
-		num_bytes = ref->num_bytes;
-		do {
-			BUG_ON(ref->bytenr != bytenr);
-			BUG_ON(ref->num_bytes != num_bytes);
-			if (ref->root) {
-				if (is_fstree(ref->root)) {
-					if (ulist_add(roots, ref->root, 0, 0) < 0)
-						goto enomem;
-				}
-			} else {
-				ret = find_parent_roots(roots, ref->parent);
+	/*
+	 * Walk forward through the list of refs for this bytenr, adding
+	 * roots to our ulist. If it's a full ref, then we have the easy
+	 * case. Otherwise we need to search for roots.
+	 */
+	do {
+		BUG_ON(ref->bytenr != bytenr);
+		BUG_ON(ref->num_bytes != num_bytes);
+		if (ref->root) {
+			if (is_fstree(ref->root)) {
+				ret = ulist_add(roots, ref->root, 0, 0);
 				if (ret < 0)
-					goto enomem;
+					return ret;
 			}
+		} else {
+			ret = find_parent_roots(acc, roots, ref->parent);
+			if (ret < 0)
+				return ret;
+		}
 
-			/*
-			 * When we leave this inner loop, node is set
-			 * to next in our tree and will be turned into
-			 * a ref object up top
-			 */
-			node = rb_next(node);
-			if (node)
-				ref = rb_entry(node, struct ref, bytenr_node);
-		} while (node && ref->bytenr == bytenr);
+		node = rb_next(node);
+		if (node)
+			ref = rb_entry(node, struct ref, bytenr_node);
+	} while (node && ref->bytenr == bytenr);
 
-		if (search_subvol)
-			print_subvol_info(search_subvol, bytenr, num_bytes,
-					  roots);
+	if (ctl->search_subvol)
+		print_subvol_info(ctl->search_subvol, bytenr, num_bytes, roots);
 
-		if (!do_qgroups)
-			continue;
+	if (!ctl->do_qgroups)
+		return 0;
 
-		if (account_one_extent(roots, bytenr, num_bytes))
-			goto enomem;
+	return account_one_extent(acc, roots, bytenr, num_bytes);
+}
+
+/*
+ * Claim batches of extents until all are accounted, the threads work on
+ * distinct ranges of bytenr.
+ */
+static void *account_refs_worker(void *arg)
+{
+	struct account_worker *worker = arg;
+	struct account_refs_ctl *ctl = worker->ctl;
+	struct ulist *roots;
+	u64 start, end, i;
+	int ret = 0;
+
+	roots = ulist_alloc(0);
+	if (!roots) {
+		ret = -ENOMEM;
+		goto out;
 	}
 
+	while (1) {
+		pthread_mutex_lock(&ctl->lock);
+		if (ctl->ret || ctl->next >= ctl->nr_extents) {
+			pthread_mutex_unlock(&ctl->lock);
+			break;
+		}
+		start = ctl->next;
+		end = min_t(u64, start + QGROUP_ACCOUNT_BATCH, ctl->nr_extents);
+		ctl->next = end;
+		pthread_mutex_unlock(&ctl->lock);
+
+		for (i = start; i < end; i++) {
+			ret = account_extent_refs(&worker->acc, ctl, roots,
+						  ctl->extents[i]);
+			if (ret)
+				goto out;
+		}
+	}
+out:
 	ulist_free(roots);
-	return 0;
+	if (ret) {
+		pthread_mutex_lock(&ctl->lock);
+		if (!ctl->ret)
+			ctl->ret = ret;
+		pthread_mutex_unlock(&ctl->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Account all extents in the ref tree, or print the extents of
+ * @search_subvol.
+ *
+ * With more threads set by qgroup_set_nr_threads() the extents are split
+ * into batches, each thread accounts the bytes to its own copy of the qgroup
+ * numbers and these are added to the qgroup counts at the end. The ref tree
+ * and the qgroups are only read by the threads. Printing the extents is done
+ * in order by one thread.
+ */
+static int account_all_refs(int do_qgroups, u64 search_subvol)
+{
+	struct account_refs_ctl ctl = { 0 };
+	struct account_worker *workers = NULL;
+	struct qgroup_count **groups = NULL;
+	unsigned int nr_groups = 0;
+	struct rb_node *node;
+	struct ref *ref;
+	u64 bytenr;
+	int nr_workers = 0;
+	int ret = 0;
+	int i;
+
+	pthread_mutex_init(&ctl.lock, NULL);
+	ctl.do_qgroups = do_qgroups;
+	ctl.search_subvol = search_subvol;
+
+	for (node = rb_first(&counts.root); node; node = rb_next(node))
+		nr_groups++;
+	groups = calloc(max(nr_groups, 1U), sizeof(*groups));
+	if (!groups)
+		goto enomem;
+	nr_groups = 0;
+	for (node = rb_first(&counts.root); node; node = rb_next(node)) {
+		struct qgroup_count *c;
+
+		c = rb_entry(node, struct qgroup_count, rb_node);
+		c->index = nr_groups;
+		groups[nr_groups++] = c;
+	}
+
+	/* Collect the first ref of each extent, in the order of bytenr */
+	bytenr = 0;
+	for (node = rb_first(&by_bytenr); node; node = rb_next(node)) {
+		ref = rb_entry(node, struct ref, bytenr_node);
+		if (!ctl.nr_extents || ref->bytenr != bytenr)
+			ctl.nr_extents++;
+		bytenr = ref->bytenr;
+	}
+	ctl.extents = malloc(max_t(u64, ctl.nr_extents, 1) * sizeof(*ctl.extents));
+	if (!ctl.extents)
+		goto enomem;
+	ctl.nr_extents = 0;
+	for (node = rb_first(&by_bytenr); node; node = rb_next(node)) {
+		ref = rb_entry(node, struct ref, bytenr_node);
+		if (!ctl.nr_extents || ref->bytenr != bytenr)
+			ctl.extents[ctl.nr_extents++] = ref;
+		bytenr = ref->bytenr;
+	}
+
+	nr_workers = search_subvol ? 1 : qgroup_nr_threads;
+	nr_workers = min_t(u64, nr_workers,
+			   DIV_ROUND_UP(ctl.nr_extents, QGROUP_ACCOUNT_BATCH));
+	nr_workers = max(nr_workers, 1);
+	workers = calloc(nr_workers, sizeof(*workers));
+	if (!workers)
+		goto enomem;
+	for (i = 0; i < nr_workers; i++) {
+		workers[i].ctl = &ctl;
+		if (init_qgroup_account(&workers[i].acc, nr_groups))
+			goto enomem;
+	}
+
+	/* The calling thread accounts too, a thread failing to start is skipped */
+	for (i = 1; i < nr_workers; i++) {
+		if (!pthread_create(&workers[i].thread, NULL,
+				    account_refs_worker, &workers[i]))
+			workers[i].started = true;
+	}
+	account_refs_worker(&workers[0]);
+	for (i = 1; i < nr_workers; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+	}
+	if (ctl.ret)
+		goto enomem;
+
+	for (i = 0; i < nr_workers && do_qgroups; i++) {
+		unsigned int j;
+
+		for (j = 0; j < nr_groups; j++) {
+			struct qgroup_info *info = &groups[j]->info;
+			struct qgroup_info *delta = &workers[i].acc.info[j];
+
+			info->referenced += delta->referenced;
+			info->referenced_compressed +=
+				delta->referenced_compressed;
+			info->exclusive += delta->exclusive;
+			info->exclusive_compressed += delta->exclusive_compressed;
+		}
+	}
+	goto out;
+
 enomem:
 	error_msg(ERROR_MSG_MEMORY, "accounting for refs for qgroups");
-	return -ENOMEM;
+	ret = -ENOMEM;
+out:
+	for (i = 0; workers && i < nr_workers; i++)
+		release_qgroup_account(&workers[i].acc);
+	free(workers);
+	free(ctl.extents);
+	free(groups);
+	pthread_mutex_destroy(&ctl.lock);
+	return ret;
 }
 
 static u64 resolve_one_root(u64 bytenr)
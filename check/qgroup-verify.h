@@ -33,5 +33,6 @@ int print_extent_state(struct btrfs_fs_info *info, u64 subvol);
 void free_qgroup_counts(void);
 
 void qgroup_set_item_count_ptr(u64 *item_count_ptr);
+void qgroup_set_nr_threads(int nr_threads);
 
 #endif
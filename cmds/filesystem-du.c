@@ -28,16 +28,19 @@
 #include <dirent.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include "kernel-lib/rbtree.h"
 #include "kernel-lib/rbtree_types.h"
-#include "kernel-lib/interval_tree_generic.h"
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/ctree.h"
+#include "kernel-shared/compression.h"
 #include "common/utils.h"
 #include "common/open-utils.h"
 #include "common/units.h"
 #include "common/help.h"
 #include "common/messages.h"
 #include "common/fsfeatures.h"
+#include "common/string-utils.h"
 #include "cmds/commands.h"
 
 #if !defined(FIEMAP_EXTENT_SHARED) && (HAVE_OWN_FIEMAP_EXTENT_SHARED_DEFINE == 1)
@@ -50,111 +53,61 @@ static char path[PATH_MAX] = { 0, };
 static char *pathp = path;
 static char *path_max = &path[PATH_MAX - 1];
 
+/* Physical range of a shared extent */
 struct shared_extent {
-	struct rb_node	rb;
-	u64	start;	/* Start of interval */
-	u64	last;	/* Last location _in_ interval */
-	u64	__subtree_last;
+	u64	start;
+	u64	len;
 };
 
 /*
- * extent_tree_* functions are defined in the massive interval tree
- * macro below. This serves to illustrate the api in human-readable
- * terms.
+ * Shared extents of all the files under a top level directory, the ranges
+ * may overlap and repeat
  */
-static void
-extent_tree_insert(struct shared_extent *node, struct rb_root *root);
-
-static void
-extent_tree_remove(struct shared_extent *node, struct rb_root *root);
-
-static struct shared_extent *
-extent_tree_iter_first(struct rb_root *root,
-		       u64 start, u64 last);
-
-static struct shared_extent *
-extent_tree_iter_next(struct shared_extent *node,
-			u64 start, u64 last);
-
-#define START(node) ((node)->start)
-#define LAST(node)  ((node)->last)
-
-INTERVAL_TREE_DEFINE(struct shared_extent, rb,
-		     u64, __subtree_last,
-		     START, LAST, static, extent_tree)
+struct shared_extents {
+	struct shared_extent *extents;
+	size_t nr;
+	size_t alloc;
+};
 
-static int add_shared_extent(u64 start, u64 len, struct rb_root *root)
+static int add_shared_extent(u64 start, u64 len, struct shared_extents *set)
 {
-	struct shared_extent *sh;
-
 	UASSERT(len != 0);
 
-	sh = calloc(1, sizeof(*sh));
-	if (!sh)
-		return -ENOMEM;
-
-	sh->start = start;
-	sh->last = (start + len - 1);
+	if (set->nr == set->alloc) {
+		size_t alloc = max_t(size_t, 1024, set->alloc * 2);
+		struct shared_extent *tmp;
 
-	extent_tree_insert(sh, root);
+		tmp = realloc(set->extents, alloc * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		set->extents = tmp;
+		set->alloc = alloc;
+	}
+	set->extents[set->nr].start = start;
+	set->extents[set->nr].len = len;
+	set->nr++;
 
 	return 0;
 }
 
-static void cleanup_shared_extents(struct rb_root *root)
+static void cleanup_shared_extents(struct shared_extents *set)
 {
-	struct shared_extent *s;
-	struct shared_extent *tmp;
-
-	if (!root)
-		return;
-
-	s = extent_tree_iter_first(root, 0, -1ULL);
-	while (s) {
-		tmp = extent_tree_iter_next(s, 0, -1ULL);
-		extent_tree_remove(s, root);
-
-		free(s);
-		s = tmp;
-	}
+	free(set->extents);
+	set->extents = NULL;
+	set->nr = 0;
+	set->alloc = 0;
 }
 
-/*
- * Find all extents which overlap 'n', calculate the space
- * covered by them and remove those nodes from the tree.
- */
-static u64 count_unique_bytes(struct rb_root *root, struct shared_extent *n)
+static int cmp_shared_extent(const void *a, const void *b)
 {
-	struct shared_extent *tmp;
-	u64 wstart = n->start;
-	u64 wlast = n->last;
-
-	pr_verbose(LOG_DEBUG, "Count overlaps:");
+	const struct shared_extent *s1 = a;
+	const struct shared_extent *s2 = b;
 
-	do {
-		/*
-		 * Expand our search window based on the latest
-		 * overlapping extent. Doing this will allow us to
-		 * find all possible overlaps
-		 */
-		if (wstart > n->start)
-			wstart = n->start;
-		if (wlast < n->last)
-			wlast = n->last;
-
-		pr_verbose(LOG_DEBUG, " (%llu, %llu)", n->start, n->last);
-
-		tmp = n;
-		n = extent_tree_iter_next(n, wstart, wlast);
-
-		extent_tree_remove(tmp, root);
-		free(tmp);
-	} while (n);
-
-	pr_verbose(LOG_DEBUG, "; wstart: %llu wlast: %llu total: %llu\n", wstart,
-		wlast, wlast - wstart + 1);
-
-	return wlast - wstart + 1;
+	if (s1->start < s2->start)
+		return -1;
+	if (s1->start > s2->start)
+		return 1;
+	return 0;
 }
 
 /*
@@ -163,36 +116,36 @@ static u64 count_unique_bytes(struct rb_root *root, struct shared_extent *n)
  * count any byte more than once, so just adding them up doesn't
  * work.
  *
- * For each set of overlapping extents we find the lowest start and
- * highest end. From there we have the actual number of bytes which is
- * shared across all of the extents in our set. A sum of each sets
- * extent length is returned.
+ * The extents are sorted by their start and swept in one pass, the
+ * overlapping extents are merged into a window from the lowest start to
+ * the highest end. A sum of the window lengths is returned.
  */
-static void count_shared_bytes(struct rb_root *root, u64 *ret_cnt)
+static void count_shared_bytes(struct shared_extents *set, u64 *ret_cnt)
 {
 	u64 count = 0;
-	struct shared_extent *s = extent_tree_iter_first(root,
-							 0, -1ULL);
+	u64 wstart = 0;
+	u64 wend = 0;
+	size_t i;
 
-	if (!s)
-		goto out;
+	qsort(set->extents, set->nr, sizeof(struct shared_extent),
+	      cmp_shared_extent);
 
-	while (s) {
-		/*
-		 * Find all extents which overlap 's', calculate the space
-		 * covered by them and remove those nodes from the tree.
-		 */
-		count += count_unique_bytes(root, s);
+	for (i = 0; i < set->nr; i++) {
+		const struct shared_extent *s = &set->extents[i];
 
-		/*
-		 * Since count_unique_bytes will be emptying the tree,
-		 * we can grab the first node here
-		 */
-		s = extent_tree_iter_first(root, 0, -1ULL);
+		if (i == 0 || s->start >= wend) {
+			count += wend - wstart;
+			wstart = s->start;
+			wend = s->start + s->len;
+			continue;
+		}
+		pr_verbose(LOG_DEBUG, "Overlap (%llu, %llu) window (%llu, %llu)\n",
+			   s->start, s->start + s->len - 1, wstart, wend - 1);
+		wend = max(wend, s->start + s->len);
 	}
+	count += wend - wstart;
 
-	BUG_ON(!RB_EMPTY_ROOT(root));
-out:
+	cleanup_shared_extents(set);
 	*ret_cnt = count;
 }
 
@@ -291,7 +244,7 @@ static void clear_seen_inodes(void)
  * space they will use yet.
  */
 #define	SKIP_FLAGS	(FIEMAP_EXTENT_UNKNOWN|FIEMAP_EXTENT_DELALLOC|FIEMAP_EXTENT_DATA_INLINE)
-static int du_calc_file_space(int fd, struct rb_root *shared_extents,
+static int du_calc_file_space(int fd, struct shared_extents *shared_extents,
 			      u64 *ret_total, u64 *ret_shared)
 {
 	char buf[16384];
@@ -368,15 +321,15 @@ struct du_dir_ctxt {
 	u64		bytes_total;
 	u64		bytes_shared;
 	DIR		*dirstream;
-	struct rb_root	shared_extents;
+	struct shared_extents shared_extents;
 };
-#define INIT_DU_DIR_CTXT	(struct du_dir_ctxt) { 0ULL, 0ULL, NULL, RB_ROOT }
+#define INIT_DU_DIR_CTXT	(struct du_dir_ctxt) { 0ULL, 0ULL, NULL, { 0 } }
 
 static int du_add_file(const char *filename, int dirfd,
-		       struct rb_root *shared_extents, u64 *ret_total,
+		       struct shared_extents *shared_extents, u64 *ret_total,
 		       u64 *ret_shared, int top_level);
 
-static int du_walk_dir(struct du_dir_ctxt *ctxt, struct rb_root *shared_extents)
+static int du_walk_dir(struct du_dir_ctxt *ctxt, struct shared_extents *shared_extents)
 {
 	int ret, type;
 	struct dirent *entry;
@@ -421,7 +374,7 @@ static int du_walk_dir(struct du_dir_ctxt *ctxt, struct rb_root *shared_extents)
 }
 
 static int du_add_file(const char *filename, int dirfd,
-		       struct rb_root *shared_extents, u64 *ret_total,
+		       struct shared_extents *shared_extents, u64 *ret_total,
 		       u64 *ret_shared, int top_level)
 {
 	int ret, len = strlen(filename);
@@ -485,10 +438,10 @@ static int du_add_file(const char *filename, int dirfd,
 		if (ret)
 			goto out_close;
 	} else if (S_ISDIR(st.st_mode)) {
-		struct rb_root *root = shared_extents;
+		struct shared_extents *root = shared_extents;
 
 		/*
-		 * We collect shared extents in an rb_root, the top
+		 * We collect shared extents in an array, the top
 		 * level caller will not pass a root down, so use the
 		 * one on our dir context.
 		 */
@@ -548,11 +501,850 @@ out:
 	return ret;
 }
 
+/*
+ * With --tree-search the file extents are not read by FIEMAP for each file,
+ * the directories are walked by threads to collect the inode numbers and the
+ * EXTENT_DATA items of each subvolume are read in bulk by the tree search
+ * ioctl. An extent is shared if the leaf with its file extent item can be
+ * shared with a snapshot, or if the extent item has more references.
+ */
+
+/* Entry found by the directory walk */
+struct du_node {
+	struct du_node *parent;
+	struct du_node **children;
+	size_t nr_children;
+	size_t alloc_children;
+	u64 ino;
+	u64 subvol;
+	dev_t dev;
+	bool is_dir;
+	/* Not accessible or a directory walked elsewhere, not printed */
+	bool skip;
+	/* Index to the inode array, regular files only */
+	size_t inode;
+	char name[];
+};
+
+/* Regular file inode, the space is accounted once for all hardlinks */
+struct du_inode {
+	u64 subvol;
+	u64 ino;
+	u64 total;
+	u64 shared;
+};
+
+struct du_walk {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Directories to be read */
+	struct du_node **queue;
+	size_t nr_queue;
+	size_t alloc_queue;
+	/* Directories being read by the threads */
+	int busy;
+	int ret;
+
+	/* Regular files, sorted by subvolume and inode later */
+	struct du_node **files;
+	size_t nr_files;
+	size_t alloc_files;
+
+	struct du_inode *inodes;
+	size_t nr_inodes;
+};
+
+/* Data extent of a file found by the tree search */
+struct du_extent {
+	u64 bytenr;
+	u64 phys;
+	u64 len;
+	size_t inode;
+	bool shared;
+};
+
+#define DU_MAX_THREADS			(64)
+/* Buffer for the tree search results */
+#define DU_SEARCH_BUF_SIZE		(SZ_1M)
+
+static bool tree_search = false;
+static int du_threads = 1;
+
+static int du_array_add(void **array, size_t *nr, size_t *alloc, size_t size,
+			const void *item)
+{
+	if (*nr == *alloc) {
+		size_t new_alloc = max_t(size_t, 64, *alloc * 2);
+		void *tmp;
+
+		tmp = realloc(*array, new_alloc * size);
+		if (!tmp)
+			return -ENOMEM;
+		*array = tmp;
+		*alloc = new_alloc;
+	}
+	memcpy((char *)*array + *nr * size, item, size);
+	(*nr)++;
+	return 0;
+}
+
+static struct du_node *du_alloc_node(struct du_node *parent, const char *name,
+				     const struct stat *st)
+{
+	struct du_node *node;
+
+	node = calloc(1, sizeof(*node) + strlen(name) + 1);
+	if (!node)
+		return NULL;
+	strcpy(node->name, name);
+	node->parent = parent;
+	node->ino = st->st_ino;
+	node->dev = st->st_dev;
+	node->is_dir = S_ISDIR(st->st_mode);
+	if (parent)
+		node->subvol = parent->subvol;
+	return node;
+}
+
+static void du_free_node(struct du_node *node)
+{
+	size_t i;
+
+	for (i = 0; i < node->nr_children; i++)
+		du_free_node(node->children[i]);
+	free(node->children);
+	free(node);
+}
+
+static int du_node_path(const struct du_node *node, char *buf, size_t size)
+{
+	size_t len;
+	int ret = 0;
+
+	if (node->parent) {
+		ret = du_node_path(node->parent, buf, size);
+		if (ret < 0)
+			return ret;
+		if (ret && buf[ret - 1] != '/')
+			buf[ret++] = '/';
+	}
+	len = strlen(node->name);
+	if (ret + len >= size)
+		return -ENAMETOOLONG;
+	memcpy(buf + ret, node->name, len + 1);
+	return ret + len;
+}
+
+/* Set the subvolume of a directory that is a root of a subvolume */
+static int du_node_subvol(struct du_node *node, const char *path)
+{
+	DIR *dirstream = NULL;
+	int fd;
+	int ret;
+
+	/* No tree for an empty subvolume */
+	if (node->ino == BTRFS_EMPTY_SUBVOL_DIR_OBJECTID) {
+		node->subvol = 0;
+		return 0;
+	}
+	fd = open_file_or_dir3(path, &dirstream, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	ret = lookup_path_rootid(fd, &node->subvol);
+	close_file_or_dir(fd, dirstream);
+	return ret;
+}
+
+/* Read one directory, queue the subdirectories and collect the files */
+static int du_read_dir(struct du_walk *walk, struct du_node *dir)
+{
+	char dirpath[PATH_MAX];
+	char *name;
+	struct dirent *entry;
+	struct stat st;
+	DIR *dirstream;
+	size_t len;
+	size_t i;
+	int ret;
+
+	ret = du_node_path(dir, dirpath, PATH_MAX - 1);
+	if (ret < 0) {
+		error("path too long: %s", dir->name);
+		return ret;
+	}
+	len = ret;
+
+	dirstream = opendir(dirpath);
+	if (!dirstream) {
+		ret = -errno;
+		warning("cannot access '%s': %m", dirpath);
+		dir->skip = true;
+		return (ret == -EACCES) ? 0 : ret;
+	}
+
+	/* Paths of the entries for the subvolume lookup */
+	if (len && dirpath[len - 1] != '/')
+		dirpath[len++] = '/';
+	name = dirpath + len;
+
+	ret = 0;
+	while (1) {
+		struct du_node *node;
+
+		errno = 0;
+		entry = readdir(dirstream);
+		if (!entry) {
+			ret = -errno;
+			break;
+		}
+		if (strcmp(entry->d_name, ".") == 0 ||
+		    strcmp(entry->d_name, "..") == 0)
+			continue;
+		if (entry->d_type != DT_REG && entry->d_type != DT_DIR)
+			continue;
+
+		if (fstatat(dirfd(dirstream), entry->d_name, &st, 0)) {
+			ret = -errno;
+			warning("cannot access '%s': %m", entry->d_name);
+			if (ret == -EACCES) {
+				ret = 0;
+				continue;
+			}
+			break;
+		}
+		if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+			continue;
+
+		node = du_alloc_node(dir, entry->d_name, &st);
+		if (!node) {
+			ret = -ENOMEM;
+			break;
+		}
+		ret = du_array_add((void **)&dir->children, &dir->nr_children,
+				   &dir->alloc_children, sizeof(node), &node);
+		if (ret) {
+			free(node);
+			break;
+		}
+	}
+	closedir(dirstream);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < dir->nr_children; i++) {
+		struct du_node *node = dir->children[i];
+
+		if (!node->is_dir)
+			continue;
+		if (node->ino == BTRFS_FIRST_FREE_OBJECTID ||
+		    node->ino == BTRFS_EMPTY_SUBVOL_DIR_OBJECTID ||
+		    node->dev != dir->dev) {
+			if (len + strlen(node->name) >= PATH_MAX) {
+				error("path too long: %s%s", dirpath, node->name);
+				return -ENAMETOOLONG;
+			}
+			strcpy(name, node->name);
+			ret = du_node_subvol(node, dirpath);
+			if (ret) {
+				errno = -ret;
+				warning("cannot access '%s': %m", dirpath);
+				if (ret != -ENOTTY && ret != -EACCES)
+					return ret;
+				node->skip = true;
+				ret = 0;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&walk->lock);
+	for (i = 0; i < dir->nr_children && !ret; i++) {
+		struct du_node *node = dir->children[i];
+
+		if (node->skip)
+			continue;
+		if (!node->is_dir) {
+			ret = du_array_add((void **)&walk->files, &walk->nr_files,
+					   &walk->alloc_files, sizeof(node),
+					   &node);
+			continue;
+		}
+		/* Nothing to walk in an empty subvolume */
+		if (node->subvol == 0)
+			continue;
+		/* Walk a directory only once, like bind mounts */
+		if (inode_seen(node->ino, node->subvol)) {
+			node->skip = true;
+			continue;
+		}
+		ret = mark_inode_seen(node->ino, node->subvol);
+		if (!ret)
+			ret = du_array_add((void **)&walk->queue,
+					   &walk->nr_queue, &walk->alloc_queue,
+					   sizeof(node), &node);
+	}
+	if (walk->nr_queue)
+		pthread_cond_broadcast(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+
+	return ret;
+}
+
+static void *du_walk_thread(void *arg)
+{
+	struct du_walk *walk = arg;
+	struct du_node *dir;
+	int ret;
+
+	pthread_mutex_lock(&walk->lock);
+	while (1) {
+		while (!walk->nr_queue && walk->busy && !walk->ret)
+			pthread_cond_wait(&walk->cond, &walk->lock);
+		if (!walk->nr_queue || walk->ret)
+			break;
+		dir = walk->queue[--walk->nr_queue];
+		walk->busy++;
+		pthread_mutex_unlock(&walk->lock);
+
+		ret = du_read_dir(walk, dir);
+
+		pthread_mutex_lock(&walk->lock);
+		walk->busy--;
+		if (ret && !walk->ret)
+			walk->ret = ret;
+		if (!walk->busy || walk->ret)
+			pthread_cond_broadcast(&walk->cond);
+	}
+	pthread_mutex_unlock(&walk->lock);
+	return NULL;
+}
+
+static int du_walk_dirs(struct du_walk *walk)
+{
+	pthread_t threads[DU_MAX_THREADS];
+	int nr_threads = 0;
+	int ret = 0;
+	int i;
+
+	for (i = 1; i < du_threads; i++) {
+		ret = pthread_create(&threads[nr_threads], NULL, du_walk_thread,
+				     walk);
+		if (ret) {
+			errno = ret;
+			warning("cannot start directory walk thread: %m");
+			break;
+		}
+		nr_threads++;
+	}
+	du_walk_thread(walk);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	return walk->ret;
+}
+
+static int cmp_du_file(const void *a, const void *b)
+{
+	const struct du_node *n1 = *(const struct du_node **)a;
+	const struct du_node *n2 = *(const struct du_node **)b;
+
+	if (n1->subvol < n2->subvol)
+		return -1;
+	if (n1->subvol > n2->subvol)
+		return 1;
+	if (n1->ino < n2->ino)
+		return -1;
+	if (n1->ino > n2->ino)
+		return 1;
+	return 0;
+}
+
+/* Build the sorted array of the inodes of the files, hardlinks only once */
+static int du_build_inodes(struct du_walk *walk)
+{
+	size_t i;
+
+	qsort(walk->files, walk->nr_files, sizeof(struct du_node *),
+	      cmp_du_file);
+	walk->inodes = calloc(max_t(size_t, 1, walk->nr_files),
+			      sizeof(struct du_inode));
+	if (!walk->inodes)
+		return -ENOMEM;
+
+	for (i = 0; i < walk->nr_files; i++) {
+		struct du_node *node = walk->files[i];
+		struct du_inode *last = &walk->inodes[walk->nr_inodes - 1];
+
+		if (!walk->nr_inodes || last->subvol != node->subvol ||
+		    last->ino != node->ino) {
+			last = &walk->inodes[walk->nr_inodes++];
+			last->subvol = node->subvol;
+			last->ino = node->ino;
+		}
+		node->inode = walk->nr_inodes - 1;
+	}
+	return 0;
+}
+
+static int du_search(int fd, struct btrfs_ioctl_search_args_v2 *args)
+{
+	args->key.nr_items = (u32)-1;
+	args->buf_size = DU_SEARCH_BUF_SIZE;
+	if (ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, args) < 0)
+		return -errno;
+	return 0;
+}
+
+/* Continue the search after the key of the last returned item */
+static void du_search_next(struct btrfs_ioctl_search_key *sk,
+			   struct btrfs_ioctl_search_header *sh)
+{
+	sk->min_objectid = btrfs_search_header_objectid(sh);
+	sk->min_type = btrfs_search_header_type(sh);
+	sk->min_offset = btrfs_search_header_offset(sh);
+	if (sk->min_offset < (u64)-1) {
+		sk->min_offset++;
+	} else if (sk->min_type < (u8)-1) {
+		sk->min_type++;
+		sk->min_offset = 0;
+	} else {
+		sk->min_objectid++;
+		sk->min_type = 0;
+		sk->min_offset = 0;
+	}
+}
+
+static int du_root_last_snapshot(int fd, u64 subvol,
+				 struct btrfs_ioctl_search_args_v2 *args,
+				 u64 *last_snapshot)
+{
+	struct btrfs_ioctl_search_key *sk = &args->key;
+	struct btrfs_ioctl_search_header *sh;
+	int ret;
+
+	memset(sk, 0, sizeof(*sk));
+	sk->tree_id = BTRFS_ROOT_TREE_OBJECTID;
+	sk->min_objectid = subvol;
+	sk->max_objectid = subvol;
+	sk->min_type = BTRFS_ROOT_ITEM_KEY;
+	sk->max_type = BTRFS_ROOT_ITEM_KEY;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
+	ret = du_search(fd, args);
+	if (ret < 0)
+		return ret;
+	if (sk->nr_items == 0)
+		return -ENOENT;
+
+	sh = (struct btrfs_ioctl_search_header *)args->buf;
+	*last_snapshot = btrfs_root_last_snapshot((struct btrfs_root_item *)(sh + 1));
+	return 0;
+}
+
+/* Shared extents first */
+static int cmp_du_extent_shared(const void *a, const void *b)
+{
+	const struct du_extent *e1 = a;
+	const struct du_extent *e2 = b;
+
+	return (int)e2->shared - (int)e1->shared;
+}
+
+static int cmp_du_extent_bytenr(const void *a, const void *b)
+{
+	const struct du_extent *e1 = a;
+	const struct du_extent *e2 = b;
+
+	if (e1->bytenr < e2->bytenr)
+		return -1;
+	if (e1->bytenr > e2->bytenr)
+		return 1;
+	return 0;
+}
+
+/*
+ * Read the extent items of the extents not shared by a snapshot, sorted by
+ * bytenr, and mark the ones with more references as shared
+ */
+static int du_search_extent_refs(int fd, struct du_extent *extents, size_t nr,
+				 struct btrfs_ioctl_search_args_v2 *args)
+{
+	struct btrfs_ioctl_search_key *sk = &args->key;
+	struct btrfs_ioctl_search_header *sh;
+	size_t cur = 0;
+	int ret;
+
+	if (!nr)
+		return 0;
+
+	memset(sk, 0, sizeof(*sk));
+	sk->tree_id = BTRFS_EXTENT_TREE_OBJECTID;
+	sk->min_objectid = extents[0].bytenr;
+	sk->max_objectid = extents[nr - 1].bytenr;
+	sk->min_type = BTRFS_EXTENT_ITEM_KEY;
+	sk->max_type = BTRFS_EXTENT_ITEM_KEY;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
+
+	while (cur < nr) {
+		unsigned long off = 0;
+		u32 i;
+
+		ret = du_search(fd, args);
+		if (ret < 0)
+			return ret;
+		if (sk->nr_items == 0)
+			break;
+
+		for (i = 0; i < sk->nr_items; i++) {
+			u64 bytenr;
+
+			sh = (struct btrfs_ioctl_search_header *)(args->buf + off);
+			off += sizeof(*sh) + btrfs_search_header_len(sh);
+			if (btrfs_search_header_type(sh) != BTRFS_EXTENT_ITEM_KEY)
+				continue;
+
+			bytenr = btrfs_search_header_objectid(sh);
+			while (cur < nr && extents[cur].bytenr < bytenr)
+				cur++;
+			while (cur < nr && extents[cur].bytenr == bytenr) {
+				/* The refs are the first member of the item */
+				if (get_unaligned_le64(sh + 1) > 1)
+					extents[cur].shared = true;
+				cur++;
+			}
+		}
+		du_search_next(sk, sh);
+		/* Skip to the next extent of the files */
+		if (cur < nr && sk->min_objectid < extents[cur].bytenr) {
+			sk->min_objectid = extents[cur].bytenr;
+			sk->min_type = BTRFS_EXTENT_ITEM_KEY;
+			sk->min_offset = 0;
+		}
+		if (sk->min_objectid > sk->max_objectid)
+			break;
+	}
+	return 0;
+}
+
+static int du_add_extent(struct du_extent **extents, size_t *nr, size_t *alloc,
+			 const struct du_extent *extent)
+{
+	return du_array_add((void **)extents, nr, alloc, sizeof(*extent),
+			    extent);
+}
+
+/*
+ * Read the file extent items of the inodes of one subvolume, starting at
+ * index @first, and account their space. The index is advanced to the first
+ * inode of the next subvolume.
+ */
+static int du_search_subvol(int fd, struct du_walk *walk, size_t *first,
+			    struct shared_extents *shared_extents,
+			    struct btrfs_ioctl_search_args_v2 *args)
+{
+	struct btrfs_ioctl_search_key *sk = &args->key;
+	struct btrfs_ioctl_search_header *sh;
+	struct du_inode *inodes = walk->inodes + *first;
+	struct du_extent *extents = NULL;
+	size_t nr_extents = 0;
+	size_t alloc_extents = 0;
+	size_t nr_unshared = 0;
+	size_t nr = 0;
+	size_t cur = 0;
+	size_t i;
+	u64 subvol = inodes[0].subvol;
+	u64 last_snapshot;
+	int ret;
+
+	while (*first + nr < walk->nr_inodes && inodes[nr].subvol == subvol)
+		nr++;
+	*first += nr;
+
+	ret = du_root_last_snapshot(fd, subvol, args, &last_snapshot);
+	if (ret < 0)
+		return ret;
+
+	memset(sk, 0, sizeof(*sk));
+	sk->tree_id = subvol;
+	sk->min_objectid = inodes[0].ino;
+	sk->max_objectid = inodes[nr - 1].ino;
+	sk->min_type = BTRFS_EXTENT_DATA_KEY;
+	sk->max_type = BTRFS_EXTENT_DATA_KEY;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
+
+	while (cur < nr) {
+		unsigned long off = 0;
+		u32 j;
+
+		ret = du_search(fd, args);
+		if (ret < 0)
+			goto out;
+		if (sk->nr_items == 0)
+			break;
+
+		for (j = 0; j < sk->nr_items; j++) {
+			struct btrfs_file_extent_item *fi;
+			struct du_extent extent = { 0 };
+			u64 ino;
+			u8 type;
+
+			sh = (struct btrfs_ioctl_search_header *)(args->buf + off);
+			off += sizeof(*sh) + btrfs_search_header_len(sh);
+			if (btrfs_search_header_type(sh) != BTRFS_EXTENT_DATA_KEY)
+				continue;
+
+			ino = btrfs_search_header_objectid(sh);
+			while (cur < nr && inodes[cur].ino < ino)
+				cur++;
+			if (cur == nr || inodes[cur].ino != ino)
+				continue;
+
+			/* Inline extents take no data space, holes neither */
+			fi = (struct btrfs_file_extent_item *)(sh + 1);
+			type = btrfs_stack_file_extent_type(fi);
+			if (type == BTRFS_FILE_EXTENT_INLINE)
+				continue;
+			extent.bytenr = btrfs_stack_file_extent_disk_bytenr(fi);
+			if (extent.bytenr == 0)
+				continue;
+			extent.len = btrfs_stack_file_extent_num_bytes(fi);
+			if (extent.len == 0)
+				continue;
+
+			/* Same as FIEMAP reports the physical offset */
+			extent.phys = extent.bytenr;
+			if (btrfs_stack_file_extent_compression(fi) ==
+			    BTRFS_COMPRESS_NONE)
+				extent.phys += btrfs_stack_file_extent_offset(fi);
+			extent.inode = *first - nr + cur;
+			/* The leaf can be shared with a snapshot */
+			extent.shared = btrfs_search_header_transid(sh) <= last_snapshot;
+			if (!extent.shared)
+				nr_unshared++;
+
+			ret = du_add_extent(&extents, &nr_extents, &alloc_extents,
+					    &extent);
+			if (ret < 0)
+				goto out;
+		}
+		du_search_next(sk, sh);
+		/* Skip the inodes that are not under the walked directory */
+		if (cur < nr && sk->min_objectid < inodes[cur].ino) {
+			sk->min_objectid = inodes[cur].ino;
+			sk->min_type = BTRFS_EXTENT_DATA_KEY;
+			sk->min_offset = 0;
+		}
+		if (sk->min_objectid > sk->max_objectid)
+			break;
+	}
+
+	/* Look up the references of the remaining extents, sorted to the end */
+	qsort(extents, nr_extents, sizeof(*extents), cmp_du_extent_shared);
+	qsort(extents + nr_extents - nr_unshared, nr_unshared, sizeof(*extents),
+	      cmp_du_extent_bytenr);
+	ret = du_search_extent_refs(fd, extents + nr_extents - nr_unshared,
+				    nr_unshared, args);
+	if (ret < 0)
+		goto out;
+
+	for (i = 0; i < nr_extents; i++) {
+		struct du_inode *inode = &walk->inodes[extents[i].inode];
+
+		inode->total += extents[i].len;
+		if (!extents[i].shared)
+			continue;
+		inode->shared += extents[i].len;
+		if (shared_extents) {
+			ret = add_shared_extent(extents[i].phys, extents[i].len,
+						shared_extents);
+			if (ret < 0)
+				goto out;
+		}
+	}
+	ret = 0;
+out:
+	free(extents);
+	return ret;
+}
+
+static int du_search_inodes(int fd, struct du_walk *walk,
+			    struct shared_extents *shared_extents)
+{
+	struct btrfs_ioctl_search_args_v2 *args;
+	size_t first = 0;
+	int ret = 0;
+
+	args = malloc(sizeof(*args) + DU_SEARCH_BUF_SIZE);
+	if (!args)
+		return -ENOMEM;
+	while (first < walk->nr_inodes) {
+		ret = du_search_subvol(fd, walk, &first, shared_extents, args);
+		if (ret < 0)
+			break;
+	}
+	free(args);
+	return ret;
+}
+
+/* Print the space of the walked entries, in the same way as du_add_file */
+static void du_print_node(struct du_walk *walk, struct du_node *node,
+			  u64 *ret_total, u64 *ret_shared, u64 set_shared,
+			  int top_level)
+{
+	char *pathtmp = pathp;
+	u64 file_total = 0;
+	u64 file_shared = 0;
+	size_t i;
+	int ret;
+
+	*ret_total = 0;
+	*ret_shared = 0;
+	if (node->skip)
+		return;
+
+	if (!node->is_dir) {
+		/* Hardlinks are accounted for the first name */
+		if (inode_seen(node->ino, node->subvol))
+			return;
+		if (mark_inode_seen(node->ino, node->subvol))
+			return;
+		file_total = walk->inodes[node->inode].total;
+		file_shared = walk->inodes[node->inode].shared;
+	}
+
+	if (pathp == path || *(pathp - 1) == '/')
+		ret = snprintf(pathp, path_max - pathp, "%s", node->name);
+	else
+		ret = snprintf(pathp, path_max - pathp, "/%s", node->name);
+	pathp += min_t(int, ret, path_max - pathp);
+
+	for (i = 0; i < node->nr_children; i++) {
+		u64 tot, shr;
+
+		du_print_node(walk, node->children[i], &tot, &shr, 0, 0);
+		*pathp = '\0';
+		file_total += tot;
+		file_shared += shr;
+	}
+
+	if (!summarize || top_level) {
+		u64 excl = file_total - file_shared;
+
+		if (top_level) {
+			if (!node->is_dir)
+				set_shared = file_shared;
+
+			pr_verbose(LOG_DEFAULT, "%10s  %10s  %10s  %s\n",
+			       pretty_size_mode(file_total, unit_mode),
+			       pretty_size_mode(excl, unit_mode),
+			       pretty_size_mode(set_shared, unit_mode),
+			       path);
+		} else {
+			pr_verbose(LOG_DEFAULT, "%10s  %10s  %10s  %s\n",
+			       pretty_size_mode(file_total, unit_mode),
+			       pretty_size_mode(excl, unit_mode),
+			       "-", path);
+		}
+	}
+
+	*ret_total = file_total;
+	*ret_shared = file_shared;
+	pathp = pathtmp;
+}
+
+static int du_tree_search(const char *filename)
+{
+	struct du_walk walk = { 0 };
+	struct shared_extents shared_extents = { 0 };
+	struct du_node *top;
+	struct stat st;
+	DIR *dirstream = NULL;
+	u64 set_shared = 0;
+	u64 tot, shr;
+	int fd;
+	int ret;
+
+	if (stat(filename, &st))
+		return -errno;
+	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+		return 0;
+
+	top = du_alloc_node(NULL, filename, &st);
+	if (!top)
+		return -ENOMEM;
+
+	fd = open_file_or_dir3(filename, &dirstream, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	if (st.st_ino != BTRFS_EMPTY_SUBVOL_DIR_OBJECTID) {
+		ret = lookup_path_rootid(fd, &top->subvol);
+		if (ret)
+			goto out_close;
+	}
+
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+	if (top->is_dir) {
+		if (top->subvol) {
+			ret = mark_inode_seen(top->ino, top->subvol);
+			if (ret)
+				goto out_walk;
+			ret = du_array_add((void **)&walk.queue, &walk.nr_queue,
+					   &walk.alloc_queue, sizeof(top), &top);
+			if (ret)
+				goto out_walk;
+		}
+		ret = du_walk_dirs(&walk);
+		if (ret)
+			goto out_walk;
+	} else {
+		ret = du_array_add((void **)&walk.files, &walk.nr_files,
+				   &walk.alloc_files, sizeof(top), &top);
+		if (ret)
+			goto out_walk;
+	}
+
+	ret = du_build_inodes(&walk);
+	if (ret)
+		goto out_walk;
+	ret = du_search_inodes(fd, &walk, top->is_dir ? &shared_extents : NULL);
+	if (ret == -EPERM)
+		error("tree search requires root privileges");
+	if (ret)
+		goto out_walk;
+
+	if (top->is_dir)
+		count_shared_bytes(&shared_extents, &set_shared);
+	pathp = path;
+	*pathp = '\0';
+	du_print_node(&walk, top, &tot, &shr, set_shared, 1);
+
+out_walk:
+	cleanup_shared_extents(&shared_extents);
+	pthread_mutex_destroy(&walk.lock);
+	pthread_cond_destroy(&walk.cond);
+	free(walk.queue);
+	free(walk.files);
+	free(walk.inodes);
+out_close:
+	close_file_or_dir(fd, dirstream);
+out:
+	du_free_node(top);
+	return ret;
+}
+
 static const char * const cmd_filesystem_du_usage[] = {
 	"btrfs filesystem du [options] <path> [<path>..]",
 	"Summarize disk usage of each file.",
 	"",
 	OPTLINE("-s|--summarize", "display only a total for each argument"),
+	OPTLINE("--tree-search", "read the file extents of each subvolume in "
+		"bulk by the tree search ioctl instead of FIEMAP for each file, "
+		"requires root"),
+	OPTLINE("--threads <N>", "walk the directories using N threads, "
+		"with --tree-search"),
 	HELPINFO_UNITS_LONG,
 	NULL
 };
@@ -568,8 +1360,16 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 
 	optind = 0;
 	while (1) {
+		enum {
+			GETOPT_VAL_TREE_SEARCH = GETOPT_VAL_FIRST,
+			GETOPT_VAL_THREADS,
+		};
 		static const struct option long_options[] = {
 			{ "summarize", no_argument, NULL, 's'},
+			{ "tree-search", no_argument, NULL,
+				GETOPT_VAL_TREE_SEARCH },
+			{ "threads", required_argument, NULL,
+				GETOPT_VAL_THREADS },
 			{ NULL, 0, NULL, 0 }
 		};
 		int c = getopt_long(argc, argv, "s", long_options, NULL);
@@ -580,6 +1380,20 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 		case 's':
 			summarize = true;
 			break;
+		case GETOPT_VAL_TREE_SEARCH:
+			tree_search = true;
+			break;
+		case GETOPT_VAL_THREADS: {
+			u64 num = arg_strtou64(optarg);
+
+			if (num == 0 || num > DU_MAX_THREADS) {
+				error("number of threads out of range, must be 1 to %d",
+				      DU_MAX_THREADS);
+				return 1;
+			}
+			du_threads = num;
+			break;
+		}
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -588,6 +1402,11 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 	if (check_argc_min(argc - optind, 1))
 		return 1;
 
+	if (du_threads > 1 && !tree_search) {
+		error("--threads requires --tree-search");
+		return 1;
+	}
+
 	kernel_version = get_running_kernel_version();
 
 	if (kernel_version < KERNEL_VERSION(2,6,33)) {
@@ -600,7 +1419,10 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 			"Filename");
 
 	for (i = optind; i < argc; i++) {
-		ret = du_add_file(argv[i], AT_FDCWD, NULL, NULL, NULL, 1);
+		if (tree_search)
+			ret = du_tree_search(argv[i]);
+		else
+			ret = du_add_file(argv[i], AT_FDCWD, NULL, NULL, NULL, 1);
 		if (ret) {
 			errno = -ret;
 			error("cannot check space of '%s': %m", argv[i]);
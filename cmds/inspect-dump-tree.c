@@ -39,6 +39,7 @@
 #include "common/help.h"
 #include "common/device-scan.h"
 #include "common/string-utils.h"
+#include "common/tree-reada.h"
 #include "cmds/commands.h"
 
 static void print_extents(struct extent_buffer *eb)
@@ -57,6 +58,7 @@ static void print_extents(struct extent_buffer *eb)
 	}
 
 	nr = btrfs_header_nritems(eb);
+	btrfs_readahead_node_children(eb);
 	for (i = 0; i < nr; i++) {
 		next = read_tree_block(fs_info, btrfs_node_blockptr(eb, i),
 				       btrfs_header_owner(eb),
@@ -466,6 +468,8 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 		error("unable to open %s", argv[optind]);
 		goto out;
 	}
+	/* Optional, tree blocks are read without readahead if this fails */
+	btrfs_tree_reada_start(info, BTRFS_TREE_READA_DEFAULT_THREADS);
 
 	print_mode = follow | traverse | csum_mode;
 
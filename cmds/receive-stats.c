@@ -0,0 +1,563 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "kernel-lib/rbtree.h"
+#include "common/internal.h"
+#include "common/messages.h"
+#include "common/path-utils.h"
+#include "common/rbtree-utils.h"
+#include "common/units.h"
+#include "cmds/receive-stats.h"
+
+/* Data written to one path by write, clone and encoded_write */
+struct receive_file_stats {
+	struct rb_node node;
+	u64 cmds;
+	u64 bytes;
+	/* Runs of adjacent data commands */
+	u64 extents;
+	u64 next_offset;
+	char path[];
+};
+
+static const char * const cmd_names[BTRFS_SEND_C_MAX + 1] = {
+	[BTRFS_SEND_C_SUBVOL]		= "subvol",
+	[BTRFS_SEND_C_SNAPSHOT]		= "snapshot",
+	[BTRFS_SEND_C_MKFILE]		= "mkfile",
+	[BTRFS_SEND_C_MKDIR]		= "mkdir",
+	[BTRFS_SEND_C_MKNOD]		= "mknod",
+	[BTRFS_SEND_C_MKFIFO]		= "mkfifo",
+	[BTRFS_SEND_C_MKSOCK]		= "mksock",
+	[BTRFS_SEND_C_SYMLINK]		= "symlink",
+	[BTRFS_SEND_C_RENAME]		= "rename",
+	[BTRFS_SEND_C_LINK]		= "link",
+	[BTRFS_SEND_C_UNLINK]		= "unlink",
+	[BTRFS_SEND_C_RMDIR]		= "rmdir",
+	[BTRFS_SEND_C_SET_XATTR]	= "set_xattr",
+	[BTRFS_SEND_C_REMOVE_XATTR]	= "remove_xattr",
+	[BTRFS_SEND_C_WRITE]		= "write",
+	[BTRFS_SEND_C_CLONE]		= "clone",
+	[BTRFS_SEND_C_TRUNCATE]		= "truncate",
+	[BTRFS_SEND_C_CHMOD]		= "chmod",
+	[BTRFS_SEND_C_CHOWN]		= "chown",
+	[BTRFS_SEND_C_UTIMES]		= "utimes",
+	[BTRFS_SEND_C_UPDATE_EXTENT]	= "update_extent",
+	[BTRFS_SEND_C_FALLOCATE]	= "fallocate",
+	[BTRFS_SEND_C_FILEATTR]		= "fileattr",
+	[BTRFS_SEND_C_ENCODED_WRITE]	= "encoded_write",
+	[BTRFS_SEND_C_ENABLE_VERITY]	= "enable_verity",
+};
+
+static u64 now_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double elapsed_secs(u64 nsecs)
+{
+	return nsecs / 1e9;
+}
+
+/*
+ * Count the command and call the wrapped callback, if there's any, accounting
+ * the time spent in it.
+ */
+#define STATS_CALL(stats, cmd, len, op, ...)				\
+({									\
+	struct btrfs_receive_stats *__stats = (stats);			\
+	int __ret = 0;							\
+									\
+	__stats->cmds[cmd].count++;					\
+	__stats->cmds[cmd].bytes += (len);				\
+	if (__stats->ops) {						\
+		u64 __start = now_nsecs();				\
+									\
+		__ret = __stats->ops->op(__VA_ARGS__, __stats->user);	\
+		__stats->cmds[cmd].nsecs += now_nsecs() - __start;	\
+	}								\
+	__ret;								\
+})
+
+static int compare_file_stats(struct rb_node *node1, struct rb_node *node2)
+{
+	struct receive_file_stats *f1;
+	struct receive_file_stats *f2;
+
+	f1 = rb_entry(node1, struct receive_file_stats, node);
+	f2 = rb_entry(node2, struct receive_file_stats, node);
+	return strcmp(f2->path, f1->path);
+}
+
+static int compare_file_stats_path(struct rb_node *node, void *key)
+{
+	struct receive_file_stats *file;
+
+	file = rb_entry(node, struct receive_file_stats, node);
+	return strcmp(key, file->path);
+}
+
+static struct receive_file_stats *find_file_stats(
+		struct btrfs_receive_stats *stats, const char *path)
+{
+	struct rb_node *node;
+
+	node = rb_search(&stats->files, (void *)path, compare_file_stats_path,
+			 NULL);
+	if (!node)
+		return NULL;
+	return rb_entry(node, struct receive_file_stats, node);
+}
+
+static void free_file_stats(struct rb_node *node)
+{
+	free(rb_entry(node, struct receive_file_stats, node));
+}
+FREE_RB_BASED_TREE(file_stats, free_file_stats);
+
+static int account_data(struct btrfs_receive_stats *stats, const char *path,
+			u64 offset, u64 len)
+{
+	struct receive_file_stats *file;
+	int bucket = 0;
+
+	while (bucket < RECEIVE_STATS_LEN_BUCKETS - 1 && (1ULL << bucket) < len)
+		bucket++;
+	stats->len_buckets[bucket]++;
+
+	file = find_file_stats(stats, path);
+	if (!file) {
+		file = calloc(1, sizeof(*file) + strlen(path) + 1);
+		if (!file)
+			return -ENOMEM;
+		strcpy(file->path, path);
+		rb_insert(&stats->files, &file->node, compare_file_stats);
+	}
+	if (!file->cmds || file->next_offset != offset)
+		file->extents++;
+	file->cmds++;
+	file->bytes += len;
+	file->next_offset = offset + len;
+	return 0;
+}
+
+/* Add the files of the finished subvolume to the summary */
+static void finish_file_stats(struct btrfs_receive_stats *stats)
+{
+	struct rb_node *node;
+
+	for (node = rb_first(&stats->files); node; node = rb_next(node)) {
+		struct receive_file_stats *file;
+
+		file = rb_entry(node, struct receive_file_stats, node);
+		stats->nr_files++;
+		stats->file_cmds += file->cmds;
+		stats->file_extents += file->extents;
+		if (file->extents > 1)
+			stats->fragmented_files++;
+		if (file->extents > stats->most_extents) {
+			stats->most_extents = file->extents;
+			stats->most_extents_bytes = file->bytes;
+			strncpy_null(stats->most_extents_path, file->path);
+		}
+	}
+	free_file_stats_tree(&stats->files);
+}
+
+static int stats_subvol(const char *path, const u8 *uuid, u64 ctransid,
+			void *user)
+{
+	struct btrfs_receive_stats *stats = user;
+
+	/* The paths are relative to the subvolume */
+	finish_file_stats(stats);
+	return STATS_CALL(stats, BTRFS_SEND_C_SUBVOL, 0, subvol, path, uuid,
+			  ctransid);
+}
+
+static int stats_snapshot(const char *path, const u8 *uuid, u64 ctransid,
+			  const u8 *parent_uuid, u64 parent_ctransid,
+			  void *user)
+{
+	struct btrfs_receive_stats *stats = user;
+
+	finish_file_stats(stats);
+	return STATS_CALL(stats, BTRFS_SEND_C_SNAPSHOT, 0, snapshot, path, uuid,
+			  ctransid, parent_uuid, parent_ctransid);
+}
+
+static int stats_mkfile(const char *path, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_MKFILE, 0, mkfile, path);
+}
+
+static int stats_mkdir(const char *path, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_MKDIR, 0, mkdir, path);
+}
+
+static int stats_mknod(const char *path, u64 mode, u64 dev, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_MKNOD, 0, mknod, path, mode, dev);
+}
+
+static int stats_mkfifo(const char *path, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_MKFIFO, 0, mkfifo, path);
+}
+
+static int stats_mksock(const char *path, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_MKSOCK, 0, mksock, path);
+}
+
+static int stats_symlink(const char *path, const char *lnk, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_SYMLINK, 0, symlink, path, lnk);
+}
+
+static int stats_rename(const char *from, const char *to, void *user)
+{
+	struct btrfs_receive_stats *stats = user;
+	struct receive_file_stats *file;
+	struct receive_file_stats *renamed;
+
+	/*
+	 * New files are created under a temporary name, keep the stats of a
+	 * renamed file. Renames of directories are not tracked.
+	 */
+	file = find_file_stats(stats, from);
+	if (file && !find_file_stats(stats, to)) {
+		rb_erase(&file->node, &stats->files);
+		renamed = realloc(file, sizeof(*file) + strlen(to) + 1);
+		if (renamed) {
+			strcpy(renamed->path, to);
+			file = renamed;
+		}
+		rb_insert(&stats->files, &file->node, compare_file_stats);
+	}
+	return STATS_CALL(stats, BTRFS_SEND_C_RENAME, 0, rename, from, to);
+}
+
+static int stats_link(const char *path, const char *lnk, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_LINK, 0, link, path, lnk);
+}
+
+static int stats_unlink(const char *path, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_UNLINK, 0, unlink, path);
+}
+
+static int stats_rmdir(const char *path, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_RMDIR, 0, rmdir, path);
+}
+
+static int stats_write(const char *path, const void *data, u64 offset,
+		       u64 len, void *user)
+{
+	int ret;
+
+	ret = account_data(user, path, offset, len);
+	if (ret < 0)
+		return ret;
+	return STATS_CALL(user, BTRFS_SEND_C_WRITE, len, write, path, data,
+			  offset, len);
+}
+
+static int stats_clone(const char *path, u64 offset, u64 len,
+		       const u8 *clone_uuid, u64 clone_ctransid,
+		       const char *clone_path, u64 clone_offset,
+		       void *user)
+{
+	int ret;
+
+	ret = account_data(user, path, offset, len);
+	if (ret < 0)
+		return ret;
+	return STATS_CALL(user, BTRFS_SEND_C_CLONE, len, clone, path, offset,
+			  len, clone_uuid, clone_ctransid, clone_path,
+			  clone_offset);
+}
+
+static int stats_set_xattr(const char *path, const char *name,
+			   const void *data, int len, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_SET_XATTR, 0, set_xattr, path,
+			  name, data, len);
+}
+
+static int stats_remove_xattr(const char *path, const char *name, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_REMOVE_XATTR, 0, remove_xattr,
+			  path, name);
+}
+
+static int stats_truncate(const char *path, u64 size, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_TRUNCATE, 0, truncate, path, size);
+}
+
+static int stats_chmod(const char *path, u64 mode, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_CHMOD, 0, chmod, path, mode);
+}
+
+static int stats_chown(const char *path, u64 uid, u64 gid, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_CHOWN, 0, chown, path, uid, gid);
+}
+
+static int stats_utimes(const char *path, struct timespec *at,
+			struct timespec *mt, struct timespec *ct,
+			void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_UTIMES, 0, utimes, path, at, mt,
+			  ct);
+}
+
+static int stats_update_extent(const char *path, u64 offset, u64 len,
+			       void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_UPDATE_EXTENT, len, update_extent,
+			  path, offset, len);
+}
+
+static int stats_encoded_write(const char *path, const void *data, u64 offset,
+			       u64 len, u64 unencoded_file_len,
+			       u64 unencoded_len, u64 unencoded_offset,
+			       u32 compression, u32 encryption, void *user)
+{
+	struct btrfs_receive_stats *stats = user;
+	int ret;
+
+	/* The length in the file, the encoded data may be shared by several */
+	ret = account_data(stats, path, offset, unencoded_file_len);
+	if (ret < 0)
+		return ret;
+	stats->encoded_bytes += len;
+	stats->unencoded_bytes += unencoded_len;
+	return STATS_CALL(stats, BTRFS_SEND_C_ENCODED_WRITE, unencoded_file_len,
+			  encoded_write, path, data, offset, len,
+			  unencoded_file_len, unencoded_len, unencoded_offset,
+			  compression, encryption);
+}
+
+static int stats_fallocate(const char *path, int mode, u64 offset, u64 len,
+			   void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_FALLOCATE, len, fallocate, path,
+			  mode, offset, len);
+}
+
+static int stats_fileattr(const char *path, u64 attr, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_FILEATTR, 0, fileattr, path, attr);
+}
+
+static int stats_enable_verity(const char *path, u8 algorithm, u32 block_size,
+			       int salt_len, char *salt,
+			       int sig_len, char *sig, void *user)
+{
+	return STATS_CALL(user, BTRFS_SEND_C_ENABLE_VERITY, 0, enable_verity,
+			  path, algorithm, block_size, salt_len, salt, sig_len,
+			  sig);
+}
+
+struct btrfs_send_ops btrfs_stats_send_ops = {
+	.subvol = stats_subvol,
+	.snapshot = stats_snapshot,
+	.mkfile = stats_mkfile,
+	.mkdir = stats_mkdir,
+	.mknod = stats_mknod,
+	.mkfifo = stats_mkfifo,
+	.mksock = stats_mksock,
+	.symlink = stats_symlink,
+	.rename = stats_rename,
+	.link = stats_link,
+	.unlink = stats_unlink,
+	.rmdir = stats_rmdir,
+	.write = stats_write,
+	.clone = stats_clone,
+	.set_xattr = stats_set_xattr,
+	.remove_xattr = stats_remove_xattr,
+	.truncate = stats_truncate,
+	.chmod = stats_chmod,
+	.chown = stats_chown,
+	.utimes = stats_utimes,
+	.update_extent = stats_update_extent,
+	.encoded_write = stats_encoded_write,
+	.fallocate = stats_fallocate,
+	.fileattr = stats_fileattr,
+	.enable_verity = stats_enable_verity,
+};
+
+/*
+ * Collect the statistics of the stream read from @fd, the commands are passed
+ * to @ops with @user if it's not NULL.
+ */
+void btrfs_receive_stats_init(struct btrfs_receive_stats *stats,
+			      struct btrfs_send_ops *ops, void *user, int fd)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->ops = ops;
+	stats->user = user;
+	stats->files = RB_ROOT;
+	/* The size of the stream is known only if it's seekable */
+	stats->start_pos = lseek(fd, 0, SEEK_CUR);
+	clock_gettime(CLOCK_MONOTONIC, &stats->start);
+}
+
+static void print_len_histogram(struct btrfs_receive_stats *stats)
+{
+	u64 max = 0;
+	int first = -1;
+	int last = 0;
+	int i;
+
+	for (i = 0; i < RECEIVE_STATS_LEN_BUCKETS; i++) {
+		if (!stats->len_buckets[i])
+			continue;
+		if (first < 0)
+			first = i;
+		last = i;
+		max = max_t(u64, max, stats->len_buckets[i]);
+	}
+	if (first < 0)
+		return;
+
+	printf("\nData command length (write, clone, encoded_write):\n");
+	for (i = first; i <= last; i++) {
+		u64 count = stats->len_buckets[i];
+		int bar = count * 40 / max;
+
+		/* The last bucket is for all the longer commands */
+		if (i == RECEIVE_STATS_LEN_BUCKETS - 1)
+			printf("  >  %-9s %10llu",
+			       pretty_size_mode(1ULL << (i - 1), UNITS_BINARY),
+			       count);
+		else
+			printf("  <= %-9s %10llu",
+			       pretty_size_mode(1ULL << i, UNITS_BINARY),
+			       count);
+		if (bar)
+			putchar(' ');
+		while (bar-- > 0)
+			putchar('#');
+		putchar('\n');
+	}
+}
+
+static void print_file_stats(struct btrfs_receive_stats *stats)
+{
+	finish_file_stats(stats);
+	if (!stats->nr_files)
+		return;
+
+	printf("\nFiles with data: %llu\n", stats->nr_files);
+	printf("  data commands per file:     %.2f\n",
+	       (double)stats->file_cmds / stats->nr_files);
+	printf("  extents per file:           %.2f\n",
+	       (double)stats->file_extents / stats->nr_files);
+	printf("  files with several extents: %llu\n", stats->fragmented_files);
+	printf("  most extents:               %llu in %s (%s)\n",
+	       stats->most_extents, stats->most_extents_path,
+	       pretty_size(stats->most_extents_bytes));
+}
+
+void btrfs_receive_stats_print(struct btrfs_receive_stats *stats, int fd)
+{
+	struct timespec end;
+	u64 elapsed;
+	u64 apply = 0;
+	u64 count = 0;
+	u64 bytes = 0;
+	off_t end_pos;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - stats->start.tv_sec) * 1000000000ULL +
+		  end.tv_nsec - stats->start.tv_nsec;
+	end_pos = lseek(fd, 0, SEEK_CUR);
+
+	printf("%-16s %10s %12s", "Command", "Count", "Bytes");
+	if (stats->ops)
+		printf(" %10s %10s", "Time", "Avg");
+	putchar('\n');
+	for (i = 0; i <= BTRFS_SEND_C_MAX; i++) {
+		struct receive_cmd_stats *cmd = &stats->cmds[i];
+
+		if (!cmd->count)
+			continue;
+		printf("%-16s %10llu %12s", cmd_names[i], cmd->count,
+		       cmd->bytes ? pretty_size(cmd->bytes) : "-");
+		if (stats->ops)
+			printf(" %9.3fs %8.1fus", elapsed_secs(cmd->nsecs),
+			       cmd->nsecs / 1000.0 / cmd->count);
+		putchar('\n');
+		count += cmd->count;
+		bytes += cmd->bytes;
+		apply += cmd->nsecs;
+	}
+	printf("%-16s %10llu %12s", "total", count, pretty_size(bytes));
+	if (stats->ops)
+		printf(" %9.3fs", elapsed_secs(apply));
+	putchar('\n');
+
+	print_len_histogram(stats);
+
+	if (stats->cmds[BTRFS_SEND_C_ENCODED_WRITE].count) {
+		printf("\nEncoded writes: %s encoded, %s unencoded",
+		       pretty_size(stats->encoded_bytes),
+		       pretty_size(stats->unencoded_bytes));
+		if (stats->unencoded_bytes)
+			printf(", ratio %.2f%%",
+			       stats->encoded_bytes * 100.0 /
+			       stats->unencoded_bytes);
+		putchar('\n');
+	}
+
+	print_file_stats(stats);
+
+	/* Time spent in the callbacks is not part of the parsing */
+	elapsed -= min(elapsed, apply);
+	printf("\nParsed %llu commands in %.3fs", count, elapsed_secs(elapsed));
+	if (elapsed) {
+		printf(", %.0f commands/s", count / elapsed_secs(elapsed));
+		if (stats->start_pos >= 0 && end_pos > stats->start_pos)
+			printf(", %s of stream, %s/s",
+			       pretty_size(end_pos - stats->start_pos),
+			       pretty_size((end_pos - stats->start_pos) /
+					   elapsed_secs(elapsed)));
+	}
+	putchar('\n');
+}
+
+void btrfs_receive_stats_release(struct btrfs_receive_stats *stats)
+{
+	free_file_stats_tree(&stats->files);
+}
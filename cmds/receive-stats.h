@@ -0,0 +1,72 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_RECEIVE_STATS_H__
+#define __BTRFS_RECEIVE_STATS_H__
+
+#include "kerncompat.h"
+#include <limits.h>
+#include <time.h>
+#include "kernel-lib/rbtree_types.h"
+#include "kernel-shared/send.h"
+#include "common/send-stream.h"
+
+/* Power of two buckets of the data command lengths, the last is above 64MiB */
+#define RECEIVE_STATS_LEN_BUCKETS	(28)
+
+struct receive_cmd_stats {
+	u64 count;
+	/* Length of file data for write, clone and the like */
+	u64 bytes;
+	/* Time spent in the wrapped callback */
+	u64 nsecs;
+};
+
+struct btrfs_receive_stats {
+	/* Callbacks to apply the commands, NULL to only collect the stats */
+	struct btrfs_send_ops *ops;
+	void *user;
+
+	struct receive_cmd_stats cmds[BTRFS_SEND_C_MAX + 1];
+	u64 len_buckets[RECEIVE_STATS_LEN_BUCKETS];
+
+	/* Sum of the encoded and unencoded lengths of encoded writes */
+	u64 encoded_bytes;
+	u64 unencoded_bytes;
+
+	/* Files of the current subvolume written by data commands, by path */
+	struct rb_root files;
+	/* Summary of the files of all subvolumes */
+	u64 nr_files;
+	u64 file_cmds;
+	u64 file_extents;
+	u64 fragmented_files;
+	u64 most_extents;
+	u64 most_extents_bytes;
+	char most_extents_path[PATH_MAX];
+
+	struct timespec start;
+	off_t start_pos;
+};
+
+extern struct btrfs_send_ops btrfs_stats_send_ops;
+
+void btrfs_receive_stats_init(struct btrfs_receive_stats *stats,
+			      struct btrfs_send_ops *ops, void *user, int fd);
+void btrfs_receive_stats_print(struct btrfs_receive_stats *stats, int fd);
+void btrfs_receive_stats_release(struct btrfs_receive_stats *stats);
+
+#endif
@@ -25,6 +25,7 @@
 #include <linux/fsverity.h>
 #endif
 #include <unistd.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <fcntl.h>
 #include <getopt.h>
@@ -44,6 +45,9 @@
 #if COMPRESSION_ZSTD
 #include <zstd.h>
 #endif
+#include "kernel-lib/list.h"
+#include "kernel-lib/rbtree.h"
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/uapi/btrfs.h"
 #include "kernel-shared/ctree.h"
 #include "common/defs.h"
@@ -54,8 +58,96 @@
 #include "common/help.h"
 #include "common/path-utils.h"
 #include "common/string-utils.h"
+#include "common/rbtree-utils.h"
 #include "cmds/commands.h"
 #include "cmds/receive-dump.h"
+#include "cmds/receive-stats.h"
+
+/* Maximum number of clone source files kept open */
+#define CLONE_FD_CACHE_SIZE		(64)
+
+/* Clone source subvolume found by its received UUID */
+struct clone_subvol {
+	struct list_head list;
+	u8 uuid[BTRFS_UUID_SIZE];
+	u64 ctransid;
+	/* Relative to the mount point */
+	char *path;
+};
+
+/* Open clone source file */
+struct clone_fd {
+	struct rb_node node;
+	struct list_head lru;
+	int fd;
+	/* The file is in the subvolume being received and can be renamed */
+	bool cur_subvol;
+	/* Relative to the mount point */
+	char path[];
+};
+
+/*
+ * Streams of deduplicated files contain clones of the same few files over and
+ * over, cache the subvolume lookups and the open files for the whole receive.
+ */
+struct clone_cache {
+	struct list_head subvols;
+	struct rb_root fds;
+	struct list_head fd_lru;
+	int nr_fds;
+
+	u64 subvol_hits;
+	u64 subvol_misses;
+	u64 fd_hits;
+	u64 fd_misses;
+};
+
+/* Upper limit of the file data queued for the writer threads */
+#define RECEIVE_MAX_INFLIGHT		(SZ_64M)
+#define RECEIVE_MAX_THREADS		(32)
+
+enum receive_write_type {
+	RECEIVE_WRITE,
+	RECEIVE_ENCODED_WRITE,
+};
+
+/* Write or encoded write queued for the writer threads */
+struct receive_write_job {
+	/* Writer queue */
+	struct list_head list;
+	/* All queued jobs */
+	struct list_head inflight;
+
+	enum receive_write_type type;
+	struct receive_write_file *file;
+	u64 offset;
+	u64 len;
+
+	/* Encoded write only */
+	u64 unencoded_file_len;
+	u64 unencoded_len;
+	u64 unencoded_offset;
+	u32 compression;
+
+	const char *path;
+	/* Data followed by the path */
+	char buf[];
+};
+
+/* File open for writing, shared by the writes queued for it */
+struct receive_write_file {
+	int fd;
+	u64 ino;
+	/* Held by the current write file and each queued write, under write_lock */
+	int refs;
+};
+
+struct receive_writer {
+	struct btrfs_receive *rctx;
+	struct list_head queue;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
 
 struct btrfs_receive
 {
@@ -64,6 +156,8 @@ struct btrfs_receive
 
 	int write_fd;
 	char write_path[PATH_MAX];
+	/* Pipelined receive only, the descriptor of write_fd */
+	struct receive_write_file *write_file;
 
 	char *root_path;
 	char *dest_dir_path; /* relative to root_path */
@@ -88,8 +182,265 @@ struct btrfs_receive
 	ZSTD_DStream *zstd_dstream;
 #endif
 	z_stream *zlib_stream;
+
+	struct clone_cache clone_cache;
+
+	/*
+	 * Pipelined receive: the stream is read ahead by a separate thread and
+	 * the file data are written by the writer threads. The writes of one
+	 * inode are done in order by the same thread, the writes of different
+	 * inodes in parallel. Commands changing a file wait until its queued
+	 * writes are done.
+	 */
+	int nr_writers;
+	int nr_started_writers;
+	struct receive_writer *writers;
+	pthread_mutex_t write_lock;
+	pthread_cond_t write_done_cond;
+	struct list_head write_inflight;
+	u64 write_inflight_bytes;
+	bool writers_stop;
+	/* First error of the queued writes, reported by the next command */
+	int write_error;
+	/* Decompression state above is shared by the writer threads */
+	pthread_mutex_t decompress_lock;
+
+	/* Time the commands and print the statistics of the stream */
+	bool stats;
 };
 
+static int wait_for_writes(struct btrfs_receive *rctx)
+{
+	int ret;
+
+	if (!rctx->nr_writers)
+		return 0;
+
+	pthread_mutex_lock(&rctx->write_lock);
+	while (!list_empty(&rctx->write_inflight))
+		pthread_cond_wait(&rctx->write_done_cond, &rctx->write_lock);
+	ret = rctx->write_error;
+	rctx->write_error = 0;
+	pthread_mutex_unlock(&rctx->write_lock);
+	return ret;
+}
+
+static bool inode_writes_queued(struct btrfs_receive *rctx, u64 ino)
+{
+	struct receive_write_job *job;
+
+	list_for_each_entry(job, &rctx->write_inflight, inflight) {
+		if (job->file->ino == ino)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Wait until the queued writes of the inode at @path are done, the writes of
+ * other inodes continue
+ */
+static int wait_for_inode_writes(struct btrfs_receive *rctx, const char *path)
+{
+	struct stat st;
+	int ret;
+
+	if (!rctx->nr_writers)
+		return 0;
+	if (lstat(path, &st) < 0)
+		return wait_for_writes(rctx);
+
+	pthread_mutex_lock(&rctx->write_lock);
+	while (inode_writes_queued(rctx, st.st_ino))
+		pthread_cond_wait(&rctx->write_done_cond, &rctx->write_lock);
+	ret = rctx->write_error;
+	rctx->write_error = 0;
+	pthread_mutex_unlock(&rctx->write_lock);
+	return ret;
+}
+
+static void clone_cache_init(struct clone_cache *cache)
+{
+	memset(cache, 0, sizeof(*cache));
+	INIT_LIST_HEAD(&cache->subvols);
+	cache->fds = RB_ROOT;
+	INIT_LIST_HEAD(&cache->fd_lru);
+}
+
+static void clone_cache_drop_fd(struct clone_cache *cache, struct clone_fd *cfd)
+{
+	rb_erase(&cfd->node, &cache->fds);
+	list_del(&cfd->lru);
+	close(cfd->fd);
+	free(cfd);
+	cache->nr_fds--;
+}
+
+/*
+ * Forget open files of the subvolume being received, called when its paths
+ * change by rename, unlink or rmdir.
+ */
+static void clone_cache_drop_cur_subvol(struct clone_cache *cache)
+{
+	struct clone_fd *cfd;
+	struct clone_fd *tmp;
+
+	list_for_each_entry_safe(cfd, tmp, &cache->fd_lru, lru) {
+		if (cfd->cur_subvol)
+			clone_cache_drop_fd(cache, cfd);
+	}
+}
+
+static void clone_cache_free(struct clone_cache *cache)
+{
+	struct clone_subvol *cs;
+	struct clone_fd *cfd;
+
+	while (!list_empty(&cache->fd_lru)) {
+		cfd = list_first_entry(&cache->fd_lru, struct clone_fd, lru);
+		clone_cache_drop_fd(cache, cfd);
+	}
+	while (!list_empty(&cache->subvols)) {
+		cs = list_first_entry(&cache->subvols, struct clone_subvol, list);
+		list_del(&cs->list);
+		free(cs->path);
+		free(cs);
+	}
+}
+
+static int clone_fd_cmp(struct rb_node *node, void *key)
+{
+	struct clone_fd *cfd = rb_entry(node, struct clone_fd, node);
+
+	return strcmp(cfd->path, key);
+}
+
+static int clone_fd_cmp_nodes(struct rb_node *node1, struct rb_node *node2)
+{
+	struct clone_fd *cfd = rb_entry(node2, struct clone_fd, node);
+
+	return clone_fd_cmp(node1, cfd->path);
+}
+
+/*
+ * Return an open read-only descriptor of @path relative to the mount point,
+ * owned by the cache. The least recently used file is closed when there are
+ * too many.
+ */
+static int clone_cache_open(struct btrfs_receive *rctx, const char *path,
+			    bool cur_subvol)
+{
+	struct clone_cache *cache = &rctx->clone_cache;
+	struct clone_fd *cfd;
+	struct rb_node *node;
+	int fd;
+
+	node = rb_search(&cache->fds, (void *)path, clone_fd_cmp, NULL);
+	if (node) {
+		cfd = rb_entry(node, struct clone_fd, node);
+		list_move(&cfd->lru, &cache->fd_lru);
+		cache->fd_hits++;
+		return cfd->fd;
+	}
+	cache->fd_misses++;
+
+	fd = openat(rctx->mnt_fd, path, O_RDONLY | O_NOATIME);
+	if (fd < 0) {
+		fd = -errno;
+		error("cannot open %s: %m", path);
+		return fd;
+	}
+	cfd = malloc(sizeof(*cfd) + strlen(path) + 1);
+	if (!cfd) {
+		close(fd);
+		return -ENOMEM;
+	}
+	cfd->fd = fd;
+	cfd->cur_subvol = cur_subvol;
+	strcpy(cfd->path, path);
+
+	if (cache->nr_fds >= CLONE_FD_CACHE_SIZE)
+		clone_cache_drop_fd(cache, list_last_entry(&cache->fd_lru,
+					struct clone_fd, lru));
+	rb_insert(&cache->fds, &cfd->node, clone_fd_cmp_nodes);
+	list_add(&cfd->lru, &cache->fd_lru);
+	cache->nr_fds++;
+	return fd;
+}
+
+/*
+ * Return path of the subvolume with received @uuid and @ctransid relative to
+ * the mount point, owned by the cache.
+ */
+static int clone_cache_find_subvol(struct btrfs_receive *rctx, const u8 *uuid,
+				   u64 ctransid, const char **path_ret)
+{
+	struct clone_cache *cache = &rctx->clone_cache;
+	struct clone_subvol *cs;
+	struct subvol_info *si;
+	const char *subvol_path;
+	int ret = 0;
+
+	list_for_each_entry(cs, &cache->subvols, list) {
+		if (cs->ctransid == ctransid &&
+		    memcmp(cs->uuid, uuid, BTRFS_UUID_SIZE) == 0) {
+			list_move(&cs->list, &cache->subvols);
+			cache->subvol_hits++;
+			*path_ret = cs->path;
+			return 0;
+		}
+	}
+	cache->subvol_misses++;
+
+	si = subvol_uuid_search(rctx->mnt_fd, 0, uuid, ctransid, NULL,
+				subvol_search_by_received_uuid);
+	if (IS_ERR_OR_NULL(si)) {
+		char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
+
+		uuid_unparse(uuid, uuid_str);
+		error("clone: cannot find source subvol %s", uuid_str);
+		return si ? PTR_ERR(si) : -ENOENT;
+	}
+	/* strip the subvolume that we are receiving to from the start of subvol_path */
+	if (rctx->full_root_path) {
+		size_t root_len = strlen(rctx->full_root_path);
+		size_t sub_len = strlen(si->path);
+
+		if (sub_len > root_len &&
+		    strstr(si->path, rctx->full_root_path) == si->path &&
+		    si->path[root_len] == '/') {
+			subvol_path = si->path + root_len + 1;
+		} else {
+			error("clone: source subvol path %s unreachable from %s",
+				si->path, rctx->full_root_path);
+			ret = -ENOENT;
+			goto out;
+		}
+	} else {
+		subvol_path = si->path;
+	}
+
+	cs = calloc(1, sizeof(*cs));
+	if (!cs) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	cs->path = strdup(subvol_path);
+	if (!cs->path) {
+		free(cs);
+		ret = -ENOMEM;
+		goto out;
+	}
+	memcpy(cs->uuid, uuid, BTRFS_UUID_SIZE);
+	cs->ctransid = ctransid;
+	list_add(&cs->list, &cache->subvols);
+	*path_ret = cs->path;
+out:
+	free(si->path);
+	free(si);
+	return ret;
+}
+
 static int finish_subvol(struct btrfs_receive *rctx)
 {
 	int ret;
@@ -98,9 +449,15 @@ static int finish_subvol(struct btrfs_receive *rctx)
 	char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
 	u64 flags;
 
+	ret = wait_for_writes(rctx);
+	if (ret < 0)
+		return ret;
+
 	if (rctx->cur_subvol_path[0] == 0)
 		return 0;
 
+	clone_cache_drop_cur_subvol(&rctx->clone_cache);
+
 	subvol_fd = openat(rctx->mnt_fd, rctx->cur_subvol_path,
 			   O_RDONLY | O_NOATIME);
 	if (subvol_fd < 0) {
@@ -551,6 +908,8 @@ static int process_rename(const char *from, const char *to, void *user)
 		goto out;
 	}
 
+	clone_cache_drop_cur_subvol(&rctx->clone_cache);
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "rename %s -> %s\n", from, to);
 
@@ -609,6 +968,8 @@ static int process_unlink(const char *path, void *user)
 		goto out;
 	}
 
+	clone_cache_drop_cur_subvol(&rctx->clone_cache);
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "unlink %s\n", path);
 
@@ -634,6 +995,8 @@ static int process_rmdir(const char *path, void *user)
 		goto out;
 	}
 
+	clone_cache_drop_cur_subvol(&rctx->clone_cache);
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "rmdir %s\n", path);
 
@@ -647,15 +1010,43 @@ out:
 	return ret;
 }
 
+/* Drop a reference of the write file, called under write_lock */
+static void put_write_file(struct receive_write_file *file)
+{
+	if (--file->refs > 0)
+		return;
+	close(file->fd);
+	free(file);
+}
+
+/* The queued writes keep the file open until they're done */
+static void close_inode_for_write(struct btrfs_receive *rctx)
+{
+	if(rctx->write_fd == -1)
+		return;
+
+	if (rctx->write_file) {
+		pthread_mutex_lock(&rctx->write_lock);
+		put_write_file(rctx->write_file);
+		pthread_mutex_unlock(&rctx->write_lock);
+		rctx->write_file = NULL;
+	} else {
+		close(rctx->write_fd);
+	}
+	rctx->write_fd = -1;
+	rctx->write_path[0] = 0;
+}
+
 static int open_inode_for_write(struct btrfs_receive *rctx, const char *path)
 {
+	struct receive_write_file *file;
+	struct stat st;
 	int ret = 0;
 
 	if (rctx->write_fd != -1) {
 		if (strcmp(rctx->write_path, path) == 0)
 			goto out;
-		close(rctx->write_fd);
-		rctx->write_fd = -1;
+		close_inode_for_write(rctx);
 	}
 
 	rctx->write_fd = open(path, O_RDWR);
@@ -666,18 +1057,197 @@ static int open_inode_for_write(struct btrfs_receive *rctx, const char *path)
 	}
 	strncpy_null(rctx->write_path, path);
 
+	if (rctx->nr_writers) {
+		/* The writes are assigned to the writer threads by inode */
+		if (fstat(rctx->write_fd, &st) < 0) {
+			ret = -errno;
+			error("cannot stat %s: %m", path);
+			close_inode_for_write(rctx);
+			goto out;
+		}
+		file = malloc(sizeof(*file));
+		if (!file) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			close_inode_for_write(rctx);
+			ret = -ENOMEM;
+			goto out;
+		}
+		file->fd = rctx->write_fd;
+		file->ino = st.st_ino;
+		file->refs = 1;
+		rctx->write_file = file;
+	}
+
 out:
 	return ret;
 }
 
-static void close_inode_for_write(struct btrfs_receive *rctx)
+static int write_data(int fd, const char *path, const char *data, u64 offset,
+		      u64 len)
 {
-	if(rctx->write_fd == -1)
+	u64 pos = 0;
+	ssize_t w;
+
+	while (pos < len) {
+		w = pwrite(fd, data + pos, len - pos, offset + pos);
+		if (w < 0) {
+			int ret = -errno;
+
+			error("writing to %s failed: %m", path);
+			return ret;
+		}
+		pos += w;
+	}
+	return 0;
+}
+
+static int encoded_write(struct btrfs_receive *rctx, int fd, const char *path,
+			 const void *data, u64 offset, u64 len,
+			 u64 unencoded_file_len, u64 unencoded_len,
+			 u64 unencoded_offset, u32 compression);
+
+static void *writer_thread(void *arg)
+{
+	struct receive_writer *writer = arg;
+	struct btrfs_receive *rctx = writer->rctx;
+	struct receive_write_job *job;
+	int ret;
+
+	pthread_mutex_lock(&rctx->write_lock);
+	while (1) {
+		while (list_empty(&writer->queue) && !rctx->writers_stop)
+			pthread_cond_wait(&writer->cond, &rctx->write_lock);
+		if (list_empty(&writer->queue))
+			break;
+		job = list_first_entry(&writer->queue, struct receive_write_job,
+				       list);
+		list_del(&job->list);
+		pthread_mutex_unlock(&rctx->write_lock);
+
+		if (job->type == RECEIVE_WRITE)
+			ret = write_data(job->file->fd, job->path, job->buf,
+					 job->offset, job->len);
+		else
+			ret = encoded_write(rctx, job->file->fd, job->path, job->buf,
+					    job->offset, job->len,
+					    job->unencoded_file_len,
+					    job->unencoded_len,
+					    job->unencoded_offset,
+					    job->compression);
+
+		pthread_mutex_lock(&rctx->write_lock);
+		if (ret < 0 && !rctx->write_error)
+			rctx->write_error = ret;
+		list_del(&job->inflight);
+		rctx->write_inflight_bytes -= job->len;
+		put_write_file(job->file);
+		free(job);
+		pthread_cond_broadcast(&rctx->write_done_cond);
+	}
+	pthread_mutex_unlock(&rctx->write_lock);
+	return NULL;
+}
+
+static void stop_writers(struct btrfs_receive *rctx)
+{
+	int i;
+
+	if (!rctx->writers)
 		return;
 
-	close(rctx->write_fd);
-	rctx->write_fd = -1;
-	rctx->write_path[0] = 0;
+	pthread_mutex_lock(&rctx->write_lock);
+	rctx->writers_stop = true;
+	for (i = 0; i < rctx->nr_started_writers; i++)
+		pthread_cond_signal(&rctx->writers[i].cond);
+	pthread_mutex_unlock(&rctx->write_lock);
+
+	for (i = 0; i < rctx->nr_started_writers; i++)
+		pthread_join(rctx->writers[i].thread, NULL);
+	for (i = 0; i < rctx->nr_writers; i++)
+		pthread_cond_destroy(&rctx->writers[i].cond);
+	free(rctx->writers);
+	rctx->writers = NULL;
+	rctx->nr_started_writers = 0;
+	pthread_cond_destroy(&rctx->write_done_cond);
+	pthread_mutex_destroy(&rctx->write_lock);
+}
+
+static int start_writers(struct btrfs_receive *rctx)
+{
+	int i;
+	int ret;
+
+	rctx->writers = calloc(rctx->nr_writers, sizeof(*rctx->writers));
+	if (!rctx->writers) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&rctx->write_lock, NULL);
+	pthread_cond_init(&rctx->write_done_cond, NULL);
+	INIT_LIST_HEAD(&rctx->write_inflight);
+	rctx->writers_stop = false;
+	for (i = 0; i < rctx->nr_writers; i++) {
+		rctx->writers[i].rctx = rctx;
+		INIT_LIST_HEAD(&rctx->writers[i].queue);
+		pthread_cond_init(&rctx->writers[i].cond, NULL);
+	}
+	for (i = 0; i < rctx->nr_writers; i++) {
+		ret = pthread_create(&rctx->writers[i].thread, NULL,
+				     writer_thread, &rctx->writers[i]);
+		if (ret) {
+			errno = ret;
+			error("failed to start writer thread: %m");
+			stop_writers(rctx);
+			return -ret;
+		}
+		rctx->nr_started_writers++;
+	}
+	return 0;
+}
+
+/*
+ * Copy the data and queue the write of the current file to a writer thread.
+ * All writes of an inode go to the same thread and are done in the order of
+ * the stream.
+ */
+static int queue_write(struct btrfs_receive *rctx, struct receive_write_job *tmpl,
+		       const void *data)
+{
+	struct receive_write_job *job;
+	struct receive_writer *writer;
+	size_t path_len = strlen(tmpl->path);
+	int ret;
+
+	job = malloc(sizeof(*job) + tmpl->len + path_len + 1);
+	if (!job) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return -ENOMEM;
+	}
+	*job = *tmpl;
+	memcpy(job->buf, data, job->len);
+	memcpy(job->buf + job->len, tmpl->path, path_len + 1);
+	job->path = job->buf + job->len;
+	job->file = rctx->write_file;
+	writer = &rctx->writers[job->file->ino % rctx->nr_writers];
+
+	pthread_mutex_lock(&rctx->write_lock);
+	while (!list_empty(&rctx->write_inflight) &&
+	       rctx->write_inflight_bytes + job->len > RECEIVE_MAX_INFLIGHT)
+		pthread_cond_wait(&rctx->write_done_cond, &rctx->write_lock);
+	ret = rctx->write_error;
+	rctx->write_error = 0;
+	if (ret < 0) {
+		pthread_mutex_unlock(&rctx->write_lock);
+		free(job);
+		return ret;
+	}
+	job->file->refs++;
+	list_add_tail(&job->inflight, &rctx->write_inflight);
+	rctx->write_inflight_bytes += job->len;
+	list_add_tail(&job->list, &writer->queue);
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&rctx->write_lock);
+	return 0;
 }
 
 static int process_write(const char *path, const void *data, u64 offset,
@@ -686,8 +1256,6 @@ static int process_write(const char *path, const void *data, u64 offset,
 	int ret = 0;
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
-	u64 pos = 0;
-	int w;
 
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
@@ -703,15 +1271,17 @@ static int process_write(const char *path, const void *data, u64 offset,
 		fprintf(stderr, "write %s - offset=%llu length=%llu\n",
 			path, offset, len);
 
-	while (pos < len) {
-		w = pwrite(rctx->write_fd, (char*)data + pos, len - pos,
-				offset + pos);
-		if (w < 0) {
-			ret = -errno;
-			error("writing to %s failed: %m", path);
-			goto out;
-		}
-		pos += w;
+	if (rctx->nr_writers) {
+		struct receive_write_job job = {
+			.type = RECEIVE_WRITE,
+			.offset = offset,
+			.len = len,
+			.path = path,
+		};
+
+		ret = queue_write(rctx, &job, data);
+	} else {
+		ret = write_data(rctx->write_fd, path, data, offset, len);
 	}
 
 out:
@@ -726,11 +1296,11 @@ static int process_clone(const char *path, u64 offset, u64 len,
 	int ret;
 	struct btrfs_receive *rctx = user;
 	struct btrfs_ioctl_clone_range_args clone_args;
-	struct subvol_info *si = NULL;
 	char full_path[PATH_MAX];
-	const char *subvol_path;
+	const char *subvol_path = NULL;
 	char full_clone_path[PATH_MAX];
-	int clone_fd = -1;
+	bool cur_subvol = false;
+	int clone_fd;
 
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
@@ -738,6 +1308,10 @@ static int process_clone(const char *path, u64 offset, u64 len,
 		goto out;
 	}
 
+	ret = wait_for_writes(rctx);
+	if (ret < 0)
+		goto out;
+
 	ret = open_inode_for_write(rctx, full_path);
 	if (ret < 0)
 		goto out;
@@ -745,38 +1319,12 @@ static int process_clone(const char *path, u64 offset, u64 len,
 	if (memcmp(clone_uuid, rctx->cur_subvol.received_uuid,
 		   BTRFS_UUID_SIZE) == 0) {
 		subvol_path = rctx->cur_subvol_path;
+		cur_subvol = true;
 	} else {
-		si = subvol_uuid_search(rctx->mnt_fd, 0, clone_uuid, clone_ctransid,
-					NULL,
-					subvol_search_by_received_uuid);
-		if (IS_ERR_OR_NULL(si)) {
-			char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
-
-			if (!si)
-				ret = -ENOENT;
-			else
-				ret = PTR_ERR(si);
-			uuid_unparse(clone_uuid, uuid_str);
-			error("clone: cannot find source subvol %s", uuid_str);
+		ret = clone_cache_find_subvol(rctx, clone_uuid, clone_ctransid,
+					      &subvol_path);
+		if (ret < 0)
 			goto out;
-		}
-		/* strip the subvolume that we are receiving to from the start of subvol_path */
-		if (rctx->full_root_path) {
-			size_t root_len = strlen(rctx->full_root_path);
-			size_t sub_len = strlen(si->path);
-
-			if (sub_len > root_len &&
-			    strstr(si->path, rctx->full_root_path) == si->path &&
-			    si->path[root_len] == '/') {
-				subvol_path = si->path + root_len + 1;
-			} else {
-				error("clone: source subvol path %s unreachable from %s",
-					si->path, rctx->full_root_path);
-				goto out;
-			}
-		} else {
-			subvol_path = si->path;
-		}
 	}
 
 	ret = path_cat_out(full_clone_path, subvol_path, clone_path);
@@ -785,10 +1333,9 @@ static int process_clone(const char *path, u64 offset, u64 len,
 		goto out;
 	}
 
-	clone_fd = openat(rctx->mnt_fd, full_clone_path, O_RDONLY | O_NOATIME);
+	clone_fd = clone_cache_open(rctx, full_clone_path, cur_subvol);
 	if (clone_fd < 0) {
-		ret = -errno;
-		error("cannot open %s: %m", full_clone_path);
+		ret = clone_fd;
 		goto out;
 	}
 
@@ -809,12 +1356,6 @@ static int process_clone(const char *path, u64 offset, u64 len,
 	}
 
 out:
-	if (!IS_ERR_OR_NULL(si)) {
-		free(si->path);
-		free(si);
-	}
-	if (clone_fd != -1)
-		close(clone_fd);
 	return ret;
 }
 
@@ -832,6 +1373,10 @@ static int process_set_xattr(const char *path, const char *name,
 		goto out;
 	}
 
+	ret = wait_for_inode_writes(rctx, full_path);
+	if (ret < 0)
+		goto out;
+
 	if (bconf.verbose >= 3) {
 		fprintf(stderr, "set_xattr %s - name=%s data_len=%d "
 				"data=%.*s\n", path, name, len,
@@ -862,6 +1407,10 @@ static int process_remove_xattr(const char *path, const char *name, void *user)
 		goto out;
 	}
 
+	ret = wait_for_inode_writes(rctx, full_path);
+	if (ret < 0)
+		goto out;
+
 	if (bconf.verbose >= 3) {
 		fprintf(stderr, "remove_xattr %s - name=%s\n",
 				path, name);
@@ -890,6 +1439,10 @@ static int process_truncate(const char *path, u64 size, void *user)
 		goto out;
 	}
 
+	ret = wait_for_inode_writes(rctx, full_path);
+	if (ret < 0)
+		goto out;
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "truncate %s size=%llu\n", path, size);
 
@@ -916,6 +1469,10 @@ static int process_chmod(const char *path, u64 mode, void *user)
 		goto out;
 	}
 
+	ret = wait_for_inode_writes(rctx, full_path);
+	if (ret < 0)
+		goto out;
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "chmod %s - mode=0%o\n", path, (int)mode);
 
@@ -942,6 +1499,10 @@ static int process_chown(const char *path, u64 uid, u64 gid, void *user)
 		goto out;
 	}
 
+	ret = wait_for_inode_writes(rctx, full_path);
+	if (ret < 0)
+		goto out;
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "chown %s - uid=%llu, gid=%llu\n", path,
 				uid, gid);
@@ -971,6 +1532,10 @@ static int process_utimes(const char *path, struct timespec *at,
 		goto out;
 	}
 
+	ret = wait_for_inode_writes(rctx, full_path);
+	if (ret < 0)
+		goto out;
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "utimes %s\n", path);
 
@@ -1161,7 +1726,7 @@ static int decompress_lzo(const char *encoded_data, u64 encoded_len,
 }
 #endif
 
-static int decompress_and_write(struct btrfs_receive *rctx,
+static int decompress_and_write(struct btrfs_receive *rctx, int fd,
 				const char *encoded_data, u64 offset,
 				u64 encoded_len, u64 unencoded_file_len,
 				u64 unencoded_len, u64 unencoded_offset,
@@ -1224,7 +1789,7 @@ static int decompress_and_write(struct btrfs_receive *rctx,
 	while (written < unencoded_file_len) {
 		ssize_t w;
 
-		w = pwrite(rctx->write_fd, unencoded_data + unencoded_offset,
+		w = pwrite(fd, unencoded_data + unencoded_offset,
 			   unencoded_file_len - written, offset);
 		if (w < 0) {
 			ret = -errno;
@@ -1240,14 +1805,12 @@ out:
 	return ret;
 }
 
-static int process_encoded_write(const char *path, const void *data, u64 offset,
-				 u64 len, u64 unencoded_file_len,
-				 u64 unencoded_len, u64 unencoded_offset,
-				 u32 compression, u32 encryption, void *user)
+static int encoded_write(struct btrfs_receive *rctx, int fd, const char *path,
+			 const void *data, u64 offset, u64 len,
+			 u64 unencoded_file_len, u64 unencoded_len,
+			 u64 unencoded_offset, u32 compression)
 {
 	int ret;
-	struct btrfs_receive *rctx = user;
-	char full_path[PATH_MAX];
 	struct iovec iov = { (char *)data, len };
 	struct btrfs_ioctl_encoded_io_args encoded = {
 		.iov = &iov,
@@ -1257,9 +1820,41 @@ static int process_encoded_write(const char *path, const void *data, u64 offset,
 		.unencoded_len = unencoded_len,
 		.unencoded_offset = unencoded_offset,
 		.compression = compression,
-		.encryption = encryption,
 	};
 
+	if (!rctx->force_decompress) {
+		ret = ioctl(fd, BTRFS_IOC_ENCODED_WRITE, &encoded);
+		if (ret >= 0)
+			return 0;
+		/* Fall back for these errors, fail hard for anything else. */
+		if (errno != ENOSPC && errno != ENOTTY && errno != EINVAL) {
+			ret = -errno;
+			error("encoded_write: writing to %s failed: %m", path);
+			return ret;
+		}
+		if (bconf.verbose >= 3)
+			fprintf(stderr,
+"encoded_write %s - falling back to decompress and write due to errno %d (\"%m\")\n",
+				path, errno);
+	}
+
+	pthread_mutex_lock(&rctx->decompress_lock);
+	ret = decompress_and_write(rctx, fd, data, offset, len,
+				   unencoded_file_len, unencoded_len,
+				   unencoded_offset, compression);
+	pthread_mutex_unlock(&rctx->decompress_lock);
+	return ret;
+}
+
+static int process_encoded_write(const char *path, const void *data, u64 offset,
+				 u64 len, u64 unencoded_file_len,
+				 u64 unencoded_len, u64 unencoded_offset,
+				 u32 compression, u32 encryption, void *user)
+{
+	int ret;
+	struct btrfs_receive *rctx = user;
+	char full_path[PATH_MAX];
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr,
 "encoded_write %s - offset=%llu, len=%llu, unencoded_offset=%llu, unencoded_file_len=%llu, unencoded_len=%llu, compression=%u, encryption=%u\n",
@@ -1281,25 +1876,24 @@ static int process_encoded_write(const char *path, const void *data, u64 offset,
 	if (ret < 0)
 		return ret;
 
-	if (!rctx->force_decompress) {
-		ret = ioctl(rctx->write_fd, BTRFS_IOC_ENCODED_WRITE, &encoded);
-		if (ret >= 0)
-			return 0;
-		/* Fall back for these errors, fail hard for anything else. */
-		if (errno != ENOSPC && errno != ENOTTY && errno != EINVAL) {
-			ret = -errno;
-			error("encoded_write: writing to %s failed: %m", path);
-			return ret;
-		}
-		if (bconf.verbose >= 3)
-			fprintf(stderr,
-"encoded_write %s - falling back to decompress and write due to errno %d (\"%m\")\n",
-				path, errno);
+	if (rctx->nr_writers) {
+		struct receive_write_job job = {
+			.type = RECEIVE_ENCODED_WRITE,
+			.offset = offset,
+			.len = len,
+			.unencoded_file_len = unencoded_file_len,
+			.unencoded_len = unencoded_len,
+			.unencoded_offset = unencoded_offset,
+			.compression = compression,
+			.path = path,
+		};
+
+		return queue_write(rctx, &job, data);
 	}
 
-	return decompress_and_write(rctx, data, offset, len, unencoded_file_len,
-				    unencoded_len, unencoded_offset,
-				    compression);
+	return encoded_write(rctx, rctx->write_fd, path, data, offset, len,
+			     unencoded_file_len, unencoded_len,
+			     unencoded_offset, compression);
 }
 
 static int process_fallocate(const char *path, int mode, u64 offset, u64 len,
@@ -1320,6 +1914,9 @@ static int process_fallocate(const char *path, int mode, u64 offset, u64 len,
 		return ret;
 	}
 	ret = open_inode_for_write(rctx, full_path);
+	if (ret < 0)
+		return ret;
+	ret = wait_for_inode_writes(rctx, full_path);
 	if (ret < 0)
 		return ret;
 	ret = fallocate(rctx->write_fd, mode, offset, len);
@@ -1394,6 +1991,10 @@ static int process_enable_verity(const char *path, u8 algorithm, u32 block_size,
 		goto out;
 	}
 
+	ret = wait_for_inode_writes(rctx, full_path);
+	if (ret < 0)
+		goto out;
+
 	ioctl_fd = open(full_path, O_RDONLY);
 	if (ioctl_fd < 0) {
 		ret = -errno;
@@ -1466,6 +2067,12 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 	char root_subvol_path[PATH_MAX];
 	bool end = false;
 	int iterations = 0;
+	struct btrfs_send_stream_reader *reader = NULL;
+	struct btrfs_receive_stats stats;
+	struct btrfs_send_ops *ops = &send_ops;
+	void *user = rctx;
+
+	clone_cache_init(&rctx->clone_cache);
 
 	dest_dir_full_path = realpath(tomnt, NULL);
 	if (!dest_dir_full_path) {
@@ -1558,9 +2165,37 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 			rctx->dest_dir_path++;
 	}
 
+	if (rctx->stats) {
+		btrfs_receive_stats_init(&stats, &send_ops, rctx, r_fd);
+		ops = &btrfs_stats_send_ops;
+		user = &stats;
+	}
+
+	if (rctx->nr_writers) {
+		/*
+		 * Reading ahead would consume the input after the end of the
+		 * stream, which belongs to the next reader with -e
+		 */
+		if (!rctx->honor_end_cmd) {
+			reader = btrfs_send_stream_reader_start(r_fd);
+			if (!reader) {
+				ret = -ENOMEM;
+				goto out;
+			}
+		}
+		ret = start_writers(rctx);
+		if (ret < 0)
+			goto out;
+	}
+
 	while (!end) {
-		ret = btrfs_read_and_process_send_stream(r_fd, &send_ops,
-							 rctx,
+		if (reader)
+			ret = btrfs_read_and_process_send_stream_reader(reader,
+					ops, user, rctx->honor_end_cmd,
+					max_errors);
+		else
+			ret = btrfs_read_and_process_send_stream(r_fd, ops,
+							 user,
 							 rctx->honor_end_cmd,
 							 max_errors);
 		if (ret < 0) {
@@ -1579,6 +2214,9 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 		if (ret > 0)
 			end = true;
 
+		ret = wait_for_writes(rctx);
+		if (ret < 0)
+			goto out;
 		close_inode_for_write(rctx);
 		ret = finish_subvol(rctx);
 		if (ret < 0)
@@ -1588,11 +2226,25 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 	}
 	ret = 0;
 
+	if (rctx->stats)
+		btrfs_receive_stats_print(&stats, r_fd);
+
 out:
-	if (rctx->write_fd != -1) {
-		close(rctx->write_fd);
-		rctx->write_fd = -1;
-	}
+	if (ops == &btrfs_stats_send_ops)
+		btrfs_receive_stats_release(&stats);
+	if (bconf.verbose >= 2 && (rctx->clone_cache.subvol_misses ||
+				   rctx->clone_cache.fd_misses))
+		fprintf(stderr,
+	"clone cache: subvol hits=%llu misses=%llu, file hits=%llu misses=%llu\n",
+			rctx->clone_cache.subvol_hits,
+			rctx->clone_cache.subvol_misses,
+			rctx->clone_cache.fd_hits,
+			rctx->clone_cache.fd_misses);
+	clone_cache_free(&rctx->clone_cache);
+	close_inode_for_write(rctx);
+	/* Writes are finished and their files closed once the writers stop */
+	stop_writers(rctx);
+	btrfs_send_stream_reader_stop(reader);
 
 	if (rctx->root_path != realmnt)
 		free(rctx->root_path);
@@ -1646,8 +2298,14 @@ static const char * const cmd_receive_usage[] = {
 		"this file system is mounted."),
 	OPTLINE("--force-decompress", "if the stream contains compressed data, always "
 		"decompress it instead of writing it with encoded I/O"),
+	OPTLINE("--threads NUM", "receive in a pipeline, the stream is read ahead "
+		"by a separate thread and file data are written by NUM threads, "
+		"0 to process the commands sequentially (default)"),
 	OPTLINE("--dump", "dump stream metadata, one line per operation, "
 		"does not require the MOUNT parameter"),
+	OPTLINE("--stats", "print statistics of the stream commands, with --dump "
+		"instead of the operations, otherwise with the time spent "
+		"applying them"),
 	OPTLINE("-v", "deprecated, alias for global -v option"),
 	HELPINFO_INSERT_GLOBALS,
 	HELPINFO_INSERT_VERBOSE,
@@ -1685,6 +2343,7 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 	rctx.write_fd = -1;
 	rctx.dest_dir_fd = -1;
 	rctx.dest_dir_chroot = false;
+	pthread_mutex_init(&rctx.decompress_lock, NULL);
 	realmnt[0] = 0;
 	fromfile[0] = 0;
 
@@ -1706,6 +2365,8 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 		enum {
 			GETOPT_VAL_DUMP = GETOPT_VAL_FIRST,
 			GETOPT_VAL_FORCE_DECOMPRESS,
+			GETOPT_VAL_THREADS,
+			GETOPT_VAL_STATS,
 		};
 		static const struct option long_opts[] = {
 			{ "max-errors", required_argument, NULL, 'E' },
@@ -1713,6 +2374,8 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 			{ "dump", no_argument, NULL, GETOPT_VAL_DUMP },
 			{ "quiet", no_argument, NULL, 'q' },
 			{ "force-decompress", no_argument, NULL, GETOPT_VAL_FORCE_DECOMPRESS },
+			{ "threads", required_argument, NULL, GETOPT_VAL_THREADS },
+			{ "stats", no_argument, NULL, GETOPT_VAL_STATS },
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -1758,6 +2421,21 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 		case GETOPT_VAL_FORCE_DECOMPRESS:
 			rctx.force_decompress = true;
 			break;
+		case GETOPT_VAL_THREADS: {
+			u64 num = arg_strtou64(optarg);
+
+			if (num > RECEIVE_MAX_THREADS) {
+				error("number of threads out of range, must be 0 to %d",
+				      RECEIVE_MAX_THREADS);
+				ret = 1;
+				goto out;
+			}
+			rctx.nr_writers = num;
+			break;
+		}
+		case GETOPT_VAL_STATS:
+			rctx.stats = true;
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -1778,7 +2456,20 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 		}
 	}
 
-	if (dump) {
+	if (dump && rctx.stats) {
+		struct btrfs_receive_stats stats;
+
+		btrfs_receive_stats_init(&stats, NULL, NULL, receive_fd);
+		ret = btrfs_read_and_process_send_stream(receive_fd,
+			&btrfs_stats_send_ops, &stats, 0, max_errors);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to parse the send stream: %m");
+		} else {
+			btrfs_receive_stats_print(&stats, receive_fd);
+		}
+		btrfs_receive_stats_release(&stats);
+	} else if (dump) {
 		struct btrfs_dump_send_args dump_args;
 
 		dump_args.root_path[0] = '.';
@@ -1798,6 +2489,7 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 	if (receive_fd != fileno(stdin))
 		close(receive_fd);
 out:
+	pthread_mutex_destroy(&rctx.decompress_lock);
 
 	return !!ret;
 }
@@ -0,0 +1,419 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Journal of the restored data, so an interrupted restore can be resumed
+ * without reading the finished files and extents again.
+ *
+ * The journal is a header followed by fixed size records appended as the
+ * data are written. A record with a non-zero length is a range of a file that
+ * has been written, a record with zero length marks the whole file as
+ * restored including its size, extended attributes and times.
+ *
+ * The records are buffered. Before they're written, the filesystem of the
+ * restored files is synced, so a record never reaches the disk before the
+ * data it covers, and the journal is synced after them. When the restore is
+ * interrupted or the system crashes, only the buffered records are lost and
+ * their data are restored again.
+ */
+
+#include "kerncompat.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kernel-lib/list.h"
+#include "kernel-shared/uapi/btrfs.h"
+#include "common/extent-cache.h"
+#include "common/internal.h"
+#include "common/messages.h"
+#include "cmds/restore-journal.h"
+
+#define RESTORE_JOURNAL_MAGIC		"btrfs-restore-1"
+/*
+ * Records buffered before they're written to the journal, each write syncs
+ * the restored data
+ */
+#define RESTORE_JOURNAL_BUFFER		(1024)
+
+struct restore_journal_header {
+	char magic[16];
+	u8 fsid[BTRFS_FSID_SIZE];
+};
+
+struct restore_journal_item {
+	__le64 root;
+	__le64 ino;
+	__le64 start;
+	/* Zero for the whole file */
+	__le64 len;
+};
+
+/* Restored data of one subvolume loaded from the journal */
+struct journal_root {
+	struct list_head list;
+	u64 root;
+	/* Written ranges, merged, objectid is the inode number */
+	struct cache_tree ranges;
+	/* Restored files, start is the inode number */
+	struct cache_tree files;
+};
+
+struct restore_journal {
+	int fd;
+	char *path;
+	/* Any file on the filesystem of the restored files, to sync the data */
+	int sync_fd;
+	struct list_head roots;
+
+	pthread_mutex_t lock;
+	struct restore_journal_item buf[RESTORE_JOURNAL_BUFFER];
+	int nr_items;
+	/* First error of writing the records */
+	int ret;
+};
+
+static struct journal_root *find_root(struct restore_journal *journal,
+				      u64 root, bool create)
+{
+	struct journal_root *jr;
+
+	list_for_each_entry(jr, &journal->roots, list) {
+		if (jr->root == root)
+			return jr;
+	}
+	if (!create)
+		return NULL;
+
+	jr = malloc(sizeof(*jr));
+	if (!jr)
+		return NULL;
+	jr->root = root;
+	cache_tree_init(&jr->ranges);
+	cache_tree_init(&jr->files);
+	list_add_tail(&jr->list, &journal->roots);
+	return jr;
+}
+
+/* Insert the range, merged with the overlapping and adjacent ones */
+static int merge_range(struct cache_tree *tree, u64 ino, u64 start, u64 len)
+{
+	struct cache_extent *pe;
+	u64 end = start + len;
+
+	while (1) {
+		u64 search = start ? start - 1 : 0;
+
+		pe = lookup_cache_extent2(tree, ino, search, end + 1 - search);
+		if (!pe)
+			break;
+		start = min(start, pe->start);
+		end = max(end, pe->start + pe->size);
+		remove_cache_extent(tree, pe);
+		free(pe);
+	}
+
+	pe = malloc(sizeof(*pe));
+	if (!pe)
+		return -ENOMEM;
+	pe->objectid = ino;
+	pe->start = start;
+	pe->size = end - start;
+	return insert_cache_extent2(tree, pe);
+}
+
+static int load_item(struct restore_journal *journal,
+		     const struct restore_journal_item *item)
+{
+	struct journal_root *jr;
+	u64 ino = le64_to_cpu(item->ino);
+	u64 start = le64_to_cpu(item->start);
+	u64 len = le64_to_cpu(item->len);
+	int ret;
+
+	jr = find_root(journal, le64_to_cpu(item->root), true);
+	if (!jr)
+		return -ENOMEM;
+
+	if (len == 0) {
+		ret = add_cache_extent(&jr->files, ino, 1);
+		if (ret == -EEXIST)
+			ret = 0;
+		return ret;
+	}
+	if (start + len < start)
+		return -EUCLEAN;
+	return merge_range(&jr->ranges, ino, start, len);
+}
+
+static int load_journal(struct restore_journal *journal, const u8 *fsid)
+{
+	struct restore_journal_header header;
+	struct restore_journal_item *items;
+	const int nr_read = 4096;
+	u64 nr_items = 0;
+	ssize_t size;
+	int ret = 0;
+	int i;
+
+	size = pread(journal->fd, &header, sizeof(header), 0);
+	if (size < 0) {
+		ret = -errno;
+		error("cannot read journal %s: %m", journal->path);
+		return ret;
+	}
+	if (size < sizeof(header) ||
+	    memcmp(header.magic, RESTORE_JOURNAL_MAGIC, sizeof(header.magic))) {
+		error("%s is not a restore journal", journal->path);
+		return -EINVAL;
+	}
+	if (memcmp(header.fsid, fsid, BTRFS_FSID_SIZE)) {
+		error("journal %s belongs to a different filesystem",
+		      journal->path);
+		return -EINVAL;
+	}
+
+	items = malloc(nr_read * sizeof(*items));
+	if (!items) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return -ENOMEM;
+	}
+	while (1) {
+		size = pread(journal->fd, items, nr_read * sizeof(*items),
+			     sizeof(header) + nr_items * sizeof(*items));
+		if (size < 0) {
+			ret = -errno;
+			error("cannot read journal %s: %m", journal->path);
+			goto out;
+		}
+		for (i = 0; i < size / sizeof(*items); i++) {
+			ret = load_item(journal, &items[i]);
+			if (ret < 0) {
+				errno = -ret;
+				error("cannot load journal %s: %m",
+				      journal->path);
+				goto out;
+			}
+		}
+		nr_items += size / sizeof(*items);
+		if (size < nr_read * sizeof(*items))
+			break;
+	}
+
+	/* Drop a partially written record, the new ones are appended */
+	if (ftruncate(journal->fd, sizeof(header) + nr_items * sizeof(*items))) {
+		ret = -errno;
+		error("cannot truncate journal %s: %m", journal->path);
+		goto out;
+	}
+	pr_verbose(LOG_VERBOSE, "Loaded %llu records from journal %s\n",
+		   nr_items, journal->path);
+out:
+	free(items);
+	return ret;
+}
+
+/*
+ * Open the journal at @path for the filesystem @fsid, the files are restored
+ * to @output. With @resume the restored files and ranges recorded in an
+ * existing journal are loaded and the new ones appended, otherwise a new
+ * journal is started.
+ */
+int restore_journal_open(struct restore_journal **ret_journal, const char *path,
+			 const char *output, const u8 *fsid, bool resume)
+{
+	struct restore_journal *journal;
+	int ret;
+
+	journal = calloc(1, sizeof(*journal));
+	if (!journal)
+		return -ENOMEM;
+	journal->fd = -1;
+	journal->sync_fd = -1;
+	INIT_LIST_HEAD(&journal->roots);
+	pthread_mutex_init(&journal->lock, NULL);
+	journal->path = strdup(path);
+	if (!journal->path) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	journal->sync_fd = open(output, O_RDONLY);
+	if (journal->sync_fd < 0) {
+		ret = -errno;
+		error("cannot open %s: %m", output);
+		goto fail;
+	}
+
+	if (resume)
+		journal->fd = open(path, O_RDWR);
+	else
+		journal->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (journal->fd < 0) {
+		ret = -errno;
+		error("cannot open journal %s: %m", path);
+		goto fail;
+	}
+
+	if (resume) {
+		ret = load_journal(journal, fsid);
+		if (ret < 0)
+			goto fail;
+	} else {
+		struct restore_journal_header header = { 0 };
+
+		strcpy(header.magic, RESTORE_JOURNAL_MAGIC);
+		memcpy(header.fsid, fsid, BTRFS_FSID_SIZE);
+		if (write(journal->fd, &header, sizeof(header)) != sizeof(header) ||
+		    fsync(journal->fd)) {
+			ret = errno ? -errno : -EIO;
+			error("cannot write journal %s: %m", path);
+			goto fail;
+		}
+	}
+	if (lseek(journal->fd, 0, SEEK_END) < 0) {
+		ret = -errno;
+		error("cannot seek journal %s: %m", path);
+		goto fail;
+	}
+
+	*ret_journal = journal;
+	return 0;
+
+fail:
+	journal->ret = ret;
+	restore_journal_close(journal);
+	return ret;
+}
+
+/*
+ * Write the buffered records. The data they cover are synced first, the
+ * records must not be persistent before the data.
+ */
+static int flush_items(struct restore_journal *journal)
+{
+	size_t size = journal->nr_items * sizeof(struct restore_journal_item);
+	ssize_t written;
+
+	if (!journal->nr_items || journal->ret)
+		return journal->ret;
+
+	journal->nr_items = 0;
+	if (syncfs(journal->sync_fd)) {
+		journal->ret = -errno;
+		error("cannot sync the restored files: %m");
+		return journal->ret;
+	}
+	written = write(journal->fd, journal->buf, size);
+	if (written != size) {
+		journal->ret = written < 0 ? -errno : -EIO;
+		errno = -journal->ret;
+		error("cannot write journal %s: %m", journal->path);
+		return journal->ret;
+	}
+	if (fsync(journal->fd)) {
+		journal->ret = -errno;
+		error("cannot sync journal %s: %m", journal->path);
+	}
+	return journal->ret;
+}
+
+/* Write the remaining records and free the journal */
+int restore_journal_close(struct restore_journal *journal)
+{
+	struct journal_root *jr, *tmp;
+	int ret;
+
+	ret = flush_items(journal);
+	if (journal->fd >= 0 && close(journal->fd) && !ret) {
+		ret = -errno;
+		error("cannot close journal %s: %m", journal->path);
+	}
+	if (journal->sync_fd >= 0)
+		close(journal->sync_fd);
+
+	list_for_each_entry_safe(jr, tmp, &journal->roots, list) {
+		free_extent_cache_tree(&jr->ranges);
+		free_extent_cache_tree(&jr->files);
+		list_del(&jr->list);
+		free(jr);
+	}
+	pthread_mutex_destroy(&journal->lock);
+	free(journal->path);
+	free(journal);
+	return ret;
+}
+
+/* Check that the whole file was restored by the previous run */
+bool restore_journal_file_done(struct restore_journal *journal, u64 root,
+			       u64 ino)
+{
+	struct journal_root *jr = find_root(journal, root, false);
+
+	return jr && lookup_cache_extent(&jr->files, ino, 1);
+}
+
+/* Check that the range of the file was written by the previous run */
+bool restore_journal_range_done(struct restore_journal *journal, u64 root,
+				u64 ino, u64 start, u64 len)
+{
+	struct journal_root *jr = find_root(journal, root, false);
+	struct cache_extent *pe;
+
+	if (!jr)
+		return false;
+	pe = lookup_cache_extent2(&jr->ranges, ino, start, len);
+	return pe && pe->start <= start && pe->start + pe->size >= start + len;
+}
+
+static int add_item(struct restore_journal *journal, u64 root, u64 ino,
+		    u64 start, u64 len)
+{
+	struct restore_journal_item *item;
+	int ret = 0;
+
+	pthread_mutex_lock(&journal->lock);
+	item = &journal->buf[journal->nr_items++];
+	item->root = cpu_to_le64(root);
+	item->ino = cpu_to_le64(ino);
+	item->start = cpu_to_le64(start);
+	item->len = cpu_to_le64(len);
+	if (journal->nr_items == RESTORE_JOURNAL_BUFFER)
+		ret = flush_items(journal);
+	pthread_mutex_unlock(&journal->lock);
+	return ret;
+}
+
+/* Record the range of the file as written, can be called from any thread */
+int restore_journal_add_range(struct restore_journal *journal, u64 root,
+			      u64 ino, u64 start, u64 len)
+{
+	if (!len)
+		return 0;
+	return add_item(journal, root, ino, start, len);
+}
+
+/* Record the file as completely restored */
+int restore_journal_add_file(struct restore_journal *journal, u64 root,
+			     u64 ino)
+{
+	return add_item(journal, root, ino, 0, 0);
+}
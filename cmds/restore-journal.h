@@ -0,0 +1,39 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_RESTORE_JOURNAL_H__
+#define __BTRFS_RESTORE_JOURNAL_H__
+
+#include "kerncompat.h"
+#include <stdbool.h>
+
+struct restore_journal;
+
+int restore_journal_open(struct restore_journal **ret_journal, const char *path,
+			 const char *output, const u8 *fsid, bool resume);
+int restore_journal_close(struct restore_journal *journal);
+
+bool restore_journal_file_done(struct restore_journal *journal, u64 root,
+			       u64 ino);
+bool restore_journal_range_done(struct restore_journal *journal, u64 root,
+				u64 ino, u64 start, u64 len);
+
+int restore_journal_add_range(struct restore_journal *journal, u64 root,
+			      u64 ino, u64 start, u64 len);
+int restore_journal_add_file(struct restore_journal *journal, u64 root,
+			     u64 ino);
+
+#endif
@@ -20,6 +20,7 @@
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -30,6 +31,7 @@
 #include <limits.h>
 #include <stddef.h>
 #include <string.h>
+#include <pthread.h>
 #if COMPRESSION_LZO
 #include <lzo/lzoconf.h>
 #include <lzo/lzo1x.h>
@@ -45,12 +47,16 @@
 #include "kernel-shared/extent_io.h"
 #include "kernel-shared/compression.h"
 #include "kernel-shared/file-item.h"
+#include "kernel-lib/list.h"
+#include "kernel-lib/sizes.h"
 #include "common/utils.h"
 #include "common/help.h"
 #include "common/open-utils.h"
 #include "common/string-utils.h"
 #include "common/messages.h"
+#include "common/tree-reada.h"
 #include "cmds/commands.h"
+#include "cmds/restore-journal.h"
 
 static char fs_name[PATH_MAX];
 static char path_name[PATH_MAX];
@@ -62,6 +68,8 @@ static int ignore_errors = 0;
 static int overwrite = 0;
 static int get_xattrs = 0;
 static int dry_run = 0;
+static int resume = 0;
+static struct restore_journal *restore_journal;
 
 #define LZO_LEN 4
 #define lzo1x_worst_compress(x) ((x) + ((x) / 16) + 64 + 3)
@@ -346,52 +354,65 @@ static int copy_one_inline(struct btrfs_root *root, int fd,
 	return 0;
 }
 
-static int copy_one_extent(struct btrfs_root *root, int fd,
-			   struct extent_buffer *leaf,
-			   struct btrfs_file_extent_item *fi, u64 pos)
-{
-	char *inbuf, *outbuf = NULL;
-	ssize_t done, total = 0;
+/* Data extent of a file to be read, decompressed and written */
+struct restore_extent {
+	/* File offset */
+	u64 pos;
 	u64 bytenr;
-	u64 ram_size;
 	u64 disk_size;
+	u64 ram_size;
+	u64 offset;
 	u64 num_bytes;
+	int compress;
+};
+
+/* Regular file being restored */
+struct restore_file {
+	struct list_head list;
+	struct btrfs_root *root;
+	u64 ino;
+	int fd;
+	char *path;
+	u64 size;
+	struct timespec times[2];
+	bool times_ok;
+	/* Recorded in the journal, only for inodes with a single link */
+	bool journal;
+	/* Size of the file left by the interrupted restore */
+	u64 resume_size;
+	/* Extents queued to the restore threads and not written yet */
+	int pending;
+	/* All the extents of the file have been queued */
+	bool queued;
+	/* First error of the restore threads */
+	int ret;
+};
+
+static int restore_extent_data(struct btrfs_root *root, int fd,
+			       const struct restore_extent *ext)
+{
+	char *inbuf, *outbuf = NULL;
+	ssize_t done, total = 0;
+	u64 bytenr = ext->bytenr;
+	u64 ram_size = ext->ram_size;
+	u64 disk_size = ext->disk_size;
+	u64 num_bytes = ext->num_bytes;
+	u64 offset = ext->offset;
+	u64 pos = ext->pos;
 	u64 length;
 	u64 size_left;
-	u64 offset;
 	u64 cur;
-	int compress;
+	int compress = ext->compress;
 	int ret;
 	int mirror_num = 1;
 	int num_copies;
 
-	compress = btrfs_file_extent_compression(leaf, fi);
-	bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
-	disk_size = btrfs_file_extent_disk_num_bytes(leaf, fi);
-	ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
-	offset = btrfs_file_extent_offset(leaf, fi);
-	num_bytes = btrfs_file_extent_num_bytes(leaf, fi);
 	size_left = disk_size;
-	/* Hole, early exit */
-	if (disk_size == 0)
-		return 0;
-
-	/* Invalid file extent */
-	if ((compress == BTRFS_COMPRESS_NONE && offset >= disk_size) ||
-	    offset > ram_size) {
-		error(
-	"invalid data extent offset, offset %llu disk_size %llu ram_size %llu",
-		      offset, disk_size, ram_size);
-		return -EUCLEAN;
-	}
-
 	if (compress == BTRFS_COMPRESS_NONE && offset < disk_size) {
 		bytenr += offset;
 		size_left -= offset;
 	}
 
-	pr_verbose(offset ? 1 : 0, "offset is %llu\n", offset);
-
 	inbuf = malloc(size_left);
 	if (!inbuf) {
 		error_msg(ERROR_MSG_MEMORY, NULL);
@@ -471,6 +492,21 @@ out:
 	return ret;
 }
 
+/* Restore the extent of the file and record it in the journal */
+static int restore_file_extent(struct restore_file *rf,
+			       const struct restore_extent *ext)
+{
+	int ret;
+
+	ret = restore_extent_data(rf->root, rf->fd, ext);
+	if (!ret && rf->journal)
+		ret = restore_journal_add_range(restore_journal,
+						rf->root->root_key.objectid,
+						rf->ino, ext->pos,
+						ext->num_bytes);
+	return ret;
+}
+
 static int set_file_xattrs(struct btrfs_root *root, u64 inode,
 			   int fd, const char *file_name)
 {
@@ -617,6 +653,338 @@ out:
 	return ret;
 }
 
+/* Limits of the extents collected before they're sorted and restored */
+#define RESTORE_BATCH_EXTENTS		(4096)
+#define RESTORE_BATCH_BYTES		(SZ_1G)
+
+struct restore_job {
+	struct restore_file *file;
+	struct restore_extent ext;
+};
+
+/*
+ * The data extents are collected from the files by the main thread in
+ * batches. A batch is sorted by the disk location and read, decompressed and
+ * written by the threads while the main thread collects the next one. The
+ * files are finished by the main thread once all their extents are written.
+ */
+struct restore_pool {
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	bool stop;
+
+	/* Batch being restored by the threads */
+	struct restore_job *jobs;
+	int nr_jobs;
+	int next_job;
+	int done_jobs;
+
+	/* Batch being collected by the main thread */
+	struct restore_job *collect;
+	int nr_collect;
+	u64 collect_bytes;
+
+	/* Files with queued extents, in the order they were opened */
+	struct list_head files;
+	int nr_files;
+	/* Files kept open by the batches, derived from RLIMIT_NOFILE */
+	int max_files;
+	/* First error of a finished file, unless errors are ignored */
+	int ret;
+};
+
+static struct restore_pool *restore_pool;
+
+static void *restore_thread(void *arg)
+{
+	struct restore_pool *pool = arg;
+	struct restore_job *job;
+	int ret;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->stop && pool->next_job >= pool->nr_jobs)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if (pool->stop) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		job = &pool->jobs[pool->next_job++];
+		pthread_mutex_unlock(&pool->lock);
+
+		ret = restore_file_extent(job->file, &job->ext);
+
+		pthread_mutex_lock(&pool->lock);
+		if (ret && !job->file->ret)
+			job->file->ret = ret;
+		job->file->pending--;
+		pool->done_jobs++;
+		if (pool->done_jobs == pool->nr_jobs)
+			pthread_cond_signal(&pool->done_cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+static int restore_pool_init(int nr_threads)
+{
+	struct restore_pool *pool;
+	struct rlimit rlim;
+	int ret;
+	int i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+	pool->threads = calloc(nr_threads, sizeof(pthread_t));
+	pool->jobs = calloc(RESTORE_BATCH_EXTENTS, sizeof(struct restore_job));
+	pool->collect = calloc(RESTORE_BATCH_EXTENTS,
+			       sizeof(struct restore_job));
+	if (!pool->threads || !pool->jobs || !pool->collect) {
+		free(pool->threads);
+		free(pool->jobs);
+		free(pool->collect);
+		free(pool);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	INIT_LIST_HEAD(&pool->files);
+	/* Both batches may keep their files open, leave room for the rest */
+	pool->max_files = RESTORE_BATCH_EXTENTS;
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0)
+		pool->max_files = clamp_t(u64, rlim.rlim_cur / 4, 16,
+					  RESTORE_BATCH_EXTENTS);
+	restore_pool = pool;
+
+	for (i = 0; i < nr_threads; i++) {
+		ret = pthread_create(&pool->threads[i], NULL, restore_thread,
+				     pool);
+		if (ret)
+			return -ret;
+		pool->nr_threads++;
+	}
+	return 0;
+}
+
+static int finish_file(struct restore_file *rf)
+{
+	int ret = rf->ret;
+
+	if (!ret && rf->size)
+		ret = ftruncate(rf->fd, (loff_t)rf->size);
+	if (!ret && get_xattrs)
+		ret = set_file_xattrs(rf->root, rf->ino, rf->fd, rf->path);
+	if (!ret && restore_metadata && rf->times_ok)
+		ret = futimens(rf->fd, rf->times);
+	if (!ret && rf->journal)
+		ret = restore_journal_add_file(restore_journal,
+					       rf->root->root_key.objectid,
+					       rf->ino);
+	return ret;
+}
+
+static void free_file(struct restore_file *rf)
+{
+	close(rf->fd);
+	free(rf->path);
+	free(rf);
+}
+
+/* Finish the files that have all their extents written */
+static void finish_written_files(struct restore_pool *pool)
+{
+	struct restore_file *rf, *tmp;
+	int ret;
+
+	list_for_each_entry_safe(rf, tmp, &pool->files, list) {
+		if (!rf->queued || rf->pending)
+			continue;
+		list_del(&rf->list);
+		pool->nr_files--;
+		ret = finish_file(rf);
+		/* Errors of the tree walk were reported already */
+		if (ret && ret != -EAGAIN) {
+			error("copying data for %s failed", rf->path);
+			if (!ignore_errors && !pool->ret)
+				pool->ret = ret;
+		}
+		free_file(rf);
+	}
+}
+
+static int compare_job_bytenr(const void *a, const void *b)
+{
+	const struct restore_job *job1 = a;
+	const struct restore_job *job2 = b;
+
+	if (job1->ext.bytenr < job2->ext.bytenr)
+		return -1;
+	if (job1->ext.bytenr > job2->ext.bytenr)
+		return 1;
+	return 0;
+}
+
+/* Wait until the batch being restored is done */
+static void wait_batch(struct restore_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->done_jobs < pool->nr_jobs)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	finish_written_files(pool);
+}
+
+/* Start restoring the collected extents once the previous batch is done */
+static void submit_batch(struct restore_pool *pool)
+{
+	struct restore_job *jobs;
+
+	wait_batch(pool);
+	if (!pool->nr_collect)
+		return;
+
+	qsort(pool->collect, pool->nr_collect, sizeof(struct restore_job),
+	      compare_job_bytenr);
+	pthread_mutex_lock(&pool->lock);
+	jobs = pool->jobs;
+	pool->jobs = pool->collect;
+	pool->nr_jobs = pool->nr_collect;
+	pool->next_job = 0;
+	pool->done_jobs = 0;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool->collect = jobs;
+	pool->nr_collect = 0;
+	pool->collect_bytes = 0;
+}
+
+/* Restore all the queued extents, finish the files and stop the threads */
+static int restore_pool_finish(void)
+{
+	struct restore_pool *pool = restore_pool;
+	int ret;
+	int i;
+
+	if (!pool)
+		return 0;
+	submit_batch(pool);
+	wait_batch(pool);
+	ret = pool->ret;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	free(pool->threads);
+	free(pool->jobs);
+	free(pool->collect);
+	free(pool);
+	restore_pool = NULL;
+	return ret;
+}
+
+/* Restore the extent now, or queue it if there are restore threads */
+static int queue_extent(struct restore_file *rf,
+			const struct restore_extent *ext)
+{
+	struct restore_pool *pool = restore_pool;
+	struct restore_job *job;
+
+	if (!pool)
+		return restore_file_extent(rf, ext);
+
+	if (pool->nr_collect == RESTORE_BATCH_EXTENTS ||
+	    pool->collect_bytes >= RESTORE_BATCH_BYTES)
+		submit_batch(pool);
+
+	job = &pool->collect[pool->nr_collect++];
+	job->file = rf;
+	job->ext = *ext;
+	pool->collect_bytes += ext->disk_size;
+	pthread_mutex_lock(&pool->lock);
+	rf->pending++;
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+/*
+ * Hand over the file with all its extents queued, it's finished once they're
+ * written. Without queued extents it's finished right away.
+ */
+static int queue_file(struct restore_file *rf)
+{
+	struct restore_pool *pool = restore_pool;
+	int ret;
+
+	if (!pool || !rf->pending) {
+		ret = finish_file(rf);
+		free_file(rf);
+		return ret;
+	}
+	rf->queued = true;
+	list_add_tail(&rf->list, &pool->files);
+	pool->nr_files++;
+	if (pool->nr_files >= pool->max_files)
+		submit_batch(pool);
+	return 0;
+}
+
+static int copy_one_extent(struct btrfs_root *root, struct restore_file *rf,
+			   struct extent_buffer *leaf,
+			   struct btrfs_file_extent_item *fi, u64 pos)
+{
+	struct restore_extent ext;
+
+	ext.pos = pos;
+	ext.compress = btrfs_file_extent_compression(leaf, fi);
+	ext.bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
+	ext.disk_size = btrfs_file_extent_disk_num_bytes(leaf, fi);
+	ext.ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
+	ext.offset = btrfs_file_extent_offset(leaf, fi);
+	ext.num_bytes = btrfs_file_extent_num_bytes(leaf, fi);
+	/* Hole, early exit */
+	if (ext.disk_size == 0)
+		return 0;
+
+	/* Invalid file extent */
+	if ((ext.compress == BTRFS_COMPRESS_NONE &&
+	     ext.offset >= ext.disk_size) || ext.offset > ext.ram_size) {
+		error(
+	"invalid data extent offset, offset %llu disk_size %llu ram_size %llu",
+		      ext.offset, ext.disk_size, ext.ram_size);
+		return -EUCLEAN;
+	}
+
+	pr_verbose(ext.offset ? 1 : 0, "offset is %llu\n", ext.offset);
+
+	if (resume && rf->journal && ext.pos + ext.num_bytes <= rf->resume_size &&
+	    restore_journal_range_done(restore_journal,
+				       root->root_key.objectid, rf->ino,
+				       ext.pos, ext.num_bytes)) {
+		pr_verbose(LOG_VERBOSE, "Skipping restored range %llu-%llu of %s\n",
+			   ext.pos, ext.pos + ext.num_bytes, rf->path);
+		return 0;
+	}
+
+	return queue_extent(rf, &ext);
+}
+
+/*
+ * Restore the data of the file open as @fd, the file is closed when it's
+ * finished, which may be later with the restore threads
+ */
 static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 		     const char *file)
 {
@@ -626,19 +994,39 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 	struct btrfs_inode_item *inode_item;
 	struct btrfs_timespec *bts;
 	struct btrfs_key found_key;
+	struct restore_file *rf;
 	int ret;
 	int extent_type;
 	int compression;
-	u64 found_size = 0;
-	struct timespec times[2];
-	bool times_ok = false;
+
+	rf = calloc(1, sizeof(*rf));
+	if (!rf) {
+		close(fd);
+		return -ENOMEM;
+	}
+	rf->root = root;
+	rf->ino = key->objectid;
+	rf->fd = fd;
+	rf->path = strdup(file);
+	if (!rf->path) {
+		free_file(rf);
+		return -ENOMEM;
+	}
+	if (resume) {
+		struct stat st;
+
+		if (fstat(fd, &st) == 0)
+			rf->resume_size = st.st_size;
+	}
 
 	btrfs_init_path(&path);
 	ret = btrfs_lookup_inode(NULL, root, &path, key, 0);
 	if (ret == 0) {
 		inode_item = btrfs_item_ptr(path.nodes[0], path.slots[0],
 				    struct btrfs_inode_item);
-		found_size = btrfs_inode_size(path.nodes[0], inode_item);
+		rf->size = btrfs_inode_size(path.nodes[0], inode_item);
+		rf->journal = restore_journal &&
+			      btrfs_inode_nlink(path.nodes[0], inode_item) == 1;
 
 		if (restore_metadata) {
 			/*
@@ -656,13 +1044,13 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 				goto out;
 
 			bts = btrfs_inode_atime(inode_item);
-			times[0].tv_sec = btrfs_timespec_sec(path.nodes[0], bts);
-			times[0].tv_nsec = btrfs_timespec_nsec(path.nodes[0], bts);
+			rf->times[0].tv_sec = btrfs_timespec_sec(path.nodes[0], bts);
+			rf->times[0].tv_nsec = btrfs_timespec_nsec(path.nodes[0], bts);
 
 			bts = btrfs_inode_mtime(inode_item);
-			times[1].tv_sec = btrfs_timespec_sec(path.nodes[0], bts);
-			times[1].tv_nsec = btrfs_timespec_nsec(path.nodes[0], bts);
-			times_ok = true;
+			rf->times[1].tv_sec = btrfs_timespec_sec(path.nodes[0], bts);
+			rf->times[1].tv_nsec = btrfs_timespec_nsec(path.nodes[0], bts);
+			rf->times_ok = true;
 		}
 	}
 	btrfs_release_path(&path);
@@ -729,7 +1117,7 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 			if (ret)
 				goto out;
 		} else if (extent_type == BTRFS_FILE_EXTENT_REG) {
-			ret = copy_one_extent(root, fd, leaf, fi,
+			ret = copy_one_extent(root, rf, leaf, fi,
 					      found_key.offset);
 			if (ret)
 				goto out;
@@ -742,25 +1130,19 @@ next:
 
 	btrfs_release_path(&path);
 set_size:
-	if (found_size) {
-		ret = ftruncate(fd, (loff_t)found_size);
-		if (ret)
-			return ret;
-	}
-	if (get_xattrs) {
-		ret = set_file_xattrs(root, key->objectid, fd, file);
-		if (ret)
-			return ret;
-	}
-	if (restore_metadata && times_ok) {
-		ret = futimens(fd, times);
-		if (ret)
-			return ret;
-	}
-	return 0;
+	return queue_file(rf);
 
 out:
 	btrfs_release_path(&path);
+	if (rf->pending) {
+		/* The error is reported by the caller, not when finished */
+		pthread_mutex_lock(&restore_pool->lock);
+		rf->ret = -EAGAIN;
+		pthread_mutex_unlock(&restore_pool->lock);
+		queue_file(rf);
+		return ret;
+	}
+	free_file(rf);
 	return ret;
 }
 
@@ -1005,8 +1387,22 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 		 * Restore directories, files, symlinks and metadata.
 		 */
 		if (type == BTRFS_FT_REG_FILE) {
-			if (!overwrite_ok(path_name))
+			/*
+			 * When resuming, the files not recorded as restored
+			 * are finished or written again.
+			 */
+			if (resume) {
+				if (restore_journal_file_done(restore_journal,
+						root->root_key.objectid,
+						location.objectid)) {
+					pr_verbose(LOG_INFO,
+						   "Skipping restored %s\n",
+						   path_name);
+					goto next;
+				}
+			} else if (!overwrite_ok(path_name)) {
 				goto next;
+			}
 
 			pr_verbose(LOG_INFO, "Restoring %s\n", path_name);
 			if (dry_run)
@@ -1020,13 +1416,17 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 				goto out;
 			}
 			ret = copy_file(root, fd, &location, path_name);
-			close(fd);
 			if (ret) {
 				error("copying data for %s failed", path_name);
 				if (ignore_errors)
 					goto next;
 				goto out;
 			}
+			/* Errors of the files finished by the restore threads */
+			if (restore_pool && restore_pool->ret) {
+				ret = restore_pool->ret;
+				goto out;
+			}
 		} else if (type == BTRFS_FT_DIR) {
 			struct btrfs_root *search_root = root;
 			char *dir = strdup(fs_name);
@@ -1242,6 +1642,9 @@ static struct btrfs_root *open_fs(const char *dev, u64 root_location,
 	if (!fs_info)
 		return NULL;
 
+	/* Optional, tree blocks are read without readahead if this fails */
+	btrfs_tree_reada_start(fs_info, BTRFS_TREE_READA_DEFAULT_THREADS);
+
 	/*
 	 * All we really need to succeed is reading the chunk tree, everything
 	 * else we can do by hand, since we only need to read the tree root and
@@ -1354,6 +1757,13 @@ static const char * const cmd_restore_usage[] = {
 	OPTLINE("-S|--symlink", "restore symbolic links"),
 	OPTLINE("-s|--snapshots", "get snapshots"),
 	OPTLINE("-x|--xattr", "restore extended attributes"),
+	OPTLINE("--threads <N>", "read and write the file data by N threads, "
+		"the extents are read in batches sorted by their location, "
+		"default is 0 (no threads)"),
+	OPTLINE("--journal <file>", "record the restored files and data "
+		"ranges to file"),
+	OPTLINE("--resume", "continue an interrupted restore, skip the "
+		"files and data ranges recorded in the --journal file"),
 	"",
 	"Filtering:",
 	OPTLINE("--path-regex <regex>", "restore only filenames matching regex, "
@@ -1404,14 +1814,27 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 	int match_cflags = REG_EXTENDED | REG_NOSUB | REG_NEWLINE;
 	regex_t match_reg, *mreg = NULL;
 	char reg_err[256];
+	u64 nr_threads = 0;
+	const char *journal_path = NULL;
+	int ret2;
 
 	optind = 0;
 	while (1) {
 		int opt;
-		enum { GETOPT_VAL_PATH_REGEX = GETOPT_VAL_FIRST };
+		enum {
+			GETOPT_VAL_PATH_REGEX = GETOPT_VAL_FIRST,
+			GETOPT_VAL_THREADS,
+			GETOPT_VAL_JOURNAL,
+			GETOPT_VAL_RESUME,
+		};
 		static const struct option long_options[] = {
 			{ "path-regex", required_argument, NULL,
 				GETOPT_VAL_PATH_REGEX },
+			{ "threads", required_argument, NULL,
+				GETOPT_VAL_THREADS },
+			{ "journal", required_argument, NULL,
+				GETOPT_VAL_JOURNAL },
+			{ "resume", no_argument, NULL, GETOPT_VAL_RESUME },
 			{ "dry-run", no_argument, NULL, 'D'},
 			{ "metadata", no_argument, NULL, 'm'},
 			{ "symlinks", no_argument, NULL, 'S'},
@@ -1490,6 +1913,19 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 			case 'x':
 				get_xattrs = 1;
 				break;
+			case GETOPT_VAL_THREADS:
+				nr_threads = arg_strtou64(optarg);
+				if (nr_threads > 1024) {
+					error("too many threads: %llu", nr_threads);
+					exit(1);
+				}
+				break;
+			case GETOPT_VAL_JOURNAL:
+				journal_path = optarg;
+				break;
+			case GETOPT_VAL_RESUME:
+				resume = 1;
+				break;
 			default:
 				usage_unknown_option(cmd, argv);
 		}
@@ -1505,6 +1941,11 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 		return 1;
 	}
 
+	if (resume && !journal_path) {
+		error("--resume requires --journal");
+		return 1;
+	}
+
 	if ((ret = check_mounted(argv[optind])) < 0) {
 		errno = -ret;
 		error("could not check mount status: %m");
@@ -1587,9 +2028,38 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 	if (dry_run)
 		printf("This is a dry-run, no files are going to be restored\n");
 
+	if (journal_path && !dry_run) {
+		ret = restore_journal_open(&restore_journal, journal_path,
+					   dir_name,
+					   root->fs_info->fs_devices->fsid,
+					   resume);
+		if (ret)
+			goto out;
+	} else {
+		resume = 0;
+	}
+
+	if (nr_threads && !dry_run) {
+		ret = restore_pool_init(nr_threads);
+		if (ret) {
+			errno = -ret;
+			error("failed to start the restore threads: %m");
+			restore_pool_finish();
+			goto out;
+		}
+	}
+
 	ret = search_dir(root, &key, dir_name, "", mreg);
+	ret2 = restore_pool_finish();
+	if (!ret)
+		ret = ret2;
 
 out:
+	if (restore_journal) {
+		ret2 = restore_journal_close(restore_journal);
+		if (!ret)
+			ret = ret2;
+	}
 	if (mreg)
 		regfree(mreg);
 	close_ctree(root);
@@ -27,6 +27,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/stat.h>
 #include "kernel-lib/sizes.h"
 #include "kernel-shared/uapi/btrfs.h"
 #include "common/utils.h"
@@ -36,6 +39,7 @@
 #include "common/sysfs-utils.h"
 #include "common/string-utils.h"
 #include "common/messages.h"
+#include "common/units.h"
 #include "cmds/commands.h"
 
 #define BTRFS_SEND_BUF_SIZE_V1	(SZ_64K)
@@ -54,6 +58,31 @@ struct btrfs_send {
 	char *root_path;
 	u32 proto;
 	u32 proto_supported;
+
+	/* Bytes of the stream written by read_sent_data() */
+	u64 sent_bytes;
+};
+
+#define SEND_MAX_THREADS		(32)
+
+/* Subvolume sent by send_thread() */
+struct send_job {
+	char *subvol;
+	u64 parent_root_id;
+	/* The first clone sources known when the subvolume is sent in order */
+	u64 clone_sources_count;
+	char outname[PATH_MAX];
+	u64 sent_bytes;
+	int ret;
+};
+
+struct send_jobs {
+	struct btrfs_send *send;
+	u64 flags;
+	struct send_job *jobs;
+	int nr_jobs;
+	pthread_mutex_t lock;
+	int next_job;
 };
 
 static int get_root_id(struct btrfs_send *sctx, const char *path, u64 *root_id)
@@ -226,6 +255,7 @@ static void *read_sent_data(void *arg)
 			ret = 0;
 			goto out;
 		}
+		sctx->sent_bytes += sbytes;
 	}
 
 out:
@@ -335,6 +365,124 @@ out:
 	return ret;
 }
 
+static int open_output(const char *outname)
+{
+	int fd;
+
+	/*
+	 * Try to use an existing file first. Even if send runs as
+	 * root, it might not have permissions to create file (eg. on a
+	 * NFS) but it should still be able to use a pre-created file.
+	 */
+	fd = open(outname, O_WRONLY | O_TRUNC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			fd = open(outname, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+	}
+	if (fd < 0)
+		error("cannot create '%s': %m", outname);
+	return fd;
+}
+
+static void *send_thread(void *arg)
+{
+	struct send_jobs *sj = arg;
+	struct send_job *job;
+	struct btrfs_send send;
+
+	while (1) {
+		pthread_mutex_lock(&sj->lock);
+		if (sj->next_job >= sj->nr_jobs) {
+			pthread_mutex_unlock(&sj->lock);
+			break;
+		}
+		job = &sj->jobs[sj->next_job++];
+		pthread_mutex_unlock(&sj->lock);
+
+		pr_stderr(LOG_DEFAULT, "At subvol %s\n", job->subvol);
+
+		send = *sj->send;
+		send.clone_sources_count = job->clone_sources_count;
+		send.sent_bytes = 0;
+		send.dump_fd = open_output(job->outname);
+		if (send.dump_fd < 0) {
+			job->ret = -errno;
+			continue;
+		}
+		job->ret = do_send(&send, job->parent_root_id, 1, 1, job->subvol,
+				   sj->flags);
+		close(send.dump_fd);
+		job->sent_bytes = send.sent_bytes;
+		pr_stderr(LOG_INFO, "Sent %s, %s\n", job->subvol,
+			  pretty_size(job->sent_bytes));
+	}
+	return NULL;
+}
+
+/*
+ * Send the subvolumes in @jobs by @nr_threads at a time, each to its own file.
+ * The sends are independent, only the parents and clone sources are resolved
+ * in advance in the order of the command line.
+ */
+static int send_parallel(struct btrfs_send *send, struct send_job *jobs,
+			 int nr_jobs, int nr_threads, u64 flags)
+{
+	struct send_jobs sj = {
+		.send = send,
+		.flags = flags,
+		.jobs = jobs,
+		.nr_jobs = nr_jobs,
+	};
+	pthread_t *threads;
+	struct timespec start;
+	struct timespec end;
+	u64 total = 0;
+	double elapsed;
+	int started = 0;
+	int ret = 0;
+	int i;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+	pthread_mutex_init(&sj.lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < min(nr_threads, nr_jobs); i++) {
+		ret = pthread_create(&threads[i], NULL, send_thread, &sj);
+		if (ret) {
+			errno = ret;
+			error("thread setup failed: %m");
+			ret = -ret;
+			/* The started threads take over the remaining jobs */
+			if (started)
+				ret = 0;
+			break;
+		}
+		started++;
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_mutex_destroy(&sj.lock);
+	free(threads);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < nr_jobs; i++) {
+		if (jobs[i].ret < 0) {
+			error("failed to send %s", jobs[i].subvol);
+			ret = jobs[i].ret;
+		}
+		total += jobs[i].sent_bytes;
+	}
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) / 1e9;
+	pr_stderr(LOG_DEFAULT, "Sent %d subvolumes, %s in %.2fs, %s/s\n",
+		  nr_jobs, pretty_size(total), elapsed,
+		  pretty_size(elapsed > 0 ? total / elapsed : total));
+	return ret;
+}
+
 static int init_root_path(struct btrfs_send *sctx, const char *subvol)
 {
 	int ret = 0;
@@ -465,6 +613,76 @@ static u32 get_sysfs_proto_supported(void)
 	return version;
 }
 
+/*
+ * Resolve the subvolumes, their parents and clone sources the same way as the
+ * sequential send does, and name the output files.
+ */
+static int prepare_jobs(struct btrfs_send *send, char **subvols, int nr,
+			bool full_send, bool have_parent, u64 parent_root_id,
+			const char *outdir, struct send_job **jobs_ret)
+{
+	struct send_job *jobs;
+	u64 root_id;
+	int ret;
+	int i;
+	int j;
+
+	jobs = calloc(nr, sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
+	*jobs_ret = jobs;
+
+	for (i = 0; i < nr; i++) {
+		struct send_job *job = &jobs[i];
+
+		job->subvol = realpath(subvols[i], NULL);
+		if (!job->subvol) {
+			ret = -errno;
+			error("realpath %s failed: %m", subvols[i]);
+			return ret;
+		}
+		ret = snprintf(job->outname, sizeof(job->outname), "%s/%s.stream",
+			       outdir, basename(job->subvol));
+		if (ret < 0 || ret >= sizeof(job->outname)) {
+			error("output file path too long for %s", job->subvol);
+			return -ENAMETOOLONG;
+		}
+		for (j = 0; j < i; j++) {
+			if (strcmp(jobs[j].outname, job->outname) == 0) {
+				error("subvolumes %s and %s would be sent to the same file %s",
+				      jobs[j].subvol, job->subvol, job->outname);
+				return -EEXIST;
+			}
+		}
+
+		job->parent_root_id = parent_root_id;
+		if (!full_send && !have_parent) {
+			ret = set_root_info(send, job->subvol, &root_id);
+			if (ret < 0)
+				return ret;
+			ret = find_good_parent(send, root_id,
+					       &job->parent_root_id);
+			if (ret < 0) {
+				error("parent determination failed for %lld",
+					root_id);
+				return ret;
+			}
+		}
+		job->clone_sources_count = send->clone_sources_count;
+
+		if (!full_send && !have_parent) {
+			/* Sent before the next one, so it's a clone source */
+			ret = add_clone_source(send, root_id);
+			if (ret < 0) {
+				errno = -ret;
+				error("cannot add clone source: %m");
+				return ret;
+			}
+		}
+	}
+	return 0;
+}
+
 static const char * const cmd_send_usage[] = {
 	"btrfs send [-ve] [-p <parent>] [-c <clone-src>] [-f <outfile>] <subvol> [<subvol>...]",
 	"Send the subvolume(s) to stdout.",
@@ -492,6 +710,8 @@ static const char * const cmd_send_usage[] = {
 	OPTLINE("--proto N", "use protocol version N, or 0 to use the highest version "
 		"supported by the sending kernel (default: 1)"),
 	OPTLINE("--compressed-data", "send data that is compressed on the filesystem directly without decompressing it"),
+	OPTLINE("--threads N", "send up to N subvolumes in parallel, each to "
+		"<subvol>.stream in the directory given by -f"),
 	OPTLINE("-v|--verbose", "deprecated, alias for global -v option"),
 	OPTLINE("-q|--quiet", "deprecated, alias for global -q option"),
 	HELPINFO_INSERT_GLOBALS,
@@ -515,6 +735,8 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 	bool new_end_cmd_semantic = false;
 	u64 send_flags = 0;
 	u64 proto = 0;
+	int nr_threads = 1;
+	struct send_job *jobs = NULL;
 
 	memset(&send, 0, sizeof(send));
 	send.dump_fd = fileno(stdout);
@@ -538,6 +760,7 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 			GETOPT_VAL_SEND_NO_DATA = GETOPT_VAL_FIRST,
 			GETOPT_VAL_PROTO,
 			GETOPT_VAL_COMPRESSED_DATA,
+			GETOPT_VAL_THREADS,
 		};
 		static const struct option long_options[] = {
 			{ "verbose", no_argument, NULL, 'v' },
@@ -545,6 +768,7 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 			{ "no-data", no_argument, NULL, GETOPT_VAL_SEND_NO_DATA },
 			{ "proto", required_argument, NULL, GETOPT_VAL_PROTO },
 			{ "compressed-data", no_argument, NULL, GETOPT_VAL_COMPRESSED_DATA },
+			{ "threads", required_argument, NULL, GETOPT_VAL_THREADS },
 			{ NULL, 0, NULL, 0 }
 		};
 		int c = getopt_long(argc, argv, "vqec:f:i:p:", long_options, NULL);
@@ -645,6 +869,18 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 		case GETOPT_VAL_COMPRESSED_DATA:
 			send_flags |= BTRFS_SEND_FLAG_COMPRESSED;
 			break;
+		case GETOPT_VAL_THREADS: {
+			u64 num = arg_strtou64(optarg);
+
+			if (num == 0 || num > SEND_MAX_THREADS) {
+				error("number of threads out of range, must be 1 to %d",
+				      SEND_MAX_THREADS);
+				ret = 1;
+				goto out;
+			}
+			nr_threads = num;
+			break;
+		}
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -653,29 +889,29 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 	if (check_argc_min(argc - optind, 1))
 		return 1;
 
-	if (outname[0]) {
-		int tmpfd;
+	if (nr_threads > 1) {
+		struct stat st;
 
-		/*
-		 * Try to use an existing file first. Even if send runs as
-		 * root, it might not have permissions to create file (eg. on a
-		 * NFS) but it should still be able to use a pre-created file.
-		 */
-		tmpfd = open(outname, O_WRONLY | O_TRUNC);
-		if (tmpfd < 0) {
-			if (errno == ENOENT)
-				tmpfd = open(outname,
-					O_CREAT | O_WRONLY | O_TRUNC, 0600);
+		if (new_end_cmd_semantic) {
+			error("option -e cannot be used with --threads");
+			ret = 1;
+			goto out;
+		}
+		if (!outname[0] || stat(outname, &st) < 0 ||
+		    !S_ISDIR(st.st_mode)) {
+			error("--threads requires -f with an existing directory");
+			ret = 1;
+			goto out;
 		}
-		send.dump_fd = tmpfd;
+	} else if (outname[0]) {
+		send.dump_fd = open_output(outname);
 		if (send.dump_fd == -1) {
 			ret = -errno;
-			error("cannot create '%s': %m", outname);
 			goto out;
 		}
 	}
 
-	if (isatty(send.dump_fd)) {
+	if (nr_threads <= 1 && isatty(send.dump_fd)) {
 		error(
 	    "not dumping send stream into a terminal, redirect it into a file");
 		ret = 1;
@@ -782,6 +1018,17 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 	pr_stderr(LOG_INFO, "Protocol version requested: %u (supported %u)\n",
 		send.proto, send.proto_supported);
 
+	if (nr_threads > 1) {
+		ret = prepare_jobs(&send, argv + optind, argc - optind,
+				   full_send, snapshot_parent != NULL,
+				   parent_root_id, outname, &jobs);
+		if (ret < 0)
+			goto out;
+		ret = send_parallel(&send, jobs, argc - optind, nr_threads,
+				    send_flags);
+		goto out;
+	}
+
 	for (i = optind; i < argc; i++) {
 		int is_first_subvol;
 		int is_last_subvol;
@@ -840,6 +1087,11 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 	ret = 0;
 
 out:
+	if (jobs) {
+		for (i = 0; i < argc - optind; i++)
+			free(jobs[i].subvol);
+		free(jobs);
+	}
 	free(subvol);
 	free(snapshot_parent);
 	free(send.clone_sources);
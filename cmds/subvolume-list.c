@@ -26,6 +26,7 @@
 #include <uuid/uuid.h>
 #include "kernel-lib/rbtree.h"
 #include "kernel-lib/rbtree_types.h"
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/uapi/btrfs.h"
 #include "kernel-shared/ctree.h"
 #include "common/defs.h"
@@ -100,6 +101,8 @@ enum btrfs_list_layout {
 struct root_info {
 	struct rb_node rb_node;
 	struct rb_node sort_node;
+	/* next root in the same hash bucket of root_lookup */
+	struct root_info *hash_next;
 
 	/* this root's id */
 	u64 root_id;
@@ -144,6 +147,20 @@ struct root_info {
 	int deleted;
 };
 
+/*
+ * All roots found by the search, ordered by root id in the tree and hashed by
+ * root id for the lookups of the parents.
+ */
+struct root_lookup {
+	struct rb_root tree;
+	struct root_info **hash;
+	unsigned int hash_bits;
+	u64 nr_roots;
+};
+
+/* Buffer size of the tree search, fits several thousands of root items */
+#define SUBVOL_SEARCH_BUF_SIZE		(SZ_4M)
+
 typedef int (*btrfs_list_filter_func)(struct root_info *, u64);
 typedef int (*btrfs_list_comp_func)(const struct root_info *a,
 				    const struct root_info *b);
@@ -462,15 +479,50 @@ static int sort_tree_insert(struct rb_root *sort_tree,
 	return 0;
 }
 
+static inline u64 root_hash(const struct root_lookup *rl, u64 root_id)
+{
+	return (root_id * 0x9e3779b97f4a7c15ULL) >> (64 - rl->hash_bits);
+}
+
+static void root_lookup_init(struct root_lookup *rl)
+{
+	rl->tree = RB_ROOT;
+	rl->hash = NULL;
+	rl->hash_bits = 0;
+	rl->nr_roots = 0;
+}
+
+/* Double the number of hash buckets, at least one per root */
+static int root_lookup_grow_hash(struct root_lookup *rl)
+{
+	unsigned int bits = rl->hash_bits ? rl->hash_bits + 1 : 10;
+	struct root_info **hash;
+	struct rb_node *n;
+
+	hash = calloc(1ULL << bits, sizeof(*hash));
+	if (!hash)
+		return -ENOMEM;
+	free(rl->hash);
+	rl->hash = hash;
+	rl->hash_bits = bits;
+
+	for (n = rb_first(&rl->tree); n; n = rb_next(n)) {
+		struct root_info *ri = to_root_info(n);
+		u64 bucket = root_hash(rl, ri->root_id);
+
+		ri->hash_next = rl->hash[bucket];
+		rl->hash[bucket] = ri;
+	}
+	return 0;
+}
+
 /*
- * insert a new root into the tree.  returns the existing root entry
- * if one is already there.  Both root_id and ref_tree are used
- * as the key
+ * insert a new root into the tree and the hash.  returns -EEXIST if
+ * there's already a root with the same root_id.
  */
-static int root_tree_insert(struct rb_root *root_tree,
-			    struct root_info *ins)
+static int root_tree_insert(struct root_lookup *rl, struct root_info *ins)
 {
-	struct rb_node **p = &root_tree->rb_node;
+	struct rb_node **p = &rl->tree.rb_node;
 	struct rb_node * parent = NULL;
 	struct root_info *curr;
 	int ret;
@@ -489,39 +541,37 @@ static int root_tree_insert(struct rb_root *root_tree,
 	}
 
 	rb_link_node(&ins->rb_node, parent, p);
-	rb_insert_color(&ins->rb_node, root_tree);
+	rb_insert_color(&ins->rb_node, &rl->tree);
+	rl->nr_roots++;
+
+	if (!rl->hash || rl->nr_roots > (1ULL << rl->hash_bits)) {
+		/* Links all the roots including the new one */
+		if (root_lookup_grow_hash(rl) < 0)
+			return -ENOMEM;
+	} else {
+		u64 bucket = root_hash(rl, ins->root_id);
+
+		ins->hash_next = rl->hash[bucket];
+		rl->hash[bucket] = ins;
+	}
 	return 0;
 }
 
-/*
- * find a given root id in the tree.  We return the smallest one,
- * rb_next can be used to move forward looking for more if required
- */
-static struct root_info *root_tree_search(struct rb_root *root_tree,
-					  u64 root_id)
+/* find a given root id in the hash */
+static struct root_info *root_tree_search(struct root_lookup *rl, u64 root_id)
 {
-	struct rb_node *n = root_tree->rb_node;
 	struct root_info *entry;
-	struct root_info tmp;
-	int ret;
 
-	tmp.root_id = root_id;
+	if (!rl->hash)
+		return NULL;
 
-	while(n) {
-		entry = to_root_info(n);
-
-		ret = comp_entry_with_rootid(&tmp, entry);
-		if (ret < 0)
-			n = n->rb_left;
-		else if (ret > 0)
-			n = n->rb_right;
-		else
-			return entry;
-	}
-	return NULL;
+	entry = rl->hash[root_hash(rl, root_id)];
+	while (entry && entry->root_id != root_id)
+		entry = entry->hash_next;
+	return entry;
 }
 
-static int update_root(struct rb_root *root_lookup,
+static int update_root(struct root_lookup *root_lookup,
 		       u64 root_id, u64 ref_tree, u64 root_offset, u64 flags,
 		       u64 dir_id, char *name, int name_len, u64 ogen, u64 gen,
 		       time_t otime, u8 *uuid, u8 *puuid, u8 *ruuid)
@@ -584,7 +634,7 @@ static int update_root(struct rb_root *root_lookup,
  * puuid: uuid of the root parent if any
  * ruuid: uuid of the received subvol, if any
  */
-static int add_root(struct rb_root *root_lookup,
+static int add_root(struct root_lookup *root_lookup,
 		    u64 root_id, u64 ref_tree, u64 root_offset, u64 flags,
 		    u64 dir_id, char *name, int name_len, u64 ogen, u64 gen,
 		    time_t otime, u8 *uuid, u8 *puuid, u8 *ruuid)
@@ -653,7 +703,7 @@ static int add_root(struct rb_root *root_lookup,
  * Simplified add_root for back references, omits the uuid and original info
  * parameters, root offset and flags.
  */
-static int add_root_backref(struct rb_root *root_lookup, u64 root_id,
+static int add_root_backref(struct root_lookup *root_lookup, u64 root_id,
 		u64 ref_tree, u64 dir_id, char *name, int name_len)
 {
 	return add_root(root_lookup, root_id, ref_tree, 0, 0, dir_id, name,
@@ -671,150 +721,269 @@ static void free_root_info(struct rb_node *node)
 	free(ri);
 }
 
+static void root_lookup_free(struct root_lookup *rl)
+{
+	rb_free_nodes(&rl->tree, free_root_info);
+	free(rl->hash);
+	root_lookup_init(rl);
+}
+
 /*
- * for a given root_info, search through the root_lookup tree to construct
- * the full path name to it.
+ * for a given root_info, construct the full path name to it from the full
+ * path of the root that references it.  The unresolved parents are resolved
+ * on the way and every root_info remembers its full path, so each root is
+ * resolved only once.  Deleted roots get "DELETED" as the full path.
  *
  * This can't be called until all the root_info->path fields are filled
- * in by lookup_ino_path
+ * in by lookup_ino_paths
  */
-static int resolve_root(struct rb_root *rl, struct root_info *ri,
+static int resolve_root(struct root_lookup *rl, struct root_info *ri,
 		       u64 top_id)
 {
-	char *full_path = NULL;
-	int len = 0;
-	struct root_info *found;
+	struct root_info **chain = NULL;
+	struct root_info *found = ri;
+	struct root_info *parent = NULL;
+	int nr_chain = 0;
+	int chain_size = 0;
+	int deleted = 0;
+	int i;
 
-	/*
-	 * we go backwards from the root_info object and add pathnames
-	 * from parent directories as we go.
-	 */
-	found = ri;
+	/* Collect the roots without a full path up to a resolved one */
 	while (1) {
-		char *tmp;
 		u64 next;
-		int add_len;
 
-		/*
-		 * ref_tree = 0 indicates the subvolume
-		 * has been deleted.
-		 */
-		if (!found->ref_tree) {
-			free(full_path);
-			return -ENOENT;
+		if (found->full_path) {
+			parent = found;
+			deleted = found->deleted;
+			break;
 		}
 
-		add_len = strlen(found->path);
+		if (nr_chain == chain_size) {
+			struct root_info **tmp;
 
-		if (full_path) {
-			/* room for / and for null */
-			tmp = malloc(add_len + 2 + len);
+			chain_size = chain_size ? chain_size * 2 : 16;
+			tmp = realloc(chain, chain_size * sizeof(*chain));
 			if (!tmp) {
 				error_msg(ERROR_MSG_MEMORY, NULL);
 				exit(1);
 			}
-			memcpy(tmp + add_len + 1, full_path, len);
-			tmp[add_len] = '/';
-			memcpy(tmp, found->path, add_len);
-			tmp [add_len + len + 1] = '\0';
-			free(full_path);
-			full_path = tmp;
-			len += add_len + 1;
-		} else {
-			full_path = strdup(found->path);
-			len = add_len;
+			chain = tmp;
 		}
-		if (!ri->top_id)
-			ri->top_id = found->ref_tree;
+		chain[nr_chain++] = found;
 
+		/*
+		 * ref_tree = 0 indicates the subvolume
+		 * has been deleted.
+		 */
 		next = found->ref_tree;
-		if (next == top_id)
+		if (!next) {
+			deleted = 1;
 			break;
+		}
 		/*
-		* if the ref_tree = BTRFS_FS_TREE_OBJECTID,
-		* we are at the top
-		*/
-		if (next == BTRFS_FS_TREE_OBJECTID)
+		 * if the ref_tree = BTRFS_FS_TREE_OBJECTID,
+		 * we are at the top
+		 */
+		if (next == top_id || next == BTRFS_FS_TREE_OBJECTID)
 			break;
 		/*
-		* if the ref_tree wasn't in our tree of roots, the
-		* subvolume was deleted.
-		*/
+		 * if the ref_tree wasn't in our tree of roots, the
+		 * subvolume was deleted.
+		 */
 		found = root_tree_search(rl, next);
 		if (!found) {
-			free(full_path);
-			return -ENOENT;
+			deleted = 1;
+			break;
+		}
+	}
+
+	/* Going down, add pathnames to the full path of the parent */
+	for (i = nr_chain - 1; i >= 0; i--) {
+		struct root_info *cur = chain[i];
+
+		if (!cur->top_id)
+			cur->top_id = cur->ref_tree;
+
+		if (deleted) {
+			if (cur->root_id != BTRFS_FS_TREE_OBJECTID) {
+				cur->full_path = strdup("DELETED");
+				cur->deleted = 1;
+			} else {
+				/*
+				 * The full path is not supposed to be printed,
+				 * but we don't want to print an empty string,
+				 * in case it appears somewhere.
+				 */
+				cur->full_path = strdup("TOPLEVEL");
+				cur->deleted = 0;
+			}
+		} else if (parent) {
+			size_t parent_len = strlen(parent->full_path);
+			size_t add_len = strlen(cur->path);
+
+			/* room for / and for null */
+			cur->full_path = malloc(parent_len + add_len + 2);
+			if (cur->full_path) {
+				memcpy(cur->full_path, parent->full_path,
+				       parent_len);
+				cur->full_path[parent_len] = '/';
+				memcpy(cur->full_path + parent_len + 1,
+				       cur->path, add_len + 1);
+			}
+		} else {
+			cur->full_path = strdup(cur->path);
 		}
+		if (!cur->full_path) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			exit(1);
+		}
+		parent = cur;
 	}
+	free(chain);
 
-	ri->full_path = full_path;
+	return deleted ? -ENOENT : 0;
+}
 
+static int cmp_root_dir(const void *a, const void *b)
+{
+	const struct root_info *ri1 = *(const struct root_info **)a;
+	const struct root_info *ri2 = *(const struct root_info **)b;
+
+	if (ri1->ref_tree != ri2->ref_tree)
+		return ri1->ref_tree < ri2->ref_tree ? -1 : 1;
+	if (ri1->dir_id != ri2->dir_id)
+		return ri1->dir_id < ri2->dir_id ? -1 : 1;
 	return 0;
 }
 
 /*
- * for a single root_info, ask the kernel to give us a path name
- * inside it's ref_root for the dir_id where it lives.
+ * ask the kernel to give us the path names inside the ref_root for the
+ * dir_id where each root lives.
  *
  * This fills in root_info->path with the path to the directory and and
- * appends this root's name.
+ * appends the root's name.  Roots in the same directory share one lookup,
+ * roots directly in the top directory of a live subvolume need none.
  */
-static int lookup_ino_path(int fd, struct root_info *ri)
+static int lookup_ino_paths(int fd, struct root_lookup *rl)
 {
 	struct btrfs_ioctl_ino_lookup_args args;
-	int ret;
+	struct root_info **roots;
+	struct root_info *ref_root;
+	struct rb_node *n;
+	u64 nr_roots = 0;
+	u64 cur_tree = 0;
+	u64 cur_dir = 0;
+	int lookup_ret = 0;
+	int ret = 0;
+	u64 i;
 
-	if (ri->path)
-		return 0;
+	roots = malloc((rl->nr_roots ?: 1) * sizeof(*roots));
+	if (!roots) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		exit(1);
+	}
+	for (n = rb_first(&rl->tree); n; n = rb_next(n)) {
+		struct root_info *ri = to_root_info(n);
 
-	if (!ri->ref_tree)
-		return -ENOENT;
+		if (ri->ref_tree && !ri->path)
+			roots[nr_roots++] = ri;
+	}
+	qsort(roots, nr_roots, sizeof(*roots), cmp_root_dir);
 
 	memset(&args, 0, sizeof(args));
-	args.treeid = ri->ref_tree;
-	args.objectid = ri->dir_id;
+	for (i = 0; i < nr_roots; i++) {
+		struct root_info *ri = roots[i];
+
+		if (i == 0 || ri->ref_tree != cur_tree || ri->dir_id != cur_dir) {
+			cur_tree = ri->ref_tree;
+			cur_dir = ri->dir_id;
+			memset(&args, 0, sizeof(args));
+			args.treeid = cur_tree;
+			args.objectid = cur_dir;
+
+			/*
+			 * The kernel returns an empty path for the top
+			 * directory of a subvolume that's still linked
+			 * somewhere, no need to ask.
+			 */
+			ref_root = root_tree_search(rl, cur_tree);
+			if (cur_dir == BTRFS_FIRST_FREE_OBJECTID && ref_root &&
+			    (ref_root->ref_tree ||
+			     ref_root->root_id == BTRFS_FS_TREE_OBJECTID)) {
+				lookup_ret = 0;
+			} else if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args) < 0) {
+				if (errno != ENOENT) {
+					ret = -errno;
+					error("failed to lookup path for root %llu: %m",
+					      cur_tree);
+					goto out;
+				}
+				lookup_ret = -ENOENT;
+			} else {
+				lookup_ret = 0;
+			}
+		}
 
-	ret = ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args);
-	if (ret < 0) {
-		if (errno == ENOENT) {
+		if (lookup_ret == -ENOENT) {
 			ri->ref_tree = 0;
-			return -ENOENT;
+			continue;
 		}
-		error("failed to lookup path for root %llu: %m", ri->ref_tree);
-		return ret;
-	}
 
-	if (args.name[0]) {
 		/*
-		 * we're in a subdirectory of ref_tree, the kernel ioctl
+		 * if we're in a subdirectory of ref_tree, the kernel ioctl
 		 * puts a / in there for us
 		 */
-		ri->path = malloc(strlen(ri->name) + strlen(args.name) + 1);
+		ri->path = malloc(strlen(args.name) + strlen(ri->name) + 1);
 		if (!ri->path) {
 			error_msg(ERROR_MSG_MEMORY, NULL);
 			exit(1);
 		}
 		strcpy(ri->path, args.name);
 		strcat(ri->path, ri->name);
-	} else {
-		/* we're at the root of ref_tree */
-		ri->path = strdup(ri->name);
-		if (!ri->path) {
-			perror("strdup failed");
-			exit(1);
-		}
 	}
+out:
+	free(roots);
+	return ret;
+}
+
+/*
+ * Search with the large buffer of TREE_SEARCH_V2, or with the 4KiB buffer of
+ * the v1 ioctl on kernels without it (< 3.16)
+ */
+static int subvol_search(int fd, struct btrfs_ioctl_search_args_v2 *args2,
+			 bool *use_v1)
+{
+	struct btrfs_ioctl_search_args args;
+	int ret;
+
+	if (!*use_v1) {
+		args2->key.nr_items = (u32)-1;
+		args2->buf_size = SUBVOL_SEARCH_BUF_SIZE;
+		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, args2);
+		if (ret == 0 || errno != ENOTTY)
+			return ret;
+		*use_v1 = true;
+	}
+
+	memcpy(&args.key, &args2->key, sizeof(args.key));
+	args.key.nr_items = 4096;
+	ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+	if (ret < 0)
+		return ret;
+	memcpy(&args2->key, &args.key, sizeof(args.key));
+	memcpy(args2->buf, args.buf, sizeof(args.buf));
 	return 0;
 }
 
-static int list_subvol_search(int fd, struct rb_root *root_lookup)
+static int list_subvol_search(int fd, struct root_lookup *root_lookup)
 {
 	int ret;
-	struct btrfs_ioctl_search_args args;
-	struct btrfs_ioctl_search_key *sk = &args.key;
+	struct btrfs_ioctl_search_args_v2 *args;
+	struct btrfs_ioctl_search_key *sk;
 	struct btrfs_ioctl_search_header sh;
 	struct btrfs_root_ref *ref;
 	struct btrfs_root_item *ri;
+	bool use_v1 = false;
 	unsigned long off;
 	int name_len;
 	char *name;
@@ -824,8 +993,13 @@ static int list_subvol_search(int fd, struct rb_root *root_lookup)
 	u64 flags;
 	int i;
 
-	root_lookup->rb_node = NULL;
-	memset(&args, 0, sizeof(args));
+	root_lookup_init(root_lookup);
+	args = calloc(1, sizeof(*args) + SUBVOL_SEARCH_BUF_SIZE);
+	if (!args) {
+		errno = ENOMEM;
+		return -ENOMEM;
+	}
+	sk = &args->key;
 
 	sk->tree_id = BTRFS_ROOT_TREE_OBJECTID;
 	/* Search both live and deleted subvolumes */
@@ -837,10 +1011,9 @@ static int list_subvol_search(int fd, struct rb_root *root_lookup)
 	sk->max_transid = (u64)-1;
 
 	while(1) {
-		sk->nr_items = 4096;
-		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+		ret = subvol_search(fd, args, &use_v1);
 		if (ret < 0)
-			return ret;
+			goto out;
 		if (sk->nr_items == 0)
 			break;
 
@@ -851,10 +1024,12 @@ static int list_subvol_search(int fd, struct rb_root *root_lookup)
 		 * read the root_ref item it contains
 		 */
 		for (i = 0; i < sk->nr_items; i++) {
-			memcpy(&sh, args.buf + off, sizeof(sh));
+			char *buf = (char *)args->buf;
+
+			memcpy(&sh, buf + off, sizeof(sh));
 			off += sizeof(sh);
 			if (sh.type == BTRFS_ROOT_BACKREF_KEY) {
-				ref = (struct btrfs_root_ref *)(args.buf + off);
+				ref = (struct btrfs_root_ref *)(buf + off);
 				name_len = btrfs_stack_root_ref_name_len(ref);
 				name = (char *)(ref + 1);
 				dir_id = btrfs_stack_root_ref_dirid(ref);
@@ -870,7 +1045,7 @@ static int list_subvol_search(int fd, struct rb_root *root_lookup)
 				u8 puuid[BTRFS_UUID_SIZE];
 				u8 ruuid[BTRFS_UUID_SIZE];
 
-				ri = (struct btrfs_root_item *)(args.buf + off);
+				ri = (struct btrfs_root_item *)(buf + off);
 				gen = btrfs_root_generation(ri);
 				flags = btrfs_root_flags(ri);
 				if(sh.len >= sizeof(struct btrfs_root_item)) {
@@ -921,8 +1096,11 @@ static int list_subvol_search(int fd, struct rb_root *root_lookup)
 		if (sk->min_objectid > sk->max_objectid)
 			break;
 	}
+	ret = 0;
 
-	return 0;
+out:
+	free(args);
+	return ret;
 }
 
 static int filter_by_rootid(struct root_info *ri, u64 data)
@@ -1092,7 +1270,7 @@ static int filter_root(struct root_info *ri,
 	return 1;
 }
 
-static void filter_and_sort_subvol(struct rb_root *all_subvols,
+static void filter_and_sort_subvol(struct root_lookup *all_subvols,
 				    struct rb_root *sort_tree,
 				    struct btrfs_list_filter_set *filter_set,
 				    struct btrfs_list_comparer_set *comp_set,
@@ -1104,25 +1282,18 @@ static void filter_and_sort_subvol(struct rb_root *all_subvols,
 
 	sort_tree->rb_node = NULL;
 
-	n = rb_last(all_subvols);
+	/*
+	 * Resolve all roots before filtering, the full paths of the parents
+	 * are reused and filters may change them.  Deleted roots get their
+	 * full path too.
+	 */
+	for (n = rb_first(&all_subvols->tree); n; n = rb_next(n))
+		resolve_root(all_subvols, to_root_info(n), top_id);
+
+	n = rb_last(&all_subvols->tree);
 	while (n) {
 		entry = to_root_info(n);
 
-		ret = resolve_root(all_subvols, entry, top_id);
-		if (ret == -ENOENT) {
-			if (entry->root_id != BTRFS_FS_TREE_OBJECTID) {
-				entry->full_path = strdup("DELETED");
-				entry->deleted = 1;
-			} else {
-				/*
-				 * The full path is not supposed to be printed,
-				 * but we don't want to print an empty string,
-				 * in case it appears somewhere.
-				 */
-				entry->full_path = strdup("TOPLEVEL");
-				entry->deleted = 0;
-			}
-		}
 		ret = filter_root(entry, filter_set);
 		if (ret)
 			sort_tree_insert(sort_tree, entry, comp_set);
@@ -1386,14 +1557,14 @@ next:
 	}
 }
 
-static int btrfs_list_subvols(int fd, struct rb_root *root_lookup)
+static int btrfs_list_subvols(int fd, struct root_lookup *root_lookup)
 {
 	int ret;
-	struct rb_node *n;
 
 	ret = list_subvol_search(fd, root_lookup);
 	if (ret) {
 		error("can't perform the search: %m");
+		root_lookup_free(root_lookup);
 		return ret;
 	}
 
@@ -1401,18 +1572,10 @@ static int btrfs_list_subvols(int fd, struct rb_root *root_lookup)
 	 * now we have an rbtree full of root_info objects, but we need to fill
 	 * in their path names within the subvol that is referencing each one.
 	 */
-	n = rb_first(root_lookup);
-	while (n) {
-		struct root_info *entry;
-		int ret;
-		entry = to_root_info(n);
-		ret = lookup_ino_path(fd, entry);
-		if (ret && ret != -ENOENT)
-			return ret;
-		n = rb_next(n);
-	}
-
-	return 0;
+	ret = lookup_ino_paths(fd, root_lookup);
+	if (ret)
+		root_lookup_free(root_lookup);
+	return ret;
 }
 
 static int btrfs_list_subvols_print(int fd, struct btrfs_list_filter_set *filter_set,
@@ -1420,7 +1583,7 @@ static int btrfs_list_subvols_print(int fd, struct btrfs_list_filter_set *filter
 		       enum btrfs_list_layout layout, int full_path,
 		       const char *raw_prefix)
 {
-	struct rb_root root_lookup;
+	struct root_lookup root_lookup;
 	struct rb_root root_sort;
 	int ret = 0;
 	u64 top_id = 0;
@@ -1441,7 +1604,7 @@ static int btrfs_list_subvols_print(int fd, struct btrfs_list_filter_set *filter
 				 comp_set, top_id);
 
 	print_all_subvol_info(&root_sort, layout, raw_prefix);
-	rb_free_nodes(&root_lookup, free_root_info);
+	root_lookup_free(&root_lookup);
 
 	return 0;
 }
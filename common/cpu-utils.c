@@ -99,6 +99,12 @@ void cpu_set_level(unsigned long topbit)
 		__cpu_flags = CPU_FLAG_NONE;
 }
 
+/* Pretend that the CPU does not support the given feature(s) */
+void cpu_clear_feature(unsigned long flags)
+{
+	__cpu_flags &= ~flags;
+}
+
 void cpu_reset_level(void)
 {
 	__cpu_flags = __cpu_flags_orig;
@@ -110,6 +116,8 @@ void cpu_detect_flags() { }
 
 void cpu_set_level(unsigned long topbit) { }
 
+void cpu_clear_feature(unsigned long flags) { }
+
 void cpu_reset_level(void) { }
 
 #endif
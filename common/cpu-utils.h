@@ -48,6 +48,7 @@ extern unsigned long __cpu_flags_orig;
 /* Public API */
 void cpu_detect_flags(void);
 void cpu_set_level(unsigned long topbit);
+void cpu_clear_feature(unsigned long flags);
 void cpu_reset_level(void);
 void cpu_print_flags(void);
 
@@ -524,6 +524,12 @@ int btrfs_scan_argv_devices(int dev_optind, int dev_argc, char **dev_argv)
 			error("cannot open %s: %m", dev_argv[dev_optind]);
 			return -errno;
 		}
+		/* Images are not devices, open_ctree() handles them */
+		if (btrfs_image_ops && btrfs_image_ops->detect(fd)) {
+			close(fd);
+			dev_optind++;
+			continue;
+		}
 		ret = btrfs_scan_one_device(fd, dev_argv[dev_optind], &fs_devices,
 					    &num_devices,
 					    BTRFS_SUPER_INFO_OFFSET,
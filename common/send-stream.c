@@ -18,13 +18,18 @@
 
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/uapi/btrfs.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/send.h"
 #include "crypto/crc32c.h"
+#include "common/internal.h"
 #include "common/send-stream.h"
 #include "common/messages.h"
 
@@ -38,10 +43,53 @@ struct btrfs_send_attribute {
 	char *data;
 };
 
+/* Size of the buffer of the stream read ahead */
+#define SEND_STREAM_READER_BUF_SIZE	(SZ_8M)
+
+/*
+ * Reads the stream ahead in a separate thread to a ring buffer, so reading
+ * from a pipe or network overlaps with processing of the commands. The reader
+ * lives for the whole stream file, as the data read ahead may belong to the
+ * next stream. Regular files are mapped instead, without the thread.
+ */
+struct btrfs_send_stream_reader {
+	int fd;
+	pthread_t thread;
+	bool thread_running;
+
+	pthread_mutex_t lock;
+	pthread_cond_t data_cond;
+	pthread_cond_t space_cond;
+
+	char *buf;
+	size_t size;
+	/* Total bytes read from fd and consumed, the buffer offset is modulo size */
+	u64 head;
+	u64 tail;
+	bool eof;
+	int error;
+	bool stop;
+};
+
+/* Unmap the processed part of a mapped stream after this many bytes */
+#define SEND_STREAM_MAP_DROP		(SZ_64M)
+
 struct btrfs_send_stream {
 	char *read_buf;
 	size_t read_buf_size;
 	int fd;
+	struct btrfs_send_stream_reader *reader;
+
+	/*
+	 * Stream in a regular file is mapped and the commands are parsed in
+	 * place, the rest of the file starts at map.
+	 */
+	char *map_base;
+	size_t map_base_len;
+	char *map;
+	size_t map_len;
+	off_t map_offset;
+	size_t map_dropped;
 
 	int cmd;
 	struct btrfs_send_attribute cmd_attrs[__BTRFS_SEND_A_MAX + 1];
@@ -57,6 +105,199 @@ struct btrfs_send_stream {
 	void *user;
 } __attribute__((aligned(64)));
 
+static void *reader_thread(void *arg)
+{
+	struct btrfs_send_stream_reader *reader = arg;
+
+	/* Can be cancelled only while waiting for the data */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	while (1) {
+		ssize_t rbytes;
+		size_t offset;
+		size_t len;
+
+		pthread_mutex_lock(&reader->lock);
+		while (reader->head - reader->tail == reader->size &&
+		       !reader->stop)
+			pthread_cond_wait(&reader->space_cond, &reader->lock);
+		if (reader->stop) {
+			pthread_mutex_unlock(&reader->lock);
+			break;
+		}
+		offset = reader->head % reader->size;
+		len = min_t(size_t, reader->size - (reader->head - reader->tail),
+			    reader->size - offset);
+		pthread_mutex_unlock(&reader->lock);
+
+		/* The free part of the buffer is not touched by the consumer */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		rbytes = read(reader->fd, reader->buf + offset, len);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (rbytes < 0 && errno == EINTR)
+			continue;
+
+		pthread_mutex_lock(&reader->lock);
+		if (rbytes < 0)
+			reader->error = -errno;
+		else if (rbytes == 0)
+			reader->eof = true;
+		else
+			reader->head += rbytes;
+		pthread_cond_signal(&reader->data_cond);
+		pthread_mutex_unlock(&reader->lock);
+		if (rbytes <= 0)
+			break;
+	}
+	return NULL;
+}
+
+struct btrfs_send_stream_reader *btrfs_send_stream_reader_start(int fd)
+{
+	struct btrfs_send_stream_reader *reader;
+	struct stat st;
+	int ret;
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		return NULL;
+	reader->fd = fd;
+	/* Regular files are mapped, reading ahead is left to the kernel */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		return reader;
+
+	reader->buf = malloc(SEND_STREAM_READER_BUF_SIZE);
+	if (!reader->buf) {
+		free(reader);
+		return NULL;
+	}
+	reader->size = SEND_STREAM_READER_BUF_SIZE;
+	pthread_mutex_init(&reader->lock, NULL);
+	pthread_cond_init(&reader->data_cond, NULL);
+	pthread_cond_init(&reader->space_cond, NULL);
+
+	ret = pthread_create(&reader->thread, NULL, reader_thread, reader);
+	if (ret) {
+		errno = ret;
+		error("failed to start stream reader thread: %m");
+		btrfs_send_stream_reader_stop(reader);
+		return NULL;
+	}
+	reader->thread_running = true;
+	return reader;
+}
+
+void btrfs_send_stream_reader_stop(struct btrfs_send_stream_reader *reader)
+{
+	if (!reader)
+		return;
+	if (reader->thread_running) {
+		pthread_mutex_lock(&reader->lock);
+		reader->stop = true;
+		pthread_cond_signal(&reader->space_cond);
+		pthread_mutex_unlock(&reader->lock);
+		/* It may still be blocked in read() if the stream was not consumed */
+		pthread_cancel(reader->thread);
+		pthread_join(reader->thread, NULL);
+	}
+	if (reader->buf) {
+		pthread_cond_destroy(&reader->data_cond);
+		pthread_cond_destroy(&reader->space_cond);
+		pthread_mutex_destroy(&reader->lock);
+		free(reader->buf);
+	}
+	free(reader);
+}
+
+/*
+ * Copy up to @len bytes from the read ahead buffer, blocking until at least
+ * some data are available.
+ *
+ * Return the number of bytes copied, 0 on EOF or negative errno.
+ */
+static ssize_t reader_read(struct btrfs_send_stream_reader *reader, char *buf,
+			   size_t len)
+{
+	size_t offset;
+	u64 avail;
+
+	pthread_mutex_lock(&reader->lock);
+	while (reader->head == reader->tail && !reader->eof && !reader->error)
+		pthread_cond_wait(&reader->data_cond, &reader->lock);
+	avail = reader->head - reader->tail;
+	if (avail == 0) {
+		int ret = reader->error;
+
+		pthread_mutex_unlock(&reader->lock);
+		if (ret)
+			errno = -ret;
+		return ret;
+	}
+	pthread_mutex_unlock(&reader->lock);
+
+	/* The filled part of the buffer is not touched by the reader */
+	offset = reader->tail % reader->size;
+	len = min_t(size_t, len, avail);
+	len = min_t(size_t, len, reader->size - offset);
+	memcpy(buf, reader->buf + offset, len);
+
+	pthread_mutex_lock(&reader->lock);
+	reader->tail += len;
+	pthread_cond_signal(&reader->space_cond);
+	pthread_mutex_unlock(&reader->lock);
+	return len;
+}
+
+/*
+ * Map the part of the stream file appended since it was mapped, the mapping
+ * may move.
+ *
+ * Return 0 if the mapping was extended, <0 otherwise.
+ */
+static int extend_map(struct btrfs_send_stream *sctx)
+{
+	struct stat st;
+	off_t aligned = sctx->map_offset - (sctx->map - sctx->map_base);
+	void *map;
+
+	if (fstat(sctx->fd, &st) < 0)
+		return -errno;
+	if (st.st_size <= sctx->map_offset + (off_t)sctx->map_len)
+		return -ENODATA;
+
+	map = mremap(sctx->map_base, sctx->map_base_len, st.st_size - aligned,
+		     MREMAP_MAYMOVE);
+	if (map == MAP_FAILED)
+		return -errno;
+	sctx->map = (char *)map + (sctx->map - sctx->map_base);
+	sctx->map_base = map;
+	sctx->map_base_len = st.st_size - aligned;
+	sctx->map_len = st.st_size - sctx->map_offset;
+	return 0;
+}
+
+/*
+ * Return pointer to the next @len bytes of a mapped stream in @ptr, valid
+ * until the next call.
+ * Return value is the same as of read_buf().
+ */
+static int map_buf(struct btrfs_send_stream *sctx, char **ptr, size_t len)
+{
+	size_t avail = sctx->map_len - sctx->stream_pos;
+
+	/* Check the size only past the mapping, the file may have grown */
+	if (avail < len && extend_map(sctx) == 0)
+		avail = sctx->map_len - sctx->stream_pos;
+	if (avail == 0 && len > 0)
+		return 1;
+	if (avail < len) {
+		error("short read from stream: expected %zu read %zu", len, avail);
+		return -EIO;
+	}
+	*ptr = sctx->map + sctx->stream_pos;
+	sctx->stream_pos += len;
+	return 0;
+}
+
 /*
  * Read len bytes to buf.
  * Return:
@@ -69,10 +310,22 @@ static int read_buf(struct btrfs_send_stream *sctx, char *buf, size_t len)
 	int ret;
 	size_t pos = 0;
 
+	if (sctx->map) {
+		char *ptr;
+
+		ret = map_buf(sctx, &ptr, len);
+		if (ret == 0)
+			memcpy(buf, ptr, len);
+		return ret;
+	}
+
 	while (pos < len) {
 		ssize_t rbytes;
 
-		rbytes = read(sctx->fd, buf + pos, len - pos);
+		if (sctx->reader)
+			rbytes = reader_read(sctx->reader, buf + pos, len - pos);
+		else
+			rbytes = read(sctx->fd, buf + pos, len - pos);
 		if (rbytes < 0) {
 			ret = -errno;
 			error("read from stream failed: %m");
@@ -98,6 +351,120 @@ out:
 	return ret;
 }
 
+/* Read the command header and data to sctx->read_buf */
+static int read_cmd_buf(struct btrfs_send_stream *sctx,
+			struct btrfs_cmd_header **cmd_hdr_ret)
+{
+	struct btrfs_cmd_header *cmd_hdr;
+	size_t buf_len;
+	u32 cmd_len;
+	int ret;
+
+	ret = read_buf(sctx, sctx->read_buf, sizeof(*cmd_hdr));
+	if (ret)
+		return ret;
+
+	cmd_hdr = (struct btrfs_cmd_header *)sctx->read_buf;
+	cmd_len = le32_to_cpu(cmd_hdr->len);
+	buf_len = sizeof(*cmd_hdr) + cmd_len;
+	if (sctx->read_buf_size < buf_len) {
+		void *new_read_buf;
+
+		new_read_buf = realloc(sctx->read_buf, buf_len);
+		if (!new_read_buf) {
+			errno = ENOMEM;
+			error_msg(ERROR_MSG_MEMORY, "read buffer for command");
+			return -ENOMEM;
+		}
+		sctx->read_buf = new_read_buf;
+		sctx->read_buf_size = buf_len;
+		/* We need to reset cmd_hdr after realloc of sctx->read_buf */
+		cmd_hdr = (struct btrfs_cmd_header *)sctx->read_buf;
+	}
+	ret = read_buf(sctx, (char *)(cmd_hdr + 1), cmd_len);
+	if (ret)
+		return ret;
+	*cmd_hdr_ret = cmd_hdr;
+	return 0;
+}
+
+/* Return the command header and data in place in the mapped stream */
+static int map_cmd(struct btrfs_send_stream *sctx,
+		   struct btrfs_cmd_header **cmd_hdr_ret)
+{
+	size_t drop;
+	u32 len;
+	char *ptr;
+	int ret;
+
+	/* The previous commands are processed, their pages are not needed */
+	drop = round_down(sctx->map - sctx->map_base + sctx->stream_pos,
+			  getpagesize());
+	if (drop - sctx->map_dropped >= SEND_STREAM_MAP_DROP) {
+		madvise(sctx->map_base + sctx->map_dropped,
+			drop - sctx->map_dropped, MADV_DONTNEED);
+		sctx->map_dropped = drop;
+	}
+
+	ret = map_buf(sctx, &ptr, sizeof(struct btrfs_cmd_header));
+	if (ret)
+		return ret;
+	len = le32_to_cpu(((struct btrfs_cmd_header *)ptr)->len);
+	ret = map_buf(sctx, &ptr, len);
+	if (ret)
+		return ret;
+	/* The mapping may have moved, the data follow the header */
+	*cmd_hdr_ret = (struct btrfs_cmd_header *)(ptr -
+					sizeof(struct btrfs_cmd_header));
+	return 0;
+}
+
+/*
+ * Map the rest of the stream file, so the commands don't need to be copied.
+ * The stream is read by read() if the file can't be mapped.
+ *
+ * The file must not be truncated while it's processed, access to the mapping
+ * beyond the end of the file raises SIGBUS. The size is checked again only
+ * when a command does not fit the mapping, a file that has grown meanwhile is
+ * mapped further.
+ */
+static void map_stream(struct btrfs_send_stream *sctx)
+{
+	struct stat st;
+	off_t offset;
+	off_t aligned;
+	void *map;
+
+	if (fstat(sctx->fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return;
+	offset = lseek(sctx->fd, 0, SEEK_CUR);
+	if (offset < 0 || offset >= st.st_size)
+		return;
+
+	aligned = round_down(offset, getpagesize());
+	map = mmap(NULL, st.st_size - aligned, PROT_READ, MAP_PRIVATE, sctx->fd,
+		   aligned);
+	if (map == MAP_FAILED)
+		return;
+	madvise(map, st.st_size - aligned, MADV_SEQUENTIAL);
+	sctx->map_base = map;
+	sctx->map_base_len = st.st_size - aligned;
+	sctx->map = sctx->map_base + (offset - aligned);
+	sctx->map_len = st.st_size - offset;
+	sctx->map_offset = offset;
+}
+
+/* Continue after the processed stream, there can be another one */
+static void unmap_stream(struct btrfs_send_stream *sctx)
+{
+	if (!sctx->map_base)
+		return;
+	lseek(sctx->fd, sctx->map_offset + sctx->stream_pos, SEEK_SET);
+	munmap(sctx->map_base, sctx->map_base_len);
+	sctx->map_base = NULL;
+	sctx->map = NULL;
+}
+
 /*
  * Reads a single command from kernel space and decodes the TLV's into
  * sctx->cmd_attrs
@@ -115,12 +482,15 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 	u32 pos;
 	u32 crc;
 	u32 crc2;
-	struct btrfs_cmd_header *cmd_hdr;
-	size_t buf_len;
+	struct btrfs_cmd_header *cmd_hdr = NULL;
+	struct btrfs_cmd_header hdr;
 
 	memset(sctx->cmd_attrs, 0, sizeof(sctx->cmd_attrs));
 
-	ret = read_buf(sctx, sctx->read_buf, sizeof(*cmd_hdr));
+	if (sctx->map)
+		ret = map_cmd(sctx, &cmd_hdr);
+	else
+		ret = read_cmd_buf(sctx, &cmd_hdr);
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -128,42 +498,16 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 		error("unexpected EOF in stream");
 		goto out;
 	}
-
-	cmd_hdr = (struct btrfs_cmd_header *)sctx->read_buf;
 	cmd_len = le32_to_cpu(cmd_hdr->len);
 	cmd = le16_to_cpu(cmd_hdr->cmd);
-	buf_len = sizeof(*cmd_hdr) + cmd_len;
-	if (sctx->read_buf_size < buf_len) {
-		void *new_read_buf;
+	data = (char *)(cmd_hdr + 1);
 
-		new_read_buf = realloc(sctx->read_buf, buf_len);
-		if (!new_read_buf) {
-			ret = -ENOMEM;
-			errno = -ret;
-			error_msg(ERROR_MSG_MEMORY, "read buffer for command");
-			goto out;
-		}
-		sctx->read_buf = new_read_buf;
-		sctx->read_buf_size = buf_len;
-		/* We need to reset cmd_hdr after realloc of sctx->read_buf */
-		cmd_hdr = (struct btrfs_cmd_header *)sctx->read_buf;
-	}
-	data = sctx->read_buf + sizeof(*cmd_hdr);
-	ret = read_buf(sctx, data, cmd_len);
-	if (ret < 0)
-		goto out;
-	if (ret) {
-		ret = -EINVAL;
-		error("unexpected EOF in stream");
-		goto out;
-	}
-
-	crc = le32_to_cpu(cmd_hdr->crc);
 	/* In send, CRC is computed with header crc = 0, replicate that */
-	cmd_hdr->crc = 0;
-
-	crc2 = crc32c(0, (unsigned char*)sctx->read_buf,
-			sizeof(*cmd_hdr) + cmd_len);
+	crc = le32_to_cpu(cmd_hdr->crc);
+	hdr = *cmd_hdr;
+	hdr.crc = 0;
+	crc2 = crc32c(0, (unsigned char *)&hdr, sizeof(hdr));
+	crc2 = crc32c(crc2, (unsigned char *)data, cmd_len);
 
 	if (crc != crc2) {
 		ret = -EINVAL;
@@ -590,10 +934,9 @@ out:
  * callbacks in btrfs_send_ops structure returns an error. If greater than
  * zero, stop after max_errors errors happened.
  */
-int btrfs_read_and_process_send_stream(int fd,
-				       struct btrfs_send_ops *ops, void *user,
-				       int honor_end_cmd,
-				       u64 max_errors)
+static int process_send_stream(int fd, struct btrfs_send_stream_reader *reader,
+			       struct btrfs_send_ops *ops, void *user,
+			       int honor_end_cmd, u64 max_errors)
 {
 	int ret;
 	struct btrfs_send_stream sctx;
@@ -601,10 +944,14 @@ int btrfs_read_and_process_send_stream(int fd,
 	u64 errors = 0;
 	int last_err = 0;
 
+	memset(&sctx, 0, sizeof(sctx));
 	sctx.fd = fd;
+	sctx.reader = reader;
 	sctx.ops = ops;
 	sctx.user = user;
 	sctx.stream_pos = 0;
+	if (!reader)
+		map_stream(&sctx);
 
 	ret = read_buf(&sctx, (char*)&hdr, sizeof(hdr));
 	if (ret < 0)
@@ -652,8 +999,31 @@ int btrfs_read_and_process_send_stream(int fd,
 	free(sctx.read_buf);
 
 out:
+	unmap_stream(&sctx);
 	if (last_err && !ret)
 		ret = last_err;
 
 	return ret;
 }
+
+int btrfs_read_and_process_send_stream(int fd,
+				       struct btrfs_send_ops *ops, void *user,
+				       int honor_end_cmd,
+				       u64 max_errors)
+{
+	return process_send_stream(fd, NULL, ops, user, honor_end_cmd,
+				   max_errors);
+}
+
+/*
+ * Same as btrfs_read_and_process_send_stream() but read the stream from
+ * @reader, started by btrfs_send_stream_reader_start().
+ */
+int btrfs_read_and_process_send_stream_reader(
+		struct btrfs_send_stream_reader *reader,
+		struct btrfs_send_ops *ops, void *user,
+		int honor_end_cmd, u64 max_errors)
+{
+	return process_send_stream(reader->fd, reader->buf ? reader : NULL, ops,
+				   user, honor_end_cmd, max_errors);
+}
@@ -70,4 +70,13 @@ int btrfs_read_and_process_send_stream(int fd,
 				       int honor_end_cmd,
 				       u64 max_errors);
 
+struct btrfs_send_stream_reader;
+
+struct btrfs_send_stream_reader *btrfs_send_stream_reader_start(int fd);
+void btrfs_send_stream_reader_stop(struct btrfs_send_stream_reader *reader);
+int btrfs_read_and_process_send_stream_reader(
+		struct btrfs_send_stream_reader *reader,
+		struct btrfs_send_ops *ops, void *user,
+		int honor_end_cmd, u64 max_errors);
+
 #endif
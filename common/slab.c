@@ -0,0 +1,151 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kernel-shared/messages.h"
+#include "common/slab.h"
+#include "common/internal.h"
+
+/*
+ * Chunk header, placed at the beginning of each chunk. The objects follow at
+ * SLAB_OBJ_ALIGN aligned offsets.
+ */
+struct slab_chunk {
+	struct slab_chunk *next;
+};
+
+#define SLAB_OBJ_ALIGN		(64)
+#define SLAB_CHUNK_HDR		(round_up(sizeof(struct slab_chunk), SLAB_OBJ_ALIGN))
+
+struct slab_cache *slab_cache_create(const char *name, u32 obj_size,
+				     unsigned int flags)
+{
+	struct slab_cache *cache;
+
+	if (obj_size == 0 || obj_size > SLAB_CHUNK_SIZE - SLAB_CHUNK_HDR)
+		return NULL;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	cache->name = name;
+	/* The free list link is stored in the object itself */
+	cache->obj_size = round_up(max_t(u32, obj_size, sizeof(void *)),
+				   SLAB_OBJ_ALIGN);
+	cache->objs_per_chunk = (SLAB_CHUNK_SIZE - SLAB_CHUNK_HDR) /
+				cache->obj_size;
+	cache->flags = flags;
+	return cache;
+}
+
+static int slab_grow(struct slab_cache *cache)
+{
+	struct slab_chunk *chunk;
+	char *obj;
+	void *mem;
+	int ret;
+	u32 i;
+
+	ret = posix_memalign(&mem, SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE);
+	if (ret)
+		return -ret;
+
+#ifdef MADV_HUGEPAGE
+	/* Only a hint, the chunk is usable with regular pages too */
+	if (cache->flags & SLAB_HUGEPAGE)
+		madvise(mem, SLAB_CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+
+	chunk = mem;
+	chunk->next = cache->chunks;
+	cache->chunks = chunk;
+	cache->stats.chunks++;
+
+	/* Link the objects so that they are handed out in address order */
+	obj = (char *)mem + SLAB_CHUNK_HDR +
+	      (u64)(cache->objs_per_chunk - 1) * cache->obj_size;
+	for (i = 0; i < cache->objs_per_chunk; i++) {
+		*(void **)obj = cache->free_list;
+		cache->free_list = obj;
+		obj -= cache->obj_size;
+	}
+	return 0;
+}
+
+void *slab_alloc(struct slab_cache *cache)
+{
+	void *obj;
+
+	if (!cache->free_list && slab_grow(cache) < 0)
+		return NULL;
+
+	obj = cache->free_list;
+	cache->free_list = *(void **)obj;
+	cache->stats.allocs++;
+	cache->stats.in_use++;
+	if (cache->stats.in_use > cache->stats.peak)
+		cache->stats.peak = cache->stats.in_use;
+	return obj;
+}
+
+void slab_free(struct slab_cache *cache, void *obj)
+{
+	if (!obj)
+		return;
+
+	ASSERT(cache->stats.in_use > 0);
+	*(void **)obj = cache->free_list;
+	cache->free_list = obj;
+	cache->stats.frees++;
+	cache->stats.in_use--;
+}
+
+void slab_cache_destroy(struct slab_cache *cache)
+{
+	struct slab_stats *stats;
+	struct slab_chunk *chunk;
+
+	if (!cache)
+		return;
+
+	stats = &cache->stats;
+	pr_verbose(LOG_DEBUG,
+	"slab %s: object size %u, %llu allocs %llu frees, peak %llu objects in %llu chunks\n",
+		   cache->name, cache->obj_size, stats->allocs, stats->frees,
+		   stats->peak, stats->chunks);
+
+	/*
+	 * Objects still in use would point to released memory, keep the
+	 * chunks around rather than risking a use after free.
+	 */
+	if (stats->in_use) {
+		warning("slab %s: %llu objects still in use, leaking %llu chunks",
+			cache->name, stats->in_use, stats->chunks);
+		free(cache);
+		return;
+	}
+
+	while (cache->chunks) {
+		chunk = cache->chunks;
+		cache->chunks = chunk->next;
+		free(chunk);
+	}
+	free(cache);
+}
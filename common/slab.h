@@ -0,0 +1,60 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __COMMON_SLAB_H__
+#define __COMMON_SLAB_H__
+
+#include "kerncompat.h"
+#include "kernel-lib/sizes.h"
+
+/* Size of one arena chunk, matches the common transparent huge page size */
+#define SLAB_CHUNK_SIZE		(SZ_2M)
+
+/* Ask for transparent huge pages backing the chunks */
+#define SLAB_HUGEPAGE		(1U << 0)
+
+struct slab_stats {
+	u64 allocs;
+	u64 frees;
+	u64 in_use;
+	u64 peak;
+	u64 chunks;
+};
+
+struct slab_chunk;
+
+/*
+ * Allocator of fixed size objects carved from large chunks. Freed objects are
+ * kept on a free list and reused, chunks are released only when the whole
+ * cache is destroyed. Not thread safe.
+ */
+struct slab_cache {
+	const char *name;
+	u32 obj_size;
+	u32 objs_per_chunk;
+	unsigned int flags;
+	void *free_list;
+	struct slab_chunk *chunks;
+	struct slab_stats stats;
+};
+
+struct slab_cache *slab_cache_create(const char *name, u32 obj_size,
+				     unsigned int flags);
+void slab_cache_destroy(struct slab_cache *cache);
+void *slab_alloc(struct slab_cache *cache);
+void slab_free(struct slab_cache *cache, void *obj);
+
+#endif
@@ -0,0 +1,415 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "kernel-lib/list.h"
+#include "kernel-lib/list_sort.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/volumes.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/extent_io.h"
+#include "kernel-shared/messages.h"
+#include "common/extent-cache.h"
+#include "common/internal.h"
+#include "common/device-utils.h"
+#include "common/messages.h"
+#include "common/tree-reada.h"
+
+/*
+ * Parallel tree block readahead.
+ *
+ * Worker threads read the tree blocks queued by readahead_tree_block() into
+ * private buffers and verify their checksums.  The buffers never enter the
+ * extent buffer cache from the worker side, which is not thread safe; the
+ * reading thread picks them up in btrfs_read_extent_buffer() and only skips
+ * the read and the checksum calculation of the first mirror.
+ *
+ * Workers don't print anything.  Any block that fails to read or verify is
+ * dropped and read again by the caller, so errors are reported the same way
+ * and in the same order as without readahead.
+ *
+ * Callers queueing more blocks at once (children of a node, batches of
+ * pending blocks) should wrap the requests in btrfs_tree_reada_plug() and
+ * btrfs_tree_reada_unplug().  The plugged blocks are handed to the workers
+ * sorted by device and physical offset, so the devices see mostly
+ * sequential reads.
+ */
+
+/* Number of blocks that can be queued or cached before new requests are dropped */
+#define TREE_READA_MAX_PENDING			(4096)
+
+enum tree_reada_state {
+	TREE_READA_PLUGGED,
+	TREE_READA_QUEUED,
+	TREE_READA_RUNNING,
+	TREE_READA_DONE,
+	TREE_READA_FAILED,
+};
+
+struct tree_reada_entry {
+	struct cache_extent cache;
+	/* In the plug list, the queue or the done list */
+	struct list_head list;
+	enum tree_reada_state state;
+	/* Location of the first mirror, for sorting */
+	u64 devid;
+	u64 physical;
+	struct extent_buffer *eb;
+};
+
+struct btrfs_tree_reada {
+	struct btrfs_fs_info *fs_info;
+	pthread_mutex_t mutex;
+	/* Signalled when a new block is queued or on stop */
+	pthread_cond_t work_cond;
+	/* Signalled when a worker finishes a block */
+	pthread_cond_t done_cond;
+	struct cache_tree entries;
+	/* Blocks queued while plugged, not visible to the workers yet */
+	struct list_head plug;
+	int plug_count;
+	struct list_head queue;
+	struct list_head done;
+	int nr_entries;
+	int nr_threads;
+	int stop;
+	pthread_t threads[BTRFS_TREE_READA_MAX_THREADS];
+};
+
+static void free_entry(struct btrfs_tree_reada *reada,
+		       struct tree_reada_entry *entry)
+{
+	remove_cache_extent(&reada->entries, &entry->cache);
+	list_del(&entry->list);
+	reada->nr_entries--;
+	free_extent_buffer(entry->eb);
+	free(entry);
+}
+
+/*
+ * Read the first mirror of a tree block without printing anything, the
+ * caller will redo the read with full error reporting if needed.
+ */
+static int read_block_silent(struct btrfs_fs_info *fs_info,
+			     struct extent_buffer *eb)
+{
+	u64 offset = 0;
+
+	while (offset < eb->len) {
+		struct btrfs_multi_bio *multi = NULL;
+		struct btrfs_device *device;
+		u64 read_len = eb->len - offset;
+		int ret;
+
+		ret = btrfs_map_block(fs_info, READ, eb->start + offset,
+				      &read_len, &multi, 1, NULL);
+		if (ret)
+			return -EIO;
+		read_len = min_t(u64, read_len, eb->len - offset);
+		device = multi->stripes[0].dev;
+		if (device->fd <= 0) {
+			kfree(multi);
+			return -EIO;
+		}
+		ret = btrfs_pread(device->fd, eb->data + offset, read_len,
+				  multi->stripes[0].physical, fs_info->zoned);
+		kfree(multi);
+		if (ret != read_len)
+			return -EIO;
+		offset += read_len;
+	}
+
+	if (verify_tree_block_csum_silent(eb, fs_info->csum_size,
+					  fs_info->csum_type))
+		return -EIO;
+	return 0;
+}
+
+static void *tree_reada_worker(void *data)
+{
+	struct btrfs_tree_reada *reada = data;
+	struct tree_reada_entry *entry;
+	int ret;
+
+	pthread_mutex_lock(&reada->mutex);
+	while (1) {
+		while (list_empty(&reada->queue) && !reada->stop)
+			pthread_cond_wait(&reada->work_cond, &reada->mutex);
+		if (reada->stop)
+			break;
+
+		entry = list_first_entry(&reada->queue, struct tree_reada_entry,
+					 list);
+		list_del_init(&entry->list);
+		entry->state = TREE_READA_RUNNING;
+		pthread_mutex_unlock(&reada->mutex);
+
+		ret = read_block_silent(reada->fs_info, entry->eb);
+
+		pthread_mutex_lock(&reada->mutex);
+		entry->state = ret ? TREE_READA_FAILED : TREE_READA_DONE;
+		list_add_tail(&entry->list, &reada->done);
+		pthread_cond_broadcast(&reada->done_cond);
+	}
+	pthread_mutex_unlock(&reada->mutex);
+
+	return NULL;
+}
+
+/*
+ * Start @nr_threads workers reading tree blocks queued by
+ * readahead_tree_block().  Only for read-only access, blocks written after
+ * they have been queued would be read back stale.
+ */
+int btrfs_tree_reada_start(struct btrfs_fs_info *fs_info, int nr_threads)
+{
+	struct btrfs_tree_reada *reada;
+	int ret;
+	int i;
+
+	if (fs_info->tree_reada)
+		return -EEXIST;
+	if (nr_threads <= 0 || nr_threads > BTRFS_TREE_READA_MAX_THREADS)
+		return -EINVAL;
+	/* Restore mode reads blocks by physical offset, nothing to map */
+	if (fs_info->on_restoring)
+		return -EINVAL;
+	/* Image reads are served from its cache, readahead is not needed */
+	if (fs_info->image)
+		return 0;
+
+	reada = calloc(1, sizeof(*reada));
+	if (!reada)
+		return -ENOMEM;
+
+	reada->fs_info = fs_info;
+	cache_tree_init(&reada->entries);
+	INIT_LIST_HEAD(&reada->plug);
+	INIT_LIST_HEAD(&reada->queue);
+	INIT_LIST_HEAD(&reada->done);
+	pthread_mutex_init(&reada->mutex, NULL);
+	pthread_cond_init(&reada->work_cond, NULL);
+	pthread_cond_init(&reada->done_cond, NULL);
+
+	for (i = 0; i < nr_threads; i++) {
+		ret = pthread_create(&reada->threads[i], NULL,
+				     tree_reada_worker, reada);
+		if (ret) {
+			ret = -ret;
+			break;
+		}
+		reada->nr_threads++;
+	}
+	fs_info->tree_reada = reada;
+	if (reada->nr_threads < nr_threads) {
+		errno = -ret;
+		error("failed to start tree readahead threads: %m");
+		btrfs_tree_reada_stop(fs_info);
+		return ret;
+	}
+	return 0;
+}
+
+void btrfs_tree_reada_stop(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_tree_reada *reada = fs_info->tree_reada;
+	struct cache_extent *cache;
+	int i;
+
+	if (!reada)
+		return;
+
+	pthread_mutex_lock(&reada->mutex);
+	reada->stop = 1;
+	pthread_cond_broadcast(&reada->work_cond);
+	pthread_mutex_unlock(&reada->mutex);
+
+	for (i = 0; i < reada->nr_threads; i++)
+		pthread_join(reada->threads[i], NULL);
+
+	while ((cache = first_cache_extent(&reada->entries))) {
+		struct tree_reada_entry *entry;
+
+		entry = container_of(cache, struct tree_reada_entry, cache);
+		free_entry(reada, entry);
+	}
+	pthread_cond_destroy(&reada->done_cond);
+	pthread_cond_destroy(&reada->work_cond);
+	pthread_mutex_destroy(&reada->mutex);
+	free(reada);
+	fs_info->tree_reada = NULL;
+}
+
+static int cmp_entry_physical(void *priv, struct list_head *a,
+			      struct list_head *b)
+{
+	const struct tree_reada_entry *ea;
+	const struct tree_reada_entry *eb;
+
+	ea = list_entry(a, struct tree_reada_entry, list);
+	eb = list_entry(b, struct tree_reada_entry, list);
+	if (ea->devid != eb->devid)
+		return ea->devid < eb->devid ? -1 : 1;
+	if (ea->physical != eb->physical)
+		return ea->physical < eb->physical ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Collect the following readahead requests and submit them at once at
+ * btrfs_tree_reada_unplug().  Plugging can be nested.
+ */
+void btrfs_tree_reada_plug(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_tree_reada *reada = fs_info->tree_reada;
+
+	if (!reada)
+		return;
+	pthread_mutex_lock(&reada->mutex);
+	reada->plug_count++;
+	pthread_mutex_unlock(&reada->mutex);
+}
+
+void btrfs_tree_reada_unplug(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_tree_reada *reada = fs_info->tree_reada;
+	struct tree_reada_entry *entry;
+
+	if (!reada)
+		return;
+	pthread_mutex_lock(&reada->mutex);
+	ASSERT(reada->plug_count > 0);
+	reada->plug_count--;
+	if (reada->plug_count == 0 && !list_empty(&reada->plug)) {
+		list_sort(NULL, &reada->plug, cmp_entry_physical);
+		list_for_each_entry(entry, &reada->plug, list)
+			entry->state = TREE_READA_QUEUED;
+		list_splice_tail_init(&reada->plug, &reada->queue);
+		pthread_cond_broadcast(&reada->work_cond);
+	}
+	pthread_mutex_unlock(&reada->mutex);
+}
+
+/*
+ * Queue the tree block at @bytenr to be read by the workers.
+ *
+ * Readahead is only a hint, if there are too many blocks queued or read but
+ * not yet consumed, the oldest finished block is dropped to make room.  If
+ * everything is still in flight the request is ignored.
+ */
+int btrfs_tree_reada_queue(struct btrfs_fs_info *fs_info, u64 bytenr)
+{
+	struct btrfs_tree_reada *reada = fs_info->tree_reada;
+	struct tree_reada_entry *entry;
+	struct btrfs_multi_bio *multi = NULL;
+	u64 length = fs_info->nodesize;
+	int ret;
+
+	/* Mapping is read only here, it's safe to do outside of the lock */
+	ret = btrfs_map_block(fs_info, READ, bytenr, &length, &multi, 1, NULL);
+	if (ret)
+		return ret;
+
+	pthread_mutex_lock(&reada->mutex);
+	if (lookup_cache_extent(&reada->entries, bytenr, fs_info->nodesize))
+		goto out;
+
+	if (reada->nr_entries >= TREE_READA_MAX_PENDING) {
+		if (list_empty(&reada->done)) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		entry = list_first_entry(&reada->done, struct tree_reada_entry,
+					 list);
+		free_entry(reada, entry);
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	entry->eb = alloc_dummy_extent_buffer(fs_info, bytenr, fs_info->nodesize);
+	if (!entry->eb) {
+		free(entry);
+		ret = -ENOMEM;
+		goto out;
+	}
+	entry->cache.start = bytenr;
+	entry->cache.size = fs_info->nodesize;
+	ret = insert_cache_extent(&reada->entries, &entry->cache);
+	if (ret) {
+		free_extent_buffer(entry->eb);
+		free(entry);
+		goto out;
+	}
+	entry->devid = multi->stripes[0].dev->devid;
+	entry->physical = multi->stripes[0].physical;
+	reada->nr_entries++;
+	if (reada->plug_count) {
+		entry->state = TREE_READA_PLUGGED;
+		list_add_tail(&entry->list, &reada->plug);
+	} else {
+		entry->state = TREE_READA_QUEUED;
+		list_add_tail(&entry->list, &reada->queue);
+		pthread_cond_signal(&reada->work_cond);
+	}
+out:
+	pthread_mutex_unlock(&reada->mutex);
+	kfree(multi);
+	return ret;
+}
+
+/*
+ * Copy the content of a tree block read ahead into @eb.
+ *
+ * Return true if @eb has been filled with the first mirror of the block with
+ * a verified checksum.  Return false if the block has not been read ahead or
+ * failed, the caller has to read it.  Blocks still waiting in the queue or
+ * plugged are dropped instead of waited for.
+ */
+bool btrfs_tree_reada_get(struct extent_buffer *eb)
+{
+	struct btrfs_tree_reada *reada = eb->fs_info->tree_reada;
+	struct tree_reada_entry *entry;
+	struct cache_extent *cache;
+	bool filled = false;
+
+	if (!reada)
+		return false;
+
+	pthread_mutex_lock(&reada->mutex);
+	cache = lookup_cache_extent(&reada->entries, eb->start, eb->len);
+	if (!cache || cache->start != eb->start || cache->size != eb->len)
+		goto out;
+
+	entry = container_of(cache, struct tree_reada_entry, cache);
+	while (entry->state == TREE_READA_RUNNING)
+		pthread_cond_wait(&reada->done_cond, &reada->mutex);
+
+	if (entry->state == TREE_READA_DONE) {
+		memcpy(eb->data, entry->eb->data, eb->len);
+		filled = true;
+	}
+	free_entry(reada, entry);
+out:
+	pthread_mutex_unlock(&reada->mutex);
+	return filled;
+}
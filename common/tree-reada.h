@@ -0,0 +1,38 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __COMMON_TREE_READA_H__
+#define __COMMON_TREE_READA_H__
+
+#include "kerncompat.h"
+#include <stdbool.h>
+
+struct btrfs_fs_info;
+struct extent_buffer;
+
+/* Upper limit of worker threads reading tree blocks */
+#define BTRFS_TREE_READA_MAX_THREADS		(64)
+/* Number of workers started by tools that read ahead without an option */
+#define BTRFS_TREE_READA_DEFAULT_THREADS	(4)
+
+int btrfs_tree_reada_start(struct btrfs_fs_info *fs_info, int nr_threads);
+void btrfs_tree_reada_stop(struct btrfs_fs_info *fs_info);
+int btrfs_tree_reada_queue(struct btrfs_fs_info *fs_info, u64 bytenr);
+void btrfs_tree_reada_plug(struct btrfs_fs_info *fs_info);
+void btrfs_tree_reada_unplug(struct btrfs_fs_info *fs_info);
+bool btrfs_tree_reada_get(struct extent_buffer *eb);
+
+#endif
@@ -180,21 +180,24 @@ static inline int convert_check_state(struct btrfs_convert_context *cctx)
 	return cctx->convert_ops->check_state(cctx);
 }
 
+/* Data are read and checksummed in batches of this size */
+#define CSUM_DISK_EXTENT_BATCH		(SZ_1M)
+
 static int csum_disk_extent(struct btrfs_trans_handle *trans,
 			    struct btrfs_root *root,
 			    u64 disk_bytenr, u64 num_bytes)
 {
 	struct btrfs_fs_info *fs_info = trans->fs_info;
-	u32 blocksize = fs_info->sectorsize;
-	u64 offset;
+	u32 buffer_size = min_t(u64, num_bytes, CSUM_DISK_EXTENT_BATCH);
+	u64 offset = 0;
 	char *buffer;
 	int ret = 0;
 
-	buffer = malloc(blocksize);
+	buffer = malloc(buffer_size);
 	if (!buffer)
 		return -ENOMEM;
-	for (offset = 0; offset < num_bytes; offset += blocksize) {
-		u64 read_len = blocksize;
+	while (offset < num_bytes) {
+		u64 read_len = min_t(u64, num_bytes - offset, buffer_size);
 
 		ret = read_data_from_disk(fs_info, buffer,
 					  disk_bytenr + offset, &read_len, 0);
@@ -206,11 +209,12 @@ static int csum_disk_extent(struct btrfs_trans_handle *trans,
 			ret = -EIO;
 			break;
 		}
-		ret = btrfs_csum_file_block(trans, disk_bytenr + offset,
-					    BTRFS_EXTENT_CSUM_OBJECTID,
+		ret = btrfs_csum_file_range(trans, disk_bytenr + offset,
+					    read_len, BTRFS_EXTENT_CSUM_OBJECTID,
 					    fs_info->csum_type, buffer);
 		if (ret)
 			break;
+		offset += read_len;
 	}
 	free(buffer);
 	return ret;
@@ -97,6 +97,11 @@ extern "C" {
   void blake2b_compress_sse2( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] );
   void blake2b_compress_sse41( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] );
 
+  /* Multi-buffer version, hashes BLAKE2B_MB_AVX2_LANES buffers at once */
+#define BLAKE2B_MB_AVX2_LANES	4
+  void blake2b_mb_avx2( const uint8_t *data[BLAKE2B_MB_AVX2_LANES], size_t length,
+                        uint8_t *digest[BLAKE2B_MB_AVX2_LANES], size_t outlen );
+
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,193 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Multi-buffer BLAKE2b using AVX2, 4 independent messages of the same length
+ * are hashed at once, one message per 64bit lane. Unkeyed, without salt and
+ * personalization, as used for checksums.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "blake2.h"
+#include "blake2-impl.h"
+#include "blake2-config.h"
+
+#ifdef HAVE_AVX2
+
+#include <immintrin.h>
+
+#define LANES		(BLAKE2B_MB_AVX2_LANES)
+
+static const uint64_t blake2b_IV[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint8_t blake2b_sigma[12][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+#define ADD(a, b)	_mm256_add_epi64((a), (b))
+#define XOR(a, b)	_mm256_xor_si256((a), (b))
+
+#define ROTR32(x)	_mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24(x)	_mm256_shuffle_epi8((x), r24)
+#define ROTR16(x)	_mm256_shuffle_epi8((x), r16)
+#define ROTR63(x)	XOR(_mm256_srli_epi64((x), 63), ADD((x), (x)))
+
+#define G(r, i, a, b, c, d)						\
+	do {								\
+		a = ADD(ADD(a, b), m[blake2b_sigma[r][2 * i + 0]]);	\
+		d = ROTR32(XOR(d, a));					\
+		c = ADD(c, d);						\
+		b = ROTR24(XOR(b, c));					\
+		a = ADD(ADD(a, b), m[blake2b_sigma[r][2 * i + 1]]);	\
+		d = ROTR16(XOR(d, a));					\
+		c = ADD(c, d);						\
+		b = ROTR63(XOR(b, c));					\
+	} while (0)
+
+/*
+ * Load 4 consecutive words from each lane and transpose them, so that m[i]
+ * holds word i of all the lanes.
+ */
+static inline void load_transpose(__m256i m[4], const uint8_t *p[LANES],
+				  size_t offset)
+{
+	__m256i r0, r1, r2, r3;
+	__m256i t0, t1, t2, t3;
+
+	r0 = _mm256_loadu_si256((const __m256i *)(p[0] + offset));
+	r1 = _mm256_loadu_si256((const __m256i *)(p[1] + offset));
+	r2 = _mm256_loadu_si256((const __m256i *)(p[2] + offset));
+	r3 = _mm256_loadu_si256((const __m256i *)(p[3] + offset));
+
+	t0 = _mm256_unpacklo_epi64(r0, r1);
+	t1 = _mm256_unpackhi_epi64(r0, r1);
+	t2 = _mm256_unpacklo_epi64(r2, r3);
+	t3 = _mm256_unpackhi_epi64(r2, r3);
+
+	m[0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+	m[1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+	m[2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+	m[3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+}
+
+static void blake2b_mb_compress(__m256i h[8], const uint8_t *p[LANES],
+				size_t offset, uint64_t counter, bool last)
+{
+	const __m256i r24 = _mm256_setr_epi8(
+			3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+			3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	const __m256i r16 = _mm256_setr_epi8(
+			2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+			2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	__m256i m[16];
+	__m256i v[16];
+	int r;
+	int i;
+
+	for (i = 0; i < 16; i += 4)
+		load_transpose(&m[i], p, offset + i * sizeof(uint64_t));
+
+	for (i = 0; i < 8; i++)
+		v[i] = h[i];
+	for (i = 0; i < 8; i++)
+		v[i + 8] = _mm256_set1_epi64x(blake2b_IV[i]);
+	v[12] = XOR(v[12], _mm256_set1_epi64x(counter));
+	if (last)
+		v[14] = XOR(v[14], _mm256_set1_epi64x(-1));
+
+	for (r = 0; r < 12; r++) {
+		G(r, 0, v[0], v[4], v[8], v[12]);
+		G(r, 1, v[1], v[5], v[9], v[13]);
+		G(r, 2, v[2], v[6], v[10], v[14]);
+		G(r, 3, v[3], v[7], v[11], v[15]);
+		G(r, 4, v[0], v[5], v[10], v[15]);
+		G(r, 5, v[1], v[6], v[11], v[12]);
+		G(r, 6, v[2], v[7], v[8], v[13]);
+		G(r, 7, v[3], v[4], v[9], v[14]);
+	}
+
+	for (i = 0; i < 8; i++)
+		h[i] = XOR(h[i], XOR(v[i], v[i + 8]));
+}
+
+/*
+ * Hash @length bytes of each of the 4 buffers in @data, producing @outlen
+ * bytes long digests stored to @digest.
+ */
+void blake2b_mb_avx2(const uint8_t *data[BLAKE2B_MB_AVX2_LANES], size_t length,
+		     uint8_t *digest[BLAKE2B_MB_AVX2_LANES], size_t outlen)
+{
+	uint8_t tail[LANES][BLAKE2B_BLOCKBYTES];
+	uint64_t out[8][LANES];
+	const uint8_t *p[LANES];
+	__m256i h[8];
+	size_t offset = 0;
+	size_t rest;
+	int lane;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		h[i] = _mm256_set1_epi64x(blake2b_IV[i]);
+	/* Parameter block: digest length, fanout 1, depth 1 */
+	h[0] = XOR(h[0], _mm256_set1_epi64x(0x01010000ULL ^ outlen));
+
+	/* The last block is processed separately, even if it's a full one */
+	while (length - offset > BLAKE2B_BLOCKBYTES) {
+		blake2b_mb_compress(h, data, offset,
+				    offset + BLAKE2B_BLOCKBYTES, false);
+		offset += BLAKE2B_BLOCKBYTES;
+	}
+
+	rest = length - offset;
+	for (lane = 0; lane < LANES; lane++) {
+		memset(tail[lane], 0, BLAKE2B_BLOCKBYTES);
+		memcpy(tail[lane], data[lane] + offset, rest);
+		p[lane] = tail[lane];
+	}
+	blake2b_mb_compress(h, p, 0, length, true);
+
+	for (i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i *)out[i], h[i]);
+	for (lane = 0; lane < LANES; lane++) {
+		uint8_t buf[BLAKE2B_OUTBYTES];
+
+		for (i = 0; i < 8; i++)
+			store64(buf + i * sizeof(uint64_t), out[i][lane]);
+		memcpy(digest[lane], buf, outlen);
+	}
+}
+
+#endif
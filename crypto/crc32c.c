@@ -10,14 +10,69 @@
 
 #include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
 #include "crypto/crc32c.h"
 #include "common/cpu-utils.h"
 
 static uint32_t __crc32c_le(uint32_t crc, unsigned char const *data, uint32_t length);
 static uint32_t (*crc_function)(uint32_t crc, unsigned char const *data, uint32_t length) = __crc32c_le;
+static void crc32c_le_multi_generic(uint32_t seed, unsigned char const **data,
+				    int nr, uint32_t length, uint32_t *crcs);
+static void (*crc_multi_function)(uint32_t seed, unsigned char const **data,
+				  int nr, uint32_t length, uint32_t *crcs) =
+	crc32c_le_multi_generic;
 
 #ifdef __x86_64__
 
+static inline uint64_t crc32c_hw_u64(uint64_t crc, const unsigned char *data)
+{
+	uint64_t val;
+
+	memcpy(&val, data, sizeof(val));
+	__asm__("crc32q %1, %0" : "+r"(crc) : "rm"(val));
+	return crc;
+}
+
+static inline uint32_t crc32c_hw_u8(uint32_t crc, unsigned char val)
+{
+	__asm__("crc32b %1, %0" : "+r"(crc) : "rm"(val));
+	return crc;
+}
+
+/*
+ * The crc32 instruction has a latency of 3 cycles but can be issued every
+ * cycle, calculate 3 independent buffers at once to keep it busy.
+ */
+static void crc32c_le_multi_3way(uint32_t seed, unsigned char const **data,
+				 int nr, uint32_t length, uint32_t *crcs)
+{
+	int i = 0;
+
+	for (; i + 3 <= nr; i += 3) {
+		const unsigned char *p0 = data[i];
+		const unsigned char *p1 = data[i + 1];
+		const unsigned char *p2 = data[i + 2];
+		uint64_t c0 = seed, c1 = seed, c2 = seed;
+		uint32_t off = 0;
+
+		for (; off + 8 <= length; off += 8) {
+			c0 = crc32c_hw_u64(c0, p0 + off);
+			c1 = crc32c_hw_u64(c1, p1 + off);
+			c2 = crc32c_hw_u64(c2, p2 + off);
+		}
+		for (; off < length; off++) {
+			c0 = crc32c_hw_u8(c0, p0[off]);
+			c1 = crc32c_hw_u8(c1, p1[off]);
+			c2 = crc32c_hw_u8(c2, p2[off]);
+		}
+		crcs[i] = c0;
+		crcs[i + 1] = c1;
+		crcs[i + 2] = c2;
+	}
+	for (; i < nr; i++)
+		crcs[i] = crc_function(seed, data[i], length);
+}
+
 #ifdef __GLIBC__
 
 /* asmlinkage */ unsigned int crc_pcl(const unsigned char *buffer, int len, unsigned int crc_init);
@@ -99,14 +154,17 @@ void crc32c_init_accel(void)
 	} else if (cpu_has_feature(CPU_FLAG_SSE42)) {
 		/* printf("CRC32C: pcl\n"); */
 		crc_function = crc32c_pcl;
+		crc_multi_function = crc32c_le_multi_3way;
 #else
 	} else if (cpu_has_feature(CPU_FLAG_SSE42)) {
 		/* printf("CRC32c: intel\n"); */
 		crc_function = crc32c_intel;
+		crc_multi_function = crc32c_le_multi_3way;
 #endif
 	} else {
 		/* printf("CRC32c: fallback\n"); */
 		crc_function = __crc32c_le;
+		crc_multi_function = crc32c_le_multi_generic;
 	}
 }
 
@@ -115,6 +173,7 @@ void crc32c_init_accel(void)
 void crc32c_init_accel(void)
 {
 	crc_function = __crc32c_le;
+	crc_multi_function = crc32c_le_multi_generic;
 }
 
 #endif /* __x86_64__ */
@@ -216,3 +275,22 @@ uint32_t crc32c_le(uint32_t crc, unsigned char const *data, uint32_t length)
 
 	return crc_function(crc, data, length);
 }
+
+static void crc32c_le_multi_generic(uint32_t seed, unsigned char const **data,
+				    int nr, uint32_t length, uint32_t *crcs)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		crcs[i] = crc32c_le(seed, data[i], length);
+}
+
+/*
+ * Calculate crc32c of @nr buffers of the same @length, starting from the same
+ * @seed, results are stored to @crcs.
+ */
+void crc32c_le_multi(uint32_t seed, unsigned char const **data, int nr,
+		     uint32_t length, uint32_t *crcs)
+{
+	crc_multi_function(seed, data, nr, length, crcs);
+}
@@ -18,6 +18,7 @@
 #include <time.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <pthread.h>
 #if HAVE_LINUX_PERF_EVENT_H == 1 && HAVE_LINUX_HW_BREAKPOINT_H == 1
 #include <linux/perf_event.h>
 #include <linux/hw_breakpoint.h>
@@ -30,6 +31,10 @@
 #include "crypto/blake2.h"
 #include "common/messages.h"
 #include "common/cpu-utils.h"
+#include "common/parse-utils.h"
+#include "common/format-output.h"
+#include "common/utils.h"
+#include "cmds/commands.h"
 
 #ifdef __x86_64__
 static const int cycles_supported = 1;
@@ -43,7 +48,14 @@ enum {
 	UNITS_PERF,
 };
 
-const int blocksize = 4096;
+/*
+ * The number of iterations is given for 4KiB blocks, other block sizes hash
+ * the same amount of data.
+ */
+#define BASE_BLOCKSIZE		(4096)
+#define SWEEP_MIN_BLOCKSIZE	(512)
+#define SWEEP_MAX_BLOCKSIZE	(SZ_1M)
+
 int iterations = 100000;
 
 #ifdef __x86_64__
@@ -171,56 +183,315 @@ static const char *units_to_str(int units)
 	return "unknown";
 }
 
+struct contestant {
+	char name[16];
+	int (*digest)(const u8 *buf, size_t length, u8 *out);
+	/* Batched variant, NULL if there's none */
+	int (*digest_multi)(const u8 **bufs, int nr, size_t length, u8 **outs);
+	int digest_size;
+	unsigned long cpu_flag;
+	/* Features to disable in addition to those above cpu_flag */
+	unsigned long cpu_clear;
+	int backend;
+};
+
+static const struct contestant contestants[] = {
+	{ .name = "NULL-NOP", .digest = hash_null_nop, .digest_size = 32 },
+	{ .name = "NULL-MEMCPY", .digest = hash_null_memcpy, .digest_size = 32 },
+	{ .name = "CRC32C-ref", .digest = hash_crc32c,
+	  .digest_multi = hash_crc32c_multi, .digest_size = 4,
+	  .cpu_flag = CPU_FLAG_NONE },
+	{ .name = "CRC32C-NI", .digest = hash_crc32c,
+	  .digest_multi = hash_crc32c_multi, .digest_size = 4,
+	  .cpu_flag = CPU_FLAG_SSE42 },
+	{ .name = "XXHASH", .digest = hash_xxhash,
+	  .digest_multi = hash_xxhash_multi, .digest_size = 8 },
+	{ .name = "SHA256-ref", .digest = hash_sha256,
+	  .digest_multi = hash_sha256_multi, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
+	{ .name = "SHA256-gcrypt", .digest = hash_sha256,
+	  .digest_multi = hash_sha256_multi, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBGCRYPT + 1 },
+	{ .name = "SHA256-sodium", .digest = hash_sha256,
+	  .digest_multi = hash_sha256_multi, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBSODIUM + 1 },
+	{ .name = "SHA256-kcapi", .digest = hash_sha256,
+	  .digest_multi = hash_sha256_multi, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBKCAPI + 1 },
+	{ .name = "SHA256-NI", .digest = hash_sha256,
+	  .digest_multi = hash_sha256_multi, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_SHA, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
+	/* Reference for single buffers, 8 lanes when batched */
+	{ .name = "SHA256-AVX2", .digest = hash_sha256,
+	  .digest_multi = hash_sha256_multi, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_AVX2, .cpu_clear = CPU_FLAG_SHA,
+	  .backend = CRYPTOPROVIDER_BUILTIN + 1 },
+	{ .name = "BLAKE2-ref", .digest = hash_blake2b,
+	  .digest_multi = hash_blake2b_multi, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
+	{ .name = "BLAKE2-gcrypt", .digest = hash_blake2b,
+	  .digest_multi = hash_blake2b_multi, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBGCRYPT + 1 },
+	{ .name = "BLAKE2-sodium", .digest = hash_blake2b,
+	  .digest_multi = hash_blake2b_multi, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBSODIUM + 1 },
+	{ .name = "BLAKE2-kcapi", .digest = hash_blake2b,
+	  .digest_multi = hash_blake2b_multi, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBKCAPI + 1 },
+	{ .name = "BLAKE2-SSE2", .digest = hash_blake2b,
+	  .digest_multi = hash_blake2b_multi, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_SSE2, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
+	{ .name = "BLAKE2-SSE41", .digest = hash_blake2b,
+	  .digest_multi = hash_blake2b_multi, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_SSE41, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
+	/* Single buffers, 4 lanes when batched */
+	{ .name = "BLAKE2-AVX2", .digest = hash_blake2b,
+	  .digest_multi = hash_blake2b_multi, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_AVX2, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
+};
+
+static const struct rowspec speedtest_rowspec[] = {
+	{ .key = "implementation", .fmt = "str", .out_text = "implementation", .out_json = "implementation" },
+	{ .key = "units", .fmt = "str", .out_text = "units", .out_json = "units" },
+	{ .key = "cpu_flags", .fmt = "%llu", .out_text = "cpu_flags", .out_json = "cpu_flags" },
+	{ .key = "name", .fmt = "str", .out_text = "name", .out_json = "name" },
+	{ .key = "block_size", .fmt = "%llu", .out_text = "block_size", .out_json = "block_size" },
+	{ .key = "batch", .fmt = "%llu", .out_text = "batch", .out_json = "batch" },
+	{ .key = "threads", .fmt = "%llu", .out_text = "threads", .out_json = "threads" },
+	{ .key = "bytes", .fmt = "%llu", .out_text = "bytes", .out_json = "bytes" },
+	{ .key = "nsecs", .fmt = "%llu", .out_text = "nsecs", .out_json = "nsecs" },
+	/* Bytes per second */
+	{ .key = "throughput", .fmt = "%llu", .out_text = "throughput", .out_json = "throughput" },
+	/* In the selected units, only for single thread measurements */
+	{ .key = "per_block", .fmt = "%llu", .out_text = "per_block", .out_json = "per_block" },
+	ROWSPEC_END
+};
+
+struct bench_worker {
+	const struct contestant *c;
+	u32 blocksize;
+	int batch;
+	u64 blocks;
+	int units;
+	pthread_barrier_t *barrier;
+
+	/* Results */
+	u64 tstart;
+	u64 tend;
+	u64 start;
+	u64 end;
+	int ret;
+};
+
+struct bench_result {
+	u64 bytes;
+	u64 time;
+	u64 cycles;
+	u64 blocks;
+};
+
+static void *bench_worker_fn(void *arg)
+{
+	struct bench_worker *w = arg;
+	const size_t bufsize = (size_t)w->blocksize * w->batch;
+	const u8 *bufs[w->batch];
+	u8 *outs[w->batch];
+	u8 *hashes;
+	u8 *buf;
+	u64 done;
+	int i;
+
+	buf = malloc(bufsize);
+	hashes = calloc(w->batch, CRYPTO_HASH_SIZE_MAX);
+	if (!buf || !hashes) {
+		w->ret = -ENOMEM;
+		/* Never skip the barrier, the other threads would hang */
+		if (w->barrier)
+			pthread_barrier_wait(w->barrier);
+		goto out;
+	}
+	memset(buf, 0, bufsize);
+	for (i = 0; i < w->batch; i++) {
+		bufs[i] = buf + (size_t)i * w->blocksize;
+		outs[i] = hashes + i * CRYPTO_HASH_SIZE_MAX;
+	}
+
+	if (w->barrier)
+		pthread_barrier_wait(w->barrier);
+
+	w->tstart = get_time();
+	w->start = get_cycles(w->units);
+	for (done = 0; done < w->blocks; done += w->batch) {
+		/* Make each round different */
+		buf[0] = done & 0xFF;
+		if (w->batch == 1)
+			w->c->digest(buf, w->blocksize, hashes);
+		else
+			w->c->digest_multi(bufs, min_t(u64, w->batch,
+						       w->blocks - done),
+					   w->blocksize, outs);
+	}
+	w->end = get_cycles(w->units);
+	w->tend = get_time();
+	w->ret = 0;
+out:
+	free(buf);
+	free(hashes);
+	return NULL;
+}
+
+/*
+ * Hash the same amount of data as the given number of iterations of 4KiB
+ * blocks would, split among the threads.
+ */
+static int run_bench(const struct contestant *c, u32 blocksize, int batch,
+		     int threads, int units, struct bench_result *res)
+{
+	struct bench_worker workers[threads];
+	pthread_t tids[threads];
+	pthread_barrier_t barrier;
+	u64 total_blocks;
+	u64 tstart = (u64)-1;
+	u64 tend = 0;
+	int ret = 0;
+	int i;
+
+	total_blocks = max_t(u64, (u64)iterations * BASE_BLOCKSIZE / blocksize, 1);
+	memset(workers, 0, sizeof(workers));
+	for (i = 0; i < threads; i++) {
+		workers[i].c = c;
+		workers[i].blocksize = blocksize;
+		workers[i].batch = batch;
+		workers[i].units = units;
+		workers[i].blocks = total_blocks / threads +
+				    (i < total_blocks % threads);
+	}
+
+	if (threads == 1) {
+		bench_worker_fn(&workers[0]);
+	} else {
+		pthread_barrier_init(&barrier, NULL, threads);
+		for (i = 0; i < threads; i++) {
+			workers[i].barrier = &barrier;
+			ret = pthread_create(&tids[i], NULL, bench_worker_fn,
+					     &workers[i]);
+			if (ret) {
+				/* The barrier would never be passed */
+				error("cannot create thread: %m");
+				exit(1);
+			}
+		}
+		for (i = 0; i < threads; i++)
+			pthread_join(tids[i], NULL);
+		pthread_barrier_destroy(&barrier);
+	}
+
+	memset(res, 0, sizeof(*res));
+	for (i = 0; i < threads; i++) {
+		if (workers[i].ret < 0)
+			ret = workers[i].ret;
+		tstart = min(tstart, workers[i].tstart);
+		tend = max(tend, workers[i].tend);
+		res->blocks += workers[i].blocks;
+	}
+	res->bytes = res->blocks * blocksize;
+	res->time = tend - tstart;
+	/* Counting cycles of other threads is not possible */
+	if (threads == 1)
+		res->cycles = workers[0].end - workers[0].start;
+	return ret;
+}
+
+/* Scale by powers of two, the maximum is always measured */
+static int next_threads(int threads, int max_threads)
+{
+	if (threads < max_threads && threads * 2 > max_threads)
+		return max_threads;
+	return threads * 2;
+}
+
+static void print_result_legacy(int idx, int units,
+				const struct bench_result *res)
+{
+	u64 total = 0;
+
+	if (units == UNITS_CYCLES || units == UNITS_PERF)
+		total = res->cycles;
+	if (units == UNITS_TIME)
+		total = res->time;
+
+	printf("%s: %12llu, %s/i %8llu",
+			units_to_str(units), total,
+			units_to_str(units), total / res->blocks);
+	if (idx > 0) {
+		float t;
+		float mb;
+
+		t = (float)res->time / 1000 / 1000 / 1000;
+		mb = (float)res->bytes / 1024 / 1024;
+		printf(", %12.3f MiB/s", mb / t);
+	}
+	putchar('\n');
+}
+
+static void print_result(const struct contestant *c, u32 blocksize, int batch,
+			 int threads, int units, const struct bench_result *res,
+			 struct format_ctx *fctx)
+{
+	const u64 time = max_t(u64, res->time, 1);
+	u64 per_block = 0;
+
+	if (threads == 1) {
+		per_block = (units == UNITS_TIME ? res->time : res->cycles);
+		per_block /= res->blocks;
+	}
+
+	if (bconf.output_format == CMD_FORMAT_JSON) {
+		fmt_print_start_group(fctx, NULL, JSON_TYPE_MAP);
+		fmt_print(fctx, "name", c->name);
+		fmt_print(fctx, "block_size", (u64)blocksize);
+		fmt_print(fctx, "batch", (u64)batch);
+		fmt_print(fctx, "threads", (u64)threads);
+		fmt_print(fctx, "bytes", res->bytes);
+		fmt_print(fctx, "nsecs", res->time);
+		fmt_print(fctx, "throughput",
+			  (u64)((double)res->bytes * 1000000000 / time));
+		if (threads == 1)
+			fmt_print(fctx, "per_block", per_block);
+		fmt_print_end_group(fctx, NULL);
+		return;
+	}
+
+	printf("%14s: %8u %6d %8d %12.3f", c->name, blocksize, batch, threads,
+	       (double)res->bytes / 1024 / 1024 * 1000000000 / time);
+	if (threads == 1)
+		printf(" %12llu", per_block);
+	putchar('\n');
+}
+
+/*
+ * Usage: hash-speedtest [options] [iterations]
+ *
+ * -c|--cycles, -t|--time, -p|--perf  units of the measurements
+ * -b|--blocksize SIZE                hash blocks of SIZE instead of 4KiB
+ * -s|--sweep                         all power of two sizes from 512B to 1MiB
+ * -B|--batch N                       also measure the batched API with N blocks
+ * -T|--threads N                     scale from 1 to N threads
+ * -j|--json                          print results in json
+ */
 int main(int argc, char **argv) {
-	u8 buf[blocksize];
-	u8 hash[32];
+	u32 blocksizes[32];
+	int nr_blocksizes = 0;
+	int batches[2] = { 1, 0 };
+	int max_threads = 1;
+	bool sweep = false;
+	bool extended;
 	int idx;
-	int iter;
-	struct contestant {
-		char name[16];
-		int (*digest)(const u8 *buf, size_t length, u8 *out);
-		int digest_size;
-		u64 cycles;
-		u64 time;
-		unsigned long cpu_flag;
-		int backend;
-	} contestants[] = {
-		{ .name = "NULL-NOP", .digest = hash_null_nop, .digest_size = 32 },
-		{ .name = "NULL-MEMCPY", .digest = hash_null_memcpy, .digest_size = 32 },
-		{ .name = "CRC32C-ref", .digest = hash_crc32c, .digest_size = 4,
-		  .cpu_flag = CPU_FLAG_NONE },
-		{ .name = "CRC32C-NI", .digest = hash_crc32c, .digest_size = 4,
-		  .cpu_flag = CPU_FLAG_SSE42 },
-		{ .name = "XXHASH", .digest = hash_xxhash, .digest_size = 8 },
-		{ .name = "SHA256-ref", .digest = hash_sha256, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
-		{ .name = "SHA256-gcrypt", .digest = hash_sha256, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBGCRYPT + 1 },
-		{ .name = "SHA256-sodium", .digest = hash_sha256, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBSODIUM + 1 },
-		{ .name = "SHA256-kcapi", .digest = hash_sha256, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBKCAPI + 1 },
-		{ .name = "SHA256-NI", .digest = hash_sha256, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_SHA, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
-		{ .name = "BLAKE2-ref", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
-		{ .name = "BLAKE2-gcrypt", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBGCRYPT + 1 },
-		{ .name = "BLAKE2-sodium", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBSODIUM + 1 },
-		{ .name = "BLAKE2-kcapi", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBKCAPI + 1 },
-		{ .name = "BLAKE2-SSE2", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_SSE2, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
-		{ .name = "BLAKE2-SSE41", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_SSE41, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
-		{ .name = "BLAKE2-AVX2", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_AVX2, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
-	};
 	int units = UNITS_CYCLES;
+	struct format_ctx fctx;
 
+	bconf.output_format = CMD_FORMAT_TEXT;
 	cpu_detect_flags();
-	cpu_print_flags();
 	hash_init_accel();
 
 	optind = 0;
@@ -229,11 +500,16 @@ int main(int argc, char **argv) {
 			{ "cycles", no_argument, NULL, 'c' },
 			{ "time", no_argument, NULL, 't' },
 			{ "perf", no_argument, NULL, 'p' },
+			{ "blocksize", required_argument, NULL, 'b' },
+			{ "sweep", no_argument, NULL, 's' },
+			{ "batch", required_argument, NULL, 'B' },
+			{ "threads", required_argument, NULL, 'T' },
+			{ "json", no_argument, NULL, 'j' },
 			{ NULL, 0, NULL, 0}
 		};
 		int c;
 
-		c = getopt_long(argc, argv, "ctp", long_options, NULL);
+		c = getopt_long(argc, argv, "ctpb:sB:T:j", long_options, NULL);
 		if (c < 0)
 			break;
 		switch (c) {
@@ -255,6 +531,34 @@ int main(int argc, char **argv) {
 			}
 			units = UNITS_PERF;
 			break;
+		case 'b':
+			blocksizes[0] = parse_size_from_string(optarg);
+			if (blocksizes[0] == 0 || blocksizes[0] > SZ_1G) {
+				error("invalid block size: %s", optarg);
+				return 1;
+			}
+			nr_blocksizes = 1;
+			break;
+		case 's':
+			sweep = true;
+			break;
+		case 'B':
+			batches[1] = atoi(optarg);
+			if (batches[1] < 2 || batches[1] > 1024) {
+				error("batch size must be between 2 and 1024");
+				return 1;
+			}
+			break;
+		case 'T':
+			max_threads = atoi(optarg);
+			if (max_threads < 1 || max_threads > 1024) {
+				error("number of threads must be between 1 and 1024");
+				return 1;
+			}
+			break;
+		case 'j':
+			bconf.output_format = CMD_FORMAT_JSON;
+			break;
 		default:
 			error("unknown option");
 			return 1;
@@ -267,64 +571,109 @@ int main(int argc, char **argv) {
 			iterations = 1;
 	}
 
-	memset(buf, 0, 4096);
+	if (sweep) {
+		u32 bs;
 
-	printf("Block size:     %d\n", blocksize);
-	printf("Iterations:     %d\n", iterations);
-	printf("Implementation: %s\n", CRYPTOPROVIDER);
-	printf("Units:          %s\n", units_to_desc(units));
-	printf("\n");
+		nr_blocksizes = 0;
+		for (bs = SWEEP_MIN_BLOCKSIZE; bs <= SWEEP_MAX_BLOCKSIZE; bs <<= 1)
+			blocksizes[nr_blocksizes++] = bs;
+	} else if (nr_blocksizes == 0) {
+		blocksizes[nr_blocksizes++] = BASE_BLOCKSIZE;
+	}
+	/* Keep the original output unless any of the new modes is requested */
+	extended = (sweep || nr_blocksizes > 1 || blocksizes[0] != BASE_BLOCKSIZE ||
+		    batches[1] || max_threads > 1 ||
+		    bconf.output_format == CMD_FORMAT_JSON);
+
+	if (bconf.output_format == CMD_FORMAT_JSON) {
+		fmt_start(&fctx, speedtest_rowspec, 16, 0);
+		fmt_print(&fctx, "implementation", CRYPTOPROVIDER);
+		fmt_print(&fctx, "units", units_to_str(units));
+		fmt_print(&fctx, "cpu_flags", (u64)__cpu_flags);
+		fmt_print_start_group(&fctx, "results", JSON_TYPE_ARRAY);
+	} else {
+		cpu_print_flags();
+		if (nr_blocksizes > 1)
+			printf("Block size:     %u-%u\n", blocksizes[0],
+			       blocksizes[nr_blocksizes - 1]);
+		else
+			printf("Block size:     %u\n", blocksizes[0]);
+		printf("Iterations:     %d\n", iterations);
+		if (batches[1])
+			printf("Batch:          %d\n", batches[1]);
+		if (max_threads > 1)
+			printf("Threads:        %d\n", max_threads);
+		printf("Implementation: %s\n", CRYPTOPROVIDER);
+		printf("Units:          %s\n", units_to_desc(units));
+		printf("\n");
+		if (extended)
+			printf("%14s  %8s %6s %8s %12s %12s\n", "", "block",
+			       "batch", "threads", "MiB/s",
+			       units_to_str(units));
+	}
 
 	for (idx = 0; idx < ARRAY_SIZE(contestants); idx++) {
-		struct contestant *c = &contestants[idx];
-		u64 start, end;
-		u64 tstart, tend;
-		u64 total = 0;
+		const struct contestant *c = &contestants[idx];
+		int bsidx;
 
 		if (c->cpu_flag != 0 && !cpu_has_feature(c->cpu_flag)) {
-			printf("%14s: no CPU support\n", c->name);
+			if (bconf.output_format == CMD_FORMAT_TEXT)
+				printf("%14s: no CPU support\n", c->name);
 			continue;
 		}
 		/* Backend not compiled in */
 		if (c->backend == 1)
 			continue;
-		printf("%14s: ", c->name);
-		fflush(stdout);
+		if (!extended) {
+			printf("%14s: ", c->name);
+			fflush(stdout);
+		}
 
 		if (c->cpu_flag) {
 			cpu_set_level(c->cpu_flag);
+			cpu_clear_feature(c->cpu_clear);
 			hash_init_accel();
 		}
-		tstart = get_time();
-		start = get_cycles(units);
-		for (iter = 0; iter < iterations; iter++) {
-			memset(buf, iter & 0xFF, blocksize);
-			memset(hash, 0, 32);
-			c->digest(buf, blocksize, hash);
+		for (bsidx = 0; bsidx < nr_blocksizes; bsidx++) {
+			int bidx;
+
+			for (bidx = 0; bidx < ARRAY_SIZE(batches); bidx++) {
+				const int batch = batches[bidx];
+				int threads;
+
+				if (batch == 0 || (batch > 1 && !c->digest_multi))
+					continue;
+
+				for (threads = 1; threads <= max_threads;
+				     threads = next_threads(threads, max_threads)) {
+					struct bench_result res;
+					int ret;
+
+					ret = run_bench(c, blocksizes[bsidx],
+							batch, threads, units,
+							&res);
+					if (ret < 0) {
+						errno = -ret;
+						error("benchmark of %s failed: %m",
+						      c->name);
+						return 1;
+					}
+					if (extended)
+						print_result(c, blocksizes[bsidx],
+							     batch, threads,
+							     units, &res, &fctx);
+					else
+						print_result_legacy(idx, units,
+								    &res);
+				}
+			}
 		}
-		end = get_cycles(units);
-		tend = get_time();
-		c->cycles = end - start;
-		c->time = tend - tstart;
 		cpu_reset_level();
-
-		if (units == UNITS_CYCLES || units == UNITS_PERF)
-			total = c->cycles;
-		if (units == UNITS_TIME)
-			total = c->time;
-
-		printf("%s: %12llu, %s/i %8llu",
-				units_to_str(units), total,
-				units_to_str(units), total / iterations);
-		if (idx > 0) {
-			float t;
-			float mb;
-
-			t = (float)c->time / 1000 / 1000 / 1000;
-			mb = blocksize * iterations / 1024 / 1024;
-			printf(", %12.3f MiB/s", mb / t);
-		}
-		putchar('\n');
+		hash_init_accel();
+	}
+	if (bconf.output_format == CMD_FORMAT_JSON) {
+		fmt_print_end_group(&fctx, "results");
+		fmt_end(&fctx);
 	}
 	perf_finish();
 
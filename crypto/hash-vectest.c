@@ -35,9 +35,46 @@ struct hash_testspec {
 	size_t count;
 	unsigned long cpu_flag;
 	int (*hash)(const u8 *buf, size_t length, u8 *out);
+	int (*hash_multi)(const u8 **bufs, int nr, size_t length, u8 **outs);
 	int backend;
 };
 
+/* Enough to fill all lanes of the multi-buffer implementations and more */
+#define MULTI_BUFFERS		(11)
+/* Longest buffer of the multi-buffer tests, besides the test vectors */
+#define MULTI_MAX_LENGTH	(4096)
+
+#if CRYPTOPROVIDER_BUILTIN == 1 && HAVE_CFLAG_mavx2 == 1
+/*
+ * Call the AVX2 multi-buffer implementations directly, hash_*_multi() may
+ * pick the single buffer variant depending on the CPU
+ */
+static int sha256_mb_avx2_multi(const u8 **bufs, int nr, size_t length,
+				u8 **outs)
+{
+	int i = 0;
+
+	for (; i + SHA256_MB_AVX2_LANES <= nr; i += SHA256_MB_AVX2_LANES)
+		sha256_mb_avx2(bufs + i, length, outs + i);
+	for (; i < nr; i++)
+		hash_sha256(bufs[i], length, outs[i]);
+	return 0;
+}
+
+static int blake2b_mb_avx2_multi(const u8 **bufs, int nr, size_t length,
+				 u8 **outs)
+{
+	int i = 0;
+
+	for (; i + BLAKE2B_MB_AVX2_LANES <= nr; i += BLAKE2B_MB_AVX2_LANES)
+		blake2b_mb_avx2(bufs + i, length, outs + i,
+				CRYPTO_HASH_SIZE_MAX);
+	for (; i < nr; i++)
+		hash_blake2b(bufs[i], length, outs[i]);
+	return 0;
+}
+#endif
+
 static const struct hash_testvec crc32c_tv[] = {
 	{
 		.psize = 0,
@@ -437,27 +474,31 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(crc32c_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_crc32c,
+		.hash_multi = hash_crc32c_multi,
 	}, {
 		.name = "CRC32C-NI",
 		.digest_size = 4,
 		.testvec = crc32c_tv,
 		.count = ARRAY_SIZE(crc32c_tv),
 		.cpu_flag = CPU_FLAG_SSE42,
-		.hash = hash_crc32c
+		.hash = hash_crc32c,
+		.hash_multi = hash_crc32c_multi
 	}, {
 		.name = "XXHASH",
 		.digest_size = 8,
 		.testvec = xxhash64_tv,
 		.count = ARRAY_SIZE(xxhash64_tv),
 		.cpu_flag = CPU_FLAG_NONE,
-		.hash = hash_xxhash
+		.hash = hash_xxhash,
+		.hash_multi = hash_xxhash_multi
 	}, {
 		.name = "SHA256-ref",
 		.digest_size = 32,
 		.testvec = sha256_tv,
 		.count = ARRAY_SIZE(sha256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
-		.hash = hash_sha256
+		.hash = hash_sha256,
+		.hash_multi = hash_sha256_multi
 	}, {
 		.name = "SHA256-gcrypt",
 		.digest_size = 32,
@@ -465,6 +506,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(sha256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_sha256,
+		.hash_multi = hash_sha256_multi,
 		.backend = CRYPTOPROVIDER_LIBGCRYPT + 1
 	}, {
 		.name = "SHA256-sodium",
@@ -473,6 +515,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(sha256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_sha256,
+		.hash_multi = hash_sha256_multi,
 		.backend = CRYPTOPROVIDER_LIBSODIUM + 1
 	}, {
 		.name = "SHA256-kcapi",
@@ -481,6 +524,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(sha256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_sha256,
+		.hash_multi = hash_sha256_multi,
 		.backend = CRYPTOPROVIDER_LIBKCAPI + 1
 	}, {
 		.name = "SHA256-NI",
@@ -489,6 +533,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(sha256_tv),
 		.cpu_flag = CPU_FLAG_SHA,
 		.hash = hash_sha256,
+		.hash_multi = hash_sha256_multi,
 		.backend = CRYPTOPROVIDER_BUILTIN + 1
 	}, {
 		.name = "BLAKE2-ref",
@@ -497,6 +542,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_blake2b,
+		.hash_multi = hash_blake2b_multi,
 		.backend = CRYPTOPROVIDER_BUILTIN + 1
 	}, {
 		.name = "BLAKE2-gcrypt",
@@ -505,6 +551,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_blake2b,
+		.hash_multi = hash_blake2b_multi,
 		.backend = CRYPTOPROVIDER_LIBGCRYPT + 1
 	}, {
 		.name = "BLAKE2-sodium",
@@ -513,6 +560,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_blake2b,
+		.hash_multi = hash_blake2b_multi,
 		.backend = CRYPTOPROVIDER_LIBSODIUM + 1
 	}, {
 		.name = "BLAKE2-kcapi",
@@ -521,6 +569,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_blake2b,
+		.hash_multi = hash_blake2b_multi,
 		.backend = CRYPTOPROVIDER_LIBKCAPI + 1
 	}, {
 		.name = "BLAKE2-SSE2",
@@ -529,6 +578,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_SSE2,
 		.hash = hash_blake2b,
+		.hash_multi = hash_blake2b_multi,
 		.backend = CRYPTOPROVIDER_BUILTIN + 1
 	}, {
 		.name = "BLAKE2-SSE41",
@@ -537,6 +587,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_SSE41,
 		.hash = hash_blake2b,
+		.hash_multi = hash_blake2b_multi,
 		.backend = CRYPTOPROVIDER_BUILTIN + 1
 	}, {
 		.name = "BLAKE2-AVX2",
@@ -545,14 +596,131 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_AVX2,
 		.hash = hash_blake2b,
+		.hash_multi = hash_blake2b_multi,
+		.backend = CRYPTOPROVIDER_BUILTIN + 1
+#if CRYPTOPROVIDER_BUILTIN == 1 && HAVE_CFLAG_mavx2 == 1
+	}, {
+		.name = "SHA256-MB-AVX2",
+		.digest_size = 32,
+		.testvec = sha256_tv,
+		.count = ARRAY_SIZE(sha256_tv),
+		.cpu_flag = CPU_FLAG_AVX2,
+		.hash = hash_sha256,
+		.hash_multi = sha256_mb_avx2_multi,
+		.backend = CRYPTOPROVIDER_BUILTIN + 1
+	}, {
+		.name = "BLAKE2-MB-AVX2",
+		.digest_size = 32,
+		.testvec = blake2b_256_tv,
+		.count = ARRAY_SIZE(blake2b_256_tv),
+		.cpu_flag = CPU_FLAG_AVX2,
+		.hash = hash_blake2b,
+		.hash_multi = blake2b_mb_avx2_multi,
 		.backend = CRYPTOPROVIDER_BUILTIN + 1
+#endif
+	}
+};
+
+/* Fill the buffer of each lane with different data */
+static void fill_lanes(u8 data[MULTI_BUFFERS][MULTI_MAX_LENGTH], size_t length)
+{
+	int i;
+	size_t j;
+
+	for (i = 0; i < MULTI_BUFFERS; i++)
+		for (j = 0; j < length; j++)
+			data[i][j] = (j * 31 + i * 97 + (j >> 8) * 7 + 1) & 0xff;
+}
+
+/*
+ * Hash the buffers at once, where lane @vec_lane holds @vec, and compare
+ * each digest with the vector or the single buffer hash. Return 1 if any
+ * digest mismatches.
+ */
+static int test_hash_lanes(const struct hash_testspec *spec,
+			   const struct hash_testvec *vec, int vec_lane,
+			   size_t length)
+{
+	static u8 data[MULTI_BUFFERS][MULTI_MAX_LENGTH];
+	u8 csums[MULTI_BUFFERS][CRYPTO_HASH_SIZE_MAX];
+	u8 want[CRYPTO_HASH_SIZE_MAX];
+	const u8 *bufs[MULTI_BUFFERS];
+	u8 *outs[MULTI_BUFFERS];
+	int ret;
+	int i;
+
+	fill_lanes(data, length);
+	for (i = 0; i < MULTI_BUFFERS; i++) {
+		bufs[i] = data[i];
+		outs[i] = csums[i];
 	}
+	if (vec)
+		bufs[vec_lane] = (const u8 *)vec->plaintext;
+
+	ret = spec->hash_multi(bufs, MULTI_BUFFERS, length, outs);
+	if (ret < 0)
+		return ret;
+	for (i = 0; i < MULTI_BUFFERS; i++) {
+		if (vec && i == vec_lane) {
+			memcpy(want, vec->digest, spec->digest_size);
+		} else {
+			ret = spec->hash(bufs[i], length, want);
+			if (ret < 0)
+				return ret;
+		}
+		if (memcmp(csums[i], want, spec->digest_size) != 0) {
+			printf("%s length %zu lane %d: MISMATCH\n", spec->name,
+			       length, i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Hash the vector in each lane in turn, the other lanes get different data
+ * of the same length, as all buffers of a batch have the same length
+ */
+static int test_hash_multi(const struct hash_testspec *spec,
+			   const struct hash_testvec *vec)
+{
+	int ret;
+	int i;
+
+	if (vec->psize > MULTI_MAX_LENGTH)
+		return -EINVAL;
+	for (i = 0; i < MULTI_BUFFERS; i++) {
+		ret = test_hash_lanes(spec, vec, i, vec->psize);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Lengths around the block sizes and padding boundaries of the hashes */
+static const size_t multi_lengths[] = {
+	0, 1, 3, 55, 56, 63, 64, 65, 111, 112, 127, 128, 129, 1000, 4095, 4096
 };
 
+/* Hash different data in each lane, for a range of lengths */
+static int test_hash_multi_lengths(const struct hash_testspec *spec)
+{
+	int ret;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(multi_lengths); i++) {
+		ret = test_hash_lanes(spec, NULL, 0, multi_lengths[i]);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
 static int test_hash(const struct hash_testspec *spec)
 {
 	int i;
 	bool header = false;
+	bool failed = false;
 
 	for (i = 0; i < spec->count; i++) {
 		int ret;
@@ -577,11 +745,24 @@ static int test_hash(const struct hash_testspec *spec)
 			hash_init_accel();
 		}
 		ret = spec->hash((const u8 *)vec->plaintext, vec->psize, csum);
-		cpu_reset_level();
 		if (ret < 0) {
+			cpu_reset_level();
 			error("hash %s = %d", spec->name, ret);
 			return 1;
 		}
+		if (spec->hash_multi) {
+			ret = test_hash_multi(spec, vec);
+			if (ret < 0) {
+				cpu_reset_level();
+				error("hash %s multi = %d", spec->name, ret);
+				return 1;
+			}
+			printf("%s vector %d multi: %s\n", spec->name, i,
+			       ret ? "MISMATCH" : "match");
+			if (ret)
+				failed = true;
+		}
+		cpu_reset_level();
 		if (memcmp(csum, vec->digest, spec->digest_size) == 0) {
 			printf("%s vector %d: match\n", spec->name, i);
 		} else {
@@ -596,13 +777,34 @@ static int test_hash(const struct hash_testspec *spec)
 			for (j = 0; j < spec->digest_size; j++)
 				printf(" %02hhx", csum[j]);
 			putchar('\n');
+			failed = true;
 		}
 	}
 
-	return 0;
+	if (header && spec->hash_multi) {
+		int ret;
+
+		if (spec->cpu_flag) {
+			cpu_set_level(spec->cpu_flag);
+			hash_init_accel();
+		}
+		ret = test_hash_multi_lengths(spec);
+		cpu_reset_level();
+		if (ret < 0) {
+			error("hash %s multi = %d", spec->name, ret);
+			return 1;
+		}
+		printf("%s lengths multi: %s\n", spec->name,
+		       ret ? "MISMATCH" : "match");
+		if (ret)
+			failed = true;
+	}
+
+	return failed;
 }
 
 int main(int argc, char **argv) {
+	int ret = 0;
 	int i;
 
 	cpu_detect_flags();
@@ -611,7 +813,7 @@ int main(int argc, char **argv) {
 
 	printf("Implementation: %s\n", CRYPTOPROVIDER);
 	for (i = 0; i < ARRAY_SIZE(test_spec); i++)
-		test_hash(&test_spec[i]);
+		ret |= test_hash(&test_spec[i]);
 
-	return 0;
+	return ret;
 }
@@ -26,6 +26,15 @@ int hash_xxhash(const u8 *buf, size_t length, u8 *out);
 int hash_sha256(const u8 *buf, size_t length, u8 *out);
 int hash_blake2b(const u8 *buf, size_t length, u8 *out);
 
+/*
+ * Hash @nr buffers of the same @length at once, digest of @bufs[i] is stored
+ * to @outs[i]
+ */
+int hash_crc32c_multi(const u8 **bufs, int nr, size_t length, u8 **outs);
+int hash_xxhash_multi(const u8 **bufs, int nr, size_t length, u8 **outs);
+int hash_sha256_multi(const u8 **bufs, int nr, size_t length, u8 **outs);
+int hash_blake2b_multi(const u8 **bufs, int nr, size_t length, u8 **outs);
+
 void hash_init_accel(void);
 void hash_init_crc32c(void);
 
@@ -71,6 +71,7 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 /*
  * If you do not have the ISO standard stdint.h header file, then you
  * must typedef the following:
@@ -214,4 +215,9 @@ void sha256_init_accel(void);
 /* Export for optimized version to silent -Wmissing-prototypes. */
 void sha256_process_x86(uint32_t state[8], const uint8_t data[], uint32_t length);
 
+/* Multi-buffer version, hashes SHA256_MB_AVX2_LANES buffers at once */
+#define SHA256_MB_AVX2_LANES	8
+void sha256_mb_avx2(const uint8_t *data[SHA256_MB_AVX2_LANES], size_t length,
+		    uint8_t *digest[SHA256_MB_AVX2_LANES]);
+
 #endif /* _SHA_H_ */
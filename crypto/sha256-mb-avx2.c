@@ -0,0 +1,209 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Multi-buffer SHA-256 using AVX2, 8 independent messages of the same length
+ * are hashed at once, one message per 32bit lane.
+ */
+
+#ifdef __AVX2__
+
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+#include "sha.h"
+
+#define LANES		(SHA256_MB_AVX2_LANES)
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t H0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#define ROTR(x, n)	_mm256_or_si256(_mm256_srli_epi32((x), (n)), \
+					_mm256_slli_epi32((x), 32 - (n)))
+#define ADD(a, b)	_mm256_add_epi32((a), (b))
+#define XOR(a, b)	_mm256_xor_si256((a), (b))
+#define AND(a, b)	_mm256_and_si256((a), (b))
+#define ANDNOT(a, b)	_mm256_andnot_si256((a), (b))
+
+#define BSIG0(x)	XOR(XOR(ROTR((x), 2), ROTR((x), 13)), ROTR((x), 22))
+#define BSIG1(x)	XOR(XOR(ROTR((x), 6), ROTR((x), 11)), ROTR((x), 25))
+#define SSIG0(x)	XOR(XOR(ROTR((x), 7), ROTR((x), 18)), \
+			    _mm256_srli_epi32((x), 3))
+#define SSIG1(x)	XOR(XOR(ROTR((x), 17), ROTR((x), 19)), \
+			    _mm256_srli_epi32((x), 10))
+#define CH(e, f, g)	XOR(AND((e), (f)), ANDNOT((e), (g)))
+#define MAJ(a, b, c)	XOR(XOR(AND((a), (b)), AND((a), (c))), AND((b), (c)))
+
+/*
+ * Load 8 consecutive words from each lane and transpose them, so that w[i]
+ * holds word i of all the lanes, converted from big endian.
+ */
+static inline void load_transpose(__m256i w[8], const uint8_t *p[LANES],
+				  size_t offset)
+{
+	const __m256i bswap = _mm256_set_epi8(
+			12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+			12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i r[8], t[8], u[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		r[i] = _mm256_loadu_si256((const __m256i *)(p[i] + offset));
+
+	for (i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (i = 0; i < 4; i++) {
+		w[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		w[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+	for (i = 0; i < 8; i++)
+		w[i] = _mm256_shuffle_epi8(w[i], bswap);
+}
+
+static void sha256_mb_block(__m256i state[8], const uint8_t *p[LANES],
+			    size_t offset)
+{
+	__m256i w[16];
+	__m256i a, b, c, d, e, f, g, h;
+	__m256i t1, t2;
+	int i;
+
+	load_transpose(&w[0], p, offset);
+	load_transpose(&w[8], p, offset + 32);
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+
+	for (i = 0; i < 64; i++) {
+		__m256i wi;
+
+		if (i < 16) {
+			wi = w[i];
+		} else {
+			wi = ADD(ADD(SSIG1(w[(i - 2) & 15]), w[(i - 7) & 15]),
+				 ADD(SSIG0(w[(i - 15) & 15]), w[i & 15]));
+			w[i & 15] = wi;
+		}
+		t1 = ADD(ADD(ADD(h, BSIG1(e)), ADD(CH(e, f, g),
+			 _mm256_set1_epi32(K[i]))), wi);
+		t2 = ADD(BSIG0(a), MAJ(a, b, c));
+		h = g;
+		g = f;
+		f = e;
+		e = ADD(d, t1);
+		d = c;
+		c = b;
+		b = a;
+		a = ADD(t1, t2);
+	}
+
+	state[0] = ADD(state[0], a);
+	state[1] = ADD(state[1], b);
+	state[2] = ADD(state[2], c);
+	state[3] = ADD(state[3], d);
+	state[4] = ADD(state[4], e);
+	state[5] = ADD(state[5], f);
+	state[6] = ADD(state[6], g);
+	state[7] = ADD(state[7], h);
+}
+
+/*
+ * Hash @length bytes of each of the 8 buffers in @data, the digests are
+ * stored to @digest.
+ */
+void sha256_mb_avx2(const uint8_t *data[SHA256_MB_AVX2_LANES], size_t length,
+		    uint8_t *digest[SHA256_MB_AVX2_LANES])
+{
+	uint8_t tail[LANES][2 * SHA256_Message_Block_Size];
+	const uint8_t *p[LANES];
+	uint32_t out[8][LANES];
+	__m256i state[8];
+	size_t full = length & ~(size_t)(SHA256_Message_Block_Size - 1);
+	size_t rest = length - full;
+	size_t tail_len;
+	uint64_t bits = (uint64_t)length * 8;
+	size_t offset;
+	int lane;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		state[i] = _mm256_set1_epi32(H0[i]);
+
+	for (offset = 0; offset < full; offset += SHA256_Message_Block_Size)
+		sha256_mb_block(state, data, offset);
+
+	/* Padding, 0x80 then zeros and the message length in bits */
+	tail_len = (rest + 1 + 8 <= SHA256_Message_Block_Size) ?
+		   SHA256_Message_Block_Size : 2 * SHA256_Message_Block_Size;
+	for (lane = 0; lane < LANES; lane++) {
+		memset(tail[lane], 0, tail_len);
+		memcpy(tail[lane], data[lane] + full, rest);
+		tail[lane][rest] = 0x80;
+		for (i = 0; i < 8; i++)
+			tail[lane][tail_len - 1 - i] = (uint8_t)(bits >> (8 * i));
+		p[lane] = tail[lane];
+	}
+	for (offset = 0; offset < tail_len; offset += SHA256_Message_Block_Size)
+		sha256_mb_block(state, p, offset);
+
+	for (i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i *)out[i], state[i]);
+	for (lane = 0; lane < LANES; lane++) {
+		for (i = 0; i < 8; i++) {
+			digest[lane][4 * i] = out[i][lane] >> 24;
+			digest[lane][4 * i + 1] = out[i][lane] >> 16;
+			digest[lane][4 * i + 2] = out[i][lane] >> 8;
+			digest[lane][4 * i + 3] = out[i][lane];
+		}
+	}
+}
+
+#endif
@@ -3,6 +3,14 @@
 #include <stddef.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
+#include <zlib.h>
+#if COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
+#if COMPRESSION_LZ4
+#include <lz4.h>
+#endif
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/disk-io.h"
 #include "crypto/crc32c.h"
@@ -34,12 +42,22 @@ const struct dump_version dump_versions[] = {
 
 const struct dump_version *current_version = &dump_versions[0];
 
+const struct dump_version *find_dump_version(u64 magic)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(dump_versions); i++) {
+		if (magic == dump_versions[i].magic_cpu)
+			return &dump_versions[i];
+	}
+	return NULL;
+}
+
 int detect_version(FILE *in)
 {
 	struct meta_cluster *cluster;
+	const struct dump_version *version;
 	u8 buf[IMAGE_BLOCK_SIZE];
-	bool found = false;
-	int i;
 	int ret;
 
 	if (fseek(in, 0, SEEK_SET) < 0) {
@@ -54,19 +72,12 @@ int detect_version(FILE *in)
 
 	fseek(in, 0, SEEK_SET);
 	cluster = (struct meta_cluster *)buf;
-	for (i = 0; i < ARRAY_SIZE(dump_versions); i++) {
-		if (le64_to_cpu(cluster->header.magic) ==
-		    dump_versions[i].magic_cpu) {
-			found = true;
-			current_version = &dump_versions[i];
-			break;
-		}
-	}
-
-	if (!found) {
+	version = find_dump_version(le64_to_cpu(cluster->header.magic));
+	if (!version) {
 		error("unrecognized header format");
 		return -EINVAL;
 	}
+	current_version = version;
 	return 0;
 }
 
@@ -208,3 +219,156 @@ out:
 		close(fp);
 	return ret;
 }
+
+bool compress_method_supported(int method)
+{
+	switch (method) {
+	case COMPRESS_NONE:
+	case COMPRESS_ZLIB:
+		return true;
+	case COMPRESS_ZSTD:
+		return COMPRESSION_ZSTD;
+	case COMPRESS_LZ4:
+		return COMPRESSION_LZ4;
+	}
+	return false;
+}
+
+const char *compress_method_name(int method)
+{
+	switch (method) {
+	case COMPRESS_NONE:
+		return "none";
+	case COMPRESS_ZLIB:
+		return "zlib";
+	case COMPRESS_ZSTD:
+		return "zstd";
+	case COMPRESS_LZ4:
+		return "lz4";
+	}
+	return "unknown";
+}
+
+/*
+ * Decompress a whole item at once, to be used for the items of known small
+ * size like the super block or tree blocks.
+ *
+ * @out_len:	size of @out, set to the decompressed length on success
+ */
+int decompress_item(int method, const u8 *in, size_t in_len, u8 *out,
+		    size_t *out_len)
+{
+	int ret;
+
+	switch (method) {
+	case COMPRESS_ZLIB: {
+		unsigned long len = *out_len;
+
+		ret = uncompress(out, &len, in, in_len);
+		if (ret != Z_OK) {
+			error("decompression failed with %d", ret);
+			return -EIO;
+		}
+		*out_len = len;
+		return 0;
+	}
+#if COMPRESSION_ZSTD
+	case COMPRESS_ZSTD: {
+		size_t len;
+
+		len = ZSTD_decompress(out, *out_len, in, in_len);
+		if (ZSTD_isError(len)) {
+			error("zstd decompression failed: %s",
+			      ZSTD_getErrorName(len));
+			return -EIO;
+		}
+		*out_len = len;
+		return 0;
+	}
+#endif
+#if COMPRESSION_LZ4
+	case COMPRESS_LZ4: {
+		u32 len;
+
+		if (in_len < sizeof(__le32))
+			return -EUCLEAN;
+		len = get_unaligned_le32(in);
+		if (len > *out_len || len > INT_MAX || in_len - 4 > INT_MAX)
+			return -EUCLEAN;
+		ret = LZ4_decompress_safe((const char *)in + sizeof(__le32),
+					  (char *)out, in_len - sizeof(__le32),
+					  len);
+		if (ret != len) {
+			error("lz4 decompression failed with %d", ret);
+			return -EIO;
+		}
+		*out_len = len;
+		return 0;
+	}
+#endif
+	}
+	error("unsupported compression method %d", method);
+	return -EOPNOTSUPP;
+}
+
+/*
+ * Read the cluster index from the end of the image.
+ *
+ * Return 0 and the entries in @index_ret (to be freed by the caller),
+ * -ENOENT if the image has no index, or other negative errno.
+ */
+int read_cluster_index(int fd, struct meta_index_entry **index_ret,
+		       u64 *nr_ret)
+{
+	u8 buf[IMAGE_BLOCK_SIZE];
+	struct meta_index_trailer *trailer = (struct meta_index_trailer *)buf;
+	struct meta_cluster_header *header = (struct meta_cluster_header *)buf;
+	struct meta_index_entry *index;
+	struct stat st;
+	u64 offset;
+	u64 nr;
+	size_t size;
+	ssize_t ret;
+
+	if (fstat(fd, &st) < 0)
+		return -errno;
+	if (!S_ISREG(st.st_mode) || st.st_size < 2 * IMAGE_BLOCK_SIZE)
+		return -ENOENT;
+
+	ret = pread(fd, buf, IMAGE_BLOCK_SIZE, st.st_size - IMAGE_BLOCK_SIZE);
+	if (ret != IMAGE_BLOCK_SIZE)
+		return ret < 0 ? -errno : -EIO;
+	if (le64_to_cpu(trailer->magic) != META_INDEX_MAGIC)
+		return -ENOENT;
+	offset = le64_to_cpu(trailer->offset);
+	nr = le64_to_cpu(trailer->nr_entries);
+	if (offset & IMAGE_BLOCK_MASK ||
+	    nr > (st.st_size - offset) / sizeof(*index) ||
+	    offset + IMAGE_BLOCK_SIZE + nr * sizeof(*index) >
+	    st.st_size - IMAGE_BLOCK_SIZE) {
+		error("invalid cluster index at %llu", offset);
+		return -EUCLEAN;
+	}
+
+	ret = pread(fd, buf, IMAGE_BLOCK_SIZE, offset);
+	if (ret != IMAGE_BLOCK_SIZE)
+		return ret < 0 ? -errno : -EIO;
+	if (le64_to_cpu(header->magic) != META_INDEX_MAGIC ||
+	    le32_to_cpu(header->nritems) != nr) {
+		error("invalid cluster index header at %llu", offset);
+		return -EUCLEAN;
+	}
+
+	size = nr * sizeof(*index);
+	index = malloc(size ?: 1);
+	if (!index)
+		return -ENOMEM;
+	ret = pread(fd, index, size, offset + IMAGE_BLOCK_SIZE);
+	if (ret != size) {
+		free(index);
+		return ret < 0 ? -errno : -EIO;
+	}
+	*index_ret = index;
+	*nr_ret = nr;
+	return 0;
+}
@@ -19,11 +19,22 @@
 
 #include "kerncompat.h"
 #include <stdio.h>
+#include <stdbool.h>
+
+struct dump_version;
+struct meta_index_entry;
 
 void csum_block(u8 *buf, size_t len);
+const struct dump_version *find_dump_version(u64 magic);
 int detect_version(FILE *in);
 int update_disk_super_on_device(struct btrfs_fs_info *info,
 				const char *other_dev, u64 cur_devid);
 void write_backup_supers(int fd, u8 *buf);
+bool compress_method_supported(int method);
+const char *compress_method_name(int method);
+int decompress_item(int method, const u8 *in, size_t in_len, u8 *out,
+		    size_t *out_len);
+int read_cluster_index(int fd, struct meta_index_entry **index_ret,
+		       u64 *nr_ret);
 
 #endif
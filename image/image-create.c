@@ -17,6 +17,13 @@
 #include "kerncompat.h"
 #include <pthread.h>
 #include <zlib.h>
+#if COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
+#if COMPRESSION_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/file-item.h"
 #include "kernel-shared/disk-io.h"
@@ -24,15 +31,144 @@
 #include "crypto/crc32c.h"
 #include "common/internal.h"
 #include "common/messages.h"
+#include "common/tree-reada.h"
 #include "image/metadump.h"
 #include "image/common.h"
 
+/*
+ * Per thread compression state, zstd is faster with the context reused for
+ * all items.
+ */
+struct compress_ctx {
+#if COMPRESSION_ZSTD
+	ZSTD_CCtx *zstd;
+#endif
+};
+
+static int compress_ctx_init(struct metadump_struct *md,
+			     struct compress_ctx *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+#if COMPRESSION_ZSTD
+	if (md->compress_method == COMPRESS_ZSTD) {
+		ctx->zstd = ZSTD_createCCtx();
+		if (!ctx->zstd)
+			return -ENOMEM;
+		ZSTD_CCtx_setParameter(ctx->zstd, ZSTD_c_compressionLevel,
+				       md->compress_level);
+		if (md->compress_long)
+			ZSTD_CCtx_setParameter(ctx->zstd,
+					ZSTD_c_enableLongDistanceMatching, 1);
+	}
+#endif
+	return 0;
+}
+
+static void compress_ctx_release(struct compress_ctx *ctx)
+{
+#if COMPRESSION_ZSTD
+	ZSTD_freeCCtx(ctx->zstd);
+#endif
+}
+
+/* Replace the item buffer by the compressed data */
+static int compress_item(struct metadump_struct *md, struct compress_ctx *ctx,
+			 struct async_work *async)
+{
+	u8 *orig = async->buffer;
+	size_t bound;
+	int ret = 0;
+
+	switch (md->compress_method) {
+#if COMPRESSION_ZSTD
+	case COMPRESS_ZSTD:
+		bound = ZSTD_compressBound(async->size);
+		break;
+#endif
+#if COMPRESSION_LZ4
+	case COMPRESS_LZ4:
+		bound = sizeof(__le32) + LZ4_compressBound(async->size);
+		break;
+#endif
+	default:
+		bound = compressBound(async->size);
+		break;
+	}
+
+	async->buffer = malloc(bound);
+	if (!async->buffer) {
+		async->buffer = orig;
+		return -ENOMEM;
+	}
+
+	switch (md->compress_method) {
+#if COMPRESSION_ZSTD
+	case COMPRESS_ZSTD: {
+		size_t len;
+
+		len = ZSTD_compress2(ctx->zstd, async->buffer, bound, orig,
+				     async->size);
+		if (ZSTD_isError(len))
+			ret = -EIO;
+		else
+			async->bufsize = len;
+		break;
+	}
+#endif
+#if COMPRESSION_LZ4
+	case COMPRESS_LZ4: {
+		char *dst = (char *)async->buffer + sizeof(__le32);
+		const int dst_len = bound - sizeof(__le32);
+		int len;
+
+		put_unaligned_le32(async->size, async->buffer);
+		if (md->compress_level > 1)
+			len = LZ4_compress_HC((const char *)orig, dst,
+					      async->size, dst_len,
+					      md->compress_level);
+		else
+			len = LZ4_compress_default((const char *)orig, dst,
+						   async->size, dst_len);
+		if (len <= 0)
+			ret = -EIO;
+		else
+			async->bufsize = sizeof(__le32) + len;
+		break;
+	}
+#endif
+	default: {
+		unsigned long len = bound;
+
+		if (compress2(async->buffer, &len, orig, async->size,
+			      md->compress_level) != Z_OK)
+			ret = -EIO;
+		else
+			async->bufsize = len;
+		break;
+	}
+	}
+
+	free(orig);
+	return ret;
+}
+
 static void *dump_worker(void *data)
 {
 	struct metadump_struct *md = (struct metadump_struct *)data;
+	struct compress_ctx ctx;
 	struct async_work *async;
 	int ret;
 
+	ret = compress_ctx_init(md, &ctx);
+	if (ret < 0) {
+		error_msg(ERROR_MSG_MEMORY, "compression context");
+		pthread_mutex_lock(&md->mutex);
+		if (!md->error)
+			md->error = ret;
+		pthread_mutex_unlock(&md->mutex);
+		pthread_exit(NULL);
+	}
+
 	while (1) {
 		pthread_mutex_lock(&md->mutex);
 		while (list_empty(&md->list)) {
@@ -47,27 +183,18 @@ static void *dump_worker(void *data)
 		pthread_mutex_unlock(&md->mutex);
 
 		if (md->compress_level > 0) {
-			u8 *orig = async->buffer;
-
-			async->bufsize = compressBound(async->size);
-			async->buffer = malloc(async->bufsize);
-			if (!async->buffer) {
-				error_msg(ERROR_MSG_MEMORY, "async buffer");
+			ret = compress_item(md, &ctx, async);
+			if (ret < 0) {
+				errno = -ret;
+				error("failed to compress item at %llu: %m",
+				      async->start);
 				pthread_mutex_lock(&md->mutex);
 				if (!md->error)
-					md->error = -ENOMEM;
+					md->error = ret;
 				pthread_mutex_unlock(&md->mutex);
+				compress_ctx_release(&ctx);
 				pthread_exit(NULL);
 			}
-
-			ret = compress2(async->buffer,
-					 (unsigned long *)&async->bufsize,
-					 orig, async->size, md->compress_level);
-
-			if (ret != Z_OK)
-				async->error = 1;
-
-			free(orig);
 		}
 
 		pthread_mutex_lock(&md->mutex);
@@ -75,6 +202,7 @@ static void *dump_worker(void *data)
 		pthread_mutex_unlock(&md->mutex);
 	}
 out:
+	compress_ctx_release(&ctx);
 	pthread_exit(NULL);
 }
 
@@ -89,7 +217,7 @@ static void meta_cluster_init(struct metadump_struct *md, u64 start)
 	header->bytenr = cpu_to_le64(start);
 	header->nritems = cpu_to_le32(0);
 	header->compress = md->compress_level > 0 ?
-			   COMPRESS_ZLIB : COMPRESS_NONE;
+			   md->compress_method : COMPRESS_NONE;
 }
 
 static void metadump_destroy(struct metadump_struct *md, int num_threads)
@@ -118,11 +246,13 @@ static void metadump_destroy(struct metadump_struct *md, int num_threads)
 		free(name);
 	}
 	extent_io_tree_release(&md->seen);
+	free(md->index);
 }
 
 static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
-			 FILE *out, int num_threads, int compress_level,
-			 bool dump_data, enum sanitize_mode sanitize_names)
+			 FILE *out, int num_threads, int compress_method,
+			 int compress_level, bool dump_data,
+			 enum sanitize_mode sanitize_names, bool write_index)
 {
 	int i, ret = 0;
 
@@ -137,8 +267,11 @@ static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
 	md->root = root;
 	md->out = out;
 	md->pending_start = (u64)-1;
+	md->compress_method = compress_method;
 	md->compress_level = compress_level;
+	md->compress_long = dump_data;
 	md->sanitize_names = sanitize_names;
+	md->write_index = write_index;
 	md->name_tree.rb_node = NULL;
 	md->num_threads = num_threads;
 	pthread_cond_init(&md->cond, NULL);
@@ -209,12 +342,36 @@ static int write_zero(FILE *out, size_t size)
 	return fwrite(zero, size, 1, out);
 }
 
+static int add_index_entry(struct metadump_struct *md, u64 offset, u64 start,
+			   u64 end)
+{
+	struct meta_index_entry *entry;
+
+	if (md->index_nr == md->index_alloc) {
+		u64 alloc = max_t(u64, md->index_alloc * 2, 1024);
+		struct meta_index_entry *tmp;
+
+		tmp = realloc(md->index, alloc * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		md->index = tmp;
+		md->index_alloc = alloc;
+	}
+	entry = &md->index[md->index_nr++];
+	entry->offset = cpu_to_le64(offset);
+	entry->start = cpu_to_le64(start);
+	entry->end = cpu_to_le64(end);
+	return 0;
+}
+
 static int write_buffers(struct metadump_struct *md, u64 *next)
 {
 	struct meta_cluster_header *header = &md->cluster.header;
 	struct meta_cluster_item *item;
 	struct async_work *async;
-	u64 bytenr = 0;
+	u64 bytenr = le64_to_cpu(header->bytenr);
+	u64 start = (u64)-1;
+	u64 end = 0;
 	u32 nritems = 0;
 	int ret;
 	int err = 0;
@@ -246,9 +403,19 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 		item->bytenr = cpu_to_le64(async->start);
 		item->size = cpu_to_le32(async->bufsize);
 		nritems++;
+		start = min(start, async->start);
+		end = max(end, async->start + async->size);
 	}
 	header->nritems = cpu_to_le32(nritems);
 
+	if (md->write_index) {
+		ret = add_index_entry(md, bytenr, start, end);
+		if (ret < 0) {
+			error_msg(ERROR_MSG_MEMORY, "cluster index");
+			return ret;
+		}
+	}
+
 	ret = fwrite(&md->cluster, IMAGE_BLOCK_SIZE, 1, md->out);
 	if (ret != 1) {
 		error("unable to write out cluster: %m");
@@ -256,7 +423,7 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 	}
 
 	/* write buffers */
-	bytenr += le64_to_cpu(header->bytenr) + IMAGE_BLOCK_SIZE;
+	bytenr += IMAGE_BLOCK_SIZE;
 	while (!list_empty(&md->ordered)) {
 		async = list_entry(md->ordered.next, struct async_work,
 				   ordered);
@@ -497,7 +664,8 @@ static int add_extent(u64 start, u64 size, struct metadump_struct *md,
 			return ret;
 		md->pending_start = start;
 	}
-	readahead_tree_block(md->root->fs_info, start, 0);
+	if (!data)
+		readahead_tree_block(md->root->fs_info, start, 0);
 	md->pending_size += size;
 	md->data = data;
 	return 0;
@@ -538,6 +706,8 @@ static int copy_tree_blocks(struct btrfs_root *root, struct extent_buffer *eb,
 
 	level = btrfs_header_level(eb);
 	nritems = btrfs_header_nritems(eb);
+	if (level > 0)
+		btrfs_readahead_node_children(eb);
 	for (i = 0; i < nritems; i++) {
 		if (level == 0) {
 			btrfs_item_key_to_cpu(eb, &key, i);
@@ -748,9 +918,49 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 	return ret;
 }
 
+/*
+ * Write the cluster index after the last cluster: header block, entries and
+ * the trailer in the last block.
+ */
+static int write_cluster_index(struct metadump_struct *md)
+{
+	union {
+		struct meta_cluster_header header;
+		struct meta_index_trailer trailer;
+		u8 bytes[IMAGE_BLOCK_SIZE];
+	} block;
+	const u64 offset = le64_to_cpu(md->cluster.header.bytenr);
+	const size_t size = md->index_nr * sizeof(struct meta_index_entry);
+	int ret;
+
+	memset(&block, 0, sizeof(block));
+	block.header.magic = cpu_to_le64(META_INDEX_MAGIC);
+	block.header.bytenr = cpu_to_le64(offset);
+	block.header.nritems = cpu_to_le32(md->index_nr);
+	ret = fwrite(&block, IMAGE_BLOCK_SIZE, 1, md->out);
+	if (ret == 1 && size)
+		ret = fwrite(md->index, size, 1, md->out);
+	if (ret == 1 && size & IMAGE_BLOCK_MASK)
+		ret = write_zero(md->out,
+				 IMAGE_BLOCK_SIZE - (size & IMAGE_BLOCK_MASK));
+
+	memset(&block, 0, sizeof(block));
+	block.trailer.magic = cpu_to_le64(META_INDEX_MAGIC);
+	block.trailer.offset = cpu_to_le64(offset);
+	block.trailer.nr_entries = cpu_to_le64(md->index_nr);
+	if (ret == 1)
+		ret = fwrite(&block, IMAGE_BLOCK_SIZE, 1, md->out);
+	if (ret != 1) {
+		error("unable to write out cluster index: %m");
+		return -errno;
+	}
+	return 0;
+}
+
 int create_metadump(const char *input, FILE *out, int num_threads,
-		    int compress_level, enum sanitize_mode sanitize,
-		    int walk_trees, bool dump_data)
+		    int compress_method, int compress_level,
+		    enum sanitize_mode sanitize, int walk_trees, bool dump_data,
+		    bool write_index)
 {
 	struct btrfs_root *root;
 	struct btrfs_path path;
@@ -764,9 +974,12 @@ int create_metadump(const char *input, FILE *out, int num_threads,
 		error("open ctree failed");
 		return -EIO;
 	}
+	/* Optional, tree blocks are read without readahead if this fails */
+	btrfs_tree_reada_start(root->fs_info, BTRFS_TREE_READA_DEFAULT_THREADS);
 
 	ret = metadump_init(&metadump, root, out, num_threads,
-			    compress_level, dump_data, sanitize);
+			    compress_method, compress_level, dump_data, sanitize,
+			    write_index);
 	if (ret) {
 		error("failed to initialize metadump: %d", ret);
 		close_ctree(root);
@@ -819,6 +1032,11 @@ out:
 			err = ret;
 		error("failed to flush pending data: %d", ret);
 	}
+	if (!err && write_index) {
+		ret = write_cluster_index(&metadump);
+		if (ret)
+			err = ret;
+	}
 
 	metadump_destroy(&metadump, num_threads);
 
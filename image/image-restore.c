@@ -17,6 +17,9 @@
 #include "kerncompat.h"
 #include <pthread.h>
 #include <zlib.h>
+#if COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/volumes.h"
 #include "kernel-shared/transaction.h"
@@ -382,23 +385,35 @@ static void update_super_old(u8 *buffer)
 /*
  * Restore one item.
  *
- * For uncompressed data, it's just reading from work->buf then write to output.
- * For compressed data, since we can have very large decompressed data
- * (up to 256M), we need to consider memory usage. So here we will fill buffer
- * then write the decompressed buffer to output.
+ * For uncompressed data, the item buffer is fixed up and written in place.
+ * For zlib and zstd compressed data, since we can have very large decompressed
+ * data (up to 256M), we need to consider memory usage. So here we will fill
+ * buffer then write the decompressed buffer to output. LZ4 has no streaming
+ * format, the item is decompressed in one go to a buffer of the size stored
+ * in the item.
+ *
+ * Called without mdres->mutex held, the chunk mappings and the original super
+ * block are set up before any item is queued and are not changed while the
+ * workers run.
  */
 static int restore_one_work(struct mdrestore_struct *mdres,
-			    struct async_work *async, u8 *buffer, int bufsize)
+			    struct async_work *async, int compress_method,
+			    u8 *buffer, int bufsize)
 {
 	z_stream strm;
+#if COMPRESSION_ZSTD
+	ZSTD_DStream *zds = NULL;
+	ZSTD_inBuffer zin = { 0 };
+#endif
+	u8 *lz4_buffer = NULL;
 	/* Offset inside work->buffer */
 	int buf_offset = 0;
 	/* Offset for output */
 	int out_offset = 0;
 	int out_len;
+	u8 *outbuf;
 	int outfd = fileno(mdres->out);
-	int compress_method = mdres->compress_method;
-	int ret;
+	int ret = 0;
 
 	UASSERT(is_power_of_2(bufsize));
 
@@ -415,10 +430,36 @@ static int restore_one_work(struct mdrestore_struct *mdres,
 			error("failed to initialize decompress parameters: %d", ret);
 			return ret;
 		}
+#if COMPRESSION_ZSTD
+	} else if (compress_method == COMPRESS_ZSTD) {
+		zds = ZSTD_createDStream();
+		if (!zds) {
+			error_msg(ERROR_MSG_MEMORY, "zstd decompression context");
+			return -ENOMEM;
+		}
+		zin.src = async->buffer;
+		zin.size = async->bufsize;
+#endif
+	} else if (compress_method == COMPRESS_LZ4) {
+		size_t size;
+
+		if (async->bufsize < sizeof(__le32)) {
+			error("invalid lz4 item at %llu", async->start);
+			return -EUCLEAN;
+		}
+		size = get_unaligned_le32(async->buffer);
+		lz4_buffer = malloc(size ?: 1);
+		if (!lz4_buffer) {
+			error_msg(ERROR_MSG_MEMORY, "lz4 buffer");
+			return -ENOMEM;
+		}
+		ret = decompress_item(compress_method, async->buffer,
+				      async->bufsize, lz4_buffer, &size);
+		if (ret < 0)
+			goto out;
 	}
 	while (buf_offset < async->bufsize) {
 		bool compress_end = false;
-		int read_size = min_t(u64, async->bufsize - buf_offset, bufsize);
 
 		/* Read part */
 		if (compress_method == COMPRESS_ZLIB) {
@@ -426,9 +467,7 @@ static int restore_one_work(struct mdrestore_struct *mdres,
 				strm.avail_out = bufsize;
 				strm.next_out = buffer;
 			}
-			pthread_mutex_unlock(&mdres->mutex);
 			ret = inflate(&strm, Z_NO_FLUSH);
-			pthread_mutex_lock(&mdres->mutex);
 			switch (ret) {
 			case Z_NEED_DICT:
 				ret = Z_DATA_ERROR;
@@ -441,30 +480,55 @@ static int restore_one_work(struct mdrestore_struct *mdres,
 				ret = 0;
 				compress_end = true;
 			}
+			outbuf = buffer;
 			out_len = bufsize - strm.avail_out;
+#if COMPRESSION_ZSTD
+		} else if (compress_method == COMPRESS_ZSTD) {
+			ZSTD_outBuffer zout = { buffer, bufsize, 0 };
+			size_t zret;
+
+			zret = ZSTD_decompressStream(zds, &zout, &zin);
+			if (ZSTD_isError(zret)) {
+				error("zstd decompression failed: %s",
+				      ZSTD_getErrorName(zret));
+				ret = -EIO;
+				goto out;
+			}
+			if (zret == 0) {
+				compress_end = true;
+			} else if (zout.pos == 0 && zin.pos == zin.size) {
+				error("truncated zstd item at %llu",
+				      async->start);
+				ret = -EIO;
+				goto out;
+			}
+			outbuf = buffer;
+			out_len = zout.pos;
+#endif
+		} else if (compress_method == COMPRESS_LZ4) {
+			outbuf = lz4_buffer;
+			out_len = get_unaligned_le32(async->buffer);
+			buf_offset = async->bufsize;
 		} else {
-			/* No compress, read as much data as possible */
-			memcpy(buffer, async->buffer + buf_offset, read_size);
-
-			buf_offset += read_size;
-			out_len = read_size;
+			/* No compress, the whole item is processed in one go */
+			outbuf = async->buffer;
+			out_len = async->bufsize;
+			buf_offset = async->bufsize;
 		}
 
 		/* Fixup part */
 		if (!mdres->multi_devices) {
 			if (async->start == BTRFS_SUPER_INFO_OFFSET) {
-				memcpy(mdres->original_super, buffer,
-				       BTRFS_SUPER_INFO_SIZE);
 				if (mdres->old_restore) {
-					update_super_old(buffer);
+					update_super_old(outbuf);
 				} else {
-					ret = update_super(mdres, buffer);
+					ret = update_super(mdres, outbuf);
 					if (ret < 0)
 						goto out;
 				}
 			} else if (!mdres->old_restore) {
 				ret = fixup_chunk_tree_block(mdres, async,
-							     buffer, out_len);
+							     outbuf, out_len);
 				if (ret)
 					goto out;
 			}
@@ -488,12 +552,12 @@ static int restore_one_work(struct mdrestore_struct *mdres,
 				else
 					bytenr = logical;
 
-				ret = pwrite(outfd, buffer + offset, chunk_size, bytenr);
+				ret = pwrite(outfd, outbuf + offset, chunk_size, bytenr);
 				if (ret != chunk_size)
 					goto write_error;
 
 				if (physical_dup)
-					ret = pwrite(outfd, buffer + offset,
+					ret = pwrite(outfd, outbuf + offset,
 						       chunk_size, physical_dup);
 				if (ret != chunk_size)
 					goto write_error;
@@ -503,8 +567,11 @@ static int restore_one_work(struct mdrestore_struct *mdres,
 				continue;
 			}
 		} else if (async->start != BTRFS_SUPER_INFO_OFFSET) {
-			ret = write_data_to_disk(mdres->info, buffer,
+			/* The fs_info is not thread safe */
+			pthread_mutex_lock(&mdres->mutex);
+			ret = write_data_to_disk(mdres->info, outbuf,
 						 async->start, out_len);
+			pthread_mutex_unlock(&mdres->mutex);
 			if (ret) {
 				error("failed to write data");
 				exit(1);
@@ -514,14 +581,12 @@ static int restore_one_work(struct mdrestore_struct *mdres,
 		/* backup super blocks are already there at fixup_offset stage */
 		if (async->start == BTRFS_SUPER_INFO_OFFSET &&
 		    !mdres->multi_devices)
-			write_backup_supers(outfd, buffer);
+			write_backup_supers(outfd, outbuf);
 		out_offset += out_len;
-		if (compress_end) {
-			inflateEnd(&strm);
+		if (compress_end)
 			break;
-		}
 	}
-	return ret;
+	goto out;
 
 write_error:
 	if (ret < 0) {
@@ -534,6 +599,10 @@ write_error:
 out:
 	if (compress_method == COMPRESS_ZLIB)
 		inflateEnd(&strm);
+#if COMPRESSION_ZSTD
+	ZSTD_freeDStream(zds);
+#endif
+	free(lz4_buffer);
 	return ret;
 }
 
@@ -542,8 +611,9 @@ static void *restore_worker(void *data)
 	struct mdrestore_struct *mdres = (struct mdrestore_struct *)data;
 	struct async_work *async;
 	u8 *buffer;
+	int compress_method;
 	int ret;
-	int buffer_size = SZ_512K;
+	int buffer_size = SZ_4M;
 
 	buffer = malloc(buffer_size);
 	if (!buffer) {
@@ -551,6 +621,7 @@ static void *restore_worker(void *data)
 		pthread_mutex_lock(&mdres->mutex);
 		if (!mdres->error)
 			mdres->error = -ENOMEM;
+		pthread_cond_broadcast(&mdres->cond);
 		pthread_mutex_unlock(&mdres->mutex);
 		pthread_exit(NULL);
 	}
@@ -566,14 +637,25 @@ static void *restore_worker(void *data)
 		}
 		async = list_entry(mdres->list.next, struct async_work, list);
 		list_del_init(&async->list);
+		compress_method = mdres->compress_method;
+		pthread_mutex_unlock(&mdres->mutex);
+
+		ret = restore_one_work(mdres, async, compress_method, buffer,
+				       buffer_size);
 
-		ret = restore_one_work(mdres, async, buffer, buffer_size);
+		pthread_mutex_lock(&mdres->mutex);
 		if (ret < 0) {
 			mdres->error = ret;
+			pthread_cond_broadcast(&mdres->cond);
 			pthread_mutex_unlock(&mdres->mutex);
+			free(async->buffer);
+			free(async);
 			goto out;
 		}
 		mdres->num_items--;
+		mdres->inflight_bytes -= async->bufsize;
+		/* Wake up the reader waiting for space and wait_for_worker() */
+		pthread_cond_broadcast(&mdres->cond);
 		pthread_mutex_unlock(&mdres->mutex);
 
 		free(async->buffer);
@@ -925,6 +1007,16 @@ static int read_chunk_block(struct mdrestore_struct *mdres, u8 *buffer,
  * This function will iterate all clusters, and find any item inside system
  * chunk ranges.  For such item, it will try to read them as tree blocks, and
  * find CHUNK_ITEMs, add them to @mdres.
+ *
+ * The position of the next cluster is known from the item sizes, so only the
+ * cluster headers and the items in system chunks are read, using pread as the
+ * seeks would drop the stdio buffers anyway. If the image has a cluster index,
+ * only the clusters with items in system chunks are visited.
+ *
+ * Without the index the headers are read one after another, but only up to
+ * the end of the system chunks. An index built by a separate pass would read
+ * the headers of the whole image, while the restore reads all clusters in
+ * order once anyway, possibly from stdin.
  */
 static int search_for_chunk_blocks(struct mdrestore_struct *mdres)
 {
@@ -936,6 +1028,10 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres)
 	u32 bufsize, nritems, i;
 	u32 max_size = current_version->max_pending_size * 2;
 	u8 *buffer, *tmp = NULL;
+	struct meta_index_entry *index = NULL;
+	u64 index_nr = 0;
+	u64 slot = 0;
+	int fd = fileno(mdres->in);
 	int ret = 0;
 
 	cluster = malloc(IMAGE_BLOCK_SIZE);
@@ -951,7 +1047,7 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres)
 		return -ENOMEM;
 	}
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (mdres->compress_method != COMPRESS_NONE) {
 		tmp = malloc(max_size);
 		if (!tmp) {
 			error_msg(ERROR_MSG_MEMORY, NULL);
@@ -961,32 +1057,52 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres)
 		}
 	}
 
-	bytenr = current_cluster;
+	ret = read_cluster_index(fd, &index, &index_nr);
+	if (ret < 0 && ret != -ENOENT)
+		warning("cannot use cluster index, reading all clusters: %s",
+			strerror(-ret));
+	ret = 0;
+
 	/* Main loop, iterating all clusters */
 	while (1) {
-		if (fseek(mdres->in, current_cluster, SEEK_SET)) {
-			error("seek failed: %m");
-			ret = -EIO;
-			goto out;
+		ssize_t rret;
+
+		if (index) {
+			struct meta_index_entry *entry;
+
+			for (; slot < index_nr; slot++) {
+				entry = &index[slot];
+				if (is_in_sys_chunks(mdres,
+						le64_to_cpu(entry->start),
+						le64_to_cpu(entry->end) -
+						le64_to_cpu(entry->start)))
+					break;
+			}
+			if (slot == index_nr)
+				goto out;
+			current_cluster = le64_to_cpu(index[slot++].offset);
 		}
 
-		ret = fread(cluster, IMAGE_BLOCK_SIZE, 1, mdres->in);
-		if (ret == 0) {
-			if (feof(mdres->in))
-				goto out;
+		rret = pread(fd, cluster, IMAGE_BLOCK_SIZE, current_cluster);
+		if (rret == 0)
+			goto out;
+		if (rret < 0) {
+			error("unable to read image at %llu: %m",
+					current_cluster);
+			ret = -errno;
+			goto out;
+		}
+		if (rret < IMAGE_BLOCK_SIZE) {
 			error(
 	"unknown state after reading cluster at %llu, probably corrupted data",
 					current_cluster);
 			ret = -EIO;
 			goto out;
-		} else if (ret < 0) {
-			error("unable to read image at %llu: %m",
-					current_cluster);
-			goto out;
 		}
-		ret = 0;
 
 		header = &cluster->header;
+		if (le64_to_cpu(header->magic) == META_INDEX_MAGIC)
+			goto out;
 		if (le64_to_cpu(header->magic) != current_version->magic_cpu ||
 		    le64_to_cpu(header->bytenr) != current_cluster) {
 			error("bad header in metadump image");
@@ -995,10 +1111,10 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres)
 		}
 
 		/* We're already over the system chunk end, no need to search*/
-		if (current_cluster > mdres->sys_chunk_end)
+		if (!index && current_cluster > mdres->sys_chunk_end)
 			goto out;
 
-		bytenr += IMAGE_BLOCK_SIZE;
+		bytenr = current_cluster + IMAGE_BLOCK_SIZE;
 		nritems = le32_to_cpu(header->nritems);
 
 		/* Search items for tree blocks in sys chunks */
@@ -1017,37 +1133,27 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres)
 			if (bufsize > max_size ||
 			    !is_in_sys_chunks(mdres, item_bytenr, bufsize) ||
 			    item_bytenr == BTRFS_SUPER_INFO_OFFSET) {
-				ret = fseek(mdres->in, bufsize, SEEK_CUR);
-				if (ret < 0) {
-					error("failed to seek: %m");
-					ret = -errno;
-					goto out;
-				}
 				bytenr += bufsize;
 				continue;
 			}
 
-			if (mdres->compress_method == COMPRESS_ZLIB) {
-				ret = fread(tmp, bufsize, 1, mdres->in);
-				if (ret != 1) {
+			if (mdres->compress_method != COMPRESS_NONE) {
+				rret = pread(fd, tmp, bufsize, bytenr);
+				if (rret != bufsize) {
 					error("read error: %m");
 					ret = -EIO;
 					goto out;
 				}
 
 				size = max_size;
-				ret = uncompress(buffer,
-						 (unsigned long *)&size, tmp,
-						 bufsize);
-				if (ret != Z_OK) {
-					error("decompression failed with %d",
-							ret);
-					ret = -EIO;
+				ret = decompress_item(mdres->compress_method,
+						      tmp, bufsize, buffer,
+						      &size);
+				if (ret < 0)
 					goto out;
-				}
 			} else {
-				ret = fread(buffer, bufsize, 1, mdres->in);
-				if (ret != 1) {
+				rret = pread(fd, buffer, bufsize, bytenr);
+				if (rret != bufsize) {
 					error("read error: %m");
 					ret = -EIO;
 					goto out;
@@ -1072,6 +1178,7 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres)
 	}
 
 out:
+	free(index);
 	free(tmp);
 	free(buffer);
 	free(cluster);
@@ -1107,6 +1214,11 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 	}
 
 	mdres->compress_method = header->compress;
+	if (!compress_method_supported(mdres->compress_method)) {
+		error("unsupported compression method %s in metadump image",
+		      compress_method_name(mdres->compress_method));
+		return -EOPNOTSUPP;
+	}
 	nritems = le32_to_cpu(header->nritems);
 	for (i = 0; i < nritems; i++) {
 		item = &cluster->items[i];
@@ -1138,7 +1250,7 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 		return -EIO;
 	}
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (mdres->compress_method != COMPRESS_NONE) {
 		size_t size = BTRFS_SUPER_INFO_SIZE;
 		u8 *tmp;
 
@@ -1147,13 +1259,12 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 			free(buffer);
 			return -ENOMEM;
 		}
-		ret = uncompress(tmp, (unsigned long *)&size,
-				 buffer, le32_to_cpu(item->size));
-		if (ret != Z_OK) {
-			error("decompression failed with %d", ret);
+		ret = decompress_item(mdres->compress_method, buffer,
+				      le32_to_cpu(item->size), tmp, &size);
+		if (ret < 0) {
 			free(buffer);
 			free(tmp);
-			return -EIO;
+			return ret;
 		}
 		free(buffer);
 		buffer = tmp;
@@ -1173,6 +1284,8 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 		pthread_mutex_unlock(&mdres->mutex);
 		return ret;
 	}
+	/* The workers read it without locking, set it up before any item */
+	memcpy(mdres->original_super, super, BTRFS_SUPER_INFO_SIZE);
 	mdres->nodesize = btrfs_super_nodesize(super);
 	if (btrfs_super_incompat_flags(super) &
 	    BTRFS_FEATURE_INCOMPAT_METADATA_UUID)
@@ -1235,7 +1348,7 @@ static int fill_mdres_info(struct mdrestore_struct *mdres,
 	if (mdres->nodesize)
 		return 0;
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (mdres->compress_method != COMPRESS_NONE) {
 		/*
 		 * We know this item is superblock, its should only be 4K.
 		 * Don't need to waste memory following max_pending_size as it
@@ -1246,12 +1359,11 @@ static int fill_mdres_info(struct mdrestore_struct *mdres,
 		buffer = malloc(size);
 		if (!buffer)
 			return -ENOMEM;
-		ret = uncompress(buffer, (unsigned long *)&size,
-				 async->buffer, async->bufsize);
-		if (ret != Z_OK) {
-			error("decompression failed with %d", ret);
+		ret = decompress_item(mdres->compress_method, async->buffer,
+				      async->bufsize, buffer, &size);
+		if (ret < 0) {
 			free(buffer);
-			return -EIO;
+			return ret;
 		}
 		outbuf = buffer;
 	} else {
@@ -1259,6 +1371,7 @@ static int fill_mdres_info(struct mdrestore_struct *mdres,
 	}
 
 	super = (struct btrfs_super_block *)outbuf;
+	memcpy(mdres->original_super, super, BTRFS_SUPER_INFO_SIZE);
 	mdres->nodesize = btrfs_super_nodesize(super);
 	if (btrfs_super_incompat_flags(super) &
 	    BTRFS_FEATURE_INCOMPAT_METADATA_UUID)
@@ -1281,6 +1394,11 @@ static int add_cluster(struct meta_cluster *cluster,
 	u32 i, nritems;
 	int ret;
 
+	if (!compress_method_supported(header->compress)) {
+		error("unsupported compression method %s in metadump image",
+		      compress_method_name(header->compress));
+		return -EOPNOTSUPP;
+	}
 	pthread_mutex_lock(&mdres->mutex);
 	mdres->compress_method = header->compress;
 	pthread_mutex_unlock(&mdres->mutex);
@@ -1289,6 +1407,23 @@ static int add_cluster(struct meta_cluster *cluster,
 	nritems = le32_to_cpu(header->nritems);
 	for (i = 0; i < nritems; i++) {
 		item = &cluster->items[i];
+
+		/*
+		 * Don't read ahead of the workers too much, but always let one
+		 * item through, they can be larger than the limit.
+		 */
+		pthread_mutex_lock(&mdres->mutex);
+		while (mdres->num_threads && !mdres->error &&
+		       mdres->inflight_bytes &&
+		       mdres->inflight_bytes + le32_to_cpu(item->size) >
+		       MAX_RESTORE_INFLIGHT)
+			pthread_cond_wait(&mdres->cond, &mdres->mutex);
+		ret = mdres->error;
+		mdres->inflight_bytes += le32_to_cpu(item->size);
+		pthread_mutex_unlock(&mdres->mutex);
+		if (ret)
+			return ret;
+
 		async = calloc(1, sizeof(*async));
 		if (!async) {
 			error_msg(ERROR_MSG_MEMORY, "async data");
@@ -1349,13 +1484,7 @@ static int wait_for_worker(struct mdrestore_struct *mdres)
 	pthread_mutex_lock(&mdres->mutex);
 	ret = mdres->error;
 	while (!ret && mdres->num_items > 0) {
-		struct timespec ts = {
-			.tv_sec = 0,
-			.tv_nsec = 10000000,
-		};
-		pthread_mutex_unlock(&mdres->mutex);
-		nanosleep(&ts, NULL);
-		pthread_mutex_lock(&mdres->mutex);
+		pthread_cond_wait(&mdres->cond, &mdres->mutex);
 		ret = mdres->error;
 	}
 	pthread_mutex_unlock(&mdres->mutex);
@@ -1820,6 +1949,12 @@ int restore_metadump(const char *input, FILE *out, int old_restore,
 			break;
 
 		header = &cluster->header;
+		/* The cluster index follows the last cluster */
+		if (le64_to_cpu(header->magic) == META_INDEX_MAGIC &&
+		    le64_to_cpu(header->bytenr) == bytenr) {
+			ret = 0;
+			break;
+		}
 		if (le64_to_cpu(header->magic) != current_version->magic_cpu ||
 		    le64_to_cpu(header->bytenr) != bytenr) {
 			error("bad header in metadump image");
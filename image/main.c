@@ -58,19 +58,34 @@
 #include "image/sanitize.h"
 #include "image/common.h"
 
+/* Only the compression methods of this build are listed */
+#if COMPRESSION_ZSTD
+#define IMAGE_HELP_ZSTD		", zstd"
+#else
+#define IMAGE_HELP_ZSTD		""
+#endif
+#if COMPRESSION_LZ4
+#define IMAGE_HELP_LZ4		", lz4"
+#else
+#define IMAGE_HELP_LZ4		""
+#endif
+
 static const char * const image_usage[] = {
 	"btrfs-image [options] source target",
 	"Create or restore a filesystem image (metadata)",
 	"",
 	"Options:",
 	OPTLINE("-r", "restore metadump image"),
-	OPTLINE("-c value", "compression level (0 ~ 9)"),
+	OPTLINE("-c value", "compression level (0 ~ 9 for zlib, 0 ~ 19 for zstd, 0 ~ 12 for lz4)"),
 	OPTLINE("-t value", "number of threads (1 ~ 32)"),
 	OPTLINE("-o", "don't mess with the chunk tree when restoring"),
 	OPTLINE("-s", "sanitize file names, use once to just use garbage, use twice if you want crc collisions"),
 	OPTLINE("-w", "walk all trees instead of using extent tree, do this if your extent tree is broken"),
 	OPTLINE("-m", "restore for multiple devices"),
 	OPTLINE("-d", "also dump data, conflicts with -w"),
+	OPTLINE("--compress-method METHOD", "compression method: zlib (default)"
+		IMAGE_HELP_ZSTD IMAGE_HELP_LZ4),
+	OPTLINE("--index", "append an index of the clusters to the image"),
 	"",
 	"In the dump mode, source is the btrfs device and target is the output file (use '-' for stdout).",
 	"In the restore mode, source is the dumped image and target is the btrfs device/file.",
@@ -81,12 +96,49 @@ static const struct cmd_struct image_cmd = {
 	.usagestr = image_usage
 };
 
+static int parse_compress_method(const char *str)
+{
+	if (strcmp(str, "zlib") == 0)
+		return COMPRESS_ZLIB;
+	if (strcmp(str, "zstd") == 0)
+		return COMPRESS_ZSTD;
+	if (strcmp(str, "lz4") == 0)
+		return COMPRESS_LZ4;
+	return -EINVAL;
+}
+
+static u64 max_compress_level(int method)
+{
+	switch (method) {
+	case COMPRESS_ZSTD:
+		return 19;
+	case COMPRESS_LZ4:
+		return 12;
+	}
+	return 9;
+}
+
+static u64 default_compress_level(int method)
+{
+	switch (method) {
+	case COMPRESS_ZSTD:
+		return 3;
+	case COMPRESS_LZ4:
+		return 1;
+	}
+	return 6;
+}
+
 int BOX_MAIN(image)(int argc, char *argv[])
 {
 	char *source;
 	char *target;
 	u64 num_threads = 0;
 	u64 compress_level = 0;
+	bool compress_level_set = false;
+	int compress_method = COMPRESS_ZLIB;
+	bool compress_method_set = false;
+	bool write_index = false;
 	int create = 1;
 	int old_restore = 0;
 	int walk_trees = 0;
@@ -102,7 +154,12 @@ int BOX_MAIN(image)(int argc, char *argv[])
 	hash_init_accel();
 
 	while (1) {
+		enum { GETOPT_VAL_COMPRESS_METHOD = GETOPT_VAL_FIRST,
+		       GETOPT_VAL_INDEX };
 		static const struct option long_options[] = {
+			{ "compress-method", required_argument, NULL,
+				GETOPT_VAL_COMPRESS_METHOD },
+			{ "index", no_argument, NULL, GETOPT_VAL_INDEX },
 			{ "help", no_argument, NULL, GETOPT_VAL_HELP},
 			{ NULL, 0, NULL, 0 }
 		};
@@ -123,11 +180,7 @@ int BOX_MAIN(image)(int argc, char *argv[])
 			break;
 		case 'c':
 			compress_level = arg_strtou64(optarg);
-			if (compress_level > 9) {
-				error("compression level out of range: %llu",
-					compress_level);
-				return 1;
-			}
+			compress_level_set = true;
 			break;
 		case 'o':
 			old_restore = 1;
@@ -149,6 +202,17 @@ int BOX_MAIN(image)(int argc, char *argv[])
 			btrfs_warn_experimental("Feature: dump image with data");
 			dump_data = true;
 			break;
+		case GETOPT_VAL_COMPRESS_METHOD:
+			compress_method = parse_compress_method(optarg);
+			if (compress_method < 0) {
+				error("unknown compression method: %s", optarg);
+				return 1;
+			}
+			compress_method_set = true;
+			break;
+		case GETOPT_VAL_INDEX:
+			write_index = true;
+			break;
 		case GETOPT_VAL_HELP:
 		default:
 			usage(&image_cmd, c != GETOPT_VAL_HELP);
@@ -161,6 +225,21 @@ int BOX_MAIN(image)(int argc, char *argv[])
 
 	dev_cnt = argc - optind - 1;
 
+	if (compress_level > max_compress_level(compress_method)) {
+		error("compression level out of range for %s: %llu > %llu",
+		      compress_method_name(compress_method), compress_level,
+		      max_compress_level(compress_method));
+		return 1;
+	}
+	/* Selecting the method alone enables compression */
+	if (compress_method_set && !compress_level_set)
+		compress_level = default_compress_level(compress_method);
+	if (compress_level && !compress_method_supported(compress_method)) {
+		error("compression method %s is not supported in this build",
+		      compress_method_name(compress_method));
+		return 1;
+	}
+
 #if !EXPERIMENTAL
 	if (dump_data) {
 		error(
@@ -180,9 +259,9 @@ int BOX_MAIN(image)(int argc, char *argv[])
 		}
 	} else {
 		if (walk_trees || sanitize != SANITIZE_NONE || compress_level ||
-		    dump_data) {
+		    dump_data || write_index) {
 			error(
-		"using -w, -s, -c, -d options for restore makes no sense");
+	"using -w, -s, -c, -d, --compress-method, --index options for restore makes no sense");
 			usage_error++;
 		}
 		if (multi_devices && dev_cnt < 2) {
@@ -235,8 +314,8 @@ int BOX_MAIN(image)(int argc, char *argv[])
 		}
 
 		ret = create_metadump(source, out, num_threads,
-				      compress_level, sanitize, walk_trees,
-				      dump_data);
+				      compress_method, compress_level, sanitize,
+				      walk_trees, dump_data, write_index);
 	} else {
 		ret = restore_metadump(source, out, old_restore, num_threads,
 				       0, target, multi_devices);
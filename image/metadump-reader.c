@@ -0,0 +1,527 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Random access to the items of a metadump image by logical address, so the
+ * image can be opened by open_ctree() without restoring it.
+ *
+ * The clusters are located by the cluster index, images without the index are
+ * scanned once when opened. Decompressed clusters are kept in a LRU cache, the
+ * ranges of the items of a cluster are remembered after it's read for the
+ * first time. Ranges not present in the image read as zeros, like in a
+ * restored image.
+ */
+
+#include "kerncompat.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kernel-lib/list.h"
+#include "kernel-lib/sizes.h"
+#include "kernel-shared/disk-io.h"
+#include "common/internal.h"
+#include "common/messages.h"
+#include "image/metadump.h"
+#include "image/common.h"
+#include "image/metadump-reader.h"
+
+/* Upper limit of decompressed cluster data kept in memory */
+#define METADUMP_READER_CACHE		(SZ_64M)
+
+struct reader_item {
+	u64 start;
+	u64 len;
+	/* Offset of the data in reader_cluster::data */
+	u64 offset;
+};
+
+struct reader_cluster {
+	/* Offset of the cluster header in the image */
+	u64 offset;
+	/* Range of logical addresses of the items, end is exclusive */
+	u64 start;
+	u64 end;
+	/* Maximum end of this and all clusters before it, sorted by start */
+	u64 max_end;
+
+	/* Known after the cluster was read for the first time */
+	struct reader_item *items;
+	u32 nr_items;
+
+	/* Decompressed items, NULL if not cached */
+	u8 *data;
+	u64 data_size;
+	struct list_head lru;
+};
+
+struct metadump_reader {
+	int fd;
+	const struct dump_version *version;
+	pthread_mutex_t mutex;
+
+	struct reader_cluster *clusters;
+	u64 nr_clusters;
+
+	struct list_head lru;
+	u64 cached_bytes;
+
+	/* Buffers for one item, compressed and decompressed */
+	u32 max_item_size;
+	u8 *in;
+	u8 *out;
+};
+
+static const struct dump_version *image_version(int fd)
+{
+	struct meta_cluster_header header;
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+		return NULL;
+	if (le64_to_cpu(header.bytenr) != 0)
+		return NULL;
+	return find_dump_version(le64_to_cpu(header.magic));
+}
+
+static void evict_cluster(struct metadump_reader *reader,
+			  struct reader_cluster *cluster)
+{
+	list_del_init(&cluster->lru);
+	reader->cached_bytes -= cluster->data_size;
+	free(cluster->data);
+	cluster->data = NULL;
+	cluster->data_size = 0;
+}
+
+/* Read and decompress all items of @cluster, unless it's cached already */
+static int load_cluster(struct metadump_reader *reader,
+			struct reader_cluster *cluster)
+{
+	u8 block[IMAGE_BLOCK_SIZE];
+	struct meta_cluster *header = (struct meta_cluster *)block;
+	struct reader_item *items;
+	u8 *data = NULL;
+	u64 data_size = 0;
+	u64 data_alloc = 0;
+	u64 bytenr;
+	u32 nritems;
+	int method;
+	u32 i;
+	int ret;
+
+	if (cluster->data) {
+		list_move(&cluster->lru, &reader->lru);
+		return 0;
+	}
+
+	ret = pread(reader->fd, block, IMAGE_BLOCK_SIZE, cluster->offset);
+	if (ret != IMAGE_BLOCK_SIZE)
+		goto read_error;
+	if (le64_to_cpu(header->header.magic) != reader->version->magic_cpu ||
+	    le64_to_cpu(header->header.bytenr) != cluster->offset) {
+		error("bad cluster header at %llu in metadump image",
+		      cluster->offset);
+		return -EUCLEAN;
+	}
+	nritems = le32_to_cpu(header->header.nritems);
+	if (nritems > (IMAGE_BLOCK_SIZE - sizeof(struct meta_cluster_header)) /
+		      sizeof(struct meta_cluster_item)) {
+		error("bad number of items in cluster at %llu", cluster->offset);
+		return -EUCLEAN;
+	}
+	method = header->header.compress;
+	if (!compress_method_supported(method)) {
+		error("unsupported compression method %s in metadump image",
+		      compress_method_name(method));
+		return -EOPNOTSUPP;
+	}
+
+	items = calloc(max_t(u32, nritems, 1), sizeof(*items));
+	if (!items)
+		return -ENOMEM;
+
+	bytenr = cluster->offset + IMAGE_BLOCK_SIZE;
+	for (i = 0; i < nritems; i++) {
+		u32 size = le32_to_cpu(header->items[i].size);
+		size_t len = reader->max_item_size;
+		u8 *buf;
+
+		if (size > reader->max_item_size) {
+			error("item at %llu too large: %u", bytenr, size);
+			ret = -EUCLEAN;
+			goto fail;
+		}
+		ret = pread(reader->fd, reader->in, size, bytenr);
+		if (ret != size)
+			goto read_error_free;
+		bytenr += size;
+
+		if (method == COMPRESS_NONE) {
+			buf = reader->in;
+			len = size;
+		} else {
+			ret = decompress_item(method, reader->in, size,
+					      reader->out, &len);
+			if (ret < 0)
+				goto fail;
+			buf = reader->out;
+		}
+
+		if (data_size + len > data_alloc) {
+			u64 alloc = max(data_alloc * 2, data_size + len);
+			u8 *tmp;
+
+			tmp = realloc(data, alloc);
+			if (!tmp) {
+				ret = -ENOMEM;
+				goto fail;
+			}
+			data = tmp;
+			data_alloc = alloc;
+		}
+		memcpy(data + data_size, buf, len);
+		items[i].start = le64_to_cpu(header->items[i].bytenr);
+		items[i].len = len;
+		items[i].offset = data_size;
+		data_size += len;
+	}
+
+	if (!cluster->items) {
+		cluster->items = items;
+		cluster->nr_items = nritems;
+	} else {
+		free(items);
+	}
+	cluster->data = data ?: malloc(1);
+	if (!cluster->data)
+		return -ENOMEM;
+	cluster->data_size = data_size;
+	list_add(&cluster->lru, &reader->lru);
+	reader->cached_bytes += data_size;
+
+	/* Keep at least the cluster just read */
+	while (reader->cached_bytes > METADUMP_READER_CACHE &&
+	       reader->lru.prev != &cluster->lru)
+		evict_cluster(reader, list_last_entry(&reader->lru,
+					struct reader_cluster, lru));
+	return 0;
+
+read_error_free:
+	ret = (ret < 0 ? -errno : -EIO);
+	error("unable to read metadump image at %llu: %m", bytenr);
+	goto fail;
+read_error:
+	ret = (ret < 0 ? -errno : -EIO);
+	error("unable to read metadump image at %llu: %m", cluster->offset);
+	return ret;
+fail:
+	free(items);
+	free(data);
+	return ret;
+}
+
+static int cluster_cmp(const void *a, const void *b)
+{
+	const struct reader_cluster *ca = a;
+	const struct reader_cluster *cb = b;
+
+	if (ca->start < cb->start)
+		return -1;
+	if (ca->start > cb->start)
+		return 1;
+	return 0;
+}
+
+static int add_cluster(struct metadump_reader *reader, u64 *alloc, u64 offset,
+		       u64 start, u64 end)
+{
+	struct reader_cluster *cluster;
+
+	if (reader->nr_clusters == *alloc) {
+		u64 new_alloc = max_t(u64, *alloc * 2, 1024);
+
+		cluster = realloc(reader->clusters,
+				  new_alloc * sizeof(*cluster));
+		if (!cluster)
+			return -ENOMEM;
+		reader->clusters = cluster;
+		*alloc = new_alloc;
+	}
+	cluster = &reader->clusters[reader->nr_clusters++];
+	memset(cluster, 0, sizeof(*cluster));
+	INIT_LIST_HEAD(&cluster->lru);
+	cluster->offset = offset;
+	cluster->start = start;
+	cluster->end = end;
+	return 0;
+}
+
+static int load_index(struct metadump_reader *reader)
+{
+	struct meta_index_entry *index;
+	u64 alloc = 0;
+	u64 nr;
+	u64 i;
+	int ret;
+
+	ret = read_cluster_index(reader->fd, &index, &nr);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < nr; i++) {
+		ret = add_cluster(reader, &alloc, le64_to_cpu(index[i].offset),
+				  le64_to_cpu(index[i].start),
+				  le64_to_cpu(index[i].end));
+		if (ret < 0)
+			break;
+	}
+	free(index);
+	return ret;
+}
+
+/*
+ * Build the list of clusters without the index. The item sizes in the cluster
+ * headers give the location of the next cluster, but the length of compressed
+ * items is known only after decompression, such clusters are read completely.
+ */
+static int scan_clusters(struct metadump_reader *reader)
+{
+	u8 block[IMAGE_BLOCK_SIZE];
+	struct meta_cluster *header = (struct meta_cluster *)block;
+	struct reader_cluster *cluster;
+	u64 offset = 0;
+	u64 alloc = 0;
+	int ret;
+
+	while (1) {
+		u64 bytenr;
+		u32 nritems;
+		u32 i;
+
+		ret = pread(reader->fd, block, IMAGE_BLOCK_SIZE, offset);
+		if (ret == 0)
+			break;
+		if (ret != IMAGE_BLOCK_SIZE) {
+			error("unable to read metadump image at %llu: %m",
+			      offset);
+			return ret < 0 ? -errno : -EIO;
+		}
+		if (le64_to_cpu(header->header.magic) == META_INDEX_MAGIC)
+			break;
+		if (le64_to_cpu(header->header.magic) !=
+		    reader->version->magic_cpu ||
+		    le64_to_cpu(header->header.bytenr) != offset) {
+			error("bad cluster header at %llu in metadump image",
+			      offset);
+			return -EUCLEAN;
+		}
+
+		ret = add_cluster(reader, &alloc, offset, (u64)-1, 0);
+		if (ret < 0)
+			return ret;
+		cluster = &reader->clusters[reader->nr_clusters - 1];
+		ret = load_cluster(reader, cluster);
+		if (ret < 0)
+			return ret;
+		for (i = 0; i < cluster->nr_items; i++) {
+			cluster->start = min(cluster->start,
+					     cluster->items[i].start);
+			cluster->end = max(cluster->end,
+					   cluster->items[i].start +
+					   cluster->items[i].len);
+		}
+		/* The array is reallocated and sorted, nothing can be cached */
+		evict_cluster(reader, cluster);
+
+		nritems = le32_to_cpu(header->header.nritems);
+		bytenr = offset + IMAGE_BLOCK_SIZE;
+		for (i = 0; i < nritems; i++)
+			bytenr += le32_to_cpu(header->items[i].size);
+		offset = round_up(bytenr, IMAGE_BLOCK_SIZE);
+	}
+	return 0;
+}
+
+static void metadump_reader_close(void *image)
+{
+	struct metadump_reader *reader = image;
+	u64 i;
+
+	if (!reader)
+		return;
+	for (i = 0; i < reader->nr_clusters; i++) {
+		free(reader->clusters[i].items);
+		free(reader->clusters[i].data);
+	}
+	free(reader->clusters);
+	free(reader->in);
+	free(reader->out);
+	pthread_mutex_destroy(&reader->mutex);
+	close(reader->fd);
+	free(reader);
+}
+
+static bool metadump_reader_detect(int fd)
+{
+	return image_version(fd) != NULL;
+}
+
+static void *metadump_reader_open(int fd)
+{
+	struct metadump_reader *reader;
+	u64 i;
+	int ret;
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return NULL;
+	}
+	pthread_mutex_init(&reader->mutex, NULL);
+	INIT_LIST_HEAD(&reader->lru);
+
+	/* The caller may close its descriptor once the filesystem is open */
+	reader->fd = dup(fd);
+	if (reader->fd < 0) {
+		error("cannot duplicate file descriptor: %m");
+		free(reader);
+		return NULL;
+	}
+	reader->version = image_version(reader->fd);
+	if (!reader->version) {
+		error("unrecognized metadump image format");
+		goto fail;
+	}
+
+	/* Same bound as for the restore */
+	reader->max_item_size = reader->version->max_pending_size * 2;
+	reader->in = malloc(reader->max_item_size);
+	reader->out = malloc(reader->max_item_size);
+	if (!reader->in || !reader->out) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		goto fail;
+	}
+
+	ret = load_index(reader);
+	if (ret == -ENOENT) {
+		pr_verbose(LOG_DEBUG,
+			   "metadump image without index, scanning clusters\n");
+		ret = scan_clusters(reader);
+	}
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot read metadump image clusters: %m");
+		goto fail;
+	}
+
+	qsort(reader->clusters, reader->nr_clusters, sizeof(*reader->clusters),
+	      cluster_cmp);
+	for (i = 0; i < reader->nr_clusters; i++) {
+		reader->clusters[i].max_end = reader->clusters[i].end;
+		if (i)
+			reader->clusters[i].max_end = max(
+					reader->clusters[i].max_end,
+					reader->clusters[i - 1].max_end);
+	}
+	pr_verbose(LOG_DEBUG, "metadump image with %llu clusters\n",
+		   reader->nr_clusters);
+	return reader;
+
+fail:
+	metadump_reader_close(reader);
+	return NULL;
+}
+
+static bool cluster_overlaps(const struct reader_cluster *cluster, u64 start,
+			     u64 end)
+{
+	u32 i;
+
+	if (cluster->end <= start || cluster->start >= end)
+		return false;
+	if (!cluster->items)
+		return true;
+	for (i = 0; i < cluster->nr_items; i++) {
+		const struct reader_item *item = &cluster->items[i];
+
+		if (item->start < end && item->start + item->len > start)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Read @len bytes at logical address @logical to @buf, the parts not stored
+ * in the image are zeroed.
+ */
+static int metadump_reader_read(void *image, void *buf, u64 logical, u64 len)
+{
+	struct metadump_reader *reader = image;
+	const u64 end = logical + len;
+	s64 lo = 0;
+	s64 hi = reader->nr_clusters;
+	s64 slot;
+	int ret = 0;
+
+	memset(buf, 0, len);
+
+	/* First cluster starting at or after @end */
+	while (lo < hi) {
+		s64 mid = lo + (hi - lo) / 2;
+
+		if (reader->clusters[mid].start < end)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	pthread_mutex_lock(&reader->mutex);
+	for (slot = lo - 1; slot >= 0; slot--) {
+		struct reader_cluster *cluster = &reader->clusters[slot];
+		u32 i;
+
+		if (cluster->max_end <= logical)
+			break;
+		if (!cluster_overlaps(cluster, logical, end))
+			continue;
+
+		ret = load_cluster(reader, cluster);
+		if (ret < 0)
+			break;
+		for (i = 0; i < cluster->nr_items; i++) {
+			const struct reader_item *item = &cluster->items[i];
+			u64 copy_start = max(item->start, logical);
+			u64 copy_end = min(item->start + item->len, end);
+
+			if (copy_start >= copy_end)
+				continue;
+			memcpy((u8 *)buf + copy_start - logical,
+			       cluster->data + item->offset +
+			       copy_start - item->start,
+			       copy_end - copy_start);
+		}
+	}
+	pthread_mutex_unlock(&reader->mutex);
+	return ret;
+}
+
+const struct btrfs_image_ops metadump_image_ops = {
+	.name		= "metadump",
+	.detect		= metadump_reader_detect,
+	.open		= metadump_reader_open,
+	.close		= metadump_reader_close,
+	.read		= metadump_reader_read,
+};
@@ -33,9 +33,15 @@
 
 #define COMPRESS_NONE		0
 #define COMPRESS_ZLIB		1
+#define COMPRESS_ZSTD		2
+/* The item starts with __le32 length of the uncompressed data */
+#define COMPRESS_LZ4		3
 
 #define MAX_WORKER_THREADS	(32)
 
+/* Upper limit of items read from the image but not yet written on restore */
+#define MAX_RESTORE_INFLIGHT	SZ_256M
+
 struct dump_version {
 	u64 magic_cpu;
 	int version;
@@ -74,6 +80,29 @@ struct meta_cluster {
 	struct meta_cluster_item items[];
 } __attribute__ ((__packed__));
 
+/*
+ * Optional index of the clusters, written after the last cluster. It starts
+ * with a block with struct meta_cluster_header with META_INDEX_MAGIC and number
+ * of entries in nritems, followed by the entries. The last block of the image
+ * is struct meta_index_trailer pointing to the index.
+ */
+#define META_INDEX_MAGIC	0x5844495f706d5544ULL /* ascii DUmp_IDX, no null */
+
+struct meta_index_entry {
+	/* Offset of the cluster in the image, same as its header bytenr */
+	__le64 offset;
+	/* Range of logical addresses of the cluster items, end is exclusive */
+	__le64 start;
+	__le64 end;
+} __attribute__ ((__packed__));
+
+struct meta_index_trailer {
+	__le64 magic;
+	/* Offset of the index header block */
+	__le64 offset;
+	__le64 nr_entries;
+} __attribute__ ((__packed__));
+
 struct fs_chunk {
 	u64 logical;
 	u64 physical;
@@ -110,11 +139,20 @@ struct metadump_struct {
 	u64 pending_start;
 	u64 pending_size;
 
+	int compress_method;
 	int compress_level;
+	/* Long distance matching for zstd, the data dump items are large */
+	bool compress_long;
 	int done;
 	int data;
 	enum sanitize_mode sanitize_names;
 
+	/* Cluster index, if requested */
+	bool write_index;
+	struct meta_index_entry *index;
+	u64 index_nr;
+	u64 index_alloc;
+
 	int error;
 
 	union {
@@ -143,6 +181,8 @@ struct mdrestore_struct {
 	struct list_head overlapping_chunks;
 	struct btrfs_super_block *original_super;
 	size_t num_items;
+	/* Size of all queued and processed items, capped by MAX_RESTORE_INFLIGHT */
+	u64 inflight_bytes;
 	u32 nodesize;
 	u64 devid;
 	u64 alloced_chunks;
@@ -162,9 +202,10 @@ struct mdrestore_struct {
 	struct btrfs_fs_info *info;
 };
 
-int create_metadump(const char *input, FILE *out, int num_threads, int
-		    compress_level, enum sanitize_mode sanitize, int
-		    walk_trees, bool dump_data);
+int create_metadump(const char *input, FILE *out, int num_threads,
+		    int compress_method, int compress_level,
+		    enum sanitize_mode sanitize, int walk_trees, bool dump_data,
+		    bool write_index);
 int restore_metadump(const char *input, FILE *out, int old_restore,
 		     int num_threads, int fixup_offset, const char *target,
 		     int multi_devices);
@@ -28,6 +28,7 @@
 #include "common/internal.h"
 #include "common/messages.h"
 #include "common/utils.h"
+#include "common/tree-reada.h"
 #include "check/repair.h"
 
 static int split_node(struct btrfs_trans_handle *trans, struct btrfs_root
@@ -1221,6 +1222,7 @@ static void reada_for_search(struct btrfs_fs_info *fs_info,
 
 	nritems = btrfs_header_nritems(node);
 	nr = slot;
+	btrfs_tree_reada_plug(fs_info);
 	while(1) {
 		if (direction < 0) {
 			if (nr == 0)
@@ -1255,6 +1257,7 @@ static void reada_for_search(struct btrfs_fs_info *fs_info,
 		if (search > highest_read)
 			highest_read = search;
 	}
+	btrfs_tree_reada_unplug(fs_info);
 }
 
 int btrfs_find_item(struct btrfs_root *fs_root, struct btrfs_path *found_path,
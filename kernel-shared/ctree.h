@@ -296,6 +296,9 @@ struct btrfs_block_group {
 
 struct btrfs_device;
 struct btrfs_fs_devices;
+struct btrfs_tree_reada;
+struct btrfs_image_ops;
+struct slab_cache;
 struct btrfs_fs_info {
 	u8 chunk_tree_uuid[BTRFS_UUID_SIZE];
 	u8 *new_chunk_tree_uuid;
@@ -313,10 +316,17 @@ struct btrfs_fs_info {
 	/* the log root tree is a directory of all the other log roots */
 	struct btrfs_root *log_root_tree;
 
+	/* Extent buffer cache, see extent_io.c */
 	struct cache_tree extent_cache;
+	struct hlist_head *eb_hash;
+	unsigned int eb_hash_bits;
+	u64 nr_cached_ebs;
+	struct list_head eb_clock;
+	struct list_head *eb_clock_hand;
+	struct extent_buffer_cache_stats eb_cache_stats;
+	struct slab_cache *eb_slab;
 	u64 max_cache_size;
 	u64 cache_size;
-	struct list_head lru;
 
 	struct extent_io_tree dirty_buffers;
 	struct extent_io_tree free_space_cache;
@@ -351,6 +361,10 @@ struct btrfs_fs_info {
 	struct btrfs_fs_devices *fs_devices;
 	struct list_head space_info;
 
+	/* Image file read instead of the devices, see btrfs_image_ops */
+	const struct btrfs_image_ops *image_ops;
+	void *image;
+
 	unsigned int system_allocs:1;
 	unsigned int readonly:1;
 	unsigned int on_restoring:1;
@@ -376,6 +390,9 @@ struct btrfs_fs_info {
 	struct cache_tree *fsck_extent_cache;
 	struct cache_tree *corrupt_blocks;
 
+	/* Tree block readahead workers, see common/tree-reada.c */
+	struct btrfs_tree_reada *tree_reada;
+
 	/*
 	 * For converting to/from bg tree feature, this records the bytenr
 	 * of the last processed block group item.
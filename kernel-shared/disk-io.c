@@ -38,6 +38,8 @@
 #include "common/rbtree-utils.h"
 #include "common/device-scan.h"
 #include "common/device-utils.h"
+#include "common/tree-reada.h"
+#include "common/slab.h"
 
 /* specified errno for check_tree_block */
 #define BTRFS_BAD_BYTENR		(-1)
@@ -164,6 +166,59 @@ int btrfs_csum_data(struct btrfs_fs_info *fs_info, u16 csum_type, const u8 *data
 	return -1;
 }
 
+/* Number of buffers passed to one hash_*_multi() call */
+#define CSUM_MULTI_BATCH	(64)
+
+/*
+ * Calculate checksums of @nr consecutive blocks of @blocksize bytes starting
+ * at @data, the checksums are stored tightly packed to @out, ie. like in the
+ * csum items.
+ */
+int btrfs_csum_data_multi(struct btrfs_fs_info *fs_info, u16 csum_type,
+			  const u8 *data, u8 *out, u32 blocksize, u32 nr)
+{
+	const u16 csum_size = btrfs_csum_type_size(csum_type);
+	const u8 *bufs[CSUM_MULTI_BATCH];
+	u8 *outs[CSUM_MULTI_BATCH];
+	int batch;
+	int ret;
+	int i;
+
+	while (nr > 0) {
+		batch = min_t(u32, nr, CSUM_MULTI_BATCH);
+		for (i = 0; i < batch; i++) {
+			bufs[i] = data + (u64)i * blocksize;
+			outs[i] = out + i * csum_size;
+		}
+
+		switch (csum_type) {
+		case BTRFS_CSUM_TYPE_CRC32:
+			ret = hash_crc32c_multi(bufs, batch, blocksize, outs);
+			break;
+		case BTRFS_CSUM_TYPE_XXHASH:
+			ret = hash_xxhash_multi(bufs, batch, blocksize, outs);
+			break;
+		case BTRFS_CSUM_TYPE_SHA256:
+			ret = hash_sha256_multi(bufs, batch, blocksize, outs);
+			break;
+		case BTRFS_CSUM_TYPE_BLAKE2:
+			ret = hash_blake2b_multi(bufs, batch, blocksize, outs);
+			break;
+		default:
+			fprintf(stderr, "ERROR: unknown csum type: %d\n", csum_type);
+			ASSERT(0);
+			return -1;
+		}
+		if (ret < 0)
+			return ret;
+
+		data += (u64)batch * blocksize;
+		out += batch * csum_size;
+		nr -= batch;
+	}
+	return 0;
+}
+
 static int __csum_tree_block_size(struct extent_buffer *buf, u16 csum_size,
 				  int verify, int silent, u16 csum_type)
 {
@@ -241,8 +296,15 @@ void readahead_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 	struct btrfs_device *device;
 
 	eb = btrfs_find_tree_block(fs_info, bytenr, fs_info->nodesize);
-	if (!(eb && btrfs_buffer_uptodate(eb, parent_transid, 0)) &&
-	    !btrfs_map_block(fs_info, READ, bytenr, &length, &multi, 0,
+	if (eb && btrfs_buffer_uptodate(eb, parent_transid, 0))
+		goto out;
+
+	if (fs_info->tree_reada) {
+		btrfs_tree_reada_queue(fs_info, bytenr);
+		goto out;
+	}
+
+	if (!btrfs_map_block(fs_info, READ, bytenr, &length, &multi, 0,
 			     NULL)) {
 		device = multi->stripes[0].dev;
 		device->total_ios++;
@@ -250,6 +312,7 @@ void readahead_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 				fs_info->nodesize);
 	}
 
+out:
 	free_extent_buffer(eb);
 	kfree(multi);
 }
@@ -284,6 +347,8 @@ out:
 
 }
 
+const struct btrfs_image_ops *btrfs_image_ops;
+
 static int read_on_restore(struct extent_buffer *eb)
 {
 	struct btrfs_fs_info *fs_info = eb->fs_info;
@@ -315,6 +380,10 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 	int ret = 0;
 	unsigned long bytes_left = eb->len;
 
+	if (info->image)
+		return info->image_ops->read(info->image, eb->data, eb->start,
+					     eb->len);
+
 	while (bytes_left) {
 		u64 read_len = bytes_left;
 
@@ -343,11 +412,18 @@ int btrfs_read_extent_buffer(struct extent_buffer *eb, u64 parent_transid,
 	int candidate_mirror = 0;
 	int num_copies;
 	int ignore = 0;
+	/* The first mirror was read and its checksum verified by readahead */
+	bool prefetched;
 
 	num_copies = btrfs_num_copies(fs_info, eb->start, eb->len);
+	prefetched = btrfs_tree_reada_get(eb);
 	while (1) {
-		ret = read_whole_eb(fs_info, eb, mirror_num);
-		if (ret == 0 && csum_tree_block(fs_info, eb, 1) == 0 &&
+		if (prefetched)
+			ret = 0;
+		else
+			ret = read_whole_eb(fs_info, eb, mirror_num);
+		if (ret == 0 &&
+		    (prefetched || csum_tree_block(fs_info, eb, 1) == 0) &&
 		    check_tree_block(fs_info, eb) == 0 &&
 		    verify_parent_transid(eb, parent_transid, ignore) == 0) {
 			if (eb->flags & EXTENT_BUFFER_BAD_TRANSID &&
@@ -375,6 +451,7 @@ int btrfs_read_extent_buffer(struct extent_buffer *eb, u64 parent_transid,
 			if (candidate_mirror <= 0)
 				candidate_mirror = mirror_num;
 		}
+		prefetched = false;
 		if (ignore) {
 			if (candidate_mirror > 0) {
 				mirror_num = candidate_mirror;
@@ -830,6 +907,10 @@ void btrfs_free_fs_info(struct btrfs_fs_info *fs_info)
 	free(fs_info->block_group_root);
 	free(fs_info->super_copy);
 	free(fs_info->log_root_tree);
+	free(fs_info->eb_hash);
+	slab_cache_destroy(fs_info->eb_slab);
+	if (fs_info->image)
+		fs_info->image_ops->close(fs_info->image);
 	free(fs_info);
 }
 
@@ -854,7 +935,8 @@ struct btrfs_fs_info *btrfs_new_fs_info(int writable, u64 sb_bytenr)
 	    !fs_info->block_group_root || !fs_info->super_copy)
 		goto free_all;
 
-	extent_buffer_init_cache(fs_info);
+	if (extent_buffer_init_cache(fs_info))
+		goto free_all;
 	extent_io_tree_init(fs_info, &fs_info->dirty_buffers, 0);
 	extent_io_tree_init(fs_info, &fs_info->free_space_cache, 0);
 	extent_io_tree_init(fs_info, &fs_info->pinned_extents, 0);
@@ -1437,6 +1519,56 @@ int btrfs_setup_chunk_tree_and_device_map(struct btrfs_fs_info *fs_info,
 	return 0;
 }
 
+static int read_image_super(struct btrfs_fs_info *fs_info,
+			    struct btrfs_super_block *sb, unsigned sbflags)
+{
+	struct btrfs_super_block buf;
+	int ret;
+
+	ret = fs_info->image_ops->read(fs_info->image, &buf,
+				       BTRFS_SUPER_INFO_OFFSET,
+				       BTRFS_SUPER_INFO_SIZE);
+	if (ret < 0)
+		return ret;
+	if (btrfs_super_bytenr(&buf) != BTRFS_SUPER_INFO_OFFSET)
+		return -EIO;
+	ret = btrfs_check_super(&buf, sbflags);
+	if (ret < 0)
+		return ret;
+	memcpy(sb, &buf, BTRFS_SUPER_INFO_SIZE);
+	return 0;
+}
+
+/*
+ * Set up reading from an image file instead of the devices. The image provides
+ * the superblock, the only device is the image file itself.
+ */
+static int open_image(int fp, struct btrfs_fs_info *fs_info,
+		      struct open_ctree_args *oca, unsigned sbflags,
+		      struct btrfs_fs_devices **fs_devices)
+{
+	int ret;
+
+	if (oca->flags & OPEN_CTREE_WRITES) {
+		error("%s image can be opened only read-only",
+		      btrfs_image_ops->name);
+		return -EROFS;
+	}
+	fs_info->image_ops = btrfs_image_ops;
+	fs_info->image = btrfs_image_ops->open(fp);
+	if (!fs_info->image)
+		return -EIO;
+
+	ret = read_image_super(fs_info, fs_info->super_copy, sbflags);
+	if (ret < 0) {
+		fprintf(stderr, "No valid Btrfs found in %s image %s\n",
+			btrfs_image_ops->name, oca->filename);
+		return ret;
+	}
+	return btrfs_scan_image_device(oca->filename, fs_info->super_copy,
+				       fs_devices);
+}
+
 static struct btrfs_fs_info *__open_ctree_fd(int fp, struct open_ctree_args *oca)
 {
 	struct btrfs_fs_info *fs_info;
@@ -1491,8 +1623,12 @@ static struct btrfs_fs_info *__open_ctree_fd(int fp, struct open_ctree_args *oca
 	if (flags & OPEN_CTREE_IGNORE_FSID_MISMATCH)
 		sbflags |= SBREAD_IGNORE_FSID_MISMATCH;
 
-	ret = btrfs_scan_fs_devices(fp, oca->filename, &fs_devices, sb_bytenr,
-			sbflags, (flags & OPEN_CTREE_NO_DEVICES));
+	if (btrfs_image_ops && btrfs_image_ops->detect(fp))
+		ret = open_image(fp, fs_info, oca, sbflags, &fs_devices);
+	else
+		ret = btrfs_scan_fs_devices(fp, oca->filename, &fs_devices,
+				sb_bytenr, sbflags,
+				(flags & OPEN_CTREE_NO_DEVICES));
 	if (ret)
 		goto out;
 
@@ -1510,7 +1646,9 @@ static struct btrfs_fs_info *__open_ctree_fd(int fp, struct open_ctree_args *oca
 		goto out;
 
 	disk_super = fs_info->super_copy;
-	if (flags & OPEN_CTREE_RECOVER_SUPER)
+	if (fs_info->image)
+		ret = 0;
+	else if (flags & OPEN_CTREE_RECOVER_SUPER)
 		ret = btrfs_read_dev_super(fs_devices->latest_bdev, disk_super,
 				sb_bytenr, SBREAD_RECOVER);
 	else if (flags & OPEN_CTREE_USE_LATEST_BDEV)
@@ -2196,6 +2334,8 @@ int close_ctree_fs_info(struct btrfs_fs_info *fs_info)
 	struct btrfs_trans_handle *trans;
 	struct btrfs_root *root = fs_info->tree_root;
 
+	btrfs_tree_reada_stop(fs_info);
+
 	if (fs_info->last_trans_committed !=
 	    fs_info->generation) {
 		BUG_ON(!root);
@@ -146,6 +146,25 @@ static inline u64 btrfs_sb_offset(int mirror)
 	return BTRFS_SUPER_INFO_OFFSET;
 }
 
+/*
+ * Read-only access to a filesystem stored in an image file that is not a copy
+ * of the devices, eg. a metadump. The blocks are read from the image by their
+ * logical address, bypassing the chunk mapping.
+ */
+struct btrfs_image_ops {
+	const char *name;
+	/* Return true if @fd is an image of this type */
+	bool (*detect)(int fd);
+	/* Return the image handle, the caller may close @fd afterwards */
+	void *(*open)(int fd);
+	void (*close)(void *image);
+	/* Read @len bytes at logical address @logical, thread safe */
+	int (*read)(void *image, void *buf, u64 logical, u64 len);
+};
+
+/* Set by the tools that can open images, NULL otherwise */
+extern const struct btrfs_image_ops *btrfs_image_ops;
+
 struct btrfs_device;
 
 int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirror);
@@ -217,6 +236,8 @@ int btrfs_buffer_uptodate(struct extent_buffer *buf, u64 parent_transid,
 int btrfs_set_buffer_uptodate(struct extent_buffer *buf);
 int btrfs_csum_data(struct btrfs_fs_info *fs_info, u16 csum_type, const u8 *data,
 		    u8 *out, size_t len);
+int btrfs_csum_data_multi(struct btrfs_fs_info *fs_info, u16 csum_type,
+			  const u8 *data, u8 *out, u32 blocksize, u32 nr);
 
 int btrfs_open_device(struct btrfs_device *dev);
 int csum_tree_block_size(struct extent_buffer *buf, u16 csum_sectorsize,
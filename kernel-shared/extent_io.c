@@ -35,22 +35,117 @@
 #include "common/utils.h"
 #include "common/device-utils.h"
 #include "common/internal.h"
+#include "common/tree-reada.h"
+#include "common/slab.h"
 
 static void free_extent_buffer_final(struct extent_buffer *eb);
 
-void extent_buffer_init_cache(struct btrfs_fs_info *fs_info)
+/*
+ * Extent buffer cache.
+ *
+ * Cached buffers are indexed by a hash table on their bytenr for lookups,
+ * and by the extent_cache tree which keeps them ordered and catches buffers
+ * overlapping a new one.  The tree is only searched when a buffer is not
+ * found in the hash table.
+ *
+ * Eviction uses the CLOCK algorithm.  Buffers are in a ring with a hand
+ * pointing to the next candidate.  An access only sets the REFERENCED flag,
+ * the hand clears it and skips the buffer once before it can be evicted.
+ * Buffers still in use are skipped, the hand keeps its position between
+ * trims so the same buffers are not scanned over and over.
+ */
+
+#define EB_HASH_MIN_BITS	(10)
+#define EB_HASH_MAX_BITS	(28)
+
+static inline unsigned int eb_hash_index(const struct btrfs_fs_info *fs_info,
+					 u64 bytenr)
+{
+	/* Multiplicative hashing, the golden ratio constant of hash_64() */
+	return ((bytenr >> 12) * 0x61C8864680B583EBULL) >>
+		(64 - fs_info->eb_hash_bits);
+}
+
+static struct hlist_head *eb_hash_alloc(unsigned int bits)
+{
+	struct hlist_head *hash;
+	unsigned int i;
+
+	hash = malloc(sizeof(*hash) << bits);
+	if (!hash)
+		return NULL;
+	for (i = 0; i < (1U << bits); i++)
+		INIT_HLIST_HEAD(&hash[i]);
+	return hash;
+}
+
+/*
+ * Double the hash table once there are more buffers than buckets.  Failure
+ * is not fatal, the chains just get longer.
+ */
+static void eb_hash_grow(struct btrfs_fs_info *fs_info)
+{
+	struct hlist_head *old = fs_info->eb_hash;
+	struct hlist_head *new;
+	unsigned int old_bits = fs_info->eb_hash_bits;
+	unsigned int i;
+
+	if (old_bits >= EB_HASH_MAX_BITS)
+		return;
+	new = eb_hash_alloc(old_bits + 1);
+	if (!new)
+		return;
+
+	fs_info->eb_hash = new;
+	fs_info->eb_hash_bits = old_bits + 1;
+	for (i = 0; i < (1U << old_bits); i++) {
+		struct extent_buffer *eb;
+		struct hlist_node *tmp;
+
+		hlist_for_each_entry_safe(eb, tmp, &old[i], hash_node) {
+			hlist_del(&eb->hash_node);
+			hlist_add_head(&eb->hash_node,
+				       &new[eb_hash_index(fs_info, eb->start)]);
+		}
+	}
+	free(old);
+}
+
+static struct extent_buffer *eb_hash_lookup(struct btrfs_fs_info *fs_info,
+					    u64 bytenr)
+{
+	struct hlist_head *head = &fs_info->eb_hash[eb_hash_index(fs_info, bytenr)];
+	struct extent_buffer *eb;
+
+	hlist_for_each_entry(eb, head, hash_node) {
+		if (eb->start == bytenr)
+			return eb;
+	}
+	return NULL;
+}
+
+int extent_buffer_init_cache(struct btrfs_fs_info *fs_info)
 {
 	fs_info->max_cache_size = total_memory() / 4;
 	fs_info->cache_size = 0;
-	INIT_LIST_HEAD(&fs_info->lru);
+	fs_info->nr_cached_ebs = 0;
+	fs_info->eb_hash_bits = EB_HASH_MIN_BITS;
+	fs_info->eb_hash = eb_hash_alloc(fs_info->eb_hash_bits);
+	if (!fs_info->eb_hash)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&fs_info->eb_clock);
+	fs_info->eb_clock_hand = &fs_info->eb_clock;
+	memset(&fs_info->eb_cache_stats, 0, sizeof(fs_info->eb_cache_stats));
+	return 0;
 }
 
 void extent_buffer_free_cache(struct btrfs_fs_info *fs_info)
 {
+	struct extent_buffer_cache_stats *stats = &fs_info->eb_cache_stats;
 	struct extent_buffer *eb;
 
-	while(!list_empty(&fs_info->lru)) {
-		eb = list_entry(fs_info->lru.next, struct extent_buffer, lru);
+	while(!list_empty(&fs_info->eb_clock)) {
+		eb = list_entry(fs_info->eb_clock.next, struct extent_buffer, clock);
 		if (eb->refs) {
 			/*
 			 * Reset extent buffer refs to 1, so the
@@ -68,6 +163,9 @@ void extent_buffer_free_cache(struct btrfs_fs_info *fs_info)
 
 	free_extent_cache_tree(&fs_info->extent_cache);
 	fs_info->cache_size = 0;
+	pr_verbose(LOG_DEBUG,
+		   "extent buffer cache: %llu hits %llu misses %llu evictions\n",
+		   stats->hits, stats->misses, stats->evictions);
 }
 
 /*
@@ -131,19 +229,40 @@ static struct extent_buffer *__alloc_extent_buffer(struct btrfs_fs_info *info,
 {
 	struct extent_buffer *eb;
 
+	/*
+	 * Tree blocks are all nodesize, take them from the slab to avoid the
+	 * malloc overhead and fragmentation with millions of buffers.
+	 */
+	if (info && info->nodesize && blocksize == info->nodesize) {
+		if (!info->eb_slab)
+			info->eb_slab = slab_cache_create("extent_buffer",
+					sizeof(struct extent_buffer) + blocksize,
+					SLAB_HUGEPAGE);
+		if (info->eb_slab) {
+			eb = slab_alloc(info->eb_slab);
+			if (!eb)
+				return NULL;
+			memset(eb, 0, sizeof(struct extent_buffer));
+			eb->flags = EXTENT_BUFFER_SLAB;
+			goto init;
+		}
+	}
+
 	eb = calloc(1, sizeof(struct extent_buffer) + blocksize);
 	if (!eb)
 		return NULL;
+	eb->flags = 0;
 
+init:
 	eb->start = bytenr;
 	eb->len = blocksize;
 	eb->refs = 1;
-	eb->flags = 0;
 	eb->cache_node.start = bytenr;
 	eb->cache_node.size = blocksize;
 	eb->fs_info = info;
 	INIT_LIST_HEAD(&eb->recow);
-	INIT_LIST_HEAD(&eb->lru);
+	INIT_LIST_HEAD(&eb->clock);
+	INIT_HLIST_NODE(&eb->hash_node);
 	memset_extent_buffer(eb, 0, 0, blocksize);
 
 	return eb;
@@ -163,16 +282,30 @@ struct extent_buffer *btrfs_clone_extent_buffer(struct extent_buffer *src)
 	return new;
 }
 
+static void __free_extent_buffer(struct extent_buffer *eb)
+{
+	if (eb->flags & EXTENT_BUFFER_SLAB)
+		slab_free(eb->fs_info->eb_slab, eb);
+	else
+		free(eb);
+}
+
 static void free_extent_buffer_final(struct extent_buffer *eb)
 {
+	struct btrfs_fs_info *fs_info = eb->fs_info;
+
 	BUG_ON(eb->refs);
-	list_del_init(&eb->lru);
 	if (!(eb->flags & EXTENT_BUFFER_DUMMY)) {
-		remove_cache_extent(&eb->fs_info->extent_cache, &eb->cache_node);
-		BUG_ON(eb->fs_info->cache_size < eb->len);
-		eb->fs_info->cache_size -= eb->len;
+		if (fs_info->eb_clock_hand == &eb->clock)
+			fs_info->eb_clock_hand = eb->clock.next;
+		list_del_init(&eb->clock);
+		hlist_del_init(&eb->hash_node);
+		remove_cache_extent(&fs_info->extent_cache, &eb->cache_node);
+		BUG_ON(fs_info->cache_size < eb->len);
+		fs_info->cache_size -= eb->len;
+		fs_info->nr_cached_ebs--;
 	}
-	free(eb);
+	__free_extent_buffer(eb);
 }
 
 static void free_extent_buffer_internal(struct extent_buffer *eb, bool free_now)
@@ -212,18 +345,17 @@ void free_extent_buffer_stale(struct extent_buffer *eb)
 struct extent_buffer *find_extent_buffer(struct btrfs_fs_info *fs_info,
 					 u64 bytenr)
 {
-	struct extent_buffer *eb = NULL;
-	struct cache_extent *cache;
+	struct extent_buffer *eb;
 
-	cache = lookup_cache_extent(&fs_info->extent_cache, bytenr,
-				    fs_info->nodesize);
-	if (cache && cache->start == bytenr &&
-	    cache->size == fs_info->nodesize) {
-		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &fs_info->lru);
+	eb = eb_hash_lookup(fs_info, bytenr);
+	if (eb && eb->len == fs_info->nodesize) {
+		fs_info->eb_cache_stats.hits++;
+		eb->flags |= EXTENT_BUFFER_REFERENCED;
 		eb->refs++;
+		return eb;
 	}
-	return eb;
+	fs_info->eb_cache_stats.misses++;
+	return NULL;
 }
 
 struct extent_buffer *find_first_extent_buffer(struct btrfs_fs_info *fs_info,
@@ -235,7 +367,7 @@ struct extent_buffer *find_first_extent_buffer(struct btrfs_fs_info *fs_info,
 	cache = search_cache_extent(&fs_info->extent_cache, start);
 	if (cache) {
 		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &fs_info->lru);
+		eb->flags |= EXTENT_BUFFER_REFERENCED;
 		eb->refs++;
 	}
 	return eb;
@@ -243,14 +375,33 @@ struct extent_buffer *find_first_extent_buffer(struct btrfs_fs_info *fs_info,
 
 static void trim_extent_buffer_cache(struct btrfs_fs_info *fs_info)
 {
-	struct extent_buffer *eb, *tmp;
+	const u64 target = (fs_info->max_cache_size * 9) / 10;
+	struct list_head *hand = fs_info->eb_clock_hand;
+	/* Two full rounds clear all the referenced bits on the way */
+	u64 budget = fs_info->nr_cached_ebs * 2;
 
-	list_for_each_entry_safe(eb, tmp, &fs_info->lru, lru) {
-		if (eb->refs == 0)
-			free_extent_buffer_final(eb);
-		if (fs_info->cache_size <= ((fs_info->max_cache_size * 9) / 10))
-			break;
+	while (fs_info->cache_size > target && budget--) {
+		struct extent_buffer *eb;
+
+		if (hand == &fs_info->eb_clock) {
+			hand = hand->next;
+			if (hand == &fs_info->eb_clock)
+				break;
+		}
+		eb = list_entry(hand, struct extent_buffer, clock);
+		hand = hand->next;
+		if (eb->refs)
+			continue;
+		if (eb->flags & EXTENT_BUFFER_REFERENCED) {
+			eb->flags &= ~EXTENT_BUFFER_REFERENCED;
+			continue;
+		}
+		fs_info->eb_clock_hand = hand;
+		free_extent_buffer_final(eb);
+		fs_info->eb_cache_stats.evictions++;
+		hand = fs_info->eb_clock_hand;
 	}
+	fs_info->eb_clock_hand = hand;
 }
 
 struct extent_buffer *alloc_extent_buffer(struct btrfs_fs_info *fs_info,
@@ -258,34 +409,40 @@ struct extent_buffer *alloc_extent_buffer(struct btrfs_fs_info *fs_info,
 {
 	struct extent_buffer *eb;
 	struct cache_extent *cache;
+	int ret;
 
-	cache = lookup_cache_extent(&fs_info->extent_cache, bytenr, blocksize);
-	if (cache && cache->start == bytenr &&
-	    cache->size == blocksize) {
-		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &fs_info->lru);
+	eb = eb_hash_lookup(fs_info, bytenr);
+	if (eb && eb->len == blocksize) {
+		fs_info->eb_cache_stats.hits++;
+		eb->flags |= EXTENT_BUFFER_REFERENCED;
 		eb->refs++;
-	} else {
-		int ret;
+		return eb;
+	}
+	fs_info->eb_cache_stats.misses++;
 
-		if (cache) {
-			eb = container_of(cache, struct extent_buffer,
-					  cache_node);
-			free_extent_buffer(eb);
-		}
-		eb = __alloc_extent_buffer(fs_info, bytenr, blocksize);
-		if (!eb)
-			return NULL;
-		ret = insert_cache_extent(&fs_info->extent_cache, &eb->cache_node);
-		if (ret) {
-			free(eb);
-			return NULL;
-		}
-		list_add_tail(&eb->lru, &fs_info->lru);
-		fs_info->cache_size += blocksize;
-		if (fs_info->cache_size >= fs_info->max_cache_size)
-			trim_extent_buffer_cache(fs_info);
+	cache = lookup_cache_extent(&fs_info->extent_cache, bytenr, blocksize);
+	if (cache) {
+		eb = container_of(cache, struct extent_buffer, cache_node);
+		free_extent_buffer(eb);
+	}
+	eb = __alloc_extent_buffer(fs_info, bytenr, blocksize);
+	if (!eb)
+		return NULL;
+	ret = insert_cache_extent(&fs_info->extent_cache, &eb->cache_node);
+	if (ret) {
+		__free_extent_buffer(eb);
+		return NULL;
 	}
+	hlist_add_head(&eb->hash_node,
+		       &fs_info->eb_hash[eb_hash_index(fs_info, bytenr)]);
+	/* New buffers go right behind the hand, the last to be looked at */
+	list_add_tail(&eb->clock, fs_info->eb_clock_hand);
+	fs_info->nr_cached_ebs++;
+	fs_info->cache_size += blocksize;
+	if (fs_info->nr_cached_ebs > (1ULL << fs_info->eb_hash_bits))
+		eb_hash_grow(fs_info);
+	if (fs_info->cache_size >= fs_info->max_cache_size)
+		trim_extent_buffer_cache(fs_info);
 	return eb;
 }
 
@@ -427,6 +584,10 @@ int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 logical,
 	u64 *raid_map = NULL;
 	int ret;
 
+	/* All mirrors are the same */
+	if (info->image)
+		return info->image_ops->read(info->image, buf, logical, *len);
+
 	ret = btrfs_map_block(info, READ, logical, &read_len, &multi, mirror,
 			      &raid_map);
 	if (ret) {
@@ -671,3 +832,21 @@ void btrfs_readahead_node_child(struct extent_buffer *node, int slot)
 	readahead_tree_block(node->fs_info, btrfs_node_blockptr(node, slot),
 			     btrfs_node_ptr_generation(node, slot));
 }
+
+/*
+ * btrfs_readahead_node_children - readahead all children of a node
+ * @node:	parent node we're reading from
+ *
+ * The requests are submitted as one batch so the readahead workers can
+ * order them by physical offset.
+ */
+void btrfs_readahead_node_children(struct extent_buffer *node)
+{
+	int nr = btrfs_header_nritems(node);
+	int i;
+
+	btrfs_tree_reada_plug(node->fs_info);
+	for (i = 0; i < nr; i++)
+		btrfs_readahead_node_child(node, i);
+	btrfs_tree_reada_unplug(node->fs_info);
+}
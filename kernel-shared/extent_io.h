@@ -29,6 +29,10 @@ struct extent_io_tree;
 #define EXTENT_BUFFER_DIRTY		(1U << 1)
 #define EXTENT_BUFFER_BAD_TRANSID	(1U << 2)
 #define EXTENT_BUFFER_DUMMY		(1U << 3)
+/* Accessed since the eviction clock hand passed the last time */
+#define EXTENT_BUFFER_REFERENCED	(1U << 4)
+/* Allocated from fs_info::eb_slab */
+#define EXTENT_BUFFER_SLAB		(1U << 5)
 
 #define BLOCK_GROUP_DATA	(1U << 1)
 #define BLOCK_GROUP_METADATA	(1U << 2)
@@ -55,10 +59,18 @@ static inline int le_test_bit(int nr, const u8 *addr)
 
 struct btrfs_fs_info;
 
+struct extent_buffer_cache_stats {
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+};
+
 struct extent_buffer {
 	struct cache_extent cache_node;
+	struct hlist_node hash_node;
 	u64 start;
-	struct list_head lru;
+	/* Position in the eviction clock */
+	struct list_head clock;
 	struct list_head recow;
 	u32 len;
 	int refs;
@@ -137,8 +149,9 @@ void extent_buffer_bitmap_clear(struct extent_buffer *eb, unsigned long start,
                                 unsigned long pos, unsigned long len);
 void extent_buffer_bitmap_set(struct extent_buffer *eb, unsigned long start,
                               unsigned long pos, unsigned long len);
-void extent_buffer_init_cache(struct btrfs_fs_info *fs_info);
+int extent_buffer_init_cache(struct btrfs_fs_info *fs_info);
 void extent_buffer_free_cache(struct btrfs_fs_info *fs_info);
 void btrfs_readahead_node_child(struct extent_buffer *node, int slot);
+void btrfs_readahead_node_children(struct extent_buffer *node);
 
 #endif
@@ -24,6 +24,7 @@
 #include "kernel-shared/transaction.h"
 #include "kernel-shared/print-tree.h"
 #include "kernel-shared/file-item.h"
+#include "kernel-shared/messages.h"
 #include "crypto/crc32c.h"
 #include "common/internal.h"
 
@@ -183,8 +184,9 @@ fail:
 	return ERR_PTR(ret);
 }
 
-int btrfs_csum_file_block(struct btrfs_trans_handle *trans, u64 logical,
-			  u64 csum_objectid, u32 csum_type, const char *data)
+/* Insert the already calculated checksum @csum of sector at @logical */
+static int insert_sector_csum(struct btrfs_trans_handle *trans, u64 logical,
+			      u64 csum_objectid, u32 csum_type, const u8 *csum)
 {
 	struct btrfs_root *root = btrfs_csum_root(trans->fs_info, logical);
 	int ret = 0;
@@ -196,7 +198,6 @@ int btrfs_csum_file_block(struct btrfs_trans_handle *trans, u64 logical,
 	struct btrfs_csum_item *item;
 	struct extent_buffer *leaf = NULL;
 	u64 csum_offset;
-	u8 csum_result[BTRFS_CSUM_SIZE];
 	u32 sectorsize = root->fs_info->sectorsize;
 	u32 nritems;
 	u32 ins_size;
@@ -315,16 +316,161 @@ csum:
 	item = (struct btrfs_csum_item *)((unsigned char *)item +
 					  csum_offset * csum_size);
 found:
-	btrfs_csum_data(root->fs_info, csum_type, (u8 *)data, csum_result,
-			sectorsize);
-	write_extent_buffer(leaf, csum_result, (unsigned long)item,
-			    csum_size);
+	write_extent_buffer(leaf, csum, (unsigned long)item, csum_size);
 	btrfs_mark_buffer_dirty(path->nodes[0]);
 fail:
 	btrfs_free_path(path);
 	return ret;
 }
 
+int btrfs_csum_file_block(struct btrfs_trans_handle *trans, u64 logical,
+			  u64 csum_objectid, u32 csum_type, const char *data)
+{
+	u8 csum_result[BTRFS_CSUM_SIZE];
+
+	btrfs_csum_data(trans->fs_info, csum_type, (u8 *)data, csum_result,
+			trans->fs_info->sectorsize);
+	return insert_sector_csum(trans, logical, csum_objectid, csum_type,
+				  csum_result);
+}
+
+/*
+ * Insert checksums of the sectors in [@logical, @logical + @len), the data are
+ * in @data. The checksums are calculated in one batch.
+ */
+int btrfs_csum_file_range(struct btrfs_trans_handle *trans, u64 logical,
+			  u64 len, u64 csum_objectid, u32 csum_type,
+			  const char *data)
+{
+	const u32 sectorsize = trans->fs_info->sectorsize;
+	const u16 csum_size = btrfs_csum_type_size(csum_type);
+	u32 nr = len / sectorsize;
+	u8 *csums;
+	u32 i;
+	int ret;
+
+	ASSERT(IS_ALIGNED(len, sectorsize));
+	csums = malloc((size_t)nr * csum_size);
+	if (!csums)
+		return -ENOMEM;
+
+	ret = btrfs_csum_data_multi(trans->fs_info, csum_type, (const u8 *)data,
+				    csums, sectorsize, nr);
+	for (i = 0; i < nr && ret == 0; i++)
+		ret = insert_sector_csum(trans, logical + (u64)i * sectorsize,
+					 csum_objectid, csum_type,
+					 csums + i * csum_size);
+	free(csums);
+	return ret;
+}
+
+/*
+ * Insert the already calculated checksums @csums of the sectors in
+ * [@logical, @logical + @len), which must not have any checksums yet.
+ *
+ * Unlike inserting the checksums sector by sector, an item ending right before
+ * @logical is extended and new items are filled with as many checksums as they
+ * can hold, so there's one tree search per item instead of one per sector.
+ */
+int btrfs_insert_file_csums(struct btrfs_trans_handle *trans, u64 logical,
+			    u64 len, u64 csum_objectid, u32 csum_type,
+			    const u8 *csums)
+{
+	struct btrfs_root *root = btrfs_csum_root(trans->fs_info, logical);
+	const u32 sectorsize = trans->fs_info->sectorsize;
+	const u16 csum_size = btrfs_csum_type_size(csum_type);
+	const u32 max_items = MAX_CSUM_ITEMS(root, csum_size);
+	struct btrfs_path path;
+	struct btrfs_key key;
+	struct btrfs_key found_key;
+	struct extent_buffer *leaf;
+	unsigned long ptr;
+	int ret = 0;
+
+	ASSERT(IS_ALIGNED(logical, sectorsize) && IS_ALIGNED(len, sectorsize));
+	btrfs_init_path(&path);
+	while (len > 0) {
+		u64 nr = len / sectorsize;
+		u64 next_offset = (u64)-1;
+		u32 item_nr;
+		u32 batch;
+		int slot;
+
+		key.objectid = csum_objectid;
+		key.type = BTRFS_EXTENT_CSUM_KEY;
+		key.offset = logical;
+		ret = btrfs_search_slot(trans, root, &key, &path, csum_size, 1);
+		if (ret < 0)
+			break;
+		if (ret == 0) {
+			ret = -EEXIST;
+			break;
+		}
+
+		/* Extend the previous item if it ends at @logical */
+		leaf = path.nodes[0];
+		slot = path.slots[0] - 1;
+		if (slot >= 0) {
+			btrfs_item_key_to_cpu(leaf, &found_key, slot);
+			item_nr = btrfs_item_size(leaf, slot) / csum_size;
+			batch = min_t(u64, nr, btrfs_leaf_free_space(leaf) / csum_size);
+			batch = min(batch, max_items - min(max_items, item_nr));
+			if (found_key.objectid == csum_objectid &&
+			    found_key.type == BTRFS_EXTENT_CSUM_KEY &&
+			    found_key.offset + (u64)item_nr * sectorsize == logical &&
+			    batch > 0) {
+				path.slots[0] = slot;
+				ret = btrfs_extend_item(root, &path,
+							batch * csum_size);
+				if (ret < 0)
+					break;
+				ptr = btrfs_item_ptr_offset(leaf, slot) +
+				      item_nr * csum_size;
+				goto write;
+			}
+		}
+
+		/* Otherwise insert a new item up to the next one */
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret < 0)
+				break;
+		} else {
+			ret = 0;
+		}
+		if (ret == 0) {
+			btrfs_item_key_to_cpu(path.nodes[0], &found_key,
+					      path.slots[0]);
+			if (found_key.objectid == csum_objectid &&
+			    found_key.type == BTRFS_EXTENT_CSUM_KEY)
+				next_offset = found_key.offset;
+		}
+		btrfs_release_path(&path);
+		batch = min_t(u64, nr, max_items);
+		batch = min_t(u64, batch, (next_offset - logical) / sectorsize);
+		if (batch == 0) {
+			ret = -EEXIST;
+			break;
+		}
+		ret = btrfs_insert_empty_item(trans, root, &path, &key,
+					      batch * csum_size);
+		if (ret < 0)
+			break;
+		leaf = path.nodes[0];
+		ptr = btrfs_item_ptr_offset(leaf, path.slots[0]);
+write:
+		write_extent_buffer(leaf, csums, ptr, batch * csum_size);
+		btrfs_mark_buffer_dirty(leaf);
+		btrfs_release_path(&path);
+
+		logical += (u64)batch * sectorsize;
+		len -= (u64)batch * sectorsize;
+		csums += batch * csum_size;
+	}
+	btrfs_release_path(&path);
+	return ret;
+}
+
 /*
  * helper function for csum removal, this expects the
  * key to describe the csum pointed to by the path, and it expects
@@ -82,6 +82,12 @@ int btrfs_insert_file_extent(struct btrfs_trans_handle *trans,
 			     u64 disk_num_bytes, u64 num_bytes);
 int btrfs_csum_file_block(struct btrfs_trans_handle *trans, u64 logical,
 			  u64 csum_objectid, u32 csum_type, const char *data);
+int btrfs_csum_file_range(struct btrfs_trans_handle *trans, u64 logical,
+			  u64 len, u64 csum_objectid, u32 csum_type,
+			  const char *data);
+int btrfs_insert_file_csums(struct btrfs_trans_handle *trans, u64 logical,
+			    u64 len, u64 csum_objectid, u32 csum_type,
+			    const u8 *csums);
 int btrfs_insert_inline_extent(struct btrfs_trans_handle *trans,
 			       struct btrfs_root *root, u64 objectid,
 			       u64 offset, const char *buffer, size_t size);
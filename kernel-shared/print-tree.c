@@ -1562,6 +1562,7 @@ static void dfs_print_children(struct extent_buffer *root_eb, unsigned int mode)
 	mode |= BTRFS_PRINT_TREE_DFS;
 	mode &= ~(BTRFS_PRINT_TREE_BFS);
 
+	btrfs_readahead_node_children(root_eb);
 	for (i = 0; i < nr; i++) {
 		next = read_tree_block(fs_info, btrfs_node_blockptr(root_eb, i),
 				       btrfs_header_owner(root_eb),
@@ -575,6 +575,13 @@ int btrfs_scan_one_device(int fd, const char *path,
 	return ret;
 }
 
+/* Register the image file as the device described by @sb */
+int btrfs_scan_image_device(const char *path, struct btrfs_super_block *sb,
+			    struct btrfs_fs_devices **fs_devices_ret)
+{
+	return device_list_add(path, sb, fs_devices_ret);
+}
+
 static u64 dev_extent_search_start(struct btrfs_device *device, u64 start)
 {
 	u64 zone_size;
@@ -283,6 +283,8 @@ int btrfs_add_device(struct btrfs_trans_handle *trans,
 		     struct btrfs_device *device);
 int btrfs_update_device(struct btrfs_trans_handle *trans,
 			struct btrfs_device *device);
+int btrfs_scan_image_device(const char *path, struct btrfs_super_block *sb,
+			    struct btrfs_fs_devices **fs_devices_ret);
 int btrfs_scan_one_device(int fd, const char *path,
 			  struct btrfs_fs_devices **fs_devices_ret,
 			  u64 *total_devs, u64 super_offset, unsigned sbflags);
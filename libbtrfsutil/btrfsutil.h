@@ -26,7 +26,7 @@
 #include <sys/time.h>
 
 #define BTRFS_UTIL_VERSION_MAJOR 1
-#define BTRFS_UTIL_VERSION_MINOR 2
+#define BTRFS_UTIL_VERSION_MINOR 3
 #define BTRFS_UTIL_VERSION_PATCH 0
 
 #ifdef __cplusplus
@@ -509,7 +509,16 @@ struct btrfs_util_subvolume_iterator;
  * is specified, foo/bar will be yielded before foo.
  */
 #define BTRFS_UTIL_SUBVOLUME_ITERATOR_POST_ORDER (1 << 0)
-#define BTRFS_UTIL_SUBVOLUME_ITERATOR_MASK ((1 << 1) - 1)
+/**
+ * BTRFS_UTIL_SUBVOLUME_ITERATOR_PREFETCH - Read all subvolumes and their
+ * information when the iterator is created, by a few large tree searches
+ * instead of separate searches for each subvolume. This is much faster on
+ * filesystems with many subvolumes, but the iterator doesn't see subvolumes
+ * created or deleted after it was created. It only has an effect when the
+ * iterator requires privilege (see btrfs_util_create_subvolume_iterator()).
+ */
+#define BTRFS_UTIL_SUBVOLUME_ITERATOR_PREFETCH (1 << 1)
+#define BTRFS_UTIL_SUBVOLUME_ITERATOR_MASK ((1 << 2) - 1)
 
 /**
  * btrfs_util_create_subvolume_iterator() - Create an iterator over subvolumes
@@ -606,6 +615,63 @@ enum btrfs_util_error btrfs_util_subvolume_iterator_next_info(struct btrfs_util_
 							      char **path_ret,
 							      struct btrfs_util_subvolume_info *subvol);
 
+/**
+ * struct btrfs_util_subvolume_entry - Subvolume returned by
+ * btrfs_util_subvolume_list_info().
+ */
+struct btrfs_util_subvolume_entry {
+	/**
+	 * @path: Path of the subvolume, relative to the subvolume ID used to
+	 * list the subvolumes.
+	 */
+	char *path;
+
+	/** @info: Information about the subvolume. */
+	struct btrfs_util_subvolume_info info;
+};
+
+/**
+ * btrfs_util_subvolume_list_info() - Get the paths and information of all
+ * subvolumes beneath a subvolume.
+ * @path: See btrfs_util_create_subvolume_iterator().
+ * @top: See btrfs_util_create_subvolume_iterator().
+ * @flags: See btrfs_util_create_subvolume_iterator().
+ * @entries: Returned array of subvolumes, in the order they would be returned
+ * by a subvolume iterator. Must be freed with
+ * btrfs_util_destroy_subvolume_list().
+ * @n: Returned number of entries in the @entries array.
+ *
+ * This is equivalent to iterating with
+ * btrfs_util_subvolume_iterator_next_info() and the
+ * BTRFS_UTIL_SUBVOLUME_ITERATOR_PREFETCH flag.
+ *
+ * This requires appropriate privilege (CAP_SYS_ADMIN) for kernels < 4.18. See
+ * btrfs_util_create_subvolume_iterator().
+ *
+ * Return: %BTRFS_UTIL_OK on success, non-zero error code on failure.
+ */
+enum btrfs_util_error btrfs_util_subvolume_list_info(const char *path,
+						     uint64_t top, int flags,
+						     struct btrfs_util_subvolume_entry **entries,
+						     size_t *n);
+
+/**
+ * btrfs_util_subvolume_list_info_fd() - See btrfs_util_subvolume_list_info().
+ */
+enum btrfs_util_error btrfs_util_subvolume_list_info_fd(int fd, uint64_t top,
+							int flags,
+							struct btrfs_util_subvolume_entry **entries,
+							size_t *n);
+
+/**
+ * btrfs_util_destroy_subvolume_list() - Free an array of subvolumes returned by
+ * btrfs_util_subvolume_list_info().
+ * @entries: Array to free.
+ * @n: Number of entries in the @entries array.
+ */
+void btrfs_util_destroy_subvolume_list(struct btrfs_util_subvolume_entry *entries,
+				       size_t n);
+
 /**
  * btrfs_util_deleted_subvolumes() - Get a list of subvolume which have been
  * deleted but not yet cleaned up.
@@ -261,6 +261,17 @@ static PyMethodDef btrfsutil_methods[] = {
 	 "path -- string, bytes, or path-like object\n"
 	 "recursive -- if the given subvolume has child subvolumes, delete\n"
 	 "them instead of failing"},
+	{"subvolume_list_info", (PyCFunction)subvolume_list_info,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "subvolume_list_info(path, top=0, post_order=False) -> list\n\n"
+	 "Get a list of (path, SubvolumeInfo) tuples of all subvolumes beneath a\n"
+	 "subvolume, in the order SubvolumeIterator would produce them. The\n"
+	 "subvolumes are read by a few large searches where possible.\n\n"
+	 "Arguments:\n"
+	 "path -- string, bytes, path-like object, or open file descriptor in\n"
+	 "filesystem to list\n"
+	 "top -- see SubvolumeIterator\n"
+	 "post_order -- see SubvolumeIterator"},
 	{"deleted_subvolumes", (PyCFunction)deleted_subvolumes,
 	 METH_VARARGS | METH_KEYWORDS,
 	 "deleted_subvolumes(path)\n\n"
@@ -455,6 +455,67 @@ PyObject *deleted_subvolumes(PyObject *self, PyObject *args, PyObject *kwds)
 	return ret;
 }
 
+PyObject *subvolume_list_info(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *keywords[] = {"path", "top", "post_order", NULL};
+	struct path_arg path = {.allow_fd = true};
+	struct btrfs_util_subvolume_entry *entries;
+	enum btrfs_util_error err;
+	unsigned long long top = 0;
+	int post_order = 0;
+	int flags = 0;
+	PyObject *ret;
+	size_t n, i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|Kp:subvolume_list_info",
+					 keywords, &path_converter, &path, &top,
+					 &post_order))
+		return NULL;
+
+	if (post_order)
+		flags |= BTRFS_UTIL_SUBVOLUME_ITERATOR_POST_ORDER;
+
+	if (path.path) {
+		err = btrfs_util_subvolume_list_info(path.path, top, flags,
+						     &entries, &n);
+	} else {
+		err = btrfs_util_subvolume_list_info_fd(path.fd, top, flags,
+							&entries, &n);
+	}
+	if (err) {
+		SetFromBtrfsUtilErrorWithPath(err, &path);
+		path_cleanup(&path);
+		return NULL;
+	}
+
+	path_cleanup(&path);
+
+	ret = PyList_New(n);
+	if (!ret)
+		goto out;
+	for (i = 0; i < n; i++) {
+		PyObject *tmp, *item;
+
+		tmp = subvolume_info_to_object(&entries[i].info);
+		if (!tmp) {
+			Py_CLEAR(ret);
+			goto out;
+		}
+		item = Py_BuildValue("O&O", PyUnicode_DecodeFSDefault,
+				     entries[i].path, tmp);
+		Py_DECREF(tmp);
+		if (!item) {
+			Py_CLEAR(ret);
+			goto out;
+		}
+		PyList_SET_ITEM(ret, i, item);
+	}
+
+out:
+	btrfs_util_destroy_subvolume_list(entries, n);
+	return ret;
+}
+
 typedef struct {
 	PyObject_HEAD
 	struct btrfs_util_subvolume_iterator *iter;
@@ -522,21 +583,25 @@ static PyObject *SubvolumeIterator_next(SubvolumeIterator *self)
 static int SubvolumeIterator_init(SubvolumeIterator *self, PyObject *args,
 				  PyObject *kwds)
 {
-	static char *keywords[] = {"path", "top", "info", "post_order", NULL};
+	static char *keywords[] = {"path", "top", "info", "post_order",
+				   "prefetch", NULL};
 	struct path_arg path = {.allow_fd = true};
 	enum btrfs_util_error err;
 	unsigned long long top = 0;
 	int info = 0;
 	int post_order = 0;
+	int prefetch = 0;
 	int flags = 0;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|Kpp:SubvolumeIterator",
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|Kppp:SubvolumeIterator",
 					 keywords, &path_converter, &path, &top,
-					 &info, &post_order))
+					 &info, &post_order, &prefetch))
 		return -1;
 
 	if (post_order)
 		flags |= BTRFS_UTIL_SUBVOLUME_ITERATOR_POST_ORDER;
+	if (prefetch)
+		flags |= BTRFS_UTIL_SUBVOLUME_ITERATOR_PREFETCH;
 
 	if (path.path) {
 		err = btrfs_util_create_subvolume_iterator(path.path, top,
@@ -596,7 +661,7 @@ static PyObject *SubvolumeIterator_exit(SubvolumeIterator *self, PyObject *args,
 }
 
 #define SubvolumeIterator_DOC	\
-	 "SubvolumeIterator(path, top=0, info=False, post_order=False) -> new subvolume iterator\n\n"	\
+	 "SubvolumeIterator(path, top=0, info=False, post_order=False, prefetch=False) -> new subvolume iterator\n\n"	\
 	 "Create a new iterator that produces tuples of (path, ID) representing\n"	\
 	 "subvolumes on a filesystem.\n\n"						\
 	 "Arguments:\n"									\
@@ -609,7 +674,10 @@ static PyObject *SubvolumeIterator_exit(SubvolumeIterator *self, PyObject *args,
 	 "info -- bool indicating the iterator should yield SubvolumeInfo instead of\n"	\
 	 "the subvolume ID\n"								\
 	 "post_order -- bool indicating whether to yield parent subvolumes before\n"	\
-	 "child subvolumes (e.g., 'foo/bar' before 'foo')"
+	 "child subvolumes (e.g., 'foo/bar' before 'foo')\n"				\
+	 "prefetch -- bool indicating whether to read all subvolumes and their\n"	\
+	 "information when the iterator is created; this is much faster for many\n"	\
+	 "subvolumes but requires privilege and doesn't see later changes"
 
 static PyMethodDef SubvolumeIterator_methods[] = {
 	{"close", (PyCFunction)SubvolumeIterator_close,
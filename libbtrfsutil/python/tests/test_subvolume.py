@@ -398,6 +398,30 @@ class TestSubvolume(BtrfsTestCase):
                               ('foo/bar', 257),
                               ('foo', 256)])
 
+        for arg in self.path_or_fd('.'):
+            with self.subTest(type=type(arg)), btrfsutil.SubvolumeIterator(arg, prefetch=True) as it:
+                self.assertEqual(list(it), subvols)
+        with btrfsutil.SubvolumeIterator('.', post_order=True, prefetch=True) as it:
+            self.assertEqual(list(it),
+                             [('foo/bar/baz', 258),
+                              ('foo/bar', 257),
+                              ('foo', 256)])
+        with btrfsutil.SubvolumeIterator('.', info=True, prefetch=True) as it:
+            path, subvol = next(it)
+            self.assertEqual(path, 'foo')
+            self.assertEqual(subvol, btrfsutil.subvolume_info('foo'))
+
+        for arg in self.path_or_fd('.'):
+            with self.subTest(type=type(arg)):
+                self.assertEqual(
+                    [(path, subvol.id)
+                     for path, subvol in btrfsutil.subvolume_list_info(arg)],
+                    subvols)
+        self.assertEqual(
+            [(path, subvol.id)
+             for path, subvol in btrfsutil.subvolume_list_info('.', post_order=True)],
+            [('foo/bar/baz', 258), ('foo/bar', 257), ('foo', 256)])
+
         subvols = [
             ('bar', 257),
             ('bar/baz', 258),
@@ -468,6 +492,12 @@ class TestSubvolume(BtrfsTestCase):
             self.assertEqual(sorted(it), subvols)
         with btrfsutil.SubvolumeIterator('.', post_order=True) as it:
             self.assertEqual(sorted(it), subvols)
+        with btrfsutil.SubvolumeIterator('.', prefetch=True) as it:
+            self.assertEqual(sorted(it), subvols)
+        self.assertEqual(
+            sorted((path, subvol.id)
+                   for path, subvol in btrfsutil.subvolume_list_info('.')),
+            subvols)
 
         with btrfsutil.SubvolumeIterator('.') as it:
             self.assertGreaterEqual(it.fileno(), 0)
@@ -773,6 +773,12 @@ struct btrfs_util_subvolume_iterator {
 
 	char *cur_path;
 	size_t cur_path_capacity;
+
+	/* Used for BTRFS_UTIL_SUBVOLUME_ITERATOR_PREFETCH. */
+	bool prefetch;
+	struct btrfs_util_subvolume_entry *entries;
+	size_t nr_entries;
+	size_t entries_pos;
 };
 
 static struct search_stack_entry *top_search_stack_entry(struct btrfs_util_subvolume_iterator *iter)
@@ -929,6 +935,523 @@ static enum btrfs_util_error pop_search_stack(struct btrfs_util_subvolume_iterat
 	return BTRFS_UTIL_OK;
 }
 
+/* Size of the buffer for the prefetching tree search. */
+#define PREFETCH_SEARCH_BUF_SIZE (1024 * 1024)
+
+#define NO_SUBVOL SIZE_MAX
+
+/* Subvolume read by the prefetching tree search. */
+struct prefetch_subvol {
+	struct btrfs_util_subvolume_info info;
+	char *name;
+	size_t name_len;
+	bool have_root_item;
+	bool have_backref;
+	/* Indexes of the children, ordered by ID, and of the next sibling. */
+	size_t first_child;
+	size_t last_child;
+	size_t next_sibling;
+};
+
+/*
+ * Directory of subvolumes in their parent subvolume, looked up once for all
+ * subvolumes in the same directory.
+ */
+struct prefetch_dir {
+	uint64_t treeid;
+	uint64_t dirid;
+	bool looked_up;
+	enum btrfs_util_error err;
+	int lookup_errno;
+	char *path;
+};
+
+struct prefetch {
+	int fd;
+	struct prefetch_subvol *subvols;
+	size_t nr_subvols;
+	size_t subvols_capacity;
+	struct prefetch_dir *dirs;
+	size_t nr_dirs;
+	struct btrfs_util_subvolume_entry *entries;
+	size_t nr_entries;
+	size_t entries_capacity;
+};
+
+static struct prefetch_subvol *prefetch_get_subvol(struct prefetch *pf,
+						   uint64_t id)
+{
+	struct prefetch_subvol *subvol;
+
+	/* The search returns the items ordered by the subvolume ID. */
+	if (pf->nr_subvols && pf->subvols[pf->nr_subvols - 1].info.id == id)
+		return &pf->subvols[pf->nr_subvols - 1];
+
+	if (pf->nr_subvols >= pf->subvols_capacity) {
+		size_t new_capacity = pf->subvols_capacity ?
+				      pf->subvols_capacity * 2 : 64;
+		struct prefetch_subvol *new_subvols;
+
+		new_subvols = reallocarray(pf->subvols, new_capacity,
+					   sizeof(*pf->subvols));
+		if (!new_subvols)
+			return NULL;
+		pf->subvols = new_subvols;
+		pf->subvols_capacity = new_capacity;
+	}
+
+	subvol = &pf->subvols[pf->nr_subvols++];
+	memset(subvol, 0, sizeof(*subvol));
+	subvol->info.id = id;
+	subvol->first_child = NO_SUBVOL;
+	subvol->last_child = NO_SUBVOL;
+	subvol->next_sibling = NO_SUBVOL;
+	return subvol;
+}
+
+static enum btrfs_util_error prefetch_add_item(struct prefetch *pf,
+					       const struct btrfs_ioctl_search_header *header)
+{
+	uint64_t id = btrfs_search_header_objectid(header);
+	uint32_t type = btrfs_search_header_type(header);
+	uint32_t len = btrfs_search_header_len(header);
+	struct prefetch_subvol *subvol;
+
+	if ((id < BTRFS_FIRST_FREE_OBJECTID && id != BTRFS_FS_TREE_OBJECTID) ||
+	    id > BTRFS_LAST_FREE_OBJECTID)
+		return BTRFS_UTIL_OK;
+	if (type != BTRFS_ROOT_ITEM_KEY && type != BTRFS_ROOT_BACKREF_KEY)
+		return BTRFS_UTIL_OK;
+
+	subvol = prefetch_get_subvol(pf, id);
+	if (!subvol)
+		return BTRFS_UTIL_ERROR_NO_MEMORY;
+
+	if (type == BTRFS_ROOT_ITEM_KEY && !subvol->have_root_item) {
+		struct btrfs_root_item root = {};
+
+		/* Old root items are shorter. */
+		memcpy(&root, header + 1,
+		       len < sizeof(root) ? len : sizeof(root));
+		copy_root_item(&subvol->info, &root);
+		subvol->have_root_item = true;
+	} else if (type == BTRFS_ROOT_BACKREF_KEY && !subvol->have_backref &&
+		   len >= sizeof(struct btrfs_root_ref)) {
+		const struct btrfs_root_ref *ref;
+
+		ref = (const struct btrfs_root_ref *)(header + 1);
+		subvol->name_len = le16_to_cpu(ref->name_len);
+		if (subvol->name_len > len - sizeof(*ref))
+			subvol->name_len = len - sizeof(*ref);
+		subvol->name = malloc(subvol->name_len);
+		if (!subvol->name)
+			return BTRFS_UTIL_ERROR_NO_MEMORY;
+		memcpy(subvol->name, ref + 1, subvol->name_len);
+		subvol->info.parent_id = btrfs_search_header_offset(header);
+		subvol->info.dir_id = le64_to_cpu(ref->dirid);
+		subvol->have_backref = true;
+	}
+	return BTRFS_UTIL_OK;
+}
+
+/*
+ * Read the root items and backrefs of all subvolumes by one sweep over the
+ * root tree.
+ */
+static enum btrfs_util_error prefetch_search(struct prefetch *pf)
+{
+	struct btrfs_ioctl_search_args_v2 *search;
+	enum btrfs_util_error err = BTRFS_UTIL_OK;
+	int ret;
+
+	search = malloc(sizeof(*search) + PREFETCH_SEARCH_BUF_SIZE);
+	if (!search)
+		return BTRFS_UTIL_ERROR_NO_MEMORY;
+
+	memset(search, 0, sizeof(*search));
+	search->key.tree_id = BTRFS_ROOT_TREE_OBJECTID;
+	search->key.min_objectid = BTRFS_FS_TREE_OBJECTID;
+	search->key.max_objectid = BTRFS_LAST_FREE_OBJECTID;
+	search->key.min_type = BTRFS_ROOT_ITEM_KEY;
+	search->key.max_type = BTRFS_ROOT_BACKREF_KEY;
+	search->key.min_offset = 0;
+	search->key.max_offset = UINT64_MAX;
+	search->key.min_transid = 0;
+	search->key.max_transid = UINT64_MAX;
+	search->buf_size = PREFETCH_SEARCH_BUF_SIZE;
+
+	for (;;) {
+		const struct btrfs_ioctl_search_header *header = NULL;
+		size_t buf_off = 0;
+		uint64_t objectid, offset;
+		uint32_t type;
+		uint32_t i;
+
+		search->key.nr_items = UINT32_MAX;
+		ret = ioctl(pf->fd, BTRFS_IOC_TREE_SEARCH_V2, search);
+		if (ret == -1) {
+			err = BTRFS_UTIL_ERROR_SEARCH_FAILED;
+			goto out;
+		}
+		if (search->key.nr_items == 0)
+			break;
+
+		for (i = 0; i < search->key.nr_items; i++) {
+			header = (const struct btrfs_ioctl_search_header *)
+				 ((char *)search->buf + buf_off);
+			err = prefetch_add_item(pf, header);
+			if (err)
+				goto out;
+			buf_off += sizeof(*header) + btrfs_search_header_len(header);
+		}
+
+		/*
+		 * The range is of whole keys, continue right after the last
+		 * one.
+		 */
+		objectid = btrfs_search_header_objectid(header);
+		type = btrfs_search_header_type(header);
+		offset = btrfs_search_header_offset(header);
+		if (offset < UINT64_MAX) {
+			offset++;
+		} else if (type < UINT8_MAX) {
+			type++;
+			offset = 0;
+		} else if (objectid < search->key.max_objectid) {
+			objectid++;
+			type = 0;
+			offset = 0;
+		} else {
+			break;
+		}
+		search->key.min_objectid = objectid;
+		search->key.min_type = type;
+		search->key.min_offset = offset;
+	}
+
+out:
+	free(search);
+	return err;
+}
+
+static int prefetch_subvol_cmp(const void *a, const void *b)
+{
+	uint64_t id = *(const uint64_t *)a;
+	const struct prefetch_subvol *subvol = b;
+
+	if (id < subvol->info.id)
+		return -1;
+	if (id > subvol->info.id)
+		return 1;
+	return 0;
+}
+
+static size_t prefetch_find_subvol(struct prefetch *pf, uint64_t id)
+{
+	struct prefetch_subvol *subvol;
+
+	subvol = bsearch(&id, pf->subvols, pf->nr_subvols,
+			 sizeof(*pf->subvols), prefetch_subvol_cmp);
+	return subvol ? subvol - pf->subvols : NO_SUBVOL;
+}
+
+static int prefetch_dir_cmp(const void *a, const void *b)
+{
+	const struct prefetch_dir *dir1 = a;
+	const struct prefetch_dir *dir2 = b;
+
+	if (dir1->treeid != dir2->treeid)
+		return dir1->treeid < dir2->treeid ? -1 : 1;
+	if (dir1->dirid != dir2->dirid)
+		return dir1->dirid < dir2->dirid ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Link the subvolumes to their parents and collect the distinct directories
+ * containing them.
+ */
+static enum btrfs_util_error prefetch_build_tree(struct prefetch *pf)
+{
+	size_t i, j;
+
+	pf->dirs = calloc(pf->nr_subvols ? pf->nr_subvols : 1,
+			  sizeof(*pf->dirs));
+	if (!pf->dirs)
+		return BTRFS_UTIL_ERROR_NO_MEMORY;
+
+	for (i = 0; i < pf->nr_subvols; i++) {
+		struct prefetch_subvol *subvol = &pf->subvols[i];
+		struct prefetch_subvol *parent;
+		size_t parent_index;
+
+		if (!subvol->have_root_item || !subvol->have_backref)
+			continue;
+		parent_index = prefetch_find_subvol(pf, subvol->info.parent_id);
+		if (parent_index == NO_SUBVOL)
+			continue;
+
+		parent = &pf->subvols[parent_index];
+		if (parent->last_child == NO_SUBVOL)
+			parent->first_child = i;
+		else
+			pf->subvols[parent->last_child].next_sibling = i;
+		parent->last_child = i;
+
+		/* The subvolume root directory is an empty path. */
+		if (subvol->info.dir_id != BTRFS_FIRST_FREE_OBJECTID) {
+			pf->dirs[pf->nr_dirs].treeid = subvol->info.parent_id;
+			pf->dirs[pf->nr_dirs].dirid = subvol->info.dir_id;
+			pf->nr_dirs++;
+		}
+	}
+
+	qsort(pf->dirs, pf->nr_dirs, sizeof(*pf->dirs), prefetch_dir_cmp);
+	for (i = 0, j = 0; i < pf->nr_dirs; i++) {
+		if (j && prefetch_dir_cmp(&pf->dirs[j - 1], &pf->dirs[i]) == 0)
+			continue;
+		pf->dirs[j++] = pf->dirs[i];
+	}
+	pf->nr_dirs = j;
+	return BTRFS_UTIL_OK;
+}
+
+/*
+ * Get the path of the directory containing @subvol in its parent, with a
+ * trailing slash unless it's empty.
+ */
+static enum btrfs_util_error prefetch_dir_path(struct prefetch *pf,
+					       const struct prefetch_subvol *subvol,
+					       const char **path_ret)
+{
+	struct prefetch_dir key = {
+		.treeid = subvol->info.parent_id,
+		.dirid = subvol->info.dir_id,
+	};
+	struct prefetch_dir *dir;
+
+	if (subvol->info.dir_id == BTRFS_FIRST_FREE_OBJECTID) {
+		*path_ret = "";
+		return BTRFS_UTIL_OK;
+	}
+
+	dir = bsearch(&key, pf->dirs, pf->nr_dirs, sizeof(*pf->dirs),
+		      prefetch_dir_cmp);
+	if (!dir->looked_up) {
+		struct btrfs_ioctl_ino_lookup_args lookup = {
+			.treeid = dir->treeid,
+			.objectid = dir->dirid,
+		};
+		int ret;
+
+		ret = ioctl(pf->fd, BTRFS_IOC_INO_LOOKUP, &lookup);
+		if (ret == -1) {
+			dir->err = BTRFS_UTIL_ERROR_INO_LOOKUP_FAILED;
+			dir->lookup_errno = errno;
+		} else {
+			dir->path = strdup(lookup.name);
+			if (!dir->path)
+				return BTRFS_UTIL_ERROR_NO_MEMORY;
+		}
+		dir->looked_up = true;
+	}
+	if (dir->err) {
+		errno = dir->lookup_errno;
+		return dir->err;
+	}
+	*path_ret = dir->path;
+	return BTRFS_UTIL_OK;
+}
+
+static enum btrfs_util_error prefetch_add_entry(struct prefetch *pf,
+						const struct prefetch_subvol *subvol,
+						char *path)
+{
+	struct btrfs_util_subvolume_entry *entry;
+
+	if (pf->nr_entries >= pf->entries_capacity) {
+		size_t new_capacity = pf->entries_capacity ?
+				      pf->entries_capacity * 2 : 64;
+		struct btrfs_util_subvolume_entry *new_entries;
+
+		new_entries = reallocarray(pf->entries, new_capacity,
+					   sizeof(*pf->entries));
+		if (!new_entries)
+			return BTRFS_UTIL_ERROR_NO_MEMORY;
+		pf->entries = new_entries;
+		pf->entries_capacity = new_capacity;
+	}
+
+	entry = &pf->entries[pf->nr_entries++];
+	entry->path = path;
+	entry->info = subvol->info;
+	return BTRFS_UTIL_OK;
+}
+
+struct prefetch_stack_entry {
+	size_t index;
+	size_t next_child;
+	char *path;
+};
+
+/*
+ * Walk the subvolumes beneath @top in the same order as
+ * subvolume_iterator_next_tree_search() and build their paths.
+ */
+static enum btrfs_util_error prefetch_walk(struct prefetch *pf, uint64_t top,
+					   bool post_order)
+{
+	struct prefetch_stack_entry *stack;
+	size_t stack_len = 0, stack_capacity = 16;
+	enum btrfs_util_error err = BTRFS_UTIL_OK;
+	size_t top_index;
+
+	top_index = prefetch_find_subvol(pf, top);
+	if (top_index == NO_SUBVOL)
+		return BTRFS_UTIL_OK;
+
+	stack = malloc(stack_capacity * sizeof(*stack));
+	if (!stack)
+		return BTRFS_UTIL_ERROR_NO_MEMORY;
+	stack[0].index = top_index;
+	stack[0].next_child = pf->subvols[top_index].first_child;
+	stack[0].path = NULL;
+	stack_len = 1;
+
+	while (stack_len) {
+		struct prefetch_stack_entry *parent = &stack[stack_len - 1];
+		const struct prefetch_subvol *subvol;
+		const char *dir;
+		size_t parent_len, dir_len, path_len;
+		char *path, *p;
+
+		if (parent->next_child == NO_SUBVOL) {
+			stack_len--;
+			/* The top subvolume itself is not listed. */
+			if (post_order && stack_len) {
+				err = prefetch_add_entry(pf,
+						&pf->subvols[parent->index],
+						parent->path);
+				if (err) {
+					free(parent->path);
+					goto out;
+				}
+			}
+			continue;
+		}
+
+		subvol = &pf->subvols[parent->next_child];
+		parent->next_child = subvol->next_sibling;
+
+		err = prefetch_dir_path(pf, subvol, &dir);
+		if (err) {
+			/* See subvolume_iterator_next_tree_search(). */
+			if (errno == ENOENT) {
+				err = BTRFS_UTIL_OK;
+				continue;
+			}
+			goto out;
+		}
+
+		parent_len = parent->path ? strlen(parent->path) : 0;
+		dir_len = strlen(dir);
+		path_len = parent_len + (parent_len ? 1 : 0) + dir_len +
+			   subvol->name_len;
+		path = malloc(path_len + 1);
+		if (!path) {
+			err = BTRFS_UTIL_ERROR_NO_MEMORY;
+			goto out;
+		}
+		p = path;
+		if (parent_len) {
+			memcpy(p, parent->path, parent_len);
+			p += parent_len;
+			*p++ = '/';
+		}
+		memcpy(p, dir, dir_len);
+		p += dir_len;
+		memcpy(p, subvol->name, subvol->name_len);
+		p[subvol->name_len] = '\0';
+
+		if (!post_order) {
+			err = prefetch_add_entry(pf, subvol, path);
+			if (err) {
+				free(path);
+				goto out;
+			}
+		}
+
+		if (stack_len >= stack_capacity) {
+			struct prefetch_stack_entry *new_stack;
+
+			new_stack = reallocarray(stack, stack_capacity * 2,
+						 sizeof(*stack));
+			if (!new_stack) {
+				if (post_order)
+					free(path);
+				err = BTRFS_UTIL_ERROR_NO_MEMORY;
+				goto out;
+			}
+			stack = new_stack;
+			stack_capacity *= 2;
+		}
+		stack[stack_len].index = subvol - pf->subvols;
+		stack[stack_len].next_child = subvol->first_child;
+		stack[stack_len].path = path;
+		stack_len++;
+	}
+
+out:
+	/*
+	 * In pre-order the paths on the stack are already owned by the entries,
+	 * the top subvolume has no path.
+	 */
+	while (post_order && stack_len > 1)
+		free(stack[--stack_len].path);
+	free(stack);
+	return err;
+}
+
+static void prefetch_free(struct prefetch *pf)
+{
+	size_t i;
+
+	for (i = 0; i < pf->nr_subvols; i++)
+		free(pf->subvols[i].name);
+	free(pf->subvols);
+	for (i = 0; i < pf->nr_dirs; i++)
+		free(pf->dirs[i].path);
+	free(pf->dirs);
+}
+
+/*
+ * Read all subvolumes beneath @top with their information for
+ * BTRFS_UTIL_SUBVOLUME_ITERATOR_PREFETCH.
+ */
+static enum btrfs_util_error prefetch_subvolumes(int fd, uint64_t top,
+						 bool post_order,
+						 struct btrfs_util_subvolume_entry **entries_ret,
+						 size_t *n_ret)
+{
+	struct prefetch pf = { .fd = fd };
+	enum btrfs_util_error err;
+
+	err = prefetch_search(&pf);
+	if (!err)
+		err = prefetch_build_tree(&pf);
+	if (!err)
+		err = prefetch_walk(&pf, top, post_order);
+	prefetch_free(&pf);
+	if (err) {
+		btrfs_util_destroy_subvolume_list(pf.entries, pf.nr_entries);
+		return err;
+	}
+
+	*entries_ret = pf.entries;
+	*n_ret = pf.nr_entries;
+	return BTRFS_UTIL_OK;
+}
+
 PUBLIC enum btrfs_util_error btrfs_util_create_subvolume_iterator(const char *path,
 								  uint64_t top,
 								  int flags,
@@ -983,6 +1506,10 @@ PUBLIC enum btrfs_util_error btrfs_util_create_subvolume_iterator_fd(int fd,
 	iter->cur_fd = fd;
 	iter->flags = flags;
 	iter->use_tree_search = use_tree_search;
+	iter->prefetch = false;
+	iter->entries = NULL;
+	iter->nr_entries = 0;
+	iter->entries_pos = 0;
 
 	iter->search_stack_len = 0;
 	iter->search_stack_capacity = 4;
@@ -1004,6 +1531,25 @@ PUBLIC enum btrfs_util_error btrfs_util_create_subvolume_iterator_fd(int fd,
 	if (err)
 		goto out_cur_path;
 
+	if ((flags & BTRFS_UTIL_SUBVOLUME_ITERATOR_PREFETCH) &&
+	    use_tree_search) {
+		err = prefetch_subvolumes(fd, top,
+				flags & BTRFS_UTIL_SUBVOLUME_ITERATOR_POST_ORDER,
+				&iter->entries, &iter->nr_entries);
+		if (!err) {
+			iter->prefetch = true;
+		} else if (err == BTRFS_UTIL_ERROR_SEARCH_FAILED &&
+			   errno == ENOTTY) {
+			/*
+			 * Kernels < 3.16 don't have TREE_SEARCH_V2, iterate one
+			 * subvolume at a time instead.
+			 */
+			err = BTRFS_UTIL_OK;
+		} else {
+			goto out_cur_path;
+		}
+	}
+
 	*ret = iter;
 
 	return BTRFS_UTIL_OK;
@@ -1294,6 +1840,8 @@ PUBLIC enum btrfs_util_error btrfs_util_delete_subvolume_by_id_fd(int parent_fd,
 PUBLIC void btrfs_util_destroy_subvolume_iterator(struct btrfs_util_subvolume_iterator *iter)
 {
 	if (iter) {
+		btrfs_util_destroy_subvolume_list(iter->entries,
+						  iter->nr_entries);
 		free(iter->cur_path);
 		free(iter->search_stack);
 		if (iter->cur_fd != iter->fd)
@@ -1574,11 +2122,38 @@ out:
 	return BTRFS_UTIL_OK;
 }
 
+static enum btrfs_util_error subvolume_iterator_next_prefetch(struct btrfs_util_subvolume_iterator *iter,
+							      char **path_ret,
+							      uint64_t *id_ret,
+							      struct btrfs_util_subvolume_info *subvol)
+{
+	const struct btrfs_util_subvolume_entry *entry;
+
+	if (iter->entries_pos >= iter->nr_entries)
+		return BTRFS_UTIL_ERROR_STOP_ITERATION;
+
+	entry = &iter->entries[iter->entries_pos];
+	if (path_ret) {
+		*path_ret = strdup(entry->path);
+		if (!*path_ret)
+			return BTRFS_UTIL_ERROR_NO_MEMORY;
+	}
+	iter->entries_pos++;
+	if (id_ret)
+		*id_ret = entry->info.id;
+	if (subvol)
+		*subvol = entry->info;
+	return BTRFS_UTIL_OK;
+}
+
 PUBLIC enum btrfs_util_error btrfs_util_subvolume_iterator_next(struct btrfs_util_subvolume_iterator *iter,
 								char **path_ret,
 								uint64_t *id_ret)
 {
-	if (iter->use_tree_search) {
+	if (iter->prefetch) {
+		return subvolume_iterator_next_prefetch(iter, path_ret, id_ret,
+							NULL);
+	} else if (iter->use_tree_search) {
 		return subvolume_iterator_next_tree_search(iter, path_ret,
 							   id_ret);
 	} else {
@@ -1594,6 +2169,10 @@ PUBLIC enum btrfs_util_error btrfs_util_subvolume_iterator_next_info(struct btrf
 	enum btrfs_util_error err;
 	uint64_t id;
 
+	if (iter->prefetch)
+		return subvolume_iterator_next_prefetch(iter, path_ret, NULL,
+							subvol);
+
 	err = btrfs_util_subvolume_iterator_next(iter, path_ret, &id);
 	if (err)
 		return err;
@@ -1604,6 +2183,98 @@ PUBLIC enum btrfs_util_error btrfs_util_subvolume_iterator_next_info(struct btrf
 		return btrfs_util_subvolume_info_fd(iter->cur_fd, 0, subvol);
 }
 
+PUBLIC enum btrfs_util_error btrfs_util_subvolume_list_info(const char *path,
+							    uint64_t top,
+							    int flags,
+							    struct btrfs_util_subvolume_entry **entries,
+							    size_t *n)
+{
+	enum btrfs_util_error err;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return BTRFS_UTIL_ERROR_OPEN_FAILED;
+
+	err = btrfs_util_subvolume_list_info_fd(fd, top, flags, entries, n);
+	SAVE_ERRNO_AND_CLOSE(fd);
+	return err;
+}
+
+PUBLIC enum btrfs_util_error btrfs_util_subvolume_list_info_fd(int fd,
+							       uint64_t top,
+							       int flags,
+							       struct btrfs_util_subvolume_entry **entries,
+							       size_t *n)
+{
+	struct btrfs_util_subvolume_iterator *iter;
+	struct btrfs_util_subvolume_entry *list = NULL;
+	size_t list_len = 0, list_capacity = 0;
+	enum btrfs_util_error err;
+
+	err = btrfs_util_create_subvolume_iterator_fd(fd, top,
+			flags | BTRFS_UTIL_SUBVOLUME_ITERATOR_PREFETCH, &iter);
+	if (err)
+		return err;
+
+	if (iter->prefetch) {
+		/* Hand over the whole list. */
+		*entries = iter->entries;
+		*n = iter->nr_entries;
+		iter->entries = NULL;
+		iter->nr_entries = 0;
+		goto out;
+	}
+
+	for (;;) {
+		struct btrfs_util_subvolume_entry *entry;
+
+		if (list_len >= list_capacity) {
+			size_t new_capacity = list_capacity ?
+					      list_capacity * 2 : 64;
+			struct btrfs_util_subvolume_entry *new_list;
+
+			new_list = reallocarray(list, new_capacity,
+						sizeof(*list));
+			if (!new_list) {
+				err = BTRFS_UTIL_ERROR_NO_MEMORY;
+				break;
+			}
+			list = new_list;
+			list_capacity = new_capacity;
+		}
+
+		entry = &list[list_len];
+		err = btrfs_util_subvolume_iterator_next_info(iter,
+							      &entry->path,
+							      &entry->info);
+		if (err)
+			break;
+		list_len++;
+	}
+	if (err == BTRFS_UTIL_ERROR_STOP_ITERATION) {
+		*entries = list;
+		*n = list_len;
+		err = BTRFS_UTIL_OK;
+	} else {
+		btrfs_util_destroy_subvolume_list(list, list_len);
+	}
+
+out:
+	btrfs_util_destroy_subvolume_iterator(iter);
+	return err;
+}
+
+PUBLIC void btrfs_util_destroy_subvolume_list(struct btrfs_util_subvolume_entry *entries,
+					      size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		free(entries[i].path);
+	free(entries);
+}
+
 PUBLIC enum btrfs_util_error btrfs_util_deleted_subvolumes(const char *path,
 							   uint64_t **ids,
 							   size_t *n)
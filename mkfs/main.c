@@ -38,6 +38,7 @@
 #include "kernel-shared/volumes.h"
 #include "kernel-shared/transaction.h"
 #include "kernel-shared/zoned.h"
+#include "kernel-shared/compression.h"
 #include "crypto/hash.h"
 #include "common/defs.h"
 #include "common/internal.h"
@@ -431,6 +432,8 @@ static const char * const mkfs_usage[] = {
 	OPTLINE("-b|--byte-count SIZE", "set size of each device to SIZE (filesystem size is sum of all device sizes)"),
 	OPTLINE("-r|--rootdir DIR", "copy files from DIR to the image root directory"),
 	OPTLINE("--shrink", "(with --rootdir) shrink the filled filesystem to minimal size"),
+	OPTLINE("--compress ALGO[:LEVEL]", "(with --rootdir) compress the file data, ALGO is one of zlib, lzo, zstd"),
+	OPTLINE("--dedupe", "(with --rootdir) share the extents of files with identical content"),
 	OPTLINE("-K|--nodiscard", "do not perform whole device TRIM"),
 	OPTLINE("-f|--force", "force overwrite of existing filesystem"),
 	"General:",
@@ -984,6 +987,93 @@ static void *prepare_one_device(void *ctx)
 	return NULL;
 }
 
+#define MKFS_ZLIB_MAX_LEVEL		9
+#define MKFS_ZSTD_MAX_LEVEL		15
+#define MKFS_ZSTD_DEFAULT_LEVEL		3
+
+static const char *compression_name(enum btrfs_compression_type compression)
+{
+	switch (compression) {
+	case BTRFS_COMPRESS_ZLIB:
+		return "zlib";
+	case BTRFS_COMPRESS_LZO:
+		return "lzo";
+	case BTRFS_COMPRESS_ZSTD:
+		return "zstd";
+	default:
+		return "none";
+	}
+}
+
+/* Parse ALGO[:LEVEL] of --compress */
+static int parse_compression(const char *arg,
+			     enum btrfs_compression_type *compression,
+			     unsigned int *level)
+{
+	char type[16];
+	const char *colon;
+	unsigned int max_level;
+	int ret;
+
+	colon = strchr(arg, ':');
+	if (!colon)
+		colon = arg + strlen(arg);
+	if (colon - arg >= sizeof(type)) {
+		error("unknown compression type: %s", arg);
+		return -EINVAL;
+	}
+	memcpy(type, arg, colon - arg);
+	type[colon - arg] = 0;
+	ret = parse_compress_type(type);
+	if (ret < 0) {
+		error("unknown compression type: %s", type);
+		return ret;
+	}
+	*compression = ret;
+
+	switch (*compression) {
+	case BTRFS_COMPRESS_ZLIB:
+		*level = BTRFS_ZLIB_DEFAULT_LEVEL;
+		max_level = MKFS_ZLIB_MAX_LEVEL;
+		break;
+	case BTRFS_COMPRESS_LZO:
+#if !COMPRESSION_LZO
+		error("lzo support not compiled in");
+		return -EOPNOTSUPP;
+#endif
+		*level = 0;
+		max_level = 0;
+		break;
+	case BTRFS_COMPRESS_ZSTD:
+#if !COMPRESSION_ZSTD
+		error("zstd support not compiled in");
+		return -EOPNOTSUPP;
+#endif
+		*level = MKFS_ZSTD_DEFAULT_LEVEL;
+		max_level = MKFS_ZSTD_MAX_LEVEL;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (*colon) {
+		u64 value;
+
+		if (!max_level) {
+			error("compression %s does not support levels", type);
+			return -EINVAL;
+		}
+		value = arg_strtou64(colon + 1);
+		if (value < 1 || value > max_level) {
+			error("compression level of %s must be between 1 and %u",
+			      type, max_level);
+			return -EINVAL;
+		}
+		*level = value;
+	}
+	return 0;
+}
+
 int BOX_MAIN(mkfs)(int argc, char **argv)
 {
 	char *file;
@@ -996,6 +1086,9 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 	int i;
 	bool ssd = false;
 	bool shrink_rootdir = false;
+	enum btrfs_compression_type compression = BTRFS_COMPRESS_NONE;
+	unsigned int compression_level = 0;
+	bool dedupe = false;
 	u64 source_dir_size = 0;
 	u64 min_dev_size;
 	u64 shrink_size;
@@ -1037,6 +1130,8 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			GETOPT_VAL_SHRINK = GETOPT_VAL_FIRST,
 			GETOPT_VAL_CHECKSUM,
 			GETOPT_VAL_GLOBAL_ROOTS,
+			GETOPT_VAL_COMPRESS,
+			GETOPT_VAL_DEDUPE,
 		};
 		static const struct option long_options[] = {
 			{ "byte-count", required_argument, NULL, 'b' },
@@ -1061,6 +1156,9 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			{ "quiet", 0, NULL, 'q' },
 			{ "verbose", 0, NULL, 'v' },
 			{ "shrink", no_argument, NULL, GETOPT_VAL_SHRINK },
+			{ "compress", required_argument, NULL,
+				GETOPT_VAL_COMPRESS },
+			{ "dedupe", no_argument, NULL, GETOPT_VAL_DEDUPE },
 #if EXPERIMENTAL
 			{ "num-global-roots", required_argument, NULL, GETOPT_VAL_GLOBAL_ROOTS },
 #endif
@@ -1185,6 +1283,14 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			case GETOPT_VAL_SHRINK:
 				shrink_rootdir = true;
 				break;
+			case GETOPT_VAL_COMPRESS:
+				if (parse_compression(optarg, &compression,
+						      &compression_level))
+					goto error;
+				break;
+			case GETOPT_VAL_DEDUPE:
+				dedupe = true;
+				break;
 			case GETOPT_VAL_CHECKSUM:
 				csum_type = parse_csum_type(optarg);
 				break;
@@ -1227,6 +1333,18 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 		error("the option --shrink must be used with --rootdir");
 		goto error;
 	}
+	if (compression && source_dir == NULL) {
+		error("the option --compress must be used with --rootdir");
+		goto error;
+	}
+	if (dedupe && source_dir == NULL) {
+		error("the option --dedupe must be used with --rootdir");
+		goto error;
+	}
+	if (compression == BTRFS_COMPRESS_LZO)
+		features.incompat_flags |= BTRFS_FEATURE_INCOMPAT_COMPRESS_LZO;
+	else if (compression == BTRFS_COMPRESS_ZSTD)
+		features.incompat_flags |= BTRFS_FEATURE_INCOMPAT_COMPRESS_ZSTD;
 
 	if (*fs_uuid) {
 		uuid_t dummy_uuid;
@@ -1724,7 +1842,17 @@ raid_groups:
 
 	if (source_dir) {
 		pr_verbose(LOG_DEFAULT, "Rootdir from:       %s\n", source_dir);
-		ret = btrfs_mkfs_fill_dir(source_dir, root);
+		if (compression && compression_level)
+			pr_verbose(LOG_DEFAULT, "  Compress:         %s:%u\n",
+				   compression_name(compression),
+				   compression_level);
+		else if (compression)
+			pr_verbose(LOG_DEFAULT, "  Compress:         %s\n",
+				   compression_name(compression));
+		if (dedupe)
+			pr_verbose(LOG_DEFAULT, "  Dedupe:           yes\n");
+		ret = btrfs_mkfs_fill_dir(source_dir, root, compression,
+					  compression_level, dedupe);
 		if (ret) {
 			error("error while filling filesystem: %d", ret);
 			goto out;
@@ -29,17 +29,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#if COMPRESSION_LZO
+#include <lzo/lzoconf.h>
+#include <lzo/lzo1x.h>
+#endif
+#if COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
 #include "kernel-lib/sizes.h"
+#include "kernel-lib/bitops.h"
 #include "kernel-shared/extent_io.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/volumes.h"
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/transaction.h"
 #include "kernel-shared/file-item.h"
+#include "kernel-shared/compression.h"
+#include "kernel-shared/free-space-tree.h"
 #include "common/internal.h"
 #include "common/messages.h"
 #include "common/path-utils.h"
+#include "common/rbtree-utils.h"
 #include "common/utils.h"
+#include "crypto/hash.h"
 #include "mkfs/rootdir.h"
 
 static u32 fs_block_size;
@@ -302,135 +316,1249 @@ fail:
 	return ret;
 }
 
+/* Size of the reads of file data, done by the reader threads */
+#define ROOTDIR_CHUNK_SIZE		(SZ_4M)
+/* Limit of the file data read ahead */
+#define ROOTDIR_MAX_INFLIGHT		(SZ_256M)
+/* Limit of the files opened for reading ahead */
+#define ROOTDIR_MAX_FILES		(64)
+#define ROOTDIR_MAX_THREADS		(16)
+
+/* File data read and checksummed by a reader thread */
+struct rootdir_chunk {
+	/* In rootdir_file::chunks, in the order of the file */
+	struct list_head list;
+	/* In rootdir_reader::pending until picked by a reader thread */
+	struct list_head pending;
+	struct rootdir_file *file;
+	u64 offset;
+	u32 len;
+	/* End of the data segment the chunk is in */
+	u64 data_end;
+	char *buf;
+	u8 *csums;
+	/*
+	 * With compression, the compressed data of each BTRFS_MAX_UNCOMPRESSED
+	 * piece of buf at the same offset and its length rounded up to
+	 * sectorsize, or 0 if the piece is not compressed. The checksums of
+	 * compressed pieces are of the compressed data.
+	 */
+	char *cbuf;
+	u32 *clens;
+	int ret;
+	bool done;
+};
+
+/* Regular file with data being read ahead */
+struct rootdir_file {
+	/* In rootdir_reader::files, in the order the files are added */
+	struct list_head list;
+	/* Index in the directory listing */
+	int index;
+	int fd;
+	/* Size rounded up to sectorsize */
+	u64 size;
+	/* Next offset to read and the end of the data segment it's in */
+	u64 next;
+	u64 data_end;
+	bool eof;
+	struct list_head chunks;
+};
+
+/*
+ * The file data are read and checksummed by the reader threads ahead of the
+ * main thread, which inserts all the items in the order of the directory
+ * listing and writes the data.
+ */
+struct rootdir_reader {
+	struct btrfs_fs_info *fs_info;
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t pending_cond;
+	pthread_cond_t done_cond;
+	struct list_head pending;
+	bool stop;
+
+	/* Accessed only by the main thread */
+	struct list_head files;
+	int nr_files;
+	u64 inflight;
+	/*
+	 * Size of the data block groups, extents can't be larger, or less if
+	 * the block group of the last data extent is getting full
+	 */
+	u64 max_extent;
+	u64 last_block_group;
+
+	enum btrfs_compression_type compression;
+	unsigned int compression_level;
+};
+
+#define LZO_LEN		4
+#define lzo1x_worst_compress(x) ((x) + ((x) / 16) + 64 + 3)
+
+/* Compression state of a reader thread */
+struct rootdir_compress_ws {
+#if COMPRESSION_LZO
+	void *lzo_mem;
+	unsigned char *lzo_buf;
+#endif
+#if COMPRESSION_ZSTD
+	ZSTD_CCtx *zstd_ctx;
+#endif
+};
+
+static int compress_ws_init(struct rootdir_reader *reader,
+			    struct rootdir_compress_ws *ws)
+{
+	memset(ws, 0, sizeof(*ws));
+	switch (reader->compression) {
+#if COMPRESSION_LZO
+	case BTRFS_COMPRESS_LZO:
+		ws->lzo_mem = malloc(LZO1X_1_MEM_COMPRESS);
+		ws->lzo_buf = malloc(lzo1x_worst_compress(
+						reader->fs_info->sectorsize));
+		if (!ws->lzo_mem || !ws->lzo_buf)
+			return -ENOMEM;
+		break;
+#endif
+#if COMPRESSION_ZSTD
+	case BTRFS_COMPRESS_ZSTD:
+		ws->zstd_ctx = ZSTD_createCCtx();
+		if (!ws->zstd_ctx)
+			return -ENOMEM;
+		break;
+#endif
+	default:
+		break;
+	}
+	return 0;
+}
+
+static void compress_ws_free(struct rootdir_compress_ws *ws)
+{
+#if COMPRESSION_LZO
+	free(ws->lzo_mem);
+	free(ws->lzo_buf);
+#endif
+#if COMPRESSION_ZSTD
+	ZSTD_freeCCtx(ws->zstd_ctx);
+#endif
+}
+
+#if COMPRESSION_LZO
+/*
+ * The format of btrfs lzo: total length, then each sector of the input
+ * compressed separately as a segment prefixed by its length. The length of a
+ * segment never crosses a sector boundary, the rest of the sector is padded
+ * by zeros instead.
+ */
+static u32 compress_lzo(struct rootdir_compress_ws *ws, u32 sectorsize,
+			const char *in, u32 len, char *out, u32 limit)
+{
+	u32 out_len = LZO_LEN;
+	u32 in_off;
+
+	for (in_off = 0; in_off < len; in_off += sectorsize) {
+		u32 rem = sectorsize - out_len % sectorsize;
+		lzo_uint seg_len;
+		int ret;
+
+		if (rem < LZO_LEN) {
+			if (out_len + rem > limit)
+				return 0;
+			memset(out + out_len, 0, rem);
+			out_len += rem;
+		}
+		ret = lzo1x_1_compress((const unsigned char *)in + in_off,
+				       min(sectorsize, len - in_off),
+				       ws->lzo_buf, &seg_len, ws->lzo_mem);
+		if (ret != LZO_E_OK || out_len + LZO_LEN + seg_len > limit)
+			return 0;
+		put_unaligned_le32(seg_len, out + out_len);
+		memcpy(out + out_len + LZO_LEN, ws->lzo_buf, seg_len);
+		out_len += LZO_LEN + seg_len;
+	}
+	put_unaligned_le32(out_len, out);
+	return out_len;
+}
+#endif
+
+/*
+ * Compress @len bytes from @in to at most @limit bytes to @out. Return the
+ * compressed length, or 0 if the data don't compress well enough.
+ */
+static u32 compress_data(struct rootdir_reader *reader,
+			 struct rootdir_compress_ws *ws, const char *in,
+			 u32 len, char *out, u32 limit)
+{
+	switch (reader->compression) {
+	case BTRFS_COMPRESS_ZLIB: {
+		uLongf out_len = limit;
+
+		if (compress2((Bytef *)out, &out_len, (const Bytef *)in, len,
+			      reader->compression_level) != Z_OK)
+			return 0;
+		return out_len;
+	}
+#if COMPRESSION_LZO
+	case BTRFS_COMPRESS_LZO:
+		return compress_lzo(ws, reader->fs_info->sectorsize, in, len,
+				    out, limit);
+#endif
+#if COMPRESSION_ZSTD
+	case BTRFS_COMPRESS_ZSTD: {
+		size_t out_len;
+
+		out_len = ZSTD_compressCCtx(ws->zstd_ctx, out, limit, in, len,
+					    reader->compression_level);
+		if (ZSTD_isError(out_len))
+			return 0;
+		return out_len;
+	}
+#endif
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Compress the chunk in pieces of the maximum size of a compressed extent and
+ * checksum what is going to be written.
+ */
+static int compress_csum_chunk(struct rootdir_reader *reader,
+			       struct rootdir_compress_ws *ws,
+			       struct rootdir_chunk *chunk)
+{
+	struct btrfs_fs_info *fs_info = reader->fs_info;
+	const u32 sectorsize = fs_info->sectorsize;
+	u32 offset;
+	int i;
+	int ret;
+
+	for (offset = 0, i = 0; offset < chunk->len;
+	     offset += BTRFS_MAX_UNCOMPRESSED, i++) {
+		u32 len = min_t(u32, chunk->len - offset,
+				BTRFS_MAX_UNCOMPRESSED);
+		char *data = chunk->buf + offset;
+		u32 clen = 0;
+
+		/* Compression must save at least one sector */
+		if (len > sectorsize)
+			clen = compress_data(reader, ws, data, len,
+					     chunk->cbuf + offset,
+					     len - sectorsize);
+		if (clen) {
+			chunk->clens[i] = round_up(clen, sectorsize);
+			memset(chunk->cbuf + offset + clen, 0,
+			       chunk->clens[i] - clen);
+			data = chunk->cbuf + offset;
+			len = chunk->clens[i];
+		} else {
+			chunk->clens[i] = 0;
+		}
+		ret = btrfs_csum_data_multi(fs_info, fs_info->csum_type,
+				(u8 *)data, chunk->csums +
+				offset / sectorsize * fs_info->csum_size,
+				sectorsize, len / sectorsize);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct rootdir_reader *reader = arg;
+	struct btrfs_fs_info *fs_info = reader->fs_info;
+	struct rootdir_compress_ws ws;
+	struct rootdir_chunk *chunk;
+	u32 done;
+	ssize_t ret;
+	int ws_ret;
+
+	ws_ret = compress_ws_init(reader, &ws);
+	while (1) {
+		pthread_mutex_lock(&reader->lock);
+		while (!reader->stop && list_empty(&reader->pending))
+			pthread_cond_wait(&reader->pending_cond, &reader->lock);
+		if (reader->stop) {
+			pthread_mutex_unlock(&reader->lock);
+			break;
+		}
+		chunk = list_first_entry(&reader->pending, struct rootdir_chunk,
+					 pending);
+		list_del_init(&chunk->pending);
+		pthread_mutex_unlock(&reader->lock);
+
+		/* The file may be shorter than expected, the rest is zeroed */
+		done = 0;
+		while (done < chunk->len) {
+			ret = pread(chunk->file->fd, chunk->buf + done,
+				    chunk->len - done, chunk->offset + done);
+			if (ret < 0) {
+				chunk->ret = -errno;
+				break;
+			}
+			if (ret == 0)
+				break;
+			done += ret;
+		}
+		memset(chunk->buf + done, 0, chunk->len - done);
+		if (!chunk->ret && chunk->clens)
+			chunk->ret = ws_ret ?: compress_csum_chunk(reader, &ws,
+								   chunk);
+		else if (!chunk->ret)
+			chunk->ret = btrfs_csum_data_multi(fs_info,
+					fs_info->csum_type, (u8 *)chunk->buf,
+					chunk->csums, fs_info->sectorsize,
+					chunk->len / fs_info->sectorsize);
+
+		pthread_mutex_lock(&reader->lock);
+		chunk->done = true;
+		pthread_cond_broadcast(&reader->done_cond);
+		pthread_mutex_unlock(&reader->lock);
+	}
+	compress_ws_free(&ws);
+	return NULL;
+}
+
+static int rootdir_reader_init(struct rootdir_reader *reader,
+			       struct btrfs_fs_info *fs_info,
+			       enum btrfs_compression_type compression,
+			       unsigned int compression_level)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct btrfs_block_group *cache;
+	int ret;
+	int i;
+
+	memset(reader, 0, sizeof(*reader));
+	reader->fs_info = fs_info;
+	reader->compression = compression;
+	reader->compression_level = compression_level;
+	pthread_mutex_init(&reader->lock, NULL);
+	pthread_cond_init(&reader->pending_cond, NULL);
+	pthread_cond_init(&reader->done_cond, NULL);
+	INIT_LIST_HEAD(&reader->pending);
+	INIT_LIST_HEAD(&reader->files);
+
+	reader->max_extent = fs_info->sectorsize;
+	cache = btrfs_lookup_first_block_group(fs_info, 0);
+	while (cache) {
+		if (cache->flags & BTRFS_BLOCK_GROUP_DATA)
+			reader->max_extent = max(reader->max_extent,
+						 cache->length);
+		cache = btrfs_lookup_first_block_group(fs_info,
+						cache->start + cache->length);
+	}
+	reader->max_extent = min_t(u64, reader->max_extent,
+				   BTRFS_MAX_EXTENT_SIZE);
+
+#if COMPRESSION_LZO
+	if (compression == BTRFS_COMPRESS_LZO && lzo_init() != LZO_E_OK) {
+		error("lzo init failed");
+		return -EINVAL;
+	}
+#endif
+
+	nr_cpus = clamp_t(long, nr_cpus, 1, ROOTDIR_MAX_THREADS);
+	reader->threads = calloc(nr_cpus, sizeof(pthread_t));
+	if (!reader->threads)
+		return -ENOMEM;
+	for (i = 0; i < nr_cpus; i++) {
+		ret = pthread_create(&reader->threads[i], NULL, reader_thread,
+				     reader);
+		if (ret) {
+			errno = ret;
+			error("failed to start reader thread: %m");
+			return -ret;
+		}
+		reader->nr_threads++;
+	}
+	return 0;
+}
+
+static void free_file_chunk(struct rootdir_reader *reader,
+			    struct rootdir_chunk *chunk)
+{
+	list_del(&chunk->list);
+	reader->inflight -= chunk->len;
+	free(chunk->buf);
+	free(chunk->csums);
+	free(chunk->cbuf);
+	free(chunk->clens);
+	free(chunk);
+}
+
+/* Wait until the reader threads are done with all the chunks of @file */
+static void release_file(struct rootdir_reader *reader,
+			 struct rootdir_file *file)
+{
+	struct rootdir_chunk *chunk;
+
+	pthread_mutex_lock(&reader->lock);
+	list_for_each_entry(chunk, &file->chunks, list) {
+		/* Not picked yet */
+		if (!list_empty(&chunk->pending)) {
+			list_del_init(&chunk->pending);
+			continue;
+		}
+		while (!chunk->done)
+			pthread_cond_wait(&reader->done_cond, &reader->lock);
+	}
+	pthread_mutex_unlock(&reader->lock);
+
+	while (!list_empty(&file->chunks)) {
+		chunk = list_first_entry(&file->chunks, struct rootdir_chunk,
+					 list);
+		free_file_chunk(reader, chunk);
+	}
+	list_del(&file->list);
+	reader->nr_files--;
+	close(file->fd);
+	free(file);
+}
+
+/* Release the files that were read ahead but not added, up to @index */
+static void release_files_before(struct rootdir_reader *reader, int index)
+{
+	struct rootdir_file *file;
+
+	while (!list_empty(&reader->files)) {
+		file = list_first_entry(&reader->files, struct rootdir_file,
+					list);
+		if (file->index >= index)
+			break;
+		release_file(reader, file);
+	}
+}
+
+static void rootdir_reader_free(struct rootdir_reader *reader)
+{
+	int i;
+
+	release_files_before(reader, INT_MAX);
+	pthread_mutex_lock(&reader->lock);
+	reader->stop = true;
+	pthread_cond_broadcast(&reader->pending_cond);
+	pthread_mutex_unlock(&reader->lock);
+	for (i = 0; i < reader->nr_threads; i++)
+		pthread_join(reader->threads[i], NULL);
+	free(reader->threads);
+	pthread_mutex_destroy(&reader->lock);
+	pthread_cond_destroy(&reader->pending_cond);
+	pthread_cond_destroy(&reader->done_cond);
+}
+
+/*
+ * Find the data segment of @file at or after file->next, holes are skipped.
+ * Return false if there's no more data.
+ */
+static bool next_data_segment(struct rootdir_file *file, u32 sectorsize)
+{
+	off_t start;
+	off_t end;
+
+	start = lseek(file->fd, file->next, SEEK_DATA);
+	if (start < 0) {
+		if (errno == ENXIO)
+			return false;
+		/* Holes can't be detected, read everything */
+		start = file->next;
+		end = file->size;
+	} else {
+		end = lseek(file->fd, start, SEEK_HOLE);
+		if (end < 0)
+			end = file->size;
+	}
+	/* Sectors partially in data are data, the previous one ends aligned */
+	start = max_t(u64, round_down(start, sectorsize), file->next);
+	end = min_t(u64, round_up(end, sectorsize), file->size);
+	if (start >= end)
+		return false;
+	file->next = start;
+	file->data_end = end;
+	return true;
+}
+
+/* Queue the next chunk of @file for reading, return false if there's none */
+static bool submit_chunk(struct rootdir_reader *reader,
+			 struct rootdir_file *file)
+{
+	const u32 sectorsize = reader->fs_info->sectorsize;
+	const u16 csum_size = reader->fs_info->csum_size;
+	struct rootdir_chunk *chunk;
+
+	if (file->eof)
+		return false;
+	if (file->next >= file->data_end &&
+	    !next_data_segment(file, sectorsize)) {
+		file->eof = true;
+		return false;
+	}
+
+	chunk = calloc(1, sizeof(*chunk));
+	if (!chunk)
+		return false;
+	chunk->file = file;
+	chunk->offset = file->next;
+	chunk->len = min_t(u64, file->data_end - file->next, ROOTDIR_CHUNK_SIZE);
+	chunk->data_end = file->data_end;
+	chunk->buf = malloc(chunk->len);
+	chunk->csums = malloc(chunk->len / sectorsize * csum_size);
+	if (reader->compression) {
+		chunk->cbuf = malloc(chunk->len);
+		chunk->clens = calloc(DIV_ROUND_UP(chunk->len,
+						   BTRFS_MAX_UNCOMPRESSED),
+				      sizeof(u32));
+	}
+	if (!chunk->buf || !chunk->csums ||
+	    (reader->compression && (!chunk->cbuf || !chunk->clens))) {
+		free(chunk->buf);
+		free(chunk->csums);
+		free(chunk->cbuf);
+		free(chunk->clens);
+		free(chunk);
+		return false;
+	}
+	file->next += chunk->len;
+	reader->inflight += chunk->len;
+	list_add_tail(&chunk->list, &file->chunks);
+
+	pthread_mutex_lock(&reader->lock);
+	list_add_tail(&chunk->pending, &reader->pending);
+	pthread_cond_signal(&reader->pending_cond);
+	pthread_mutex_unlock(&reader->lock);
+	return true;
+}
+
+/* Read ahead the data of the open files, in their order */
+static void submit_chunks(struct rootdir_reader *reader)
+{
+	struct rootdir_file *file;
+
+	list_for_each_entry(file, &reader->files, list) {
+		while (reader->inflight < ROOTDIR_MAX_INFLIGHT) {
+			if (!submit_chunk(reader, file))
+				break;
+		}
+		if (reader->inflight >= ROOTDIR_MAX_INFLIGHT)
+			break;
+	}
+}
+
+static bool is_inline_file(struct btrfs_fs_info *fs_info, const struct stat *st)
+{
+	return st->st_size <= BTRFS_MAX_INLINE_DATA_SIZE(fs_info) &&
+	       st->st_size < fs_info->sectorsize;
+}
+
+static struct rootdir_file *open_file(struct rootdir_reader *reader, int index,
+				      const char *name, const struct stat *st)
+{
+	struct rootdir_file *file;
+
+	file = calloc(1, sizeof(*file));
+	if (!file)
+		return NULL;
+	file->fd = open(name, O_RDONLY);
+	if (file->fd < 0) {
+		error("cannot open %s: %m", name);
+		free(file);
+		return NULL;
+	}
+	file->index = index;
+	file->size = round_up(st->st_size, reader->fs_info->sectorsize);
+	INIT_LIST_HEAD(&file->chunks);
+	reader->nr_files++;
+	return file;
+}
+
+/*
+ * Open the regular files of the directory listing from *@next_index on and
+ * start reading them. Files with hard links are left for later, as only the
+ * first link adds the data.
+ */
+static void read_ahead_files(struct rootdir_reader *reader,
+			     struct dirent **files, int count, int *next_index)
+{
+	struct rootdir_file *file;
+	struct stat st;
+
+	for (; *next_index < count; (*next_index)++) {
+		const char *name = files[*next_index]->d_name;
+
+		if (reader->nr_files >= ROOTDIR_MAX_FILES ||
+		    reader->inflight >= ROOTDIR_MAX_INFLIGHT)
+			break;
+		if (lstat(name, &st) < 0 || !S_ISREG(st.st_mode) ||
+		    st.st_nlink > 1 || st.st_size == 0 ||
+		    is_inline_file(reader->fs_info, &st))
+			continue;
+		/* Errors are reported when the file is added */
+		file = open_file(reader, *next_index, name, &st);
+		if (!file)
+			continue;
+		list_add_tail(&file->list, &reader->files);
+	}
+	submit_chunks(reader);
+}
+
+/* Return the next chunk of @file once it's read, or NULL at the end */
+static struct rootdir_chunk *next_file_chunk(struct rootdir_reader *reader,
+					     struct rootdir_file *file)
+{
+	struct rootdir_chunk *chunk;
+
+	/* The file being added is always read, regardless of the limit */
+	if (list_empty(&file->chunks) && !submit_chunk(reader, file)) {
+		if (!file->eof)
+			return ERR_PTR(-ENOMEM);
+		return NULL;
+	}
+	chunk = list_first_entry(&file->chunks, struct rootdir_chunk, list);
+
+	pthread_mutex_lock(&reader->lock);
+	while (!chunk->done)
+		pthread_cond_wait(&reader->done_cond, &reader->lock);
+	pthread_mutex_unlock(&reader->lock);
+	return chunk;
+}
+
+/*
+ * Reserve a data extent of up to @len bytes, smaller if there's no contiguous
+ * free space for it.
+ */
+static int reserve_data_extent(struct btrfs_trans_handle *trans,
+			       struct btrfs_root *root,
+			       struct rootdir_reader *reader, u64 len,
+			       struct btrfs_key *key)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	struct btrfs_block_group *cache;
+	bool shrunk = false;
+	int ret;
+
+	len = min(len, reader->max_extent);
+	while (1) {
+		ret = btrfs_reserve_extent(trans, root, len, 0, 0, (u64)-1, key,
+					   1);
+		if (ret != -ENOSPC || len <= fs_info->sectorsize)
+			break;
+		len = max_t(u64, round_down(len / 2, fs_info->sectorsize),
+			    fs_info->sectorsize);
+		shrunk = true;
+	}
+	if (ret)
+		return ret;
+
+	cache = btrfs_lookup_block_group(fs_info, key->objectid);
+	if (cache && cache->start != reader->last_block_group) {
+		/* Newly allocated block groups may be larger */
+		reader->last_block_group = cache->start;
+		reader->max_extent = min_t(u64, cache->length,
+					   BTRFS_MAX_EXTENT_SIZE);
+	} else if (shrunk) {
+		/* Avoid failing attempts until there's a new block group */
+		reader->max_extent = key->offset;
+	}
+	return 0;
+}
+
+/*
+ * Record the used part of the extent being filled by a file, the rest of the
+ * reservation is given back.
+ */
+static int finish_data_extent(struct btrfs_trans_handle *trans,
+			      struct btrfs_root *root, u64 objectid,
+			      struct btrfs_inode_item *btrfs_inode,
+			      u64 file_pos, u64 disk_bytenr, u64 len, u64 used)
+{
+	if (used < len)
+		set_extent_dirty(&trans->fs_info->free_space_cache,
+				 disk_bytenr + used, disk_bytenr + len - 1,
+				 GFP_NOFS);
+	if (!used)
+		return 0;
+	return btrfs_record_file_extent(trans, root, objectid, btrfs_inode,
+					file_pos, disk_bytenr, used);
+}
+
+/*
+ * Insert the extent item and the file extent item of a compressed extent of
+ * @disk_num_bytes at @disk_bytenr holding @ram_bytes of the file at
+ * @file_pos.
+ */
+static int record_compressed_extent(struct btrfs_trans_handle *trans,
+				    struct btrfs_root *root, u64 objectid,
+				    u64 file_pos, u64 disk_bytenr,
+				    u64 disk_num_bytes, u64 ram_bytes,
+				    enum btrfs_compression_type compression)
+{
+	struct btrfs_root *extent_root = btrfs_extent_root(trans->fs_info,
+							   disk_bytenr);
+	struct btrfs_file_extent_item *fi;
+	struct btrfs_extent_item *ei;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = disk_bytenr;
+	key.type = BTRFS_EXTENT_ITEM_KEY;
+	key.offset = disk_num_bytes;
+	ret = btrfs_insert_empty_item(trans, extent_root, &path, &key,
+				      sizeof(*ei));
+	if (ret)
+		goto out;
+	leaf = path.nodes[0];
+	ei = btrfs_item_ptr(leaf, path.slots[0], struct btrfs_extent_item);
+	btrfs_set_extent_refs(leaf, ei, 0);
+	btrfs_set_extent_generation(leaf, ei, trans->transid);
+	btrfs_set_extent_flags(leaf, ei, BTRFS_EXTENT_FLAG_DATA);
+	btrfs_mark_buffer_dirty(leaf);
+	btrfs_release_path(&path);
+
+	ret = btrfs_update_block_group(trans, disk_bytenr, disk_num_bytes, 1, 0);
+	if (ret)
+		goto out;
+	ret = remove_from_free_space_tree(trans, disk_bytenr, disk_num_bytes);
+	if (ret)
+		goto out;
+
+	key.objectid = objectid;
+	key.type = BTRFS_EXTENT_DATA_KEY;
+	key.offset = file_pos;
+	ret = btrfs_insert_empty_item(trans, root, &path, &key, sizeof(*fi));
+	if (ret)
+		goto out;
+	leaf = path.nodes[0];
+	fi = btrfs_item_ptr(leaf, path.slots[0], struct btrfs_file_extent_item);
+	btrfs_set_file_extent_generation(leaf, fi, trans->transid);
+	btrfs_set_file_extent_type(leaf, fi, BTRFS_FILE_EXTENT_REG);
+	btrfs_set_file_extent_disk_bytenr(leaf, fi, disk_bytenr);
+	btrfs_set_file_extent_disk_num_bytes(leaf, fi, disk_num_bytes);
+	btrfs_set_file_extent_offset(leaf, fi, 0);
+	btrfs_set_file_extent_num_bytes(leaf, fi, ram_bytes);
+	btrfs_set_file_extent_ram_bytes(leaf, fi, ram_bytes);
+	btrfs_set_file_extent_compression(leaf, fi, compression);
+	btrfs_set_file_extent_encryption(leaf, fi, 0);
+	btrfs_set_file_extent_other_encoding(leaf, fi, 0);
+	btrfs_mark_buffer_dirty(leaf);
+	btrfs_release_path(&path);
+
+	ret = btrfs_inc_extent_ref(trans, disk_bytenr, disk_num_bytes, 0,
+				   root->root_key.objectid, objectid, file_pos);
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+/* Write the compressed piece of @chunk at @offset as a separate extent */
+static int add_compressed_extent(struct btrfs_trans_handle *trans,
+				 struct btrfs_root *root,
+				 struct rootdir_reader *reader, u64 objectid,
+				 struct rootdir_chunk *chunk, u32 offset,
+				 u32 len, u32 clen)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	struct btrfs_key key;
+	int ret;
+
+	ret = btrfs_reserve_extent(trans, root, clen, 0, 0, (u64)-1, &key, 1);
+	if (ret)
+		return ret;
+	ret = write_data_to_disk(fs_info, chunk->cbuf + offset, key.objectid,
+				 clen);
+	if (ret)
+		return ret;
+	ret = btrfs_insert_file_csums(trans, key.objectid, clen,
+			BTRFS_EXTENT_CSUM_OBJECTID, fs_info->csum_type,
+			chunk->csums + offset / fs_info->sectorsize *
+			fs_info->csum_size);
+	if (ret)
+		return ret;
+	return record_compressed_extent(trans, root, objectid,
+					chunk->offset + offset, key.objectid,
+					clen, len, reader->compression);
+}
+
+static int update_inode_nbytes(struct btrfs_trans_handle *trans,
+			       struct btrfs_root *root, u64 objectid,
+			       u64 nbytes)
+{
+	struct btrfs_path path;
+	struct btrfs_key key;
+	struct btrfs_inode_item *ii;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = objectid;
+	key.type = BTRFS_INODE_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_lookup_inode(trans, root, &path, &key, 1);
+	if (ret > 0)
+		ret = -ENOENT;
+	if (ret < 0)
+		goto out;
+	ii = btrfs_item_ptr(path.nodes[0], path.slots[0],
+			    struct btrfs_inode_item);
+	btrfs_set_inode_nbytes(path.nodes[0], ii, nbytes);
+	btrfs_mark_buffer_dirty(path.nodes[0]);
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
 static int add_file_items(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *root,
 			  struct btrfs_inode_item *btrfs_inode, u64 objectid,
-			  struct stat *st, const char *path_name)
+			  struct stat *st, const char *path_name,
+			  struct rootdir_reader *reader, int index)
 {
 	struct btrfs_fs_info *fs_info = trans->fs_info;
+	const bool no_holes = btrfs_fs_incompat(fs_info, NO_HOLES);
+	const u32 sectorsize = fs_info->sectorsize;
 	int ret = -1;
 	ssize_t ret_read;
-	u64 bytes_read = 0;
 	struct btrfs_key key;
-	int blocks;
-	u32 sectorsize = fs_info->sectorsize;
-	u64 first_block = 0;
-	u64 file_pos = 0;
-	u64 cur_bytes;
-	u64 total_bytes;
-	void *buf = NULL;
-	int fd;
+	struct rootdir_file *file;
+	struct rootdir_chunk *chunk;
+	/* Extent being filled */
+	u64 extent_pos = 0;
+	u64 extent_start = 0;
+	u64 extent_len = 0;
+	u64 extent_used = 0;
+	/* End of the last data, the rest up to the next data is a hole */
+	u64 data_end = 0;
+	u64 nbytes = 0;
 
 	if (st->st_size == 0)
 		return 0;
 
-	fd = open(path_name, O_RDONLY);
-	if (fd == -1) {
-		error("cannot open %s: %m", path_name);
+	if (is_inline_file(fs_info, st)) {
+		char *buffer = malloc(st->st_size);
+		int fd;
+
+		if (!buffer)
+			return -ENOMEM;
+
+		fd = open(path_name, O_RDONLY);
+		if (fd == -1) {
+			error("cannot open %s: %m", path_name);
+			free(buffer);
+			return ret;
+		}
+		ret_read = pread(fd, buffer, st->st_size, 0);
+		if (ret_read == -1) {
+			error("cannot read %s at offset %llu length %llu: %m",
+				path_name, 0ULL, (unsigned long long)st->st_size);
+			ret = -1;
+		} else {
+			ret = btrfs_insert_inline_extent(trans, root, objectid,
+							 0, buffer, st->st_size);
+		}
+		free(buffer);
+		close(fd);
 		return ret;
 	}
 
-	blocks = st->st_size / sectorsize;
-	if (st->st_size % sectorsize)
-		blocks += 1;
+	/* The file is read ahead unless it has hard links */
+	file = list_first_entry_or_null(&reader->files, struct rootdir_file,
+					list);
+	if (!file || file->index != index) {
+		file = open_file(reader, index, path_name, st);
+		if (!file)
+			return ret;
+		list_add(&file->list, &reader->files);
+	}
 
-	if (st->st_size <= BTRFS_MAX_INLINE_DATA_SIZE(fs_info) &&
-	    st->st_size < sectorsize) {
-		char *buffer = malloc(st->st_size);
+	while (1) {
+		u32 offset = 0;
 
-		if (!buffer) {
-			ret = -ENOMEM;
+		chunk = next_file_chunk(reader, file);
+		if (IS_ERR(chunk)) {
+			ret = PTR_ERR(chunk);
 			goto end;
 		}
-
-		ret_read = pread(fd, buffer, st->st_size, bytes_read);
-		if (ret_read == -1) {
-			error("cannot read %s at offset %llu length %llu: %m",
-				path_name, bytes_read, (unsigned long long)st->st_size);
-			free(buffer);
+		if (!chunk)
+			break;
+		if (chunk->ret < 0) {
+			ret = chunk->ret;
+			errno = -ret;
+			error("cannot read %s at offset %llu length %u: %m",
+			      path_name, chunk->offset, chunk->len);
 			goto end;
 		}
 
-		ret = btrfs_insert_inline_extent(trans, root, objectid, 0,
-						 buffer, st->st_size);
-		free(buffer);
-		goto end;
-	}
+		while (offset < chunk->len) {
+			u64 pos = chunk->offset + offset;
+			u32 clen = 0;
+			u64 len;
 
-	/* round up our st_size to the FS blocksize */
-	total_bytes = (u64)blocks * sectorsize;
+			if (chunk->clens)
+				clen = chunk->clens[offset /
+						    BTRFS_MAX_UNCOMPRESSED];
+			/*
+			 * Extents are at most BTRFS_MAX_EXTENT_SIZE and don't
+			 * cross the end of a data segment, so the previous one
+			 * is full here unless it's followed by compressed data.
+			 */
+			if (extent_used == extent_len || clen) {
+				ret = finish_data_extent(trans, root, objectid,
+						btrfs_inode, extent_pos,
+						extent_start, extent_len,
+						extent_used);
+				if (ret)
+					goto end;
+				extent_len = 0;
+				extent_used = 0;
+				if (!no_holes && pos > data_end) {
+					ret = btrfs_record_file_extent(trans,
+						root, objectid, btrfs_inode,
+						data_end, 0, pos - data_end);
+					if (ret)
+						goto end;
+				}
+			}
+			if (clen) {
+				len = min_t(u32, chunk->len - offset,
+					    BTRFS_MAX_UNCOMPRESSED);
+				ret = add_compressed_extent(trans, root, reader,
+						objectid, chunk, offset, len,
+						clen);
+				if (ret) {
+					error("failed to write %s", path_name);
+					goto end;
+				}
+				offset += len;
+				nbytes += len;
+				data_end = pos + len;
+				continue;
+			}
+			if (extent_used == extent_len) {
+				ret = reserve_data_extent(trans, root, reader,
+						min_t(u64, chunk->data_end - pos,
+						      BTRFS_MAX_EXTENT_SIZE),
+						&key);
+				if (ret)
+					goto end;
+				extent_pos = pos;
+				extent_start = key.objectid;
+				extent_len = key.offset;
+				extent_used = 0;
+			}
 
-	buf = malloc(sectorsize);
-	if (!buf) {
-		ret = -ENOMEM;
-		goto end;
+			len = min_t(u64, chunk->len - offset,
+				    extent_len - extent_used);
+			/* Stop at the next piece, it may be compressed */
+			if (chunk->clens)
+				len = min_t(u64, len,
+					    BTRFS_MAX_UNCOMPRESSED -
+					    offset % BTRFS_MAX_UNCOMPRESSED);
+			ret = write_data_to_disk(fs_info, chunk->buf + offset,
+						 extent_start + extent_used, len);
+			if (ret) {
+				error("failed to write %s", path_name);
+				goto end;
+			}
+			ret = btrfs_insert_file_csums(trans,
+					extent_start + extent_used, len,
+					BTRFS_EXTENT_CSUM_OBJECTID,
+					fs_info->csum_type,
+					chunk->csums +
+					offset / sectorsize * fs_info->csum_size);
+			if (ret)
+				goto end;
+
+			extent_used += len;
+			offset += len;
+			nbytes += len;
+			data_end = pos + len;
+		}
+		free_file_chunk(reader, chunk);
+		submit_chunks(reader);
 	}
 
-again:
-
-	/*
-	 * keep our extent size at 1MB max, this makes it easier to work inside
-	 * the tiny block groups created during mkfs
-	 */
-	cur_bytes = min(total_bytes, (u64)SZ_1M);
-	ret = btrfs_reserve_extent(trans, root, cur_bytes, 0, 0, (u64)-1,
-				   &key, 1);
+	ret = finish_data_extent(trans, root, objectid, btrfs_inode,
+				 extent_pos, extent_start, extent_len,
+				 extent_used);
 	if (ret)
 		goto end;
+	if (!no_holes && file->size > data_end) {
+		ret = btrfs_record_file_extent(trans, root, objectid,
+					       btrfs_inode, data_end, 0,
+					       file->size - data_end);
+		if (ret)
+			goto end;
+	}
+	/* The inode was inserted with all the sectors counted */
+	if (nbytes != file->size)
+		ret = update_inode_nbytes(trans, root, objectid, nbytes);
+	else
+		ret = 0;
 
-	first_block = key.objectid;
-	bytes_read = 0;
+end:
+	release_file(reader, file);
+	return ret;
+}
 
-	while (bytes_read < cur_bytes) {
+/* Size of the reads for the digest of file content */
+#define DEDUPE_READ_SIZE		(SZ_1M)
+
+/* Files of the same size added with dedupe, in a tree by the size */
+struct dedupe_size {
+	struct rb_node node;
+	u64 size;
+	struct list_head files;
+};
+
+struct dedupe_file {
+	struct list_head list;
+	u64 ino;
+	/* Full path to compute the digest once a file of the same size comes */
+	char *path;
+	bool has_digest;
+	u8 digest[CRYPTO_HASH_SIZE_MAX];
+};
+
+static int dedupe_size_cmp(struct rb_node *node, void *key)
+{
+	struct dedupe_size *ds = rb_entry(node, struct dedupe_size, node);
+	u64 size = *(u64 *)key;
 
-		memset(buf, 0, sectorsize);
+	if (size < ds->size)
+		return -1;
+	if (size > ds->size)
+		return 1;
+	return 0;
+}
 
-		ret_read = pread(fd, buf, sectorsize, file_pos + bytes_read);
-		if (ret_read == -1) {
-			error("cannot read %s at offset %llu length %u: %m",
-				path_name, file_pos + bytes_read, sectorsize);
-			goto end;
-		}
+static int dedupe_size_cmp_nodes(struct rb_node *node1, struct rb_node *node2)
+{
+	struct dedupe_size *ds2 = rb_entry(node2, struct dedupe_size, node);
 
-		ret = write_data_to_disk(root->fs_info, buf,
-					 first_block + bytes_read, sectorsize);
-		if (ret) {
-			error("failed to write %s", path_name);
-			goto end;
-		}
+	return dedupe_size_cmp(node1, &ds2->size);
+}
 
-		ret = btrfs_csum_file_block(trans, first_block + bytes_read,
-					    BTRFS_EXTENT_CSUM_OBJECTID,
-					    fs_info->csum_type, buf);
-		if (ret)
-			goto end;
+static void free_dedupe_size(struct rb_node *node)
+{
+	struct dedupe_size *ds = rb_entry(node, struct dedupe_size, node);
+	struct dedupe_file *df;
+
+	while (!list_empty(&ds->files)) {
+		df = list_first_entry(&ds->files, struct dedupe_file, list);
+		list_del(&df->list);
+		free(df->path);
+		free(df);
+	}
+	free(ds);
+}
 
-		bytes_read += sectorsize;
+FREE_RB_BASED_TREE(dedupe_size, free_dedupe_size);
+
+/*
+ * Digest of the file content, each read is hashed together with the digest of
+ * the previous ones.
+ */
+static int file_digest(const char *path, u8 *digest)
+{
+	char *buf;
+	size_t len;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		error("cannot open %s: %m", path);
+		return ret;
+	}
+	buf = malloc(CRYPTO_HASH_SIZE_MAX + DEDUPE_READ_SIZE);
+	if (!buf) {
+		close(fd);
+		return -ENOMEM;
 	}
 
-	if (bytes_read) {
-		ret = btrfs_record_file_extent(trans, root, objectid,
-				btrfs_inode, file_pos, first_block, cur_bytes);
+	memset(digest, 0, CRYPTO_HASH_SIZE_MAX);
+	do {
+		for (len = 0; len < DEDUPE_READ_SIZE; len += ret) {
+			ret = read(fd, buf + CRYPTO_HASH_SIZE_MAX + len,
+				   DEDUPE_READ_SIZE - len);
+			if (ret < 0) {
+				ret = -errno;
+				error("cannot read %s: %m", path);
+				goto out;
+			}
+			if (ret == 0)
+				break;
+		}
+		memcpy(buf, digest, CRYPTO_HASH_SIZE_MAX);
+		hash_blake2b((u8 *)buf, CRYPTO_HASH_SIZE_MAX + len, digest);
+	} while (len == DEDUPE_READ_SIZE);
+	ret = 0;
+out:
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+/* Share all the file extents of @src_ino with @ino */
+static int clone_file_extents(struct btrfs_trans_handle *trans,
+			      struct btrfs_root *root, u64 src_ino, u64 ino)
+{
+	struct btrfs_file_extent_item fi;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	struct btrfs_key found_key;
+	u64 nbytes = 0;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = src_ino;
+	key.type = BTRFS_EXTENT_DATA_KEY;
+	key.offset = 0;
+	while (1) {
+		u64 disk_bytenr;
+		u64 num_bytes;
+
+		ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+		if (ret < 0)
+			goto out;
+		leaf = path.nodes[0];
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				break;
+			leaf = path.nodes[0];
+		}
+		btrfs_item_key_to_cpu(leaf, &found_key, path.slots[0]);
+		if (found_key.objectid != src_ino ||
+		    found_key.type != BTRFS_EXTENT_DATA_KEY)
+			break;
+		read_extent_buffer(leaf, &fi,
+				   btrfs_item_ptr_offset(leaf, path.slots[0]),
+				   sizeof(fi));
+		btrfs_release_path(&path);
+
+		key.objectid = ino;
+		key.offset = found_key.offset;
+		ret = btrfs_insert_item(trans, root, &key, &fi, sizeof(fi));
 		if (ret)
-			goto end;
+			goto out;
+
+		disk_bytenr = btrfs_stack_file_extent_disk_bytenr(&fi);
+		num_bytes = btrfs_stack_file_extent_num_bytes(&fi);
+		if (disk_bytenr) {
+			ret = btrfs_inc_extent_ref(trans, disk_bytenr,
+				btrfs_stack_file_extent_disk_num_bytes(&fi), 0,
+				root->root_key.objectid, ino,
+				found_key.offset -
+				btrfs_stack_file_extent_offset(&fi));
+			if (ret)
+				goto out;
+			nbytes += num_bytes;
+		}
 
+		key.objectid = src_ino;
+		key.offset = found_key.offset + 1;
 	}
+	btrfs_release_path(&path);
+	ret = update_inode_nbytes(trans, root, ino, nbytes);
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
 
-	file_pos += cur_bytes;
-	total_bytes -= cur_bytes;
+/*
+ * Share the extents of a file added before if it has the same content as the
+ * file @name in @dir_path. Return 1 if the extents were shared, 0 if the file
+ * is to be added, or a negative error.
+ */
+static int dedupe_file(struct btrfs_trans_handle *trans,
+		       struct btrfs_root *root, struct rb_root *dedupe_files,
+		       u64 ino, const struct stat *st, const char *dir_path,
+		       const char *name)
+{
+	char path[PATH_MAX];
+	struct dedupe_size *ds;
+	struct dedupe_file *df;
+	struct dedupe_file *new;
+	struct rb_node *node;
+	u64 size = st->st_size;
+	int ret;
 
-	if (total_bytes)
-		goto again;
+	if (size == 0 || is_inline_file(root->fs_info, st))
+		return 0;
+	if (path_cat_out(path, dir_path, name)) {
+		error("invalid path: %s/%s", dir_path, name);
+		return -EINVAL;
+	}
+	new = calloc(1, sizeof(*new));
+	if (!new)
+		return -ENOMEM;
+	new->ino = ino;
+	new->path = strdup(path);
+	if (!new->path) {
+		free(new);
+		return -ENOMEM;
+	}
 
-end:
-	free(buf);
-	close(fd);
+	node = rb_search(dedupe_files, &size, dedupe_size_cmp, NULL);
+	if (!node) {
+		ds = calloc(1, sizeof(*ds));
+		if (!ds) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		ds->size = size;
+		INIT_LIST_HEAD(&ds->files);
+		rb_insert(dedupe_files, &ds->node, dedupe_size_cmp_nodes);
+		list_add_tail(&new->list, &ds->files);
+		return 0;
+	}
+
+	ds = rb_entry(node, struct dedupe_size, node);
+	ret = file_digest(name, new->digest);
+	if (ret < 0)
+		goto out;
+	new->has_digest = true;
+	list_for_each_entry(df, &ds->files, list) {
+		if (!df->has_digest) {
+			ret = file_digest(df->path, df->digest);
+			if (ret < 0)
+				goto out;
+			df->has_digest = true;
+		}
+		if (memcmp(df->digest, new->digest, CRYPTO_HASH_SIZE_MAX))
+			continue;
+
+		pr_verbose(LOG_INFO, "DEDUPE: %s same as %s\n", new->path,
+			   df->path);
+		ret = clone_file_extents(trans, root, df->ino, ino);
+		if (ret == 0)
+			ret = 1;
+		goto out;
+	}
+	list_add_tail(&new->list, &ds->files);
+	return 0;
+out:
+	free(new->path);
+	free(new);
 	return ret;
 }
 
 static int traverse_directory(struct btrfs_trans_handle *trans,
 			      struct btrfs_root *root, const char *dir_name,
-			      struct directory_name_entry *dir_head)
+			      struct directory_name_entry *dir_head,
+			      struct rootdir_reader *reader,
+			      struct rb_root *dedupe_files)
 {
 	int ret = 0;
 
@@ -448,6 +1576,7 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 	struct extent_buffer *leaf;
 	struct btrfs_key root_dir_key;
 	u64 root_dir_inode_size = 0;
+	int next_read_ahead;
 
 	/* Add list for source directory */
 	dir_entry = malloc(sizeof(struct directory_name_entry));
@@ -510,11 +1639,16 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 			goto fail;
 		}
 
+		next_read_ahead = 0;
 		for (i = 0; i < count; i++) {
 			char tmp[PATH_MAX];
 
 			cur_file = files[i];
 
+			release_files_before(reader, i);
+			next_read_ahead = max(next_read_ahead, i);
+			read_ahead_files(reader, files, count, &next_read_ahead);
+
 			if (lstat(cur_file->d_name, &st) == -1) {
 				error("lstat failed for %s: %m",
 					cur_file->d_name);
@@ -597,9 +1731,26 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 				list_add_tail(&dir_entry->list,
 					      &dir_head->list);
 			} else if (S_ISREG(st.st_mode)) {
+				if (dedupe_files) {
+					ret = dedupe_file(trans, root,
+							  dedupe_files,
+							  cur_inum, &st,
+							  parent_dir_entry->path,
+							  cur_file->d_name);
+					if (ret < 0) {
+						error("unable to dedupe %s: %d",
+						      cur_file->d_name, ret);
+						goto fail;
+					}
+					if (ret > 0) {
+						ret = 0;
+						continue;
+					}
+				}
 				ret = add_file_items(trans, root, &cur_inode,
 						     cur_inum, &st,
-						     cur_file->d_name);
+						     cur_file->d_name, reader,
+						     i);
 				if (ret) {
 					error("unable to add file items for %s: %d",
 						cur_file->d_name, ret);
@@ -616,6 +1767,7 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 			}
 		}
 
+		release_files_before(reader, INT_MAX);
 		free_namelist(files, count);
 		free(parent_dir_entry->path);
 		free(parent_dir_entry);
@@ -627,6 +1779,7 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 out:
 	return !!ret;
 fail:
+	release_files_before(reader, INT_MAX);
 	free_namelist(files, count);
 fail_no_files:
 	free(parent_dir_entry);
@@ -636,13 +1789,17 @@ fail_no_dir:
 	goto out;
 }
 
-int btrfs_mkfs_fill_dir(const char *source_dir, struct btrfs_root *root)
+int btrfs_mkfs_fill_dir(const char *source_dir, struct btrfs_root *root,
+			enum btrfs_compression_type compression,
+			unsigned int compression_level, bool dedupe)
 {
 	int ret;
 	struct btrfs_trans_handle *trans;
 	struct stat root_st;
 	struct directory_name_entry dir_head;
 	struct directory_name_entry *dir_entry = NULL;
+	struct rootdir_reader reader;
+	struct rb_root dedupe_files = RB_ROOT;
 
 	ret = lstat(source_dir, &root_st);
 	if (ret) {
@@ -653,15 +1810,26 @@ int btrfs_mkfs_fill_dir(const char *source_dir, struct btrfs_root *root)
 
 	INIT_LIST_HEAD(&dir_head.list);
 
+	ret = rootdir_reader_init(&reader, root->fs_info, compression,
+				  compression_level);
+	if (ret < 0) {
+		rootdir_reader_free(&reader);
+		goto out;
+	}
+
 	trans = btrfs_start_transaction(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
 		error_msg(ERROR_MSG_START_TRANS, "%m");
+		rootdir_reader_free(&reader);
 		goto fail;
 }
 
-	ret = traverse_directory(trans, root, source_dir, &dir_head);
+	ret = traverse_directory(trans, root, source_dir, &dir_head, &reader,
+				 dedupe ? &dedupe_files : NULL);
+	rootdir_reader_free(&reader);
+	free_dedupe_size_tree(&dedupe_files);
 	if (ret) {
 		error("unable to traverse directory %s: %d", source_dir, ret);
 		goto fail;
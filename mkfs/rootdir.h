@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <stdbool.h>
 #include "kernel-lib/list.h"
+#include "kernel-shared/compression.h"
 
 struct btrfs_fs_info;
 struct btrfs_root;
@@ -36,7 +37,9 @@ struct directory_name_entry {
 	struct list_head list;
 };
 
-int btrfs_mkfs_fill_dir(const char *source_dir, struct btrfs_root *root);
+int btrfs_mkfs_fill_dir(const char *source_dir, struct btrfs_root *root,
+			enum btrfs_compression_type compression,
+			unsigned int compression_level, bool dedupe);
 u64 btrfs_mkfs_size_dir(const char *dir_name, u32 sectorsize, u64 min_dev_size,
 			u64 meta_profile, u64 data_profile);
 int btrfs_mkfs_shrink_fs(struct btrfs_fs_info *fs_info, u64 *new_size_ret,
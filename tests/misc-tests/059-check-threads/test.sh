@@ -0,0 +1,67 @@
+#!/bin/bash
+# Verify that 'btrfs check --threads' reports the same as a single threaded run
+
+source "$TEST_TOP/common" || exit
+source "$TEST_TOP/common.convert" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+check_kernel_support_acl
+
+run_check_mkfs_test_dev --nodesize 4096
+run_check_mount_test_dev
+populate_fs
+run_check_umount_test_dev
+
+_mktemp_local check-single.out
+_mktemp_local check-threads.out
+run_check_stdout $SUDO_HELPER "$TOP/btrfs" check "$TEST_DEV" > check-single.out
+run_check_stdout $SUDO_HELPER "$TOP/btrfs" check --threads 4 "$TEST_DEV" > check-threads.out
+run_check_stdout $SUDO_HELPER "$TOP/btrfs" check --mode=lowmem --threads 4 "$TEST_DEV"
+
+if ! diff -u check-single.out check-threads.out >> "$RESULTS" 2>&1; then
+	_fail "output of check with --threads differs"
+fi
+
+run_check_stdout $SUDO_HELPER "$TOP/btrfs" check --check-data-csum "$TEST_DEV" > check-single.out
+run_check_stdout $SUDO_HELPER "$TOP/btrfs" check --check-data-csum --threads 4 "$TEST_DEV" > check-threads.out
+
+if ! diff -u check-single.out check-threads.out >> "$RESULTS" 2>&1; then
+	_fail "output of check --check-data-csum with --threads differs"
+fi
+
+# The qgroups are accounted in batches of 1024 extents per thread, create
+# enough data extents for several batches. The snapshots share the tree blocks
+# and the files changed afterwards get shared refs, so the roots are resolved
+# through the parent tree blocks.
+run_check_mkfs_test_dev --nodesize 4096 -O quota
+run_check_mount_test_dev
+DATASET_SIZE=5000 generate_dataset small
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot "$TEST_MNT" "$TEST_MNT/snap1"
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot "$TEST_MNT" "$TEST_MNT/snap2"
+for num in $(seq 1 25 5000); do
+	run_check $SUDO_HELPER dd if=/dev/urandom of="$TEST_MNT/snap1/small/small.$num" \
+		bs=10K count=1 conv=notrunc status=noxfer >/dev/null 2>&1
+done
+run_check_umount_test_dev
+
+nr_extents=$(run_check_stdout "$TOP/btrfs" inspect-internal dump-tree -t extent "$TEST_DEV" | \
+	grep -c -e 'EXTENT_ITEM' -e 'METADATA_ITEM')
+if [ "$nr_extents" -lt 4096 ]; then
+	_fail "expected at least 4096 extents for the qgroup accounting, found $nr_extents"
+fi
+
+run_check_stdout $SUDO_HELPER "$TOP/btrfs" check --qgroup-report "$TEST_DEV" > check-single.out
+run_check_stdout $SUDO_HELPER "$TOP/btrfs" check --qgroup-report --threads 4 "$TEST_DEV" > check-threads.out
+
+if ! diff -u check-single.out check-threads.out >> "$RESULTS" 2>&1; then
+	_fail "output of check --qgroup-report with --threads differs"
+fi
+
+run_mustfail "--threads accepted with --repair" \
+	$SUDO_HELPER "$TOP/btrfs" check --repair --force --threads 4 "$TEST_DEV"
+
+rm -f -- check-single.out check-threads.out
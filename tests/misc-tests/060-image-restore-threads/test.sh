@@ -0,0 +1,33 @@
+#!/bin/bash
+# Verify that restoring a metadump image with several threads gives the same
+# result as with one thread, for uncompressed and compressed images
+
+source "$TEST_TOP/common" || exit
+source "$TEST_TOP/common.convert" || exit
+
+check_prereq btrfs-image
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir image)
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+populate_fs
+run_check_umount_test_dev
+
+for level in 0 9; do
+	run_check $SUDO_HELPER "$TOP/btrfs-image" -c "$level" "$TEST_DEV" "$tmp/dump"
+	run_check "$TOP/btrfs-image" -t 1 -r "$tmp/dump" "$tmp/restored-single"
+	run_check "$TOP/btrfs-image" -t 4 -r "$tmp/dump" "$tmp/restored-threads"
+	if ! cmp "$tmp/restored-single" "$tmp/restored-threads" >> "$RESULTS" 2>&1; then
+		_fail "restored images differ, compression level $level"
+	fi
+	run_check "$TOP/btrfs" check "$tmp/restored-threads"
+	rm -f -- "$tmp/dump" "$tmp/restored-single" "$tmp/restored-threads"
+done
+
+rm -rf -- "$tmp"
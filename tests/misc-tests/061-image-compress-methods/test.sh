@@ -0,0 +1,45 @@
+#!/bin/bash
+# Dump and restore images with all compression methods, with and without the
+# cluster index, the restored images must not differ
+
+source "$TEST_TOP/common" || exit
+source "$TEST_TOP/common.convert" || exit
+
+check_prereq btrfs-image
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir image)
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+populate_fs
+run_check_umount_test_dev
+
+run_check $SUDO_HELPER "$TOP/btrfs-image" -c 0 "$TEST_DEV" "$tmp/dump"
+run_check "$TOP/btrfs-image" -r "$tmp/dump" "$tmp/restored-ref"
+rm -f -- "$tmp/dump"
+
+for method in zlib zstd lz4; do
+	# zstd and lz4 are optional, the help lists the methods of the build
+	if ! "$TOP/btrfs-image" --help 2>&1 | grep -e "--compress-method" | \
+			grep -qw "$method"; then
+		_log "compression method $method not supported, skipped"
+		continue
+	fi
+	for index in "" "--index"; do
+		run_check $SUDO_HELPER "$TOP/btrfs-image" \
+			--compress-method "$method" $index "$TEST_DEV" "$tmp/dump"
+		run_check "$TOP/btrfs-image" -t 4 -r "$tmp/dump" "$tmp/restored"
+		if ! cmp "$tmp/restored-ref" "$tmp/restored" >> "$RESULTS" 2>&1; then
+			_fail "restored images differ, method $method $index"
+		fi
+		rm -f -- "$tmp/dump" "$tmp/restored"
+	done
+done
+run_check "$TOP/btrfs" check "$tmp/restored-ref"
+
+rm -rf -- "$tmp"
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Open metadump images directly by check and dump-tree, the output must match
+# the restored image
+
+source "$TEST_TOP/common" || exit
+source "$TEST_TOP/common.convert" || exit
+
+check_prereq btrfs-image
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir image)
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+populate_fs
+run_check_umount_test_dev
+
+for index in "" "--index"; do
+	run_check $SUDO_HELPER "$TOP/btrfs-image" $index "$TEST_DEV" "$tmp/dump"
+	run_check "$TOP/btrfs-image" -r "$tmp/dump" "$tmp/restored"
+
+	run_check "$TOP/btrfs" check "$tmp/dump"
+	run_check "$TOP/btrfs" check --mode=lowmem "$tmp/dump"
+	"$TOP/btrfs" inspect-internal dump-tree "$tmp/dump" > "$tmp/tree-dump" 2>&1 ||
+		_fail "dump-tree of the image failed, $index"
+	"$TOP/btrfs" inspect-internal dump-tree "$tmp/restored" > "$tmp/tree-restored" 2>&1 ||
+		_fail "dump-tree of the restored image failed, $index"
+	if ! cmp "$tmp/tree-dump" "$tmp/tree-restored" >> "$RESULTS" 2>&1; then
+		_fail "dump-tree output differs, $index"
+	fi
+	run_mustfail "image opened for writing" \
+		"$TOP/btrfs" check --repair --force "$tmp/dump"
+	rm -f -- "$tmp/dump" "$tmp/restored" "$tmp/tree-dump" "$tmp/tree-restored"
+done
+
+rm -rf -- "$tmp"
@@ -0,0 +1,22 @@
+#!/bin/bash
+# Print statistics of a send stream by receive --dump --stats
+
+source "$TEST_TOP/common" || exit
+
+check_prereq btrfs
+
+stream=$(extract_image "$TEST_TOP/misc-tests/016-send-clone-src/multi-clone-src-v4.8.2.stream.xz")
+tmp=$(_mktemp send-stats)
+
+run_check_stdout "$TOP/btrfs" receive --dump --stats -f "$stream" > "$tmp"
+grep -q '^write  *22 ' "$tmp" || _fail "wrong count of write commands"
+grep -q '^clone  *1 ' "$tmp" || _fail "wrong count of clone commands"
+grep -q 'data commands per file: *11.50' "$tmp" || _fail "wrong per-file stats"
+
+# Stream from a pipe, the size is not known
+cat "$stream" | run_check "$TOP/btrfs" receive --dump --stats
+
+printf 'btrfs-stream\0\0\0\0\0' | run_mustfail "parsing invalid stream did not fail" \
+	"$TOP/btrfs" receive --dump --stats
+
+rm -f -- "$stream" "$tmp"
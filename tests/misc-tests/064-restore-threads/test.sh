@@ -0,0 +1,53 @@
+#!/bin/bash
+# Restore files by restore --threads, the data extents are written out of
+# order and must result in the same content and times as the sequential
+# restore
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+prepare_test_dev
+
+tmp=$(_mktemp_dir restore-threads)
+restored=$(_mktemp_dir restore-threads-out)
+
+mkdir "$tmp/dir"
+# Inline and single extent files, written by different threads
+for i in $(seq 1 200); do
+	head -c $((i * 100)) /dev/urandom > "$tmp/dir/file$i"
+done
+# Many extents of one file when compressed, written in any order
+seq -f "line %g of a file with many compressed extents" 1 100000 > "$tmp/extents"
+# Data between holes, the size must be set after the last extent is written
+truncate -s 6M "$tmp/sparse"
+for offset in 1 3; do
+	head -c 100000 /dev/urandom |
+		dd of="$tmp/sparse" bs=1M seek="$offset" conv=notrunc status=none
+done
+# Times are set after all extents of the file are written
+touch -d '2001-02-03 04:05:06' "$tmp/extents" "$tmp/sparse" "$tmp/dir/file100"
+
+test_restore_threads()
+{
+	run_check_mkfs_test_dev --rootdir "$tmp" "$@"
+
+	for threads in 1 4; do
+		rm -rf -- "$restored"/*
+		run_check "$TOP/btrfs" restore -m --threads "$threads" \
+			"$TEST_DEV" "$restored"
+		run_check diff -r "$tmp" "$restored"
+		for file in extents dir/file100 sparse; do
+			if [ "$(stat -c %Y "$tmp/$file")" != \
+			     "$(stat -c %Y "$restored/$file")" ]; then
+				_fail "times of $file not restored"
+			fi
+		done
+	done
+}
+
+test_restore_threads
+test_restore_threads --compress zlib
+
+rm -rf -- "$tmp" "$restored"
@@ -0,0 +1,60 @@
+#!/bin/bash
+# Resume an interrupted restore from its journal, simulated by dropping the
+# last records of the journal and removing some of the restored files
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+prepare_test_dev
+
+tmp=$(_mktemp_dir restore-resume)
+restored=$(_mktemp_dir restore-resume-out)
+journal=$(_mktemp restore-resume-journal)
+
+# Enough files to be recorded in several journal records, a file to be
+# partially restored and a hardlink that is never recorded
+mkdir "$tmp/dir"
+for i in $(seq 1 50); do
+	head -c $((i * 1000)) /dev/urandom > "$tmp/dir/file$i"
+done
+head -c 20M /dev/urandom > "$tmp/big"
+ln "$tmp/dir/file1" "$tmp/link"
+
+run_check_mkfs_test_dev --rootdir "$tmp"
+
+test_resume()
+{
+	rm -rf -- "$restored"/*
+	run_check "$TOP/btrfs" restore "$@" --journal "$journal" "$TEST_DEV" \
+		"$restored"
+	run_check diff -r "$tmp" "$restored"
+
+	# Keep the header and 10 records, and a part of the next one
+	run_check truncate -s $((32 + 10 * 32 + 7)) "$journal"
+	run_check rm -f -- "$restored/dir/file40" "$restored/link"
+	run_check truncate -s 1M "$restored/big"
+	run_check "$TOP/btrfs" restore "$@" --journal "$journal" --resume \
+		"$TEST_DEV" "$restored"
+	run_check diff -r "$tmp" "$restored"
+
+	# Everything is recorded now, except for the hardlinked file
+	run_check_stdout "$TOP/btrfs" -vv restore "$@" --journal "$journal" \
+		--resume "$TEST_DEV" "$restored" > "$journal.log"
+	if ! grep -q "Skipping restored .*/big" "$journal.log"; then
+		_fail "restored file not skipped"
+	fi
+	if grep -q "Skipping restored .*/link" "$journal.log"; then
+		_fail "hardlinked file skipped"
+	fi
+	run_check diff -r "$tmp" "$restored"
+}
+
+test_resume
+test_resume --threads 4
+
+run_mustfail "resume without journal did not fail" \
+	"$TOP/btrfs" restore --resume "$TEST_DEV" "$restored"
+
+rm -rf -- "$tmp" "$restored" "$journal" "$journal.log"
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Compare filesystem du using FIEMAP and --tree-search, for exclusive,
+# reflinked, snapshotted, compressed and hardlinked files
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+check_global_prereq cp
+setup_root_helper
+prepare_test_dev
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev -o compress=zlib
+
+cd "$TEST_MNT"
+
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume create subv
+run_check $SUDO_HELPER mkdir subv/dir
+run_check $SUDO_HELPER dd if=/dev/urandom of=subv/random bs=1M count=4 status=none
+run_check $SUDO_HELPER dd if=/dev/zero of=subv/dir/zeros bs=1M count=4 status=none
+run_check $SUDO_HELPER cp --reflink=always subv/random subv/dir/reflink
+run_check $SUDO_HELPER ln subv/random subv/dir/hardlink
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume create subv/nested
+run_check $SUDO_HELPER dd if=/dev/urandom of=subv/nested/file bs=1M count=1 status=none
+run_check $SUDO_HELPER sync
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot subv snap
+# Changed after the snapshot, the rest is shared
+run_check $SUDO_HELPER dd if=/dev/urandom of=snap/dir/zeros bs=1M count=1 \
+	conv=notrunc status=none
+run_check $SUDO_HELPER sync
+
+for args in "subv" "snap" "-s subv snap" "subv/random"; do
+	fiemap=$(run_check_stdout $SUDO_HELPER "$TOP/btrfs" filesystem du --raw $args)
+	for threads in 1 4; do
+		search=$(run_check_stdout $SUDO_HELPER "$TOP/btrfs" filesystem du \
+			--raw --tree-search --threads "$threads" $args)
+		if [ "$fiemap" != "$search" ]; then
+			echo "FIEMAP:" >> "$RESULTS"
+			echo "$fiemap" >> "$RESULTS"
+			echo "tree search:" >> "$RESULTS"
+			echo "$search" >> "$RESULTS"
+			_fail "different output for $args with $threads threads"
+		fi
+	done
+done
+
+cd ..
+
+run_check_umount_test_dev
@@ -0,0 +1,93 @@
+#!/bin/bash
+# Verify that 'btrfs receive --threads' creates the same files as the sequential
+# receive, from a stream file, from a pipe and with several streams read by -e
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+check_prereq fssum
+check_global_prereq setfattr
+
+setup_root_helper
+prepare_test_dev
+
+FSSUM_PROG="$INTERNAL_BIN/fssum"
+tmp=$(_mktemp_dir receive-threads)
+run_check chmod a+rw "$tmp"
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+
+src="$TEST_MNT/src"
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume create "$src"
+run_check $SUDO_HELPER mkdir "$src/dir"
+
+# Files written by several commands each, the writes of different files are
+# queued to different threads
+for i in $(seq 1 60); do
+	run_check $SUDO_HELPER dd if=/dev/urandom of="$src/dir/file$i" \
+		bs=$((i * 7))K count=$((i % 5 + 1)) status=none
+done
+run_check $SUDO_HELPER cp --reflink=always "$src/dir/file60" "$src/clone"
+run_check $SUDO_HELPER ln "$src/dir/file1" "$src/link"
+run_check $SUDO_HELPER setfattr -n user.test -v value "$src/dir/file2"
+run_check $SUDO_HELPER chmod 4755 "$src/dir/file3"
+run_check $SUDO_HELPER truncate -s 3M "$src/dir/file4"
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$src" "$TEST_MNT/snap0"
+
+# Overwrite, rename and remove files for the incremental stream
+for i in $(seq 5 5 60); do
+	run_check $SUDO_HELPER dd if=/dev/urandom of="$src/dir/file$i" \
+		bs=4K seek=$i count=3 conv=notrunc status=none
+done
+run_check $SUDO_HELPER mv "$src/dir/file6" "$src/file6.renamed"
+run_check $SUDO_HELPER rm -f -- "$src/dir/file7"
+run_check $SUDO_HELPER dd if=/dev/urandom of="$src/dir/file7" bs=64K count=4 status=none
+run_check $SUDO_HELPER cp --reflink=always "$src/dir/file50" "$src/dir/file8"
+run_check $SUDO_HELPER chmod 2750 "$src/dir/file9"
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$src" "$TEST_MNT/snap1"
+
+run_check $SUDO_HELPER "$TOP/btrfs" send -f "$tmp/snap0.stream" "$TEST_MNT/snap0"
+run_check $SUDO_HELPER "$TOP/btrfs" send -p "$TEST_MNT/snap0" -f "$tmp/snap1.stream" \
+	"$TEST_MNT/snap1"
+run_check $FSSUM_PROG -A -f -w "$tmp/snap0.fssum" "$TEST_MNT/snap0"
+run_check $FSSUM_PROG -A -f -w "$tmp/snap1.fssum" "$TEST_MNT/snap1"
+run_check_umount_test_dev
+
+verify_received()
+{
+	run_check $FSSUM_PROG -r "$tmp/snap0.fssum" "$TEST_MNT/snap0"
+	run_check $FSSUM_PROG -r "$tmp/snap1.fssum" "$TEST_MNT/snap1"
+	run_check_umount_test_dev
+}
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+run_check $SUDO_HELPER "$TOP/btrfs" receive -f "$tmp/snap0.stream" "$TEST_MNT"
+run_check $SUDO_HELPER "$TOP/btrfs" receive -f "$tmp/snap1.stream" "$TEST_MNT"
+verify_received
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+run_check $SUDO_HELPER "$TOP/btrfs" receive --threads 4 -f "$tmp/snap0.stream" "$TEST_MNT"
+run_check $SUDO_HELPER "$TOP/btrfs" receive --threads 4 -f "$tmp/snap1.stream" "$TEST_MNT"
+verify_received
+
+# The stream is read ahead from a pipe by a separate thread
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+cat "$tmp/snap0.stream" "$tmp/snap1.stream" | \
+	run_check $SUDO_HELPER "$TOP/btrfs" receive --threads 4 "$TEST_MNT"
+verify_received
+
+# With -e each receive must leave the following stream in the pipe
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+cat "$tmp/snap0.stream" "$tmp/snap1.stream" | {
+	run_check $SUDO_HELPER "$TOP/btrfs" receive -e --threads 4 "$TEST_MNT"
+	run_check $SUDO_HELPER "$TOP/btrfs" receive -e --threads 4 "$TEST_MNT"
+}
+verify_received
+
+rm -rf -- "$tmp"
@@ -0,0 +1,38 @@
+#!/bin/bash
+# Convert the checksums of a filesystem with data from crc32c to all other
+# types, the data checksums must be valid afterwards
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfstune
+check_prereq btrfs
+
+if ! "$TOP/btrfstune" --help 2>&1 | grep -q -e "--csum"; then
+	_not_run "checksum conversion not supported, needs experimental build"
+fi
+
+prepare_test_dev
+
+tmp=$(_mktemp_dir tune-csum)
+
+# Inline files, files with data in several csum leaves and a sparse file
+mkdir "$tmp/dir"
+for i in $(seq 1 300); do
+	head -c $((i * 300)) /dev/urandom > "$tmp/dir/file$i"
+done
+head -c 16M /dev/urandom > "$tmp/big"
+truncate -s 8M "$tmp/sparse"
+head -c 100000 /dev/urandom |
+	dd of="$tmp/sparse" bs=1M seek=2 conv=notrunc status=none
+
+for csum in sha256 blake2 xxhash; do
+	run_check_mkfs_test_dev --csum crc32c --rootdir "$tmp"
+	run_check "$TOP/btrfs" check --check-data-csum "$TEST_DEV"
+	run_check "$TOP/btrfstune" --csum "$csum" "$TEST_DEV"
+	run_check_stdout "$TOP/btrfs" inspect-internal dump-super "$TEST_DEV" |
+		grep -q "csum_type.*($csum" || _fail "checksum type not $csum"
+	run_check "$TOP/btrfs" check --check-data-csum "$TEST_DEV"
+done
+
+rm -rf -- "$tmp"
@@ -0,0 +1,109 @@
+#!/bin/bash
+# Send several snapshots by 'btrfs send --threads' to a directory, full and
+# incremental, the streams must be the same as from the sequential send and
+# must receive to the same files
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+check_prereq fssum
+
+setup_root_helper
+prepare_test_dev
+
+FSSUM_PROG="$INTERNAL_BIN/fssum"
+tmp=$(_mktemp_dir send-threads)
+run_check chmod a+rw "$tmp"
+for dir in full incremental; do
+	run_check mkdir "$tmp/$dir"
+	run_check chmod a+rw "$tmp/$dir"
+done
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+
+src="$TEST_MNT/src"
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume create "$src"
+for i in $(seq 1 40); do
+	run_check $SUDO_HELPER dd if=/dev/urandom of="$src/file$i" \
+		bs=$((i * 5))K count=2 status=none
+done
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$src" "$TEST_MNT/snap1"
+
+# Modified, cloned, renamed and removed files for the incremental streams
+for i in $(seq 5 5 40); do
+	run_check $SUDO_HELPER dd if=/dev/urandom of="$src/file$i" \
+		bs=4K seek=$i count=2 conv=notrunc status=none
+done
+run_check $SUDO_HELPER cp --reflink=always "$src/file40" "$src/clone"
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$src" "$TEST_MNT/snap2"
+
+run_check $SUDO_HELPER rm -f -- "$src/file1" "$src/file2"
+run_check $SUDO_HELPER mv "$src/file3" "$src/file3.renamed"
+run_check $SUDO_HELPER dd if=/dev/urandom of="$src/new" bs=64K count=4 status=none
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$src" "$TEST_MNT/snap3"
+
+snaps="$TEST_MNT/snap1 $TEST_MNT/snap2 $TEST_MNT/snap3"
+run_check $SUDO_HELPER "$TOP/btrfs" send -f "$tmp/full.stream" $snaps
+run_check $SUDO_HELPER "$TOP/btrfs" send --threads 3 -f "$tmp/full" $snaps
+# The parents are determined from the clone sources and the previously sent
+# snapshots, snap2 is sent relative to snap1 and snap3 relative to snap2
+snaps="$TEST_MNT/snap2 $TEST_MNT/snap3"
+run_check $SUDO_HELPER "$TOP/btrfs" send -c "$TEST_MNT/snap1" \
+	-f "$tmp/incremental.stream" $snaps
+run_check $SUDO_HELPER "$TOP/btrfs" send --threads 2 -c "$TEST_MNT/snap1" \
+	-f "$tmp/incremental" $snaps
+for i in 1 2 3; do
+	run_check $FSSUM_PROG -A -f -w "$tmp/snap$i.fssum" "$TEST_MNT/snap$i"
+done
+run_check_umount_test_dev
+
+# Streams of the same snapshots and parents are the same
+compare_streams()
+{
+	local name="$1"
+
+	shift
+	run_check_stdout "$TOP/btrfs" receive --dump -f "$tmp/$name.stream" > \
+		"$tmp/$name.dump"
+	for snap in "$@"; do
+		run_check_stdout "$TOP/btrfs" receive --dump \
+			-f "$tmp/$name/$snap.stream"
+	done > "$tmp/$name-threads.dump"
+	run_check diff -u "$tmp/$name.dump" "$tmp/$name-threads.dump"
+}
+
+compare_streams full snap1 snap2 snap3
+compare_streams incremental snap2 snap3
+
+verify_received()
+{
+	for i in 1 2 3; do
+		run_check $FSSUM_PROG -r "$tmp/snap$i.fssum" "$TEST_MNT/snap$i"
+	done
+	run_check_umount_test_dev
+}
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+run_check $SUDO_HELPER "$TOP/btrfs" receive -f "$tmp/full.stream" "$TEST_MNT"
+verify_received
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+run_check $SUDO_HELPER "$TOP/btrfs" receive -f "$tmp/full/snap1.stream" "$TEST_MNT"
+run_check $SUDO_HELPER "$TOP/btrfs" receive -f "$tmp/incremental.stream" "$TEST_MNT"
+verify_received
+
+# The streams of --threads are received one by one in the order of sending
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+run_check $SUDO_HELPER "$TOP/btrfs" receive -f "$tmp/full/snap1.stream" "$TEST_MNT"
+for i in 2 3; do
+	run_check $SUDO_HELPER "$TOP/btrfs" receive \
+		-f "$tmp/incremental/snap$i.stream" "$TEST_MNT"
+done
+verify_received
+
+rm -rf -- "$tmp"
@@ -0,0 +1,54 @@
+#!/bin/bash
+# Test mkfs.btrfs --rootdir with --compress and --dedupe, the compressed
+# extents and the extents shared by identical files must pass the check and
+# restore to the same content
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+prepare_test_dev
+
+tmp=$(_mktemp_dir mkfs-rootdir)
+restored=$(_mktemp_dir mkfs-rootdir-restore)
+
+mkdir "$tmp/dir"
+seq 1 1000000 > "$tmp/text"
+cp "$tmp/text" "$tmp/dir/text-copy"
+# Incompressible data between compressible pieces
+for i in 1 2 3 4; do
+	head -c 200000 /dev/urandom
+	seq 1 30000
+done > "$tmp/mixed"
+cp "$tmp/mixed" "$tmp/dir/mixed-copy"
+# Same size, different content
+head -c 1000000 /dev/urandom > "$tmp/random"
+head -c 1000000 /dev/urandom > "$tmp/dir/random-other"
+truncate -s 10M "$tmp/sparse"
+seq 1 10000 | dd of="$tmp/sparse" bs=1M seek=4 conv=notrunc status=none
+
+test_compress_dedupe()
+{
+	run_check_mkfs_test_dev --rootdir "$tmp" --dedupe "$@"
+	run_check "$TOP/btrfs" check --check-data-csum "$TEST_DEV"
+
+	if ! run_check_stdout "$TOP/btrfs" inspect-internal dump-tree -t fs \
+		"$TEST_DEV" | grep -q "compression 1"; then
+		_fail "no compressed extents found"
+	fi
+	# Each identical pair has its data extents referenced twice
+	if ! run_check_stdout "$TOP/btrfs" inspect-internal dump-tree -t extent \
+		"$TEST_DEV" | grep -q "refs 2"; then
+		_fail "no shared extents found"
+	fi
+
+	rm -rf -- "$restored"/*
+	run_check "$TOP/btrfs" restore "$TEST_DEV" "$restored"
+	run_check diff -r "$tmp" "$restored"
+}
+
+test_compress_dedupe --compress zlib
+test_compress_dedupe --compress zlib:9 -O no-holes
+
+rm -rf -- "$tmp" "$restored"
@@ -18,12 +18,18 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "kernel-lib/bitops.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/volumes.h"
 #include "kernel-shared/file-item.h"
 #include "kernel-shared/extent_io.h"
 #include "kernel-shared/transaction.h"
+#include "common/device-utils.h"
 #include "common/messages.h"
 #include "common/internal.h"
 #include "common/utils.h"
@@ -161,60 +167,419 @@ static int read_verify_one_data_sector(struct btrfs_fs_info *fs_info,
 	return 0;
 }
 
-static int generate_new_csum_range(struct btrfs_trans_handle *trans,
-				   u64 logical, u64 length, u16 new_csum_type,
-				   const void *old_csums)
+/* Data read and checksummed by a thread at once */
+#define CSUM_CHANGE_CHUNK_SIZE		(SZ_1M)
+/* Data queued to the threads ahead of the insertion of the new csums */
+#define CSUM_CHANGE_QUEUE_SIZE		(SZ_64M)
+/*
+ * The threads also wait for the reads, start more of them than CPUs on small
+ * machines to keep several reads in flight.
+ */
+#define CSUM_CHANGE_MIN_THREADS		(4)
+#define CSUM_CHANGE_MAX_THREADS		(64)
+
+/* Contiguous range of data with old csums, within one device stripe */
+struct csum_change_chunk {
+	/* In csum_changer::chunks, in the logical order */
+	struct list_head list;
+	/* In csum_changer::pending until picked by a thread */
+	struct list_head pending;
+	u64 logical;
+	u32 len;
+	u32 capacity;
+	/* Where the first mirror is, or -1 if it can't be read directly */
+	int fd;
+	u64 physical;
+
+	void *buf;
+	u8 *old_csums;
+	/* Old type csums of the data read, valid if read_ok */
+	u8 *read_csums;
+	u8 *new_csums;
+	bool read_ok;
+	bool mismatch;
+	int ret;
+	bool done;
+};
+
+/*
+ * The data are read, verified against the old csums and checksummed with the
+ * new csum type by the threads, in large chunks. The main thread walks the
+ * old csum items ahead of them and inserts the new csums in the logical order,
+ * the sectors that fail the verification are read again sector by sector from
+ * all mirrors by the main thread.
+ *
+ * The threads don't access the trees, the chunks are mapped to the devices by
+ * the main thread.
+ */
+struct csum_changer {
+	struct btrfs_fs_info *fs_info;
+	u16 new_csum_type;
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t pending_cond;
+	pthread_cond_t done_cond;
+	struct list_head pending;
+	bool stop;
+
+	/* Accessed only by the main thread */
+	struct list_head chunks;
+	struct csum_change_chunk *filling;
+	u64 queued;
+};
+
+static void read_csum_change_chunk(struct csum_changer *changer,
+				   struct csum_change_chunk *chunk)
 {
-	struct btrfs_fs_info *fs_info = trans->fs_info;
+	struct btrfs_fs_info *fs_info = changer->fs_info;
 	const u32 sectorsize = fs_info->sectorsize;
-	int ret = 0;
-	void *buf;
+	const u32 nr = chunk->len / sectorsize;
+	ssize_t ret;
+
+	/* Failed reads are retried sector by sector by the main thread */
+	if (chunk->fd < 0)
+		return;
+	ret = btrfs_pread(chunk->fd, chunk->buf, chunk->len, chunk->physical,
+			  fs_info->zoned);
+	if (ret != chunk->len)
+		return;
+	chunk->read_ok = true;
+
+	chunk->ret = btrfs_csum_data_multi(fs_info, fs_info->csum_type,
+					   chunk->buf, chunk->read_csums,
+					   sectorsize, nr);
+	if (chunk->ret < 0)
+		return;
+	if (memcmp(chunk->read_csums, chunk->old_csums, nr * fs_info->csum_size))
+		chunk->mismatch = true;
+	chunk->ret = btrfs_csum_data_multi(fs_info, changer->new_csum_type,
+					   chunk->buf, chunk->new_csums,
+					   sectorsize, nr);
+}
 
-	buf = malloc(fs_info->sectorsize);
-	if (!buf)
+static void *csum_change_thread(void *arg)
+{
+	struct csum_changer *changer = arg;
+	struct csum_change_chunk *chunk;
+
+	while (1) {
+		pthread_mutex_lock(&changer->lock);
+		while (!changer->stop && list_empty(&changer->pending))
+			pthread_cond_wait(&changer->pending_cond, &changer->lock);
+		if (changer->stop) {
+			pthread_mutex_unlock(&changer->lock);
+			break;
+		}
+		chunk = list_first_entry(&changer->pending,
+					 struct csum_change_chunk, pending);
+		list_del_init(&chunk->pending);
+		pthread_mutex_unlock(&changer->lock);
+
+		read_csum_change_chunk(changer, chunk);
+
+		pthread_mutex_lock(&changer->lock);
+		chunk->done = true;
+		pthread_cond_broadcast(&changer->done_cond);
+		pthread_mutex_unlock(&changer->lock);
+	}
+	return NULL;
+}
+
+static int csum_changer_init(struct csum_changer *changer,
+			     struct btrfs_fs_info *fs_info, u16 new_csum_type)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int ret;
+	int i;
+
+	memset(changer, 0, sizeof(*changer));
+	changer->fs_info = fs_info;
+	changer->new_csum_type = new_csum_type;
+	pthread_mutex_init(&changer->lock, NULL);
+	pthread_cond_init(&changer->pending_cond, NULL);
+	pthread_cond_init(&changer->done_cond, NULL);
+	INIT_LIST_HEAD(&changer->pending);
+	INIT_LIST_HEAD(&changer->chunks);
+
+	nr_cpus = clamp_t(long, nr_cpus, CSUM_CHANGE_MIN_THREADS,
+			  CSUM_CHANGE_MAX_THREADS);
+	changer->threads = calloc(nr_cpus, sizeof(pthread_t));
+	if (!changer->threads)
 		return -ENOMEM;
+	for (i = 0; i < nr_cpus; i++) {
+		ret = pthread_create(&changer->threads[i], NULL,
+				     csum_change_thread, changer);
+		if (ret) {
+			errno = ret;
+			error("failed to start csum change thread: %m");
+			return -ret;
+		}
+		changer->nr_threads++;
+	}
+	return 0;
+}
 
-	for (u64 cur = logical; cur < logical + length; cur += sectorsize) {
-		ret = read_verify_one_data_sector(fs_info, cur, buf, old_csums +
-				(cur - logical) / sectorsize * fs_info->csum_size,
-				fs_info->csum_type, true);
+static void free_csum_change_chunk(struct csum_changer *changer,
+				   struct csum_change_chunk *chunk)
+{
+	list_del(&chunk->list);
+	changer->queued -= chunk->len;
+	free(chunk->buf);
+	free(chunk->old_csums);
+	free(chunk->read_csums);
+	free(chunk->new_csums);
+	free(chunk);
+}
 
-		if (ret < 0) {
-			error("failed to recover a good copy for data at logical %llu",
-			      logical);
-			goto out;
+static void csum_changer_free(struct csum_changer *changer)
+{
+	struct csum_change_chunk *chunk;
+	int i;
+
+	pthread_mutex_lock(&changer->lock);
+	changer->stop = true;
+	pthread_cond_broadcast(&changer->pending_cond);
+	pthread_mutex_unlock(&changer->lock);
+	for (i = 0; i < changer->nr_threads; i++)
+		pthread_join(changer->threads[i], NULL);
+	free(changer->threads);
+
+	while (!list_empty(&changer->chunks)) {
+		chunk = list_first_entry(&changer->chunks,
+					 struct csum_change_chunk, list);
+		free_csum_change_chunk(changer, chunk);
+	}
+	pthread_mutex_destroy(&changer->lock);
+	pthread_cond_destroy(&changer->pending_cond);
+	pthread_cond_destroy(&changer->done_cond);
+}
+
+/* Hand the chunk being filled over to the threads */
+static void submit_csum_change_chunk(struct csum_changer *changer)
+{
+	struct csum_change_chunk *chunk = changer->filling;
+
+	if (!chunk)
+		return;
+	changer->filling = NULL;
+	pthread_mutex_lock(&changer->lock);
+	list_add_tail(&chunk->pending, &changer->pending);
+	pthread_cond_signal(&changer->pending_cond);
+	pthread_mutex_unlock(&changer->lock);
+}
+
+/* Start a new chunk at @logical, up to the end of its stripe */
+static int alloc_csum_change_chunk(struct csum_changer *changer, u64 logical)
+{
+	struct btrfs_fs_info *fs_info = changer->fs_info;
+	const u32 sectorsize = fs_info->sectorsize;
+	struct btrfs_multi_bio *multi = NULL;
+	struct csum_change_chunk *chunk;
+	u64 *raid_map = NULL;
+	u64 len = CSUM_CHANGE_CHUNK_SIZE;
+	u32 nr;
+	int ret;
+
+	chunk = calloc(1, sizeof(*chunk));
+	if (!chunk)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&chunk->pending);
+	chunk->logical = logical;
+	chunk->fd = -1;
+	chunk->capacity = CSUM_CHANGE_CHUNK_SIZE;
+
+	ret = btrfs_map_block(fs_info, READ, logical, &len, &multi, 1, &raid_map);
+	if (ret == 0) {
+		chunk->capacity = round_down(min_t(u64, len, chunk->capacity),
+					     sectorsize);
+		chunk->capacity = max(chunk->capacity, sectorsize);
+		if (!fs_info->image && multi->stripes[0].dev->fd >= 0) {
+			chunk->fd = multi->stripes[0].dev->fd;
+			chunk->physical = multi->stripes[0].physical;
 		}
-		/* Calculate new csum and insert it into the csum tree. */
-		ret = btrfs_csum_file_block(trans, cur,
-				BTRFS_CSUM_CHANGE_OBJECTID, new_csum_type, buf);
-		if (ret < 0) {
-			errno = -ret;
-			error("failed to insert new csum for data at logical %llu: %m",
-			      cur);
-			goto out;
+		kfree(multi);
+		free(raid_map);
+	}
+
+	nr = chunk->capacity / sectorsize;
+	chunk->buf = malloc(chunk->capacity);
+	chunk->old_csums = malloc(nr * fs_info->csum_size);
+	chunk->read_csums = malloc(nr * fs_info->csum_size);
+	chunk->new_csums = malloc(nr * btrfs_csum_type_size(changer->new_csum_type));
+	list_add_tail(&chunk->list, &changer->chunks);
+	if (!chunk->buf || !chunk->old_csums || !chunk->read_csums ||
+	    !chunk->new_csums) {
+		free_csum_change_chunk(changer, chunk);
+		return -ENOMEM;
+	}
+	changer->filling = chunk;
+	return 0;
+}
+
+/* Queue the data of the csum item at @ptr of @leaf, covering @len bytes */
+static int queue_csum_item(struct csum_changer *changer, u64 logical, u64 len,
+			   struct extent_buffer *leaf, unsigned long ptr)
+{
+	const u32 sectorsize = changer->fs_info->sectorsize;
+	const u16 csum_size = changer->fs_info->csum_size;
+	struct csum_change_chunk *chunk;
+	u32 cur_len;
+	int ret;
+
+	while (len > 0) {
+		chunk = changer->filling;
+		if (chunk && chunk->logical + chunk->len != logical) {
+			submit_csum_change_chunk(changer);
+			chunk = NULL;
 		}
+		if (!chunk) {
+			ret = alloc_csum_change_chunk(changer, logical);
+			if (ret < 0)
+				return ret;
+			chunk = changer->filling;
+		}
+
+		cur_len = min_t(u64, len, chunk->capacity - chunk->len);
+		read_extent_buffer(leaf, chunk->old_csums +
+				   chunk->len / sectorsize * csum_size, ptr,
+				   cur_len / sectorsize * csum_size);
+		chunk->len += cur_len;
+		changer->queued += cur_len;
+		logical += cur_len;
+		len -= cur_len;
+		ptr += cur_len / sectorsize * csum_size;
+		if (chunk->len == chunk->capacity)
+			submit_csum_change_chunk(changer);
 	}
-out:
-	free(buf);
+	return 0;
+}
+
+/*
+ * Queue the data of the old csum items starting at *@cur up to the end of the
+ * leaf, and advance *@cur past them.
+ *
+ * Return >0 if there are no more old csum items.
+ * Return 0 if some were queued.
+ * Return <0 for errors.
+ */
+static int queue_csum_items(struct csum_changer *changer, u64 *cur)
+{
+	struct btrfs_fs_info *fs_info = changer->fs_info;
+	struct btrfs_root *csum_root = btrfs_csum_root(fs_info, 0);
+	struct btrfs_path path = { 0 };
+	struct extent_buffer *leaf;
+	struct btrfs_key key;
+	int slot;
+	int ret;
+
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = *cur;
+
+	ret = btrfs_search_slot(NULL, csum_root, &key, &path, 0, 0);
+	if (ret < 0)
+		return ret;
+	if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
+		ret = btrfs_next_leaf(csum_root, &path);
+		if (ret) {
+			btrfs_release_path(&path);
+			return ret;
+		}
+	}
+
+	ret = 0;
+	leaf = path.nodes[0];
+	for (slot = path.slots[0]; slot < btrfs_header_nritems(leaf); slot++) {
+		u64 len;
+
+		btrfs_item_key_to_cpu(leaf, &key, slot);
+		if (key.objectid != BTRFS_EXTENT_CSUM_OBJECTID ||
+		    key.type != BTRFS_EXTENT_CSUM_KEY) {
+			ret = 1;
+			break;
+		}
+		assert(key.offset >= *cur);
+		len = btrfs_item_size(leaf, slot) / fs_info->csum_size *
+		      fs_info->sectorsize;
+		ret = queue_csum_item(changer, key.offset, len, leaf,
+				      btrfs_item_ptr_offset(leaf, slot));
+		if (ret < 0)
+			break;
+		*cur = key.offset + len;
+	}
+	btrfs_release_path(&path);
+	submit_csum_change_chunk(changer);
 	return ret;
 }
 
 /*
- * After reading this many bytes of data, commit the current transaction.
+ * Wait for the threads to finish @chunk, and read the sectors that failed the
+ * verification again from all the mirrors.
+ */
+static int finish_csum_change_chunk(struct csum_changer *changer,
+				    struct csum_change_chunk *chunk)
+{
+	struct btrfs_fs_info *fs_info = changer->fs_info;
+	const u32 sectorsize = fs_info->sectorsize;
+	const u16 csum_size = fs_info->csum_size;
+	const u16 new_csum_size = btrfs_csum_type_size(changer->new_csum_type);
+	int ret;
+
+	pthread_mutex_lock(&changer->lock);
+	while (!chunk->done)
+		pthread_cond_wait(&changer->done_cond, &changer->lock);
+	pthread_mutex_unlock(&changer->lock);
+
+	if (chunk->ret < 0)
+		return chunk->ret;
+	if (chunk->read_ok && !chunk->mismatch)
+		return 0;
+
+	for (u32 offset = 0; offset < chunk->len; offset += sectorsize) {
+		const u32 index = offset / sectorsize;
+		const u8 *old_csum = chunk->old_csums + index * csum_size;
+		u8 new_csum[BTRFS_CSUM_SIZE];
+
+		if (chunk->read_ok &&
+		    memcmp(chunk->read_csums + index * csum_size, old_csum,
+			   csum_size) == 0)
+			continue;
+
+		ret = read_verify_one_data_sector(fs_info,
+				chunk->logical + offset, chunk->buf + offset,
+				old_csum, fs_info->csum_type, true);
+		if (ret < 0) {
+			error("failed to recover a good copy for data at logical %llu",
+			      chunk->logical + offset);
+			return ret;
+		}
+		/* btrfs_csum_data() clears whole BTRFS_CSUM_SIZE of the output */
+		btrfs_csum_data(fs_info, changer->new_csum_type,
+				chunk->buf + offset, new_csum, sectorsize);
+		memcpy(chunk->new_csums + index * new_csum_size, new_csum,
+		       new_csum_size);
+	}
+	return 0;
+}
+
+/*
+ * After inserting new csums for this many bytes of data, commit the current
+ * transaction.
  *
- * Only a soft cap, we can exceed the threshold if hitting a large enough csum
- * item.
+ * The new csums are inserted in the logical order, so at each commit they
+ * cover all the old csums up to the last new csum item and the conversion can
+ * be resumed from there.
  */
-#define CSUM_CHANGE_BYTES_THRESHOLD	(SZ_2M)
+#define CSUM_CHANGE_BYTES_THRESHOLD	(SZ_1G)
 static int generate_new_data_csums_range(struct btrfs_fs_info *fs_info, u64 start,
 					 u16 new_csum_type)
 {
 	struct btrfs_root *csum_root = btrfs_csum_root(fs_info, 0);
 	struct btrfs_trans_handle *trans;
-	struct btrfs_path path = { 0 };
-	struct btrfs_key key;
+	struct csum_changer changer;
+	struct csum_change_chunk *chunk;
 	const u32 new_csum_size = btrfs_csum_type_size(new_csum_type);
-	void *csum_buffer;
 	u64 converted_bytes = 0;
 	u64 last_csum;
 	u64 cur = start;
@@ -226,9 +591,9 @@ static int generate_new_data_csums_range(struct btrfs_fs_info *fs_info, u64 star
 		error("failed to get the last csum item: %m");
 		return ret;
 	}
-	csum_buffer = malloc(fs_info->nodesize);
-	if (!csum_buffer)
-		return -ENOMEM;
+	ret = csum_changer_init(&changer, fs_info, new_csum_type);
+	if (ret < 0)
+		goto out;
 
 	trans = btrfs_start_transaction(csum_root,
 			CSUM_CHANGE_BYTES_THRESHOLD / fs_info->sectorsize *
@@ -237,55 +602,44 @@ static int generate_new_data_csums_range(struct btrfs_fs_info *fs_info, u64 star
 		ret = PTR_ERR(trans);
 		errno = -ret;
 		error("failed to start transaction: %m");
-		return ret;
+		goto out;
 	}
 
-	while (cur < last_csum) {
-		u64 start;
-		u64 len;
-		u32 item_size;
-
-		key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
-		key.type = BTRFS_EXTENT_CSUM_KEY;
-		key.offset = cur;
-
-		ret = btrfs_search_slot(NULL, csum_root, &key, &path, 0, 0);
-		if (ret < 0)
-			goto out;
-		if (ret > 0 && path.slots[0] >=
-			       btrfs_header_nritems(path.nodes[0])) {
-			ret = btrfs_next_leaf(csum_root, &path);
-			if (ret > 0) {
-				ret = 0;
-				btrfs_release_path(&path);
-				break;
-			}
-			if (ret < 0) {
-				btrfs_release_path(&path);
+	while (1) {
+		while (cur < last_csum && changer.queued < CSUM_CHANGE_QUEUE_SIZE) {
+			ret = queue_csum_items(&changer, &cur);
+			if (ret < 0)
 				goto out;
-			}
+			if (ret > 0)
+				cur = last_csum;
 		}
-		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
-		assert(key.offset >= cur);
-		item_size = btrfs_item_size(path.nodes[0], path.slots[0]);
-
-		start = key.offset;
-		len = item_size / fs_info->csum_size * fs_info->sectorsize;
-		read_extent_buffer(path.nodes[0], csum_buffer,
-				btrfs_item_ptr_offset(path.nodes[0], path.slots[0]),
-				item_size);
-		btrfs_release_path(&path);
+		if (list_empty(&changer.chunks))
+			break;
 
-		ret = generate_new_csum_range(trans, start, len, new_csum_type,
-					      csum_buffer);
+		chunk = list_first_entry(&changer.chunks,
+					 struct csum_change_chunk, list);
+		ret = finish_csum_change_chunk(&changer, chunk);
 		if (ret < 0)
 			goto out;
-		converted_bytes += len;
+		ret = btrfs_insert_file_csums(trans, chunk->logical, chunk->len,
+					      BTRFS_CSUM_CHANGE_OBJECTID,
+					      new_csum_type, chunk->new_csums);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to insert new csum for data at logical %llu: %m",
+			      chunk->logical);
+			goto out;
+		}
+		converted_bytes += chunk->len;
+		free_csum_change_chunk(&changer, chunk);
+
 		if (converted_bytes >= CSUM_CHANGE_BYTES_THRESHOLD) {
 			converted_bytes = 0;
 			ret = btrfs_commit_transaction(trans, csum_root);
-			if (inject_error(0xfc35ae54))
-				return -EUCLEAN;
+			if (inject_error(0xfc35ae54)) {
+				ret = -EUCLEAN;
+				goto out;
+			}
 			if (ret < 0)
 				goto out;
 			trans = btrfs_start_transaction(csum_root,
@@ -296,13 +650,12 @@ static int generate_new_data_csums_range(struct btrfs_fs_info *fs_info, u64 star
 				goto out;
 			}
 		}
-		cur = start + len;
 	}
 	ret = btrfs_commit_transaction(trans, csum_root);
 	if (inject_error(0x4de02239))
-		return -EUCLEAN;
+		ret = -EUCLEAN;
 out:
-	free(csum_buffer);
+	csum_changer_free(&changer);
 	return ret;
 }
 
@@ -546,9 +899,474 @@ out:
 	return ret;
 }
 
+/* Tree blocks read, checked and written back in one batch */
+#define META_CSUM_BATCH_SIZE		(SZ_64M)
+/* Largest read or write of physically adjacent tree blocks */
+#define META_CSUM_MAX_IO		(SZ_1M)
+#define META_CSUM_MAX_THREADS		(64)
+/* Copies of a tree block, RAID1C4 */
+#define META_CSUM_MAX_STRIPES		(4)
+
+enum meta_csum_state {
+	/* To be read, and rewritten if it has the old csum */
+	META_CSUM_REWRITE,
+	/* Already has the new csum, from an interrupted change */
+	META_CSUM_DONE,
+	/* Left to rewrite_tree_block_csum(), eg. RAID56 or a bad first copy */
+	META_CSUM_FALLBACK,
+};
+
+struct meta_csum_block {
+	u64 logical;
+	void *data;
+	enum meta_csum_state state;
+	int nr_stripes;
+	/* Index to meta_csum_changer::devs and the offset of each copy */
+	int devs[META_CSUM_MAX_STRIPES];
+	u64 physical[META_CSUM_MAX_STRIPES];
+};
+
+/* Read or write of one copy of a tree block */
+struct meta_csum_io {
+	u64 physical;
+	struct meta_csum_block *block;
+};
+
+struct meta_csum_dev {
+	struct btrfs_device *dev;
+	/* Sorted by the physical offset */
+	struct meta_csum_io *ios;
+	int nr_ios;
+};
+
+enum meta_csum_task_type {
+	META_CSUM_READ,
+	META_CSUM_HASH,
+	META_CSUM_WRITE,
+};
+
+struct meta_csum_task {
+	struct list_head list;
+	enum meta_csum_task_type type;
+	/* Device to read from or write to */
+	struct meta_csum_dev *mdev;
+	/* Blocks to hash */
+	int start;
+	int end;
+};
+
+/*
+ * The tree blocks are collected from the extent tree by the main thread and
+ * processed in batches. The first copies are read by one task per device in
+ * the physical order, the csums are verified and recalculated by tasks over
+ * slices of the batch, and all the copies of the blocks with old csums are
+ * written back by one task per device, adjacent blocks by one read or write.
+ * The devices are thus accessed in parallel and the threads don't access the
+ * trees.
+ */
+struct meta_csum_changer {
+	struct btrfs_fs_info *fs_info;
+	u16 new_csum_type;
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t task_cond;
+	pthread_cond_t done_cond;
+	struct list_head tasks;
+	/* Queued and running tasks */
+	int nr_tasks;
+	bool stop;
+	/* First write error */
+	int ret;
+
+	struct meta_csum_block *blocks;
+	int nr_blocks;
+	int max_blocks;
+	void *data;
+	struct meta_csum_dev *devs;
+	int nr_devs;
+	struct meta_csum_task *task_buf;
+};
+
+/*
+ * Fill @iov with the run of physically adjacent ios of @mdev starting at
+ * @index, return the number of them.
+ */
+static int meta_csum_io_run(struct meta_csum_changer *mc,
+			    struct meta_csum_dev *mdev, int index,
+			    struct iovec *iov)
+{
+	const u32 nodesize = mc->fs_info->nodesize;
+	const int max_nr = META_CSUM_MAX_IO / nodesize ?: 1;
+	int nr = 0;
+
+	do {
+		iov[nr].iov_base = mdev->ios[index + nr].block->data;
+		iov[nr].iov_len = nodesize;
+		nr++;
+	} while (nr < max_nr && index + nr < mdev->nr_ios &&
+		 mdev->ios[index + nr].physical ==
+		 mdev->ios[index].physical + (u64)nr * nodesize);
+	return nr;
+}
+
+static void meta_csum_read(struct meta_csum_changer *mc,
+			   struct meta_csum_dev *mdev)
+{
+	const u32 nodesize = mc->fs_info->nodesize;
+	struct iovec iov[META_CSUM_MAX_IO / SZ_4K];
+	ssize_t ret;
+	int nr;
+
+	for (int i = 0; i < mdev->nr_ios; i += nr) {
+		nr = meta_csum_io_run(mc, mdev, i, iov);
+		ret = preadv(mdev->dev->fd, iov, nr, mdev->ios[i].physical);
+		if (ret == (ssize_t)nr * nodesize)
+			continue;
+		/* Read again with the usual error handling */
+		for (int j = i; j < i + nr; j++)
+			mdev->ios[j].block->state = META_CSUM_FALLBACK;
+	}
+}
+
+static void meta_csum_write(struct meta_csum_changer *mc,
+			    struct meta_csum_dev *mdev)
+{
+	const u32 nodesize = mc->fs_info->nodesize;
+	struct iovec iov[META_CSUM_MAX_IO / SZ_4K];
+	ssize_t ret;
+	int nr;
+
+	for (int i = 0; i < mdev->nr_ios; i += nr) {
+		nr = meta_csum_io_run(mc, mdev, i, iov);
+		ret = pwritev(mdev->dev->fd, iov, nr, mdev->ios[i].physical);
+		if (ret == (ssize_t)nr * nodesize)
+			continue;
+
+		pthread_mutex_lock(&mc->lock);
+		if (!mc->ret) {
+			mc->ret = ret < 0 ? -errno : -EIO;
+			errno = -mc->ret;
+			error("failed to write tree block at logical %llu: %m",
+			      mdev->ios[i].block->logical);
+		}
+		pthread_mutex_unlock(&mc->lock);
+		break;
+	}
+}
+
+static void meta_csum_hash(struct meta_csum_changer *mc, int start, int end)
+{
+	struct btrfs_fs_info *fs_info = mc->fs_info;
+	const u32 len = fs_info->nodesize - BTRFS_CSUM_SIZE;
+	u8 result_old[BTRFS_CSUM_SIZE];
+	u8 result_new[BTRFS_CSUM_SIZE];
+
+	for (int i = start; i < end; i++) {
+		struct meta_csum_block *block = &mc->blocks[i];
+
+		if (block->state != META_CSUM_REWRITE)
+			continue;
+
+		btrfs_csum_data(fs_info, fs_info->csum_type,
+				block->data + BTRFS_CSUM_SIZE, result_old, len);
+		btrfs_csum_data(fs_info, mc->new_csum_type,
+				block->data + BTRFS_CSUM_SIZE, result_new, len);
+		if (memcmp(block->data, result_old, fs_info->csum_size) == 0)
+			memcpy(block->data, result_new,
+			       btrfs_csum_type_size(mc->new_csum_type));
+		else if (memcmp(block->data, result_new, fs_info->csum_size) == 0)
+			block->state = META_CSUM_DONE;
+		else
+			block->state = META_CSUM_FALLBACK;
+	}
+}
+
+static void *meta_csum_thread(void *arg)
+{
+	struct meta_csum_changer *mc = arg;
+	struct meta_csum_task *task;
+
+	while (1) {
+		pthread_mutex_lock(&mc->lock);
+		while (!mc->stop && list_empty(&mc->tasks))
+			pthread_cond_wait(&mc->task_cond, &mc->lock);
+		if (mc->stop) {
+			pthread_mutex_unlock(&mc->lock);
+			break;
+		}
+		task = list_first_entry(&mc->tasks, struct meta_csum_task, list);
+		list_del_init(&task->list);
+		pthread_mutex_unlock(&mc->lock);
+
+		switch (task->type) {
+		case META_CSUM_READ:
+			meta_csum_read(mc, task->mdev);
+			break;
+		case META_CSUM_HASH:
+			meta_csum_hash(mc, task->start, task->end);
+			break;
+		case META_CSUM_WRITE:
+			meta_csum_write(mc, task->mdev);
+			break;
+		}
+
+		pthread_mutex_lock(&mc->lock);
+		mc->nr_tasks--;
+		if (mc->nr_tasks == 0)
+			pthread_cond_signal(&mc->done_cond);
+		pthread_mutex_unlock(&mc->lock);
+	}
+	return NULL;
+}
+
+static int meta_csum_changer_init(struct meta_csum_changer *mc,
+				  struct btrfs_fs_info *fs_info,
+				  u16 new_csum_type)
+{
+	struct btrfs_device *device;
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int ret;
+	int i;
+
+	memset(mc, 0, sizeof(*mc));
+	mc->fs_info = fs_info;
+	mc->new_csum_type = new_csum_type;
+	pthread_mutex_init(&mc->lock, NULL);
+	pthread_cond_init(&mc->task_cond, NULL);
+	pthread_cond_init(&mc->done_cond, NULL);
+	INIT_LIST_HEAD(&mc->tasks);
+
+	list_for_each_entry(device, &fs_info->fs_devices->devices, dev_list)
+		mc->nr_devs++;
+	mc->devs = calloc(mc->nr_devs, sizeof(*mc->devs));
+	mc->max_blocks = max_t(u32, META_CSUM_BATCH_SIZE / fs_info->nodesize, 1);
+	mc->blocks = calloc(mc->max_blocks, sizeof(*mc->blocks));
+	mc->data = malloc((size_t)mc->max_blocks * fs_info->nodesize);
+	for (i = 0; mc->devs && i < mc->nr_devs; i++) {
+		mc->devs[i].ios = malloc(mc->max_blocks * META_CSUM_MAX_STRIPES *
+					 sizeof(struct meta_csum_io));
+		if (!mc->devs[i].ios)
+			return -ENOMEM;
+	}
+	if (!mc->devs || !mc->blocks || !mc->data)
+		return -ENOMEM;
+	i = 0;
+	list_for_each_entry(device, &fs_info->fs_devices->devices, dev_list)
+		mc->devs[i++].dev = device;
+
+	/* Reads and writes are done by one thread per device */
+	nr_cpus = clamp_t(long, max_t(long, nr_cpus, mc->nr_devs), 1,
+			  META_CSUM_MAX_THREADS);
+	mc->task_buf = calloc(max_t(long, nr_cpus, mc->nr_devs),
+			      sizeof(*mc->task_buf));
+	mc->threads = calloc(nr_cpus, sizeof(pthread_t));
+	if (!mc->task_buf || !mc->threads)
+		return -ENOMEM;
+	for (i = 0; i < nr_cpus; i++) {
+		ret = pthread_create(&mc->threads[i], NULL, meta_csum_thread, mc);
+		if (ret) {
+			errno = ret;
+			error("failed to start csum change thread: %m");
+			return -ret;
+		}
+		mc->nr_threads++;
+	}
+	return 0;
+}
+
+static void meta_csum_changer_free(struct meta_csum_changer *mc)
+{
+	int i;
+
+	pthread_mutex_lock(&mc->lock);
+	mc->stop = true;
+	pthread_cond_broadcast(&mc->task_cond);
+	pthread_mutex_unlock(&mc->lock);
+	for (i = 0; i < mc->nr_threads; i++)
+		pthread_join(mc->threads[i], NULL);
+	free(mc->threads);
+	for (i = 0; mc->devs && i < mc->nr_devs; i++)
+		free(mc->devs[i].ios);
+	free(mc->devs);
+	free(mc->blocks);
+	free(mc->data);
+	free(mc->task_buf);
+	pthread_mutex_destroy(&mc->lock);
+	pthread_cond_destroy(&mc->task_cond);
+	pthread_cond_destroy(&mc->done_cond);
+}
+
+static void meta_csum_queue_task(struct meta_csum_changer *mc,
+				 struct meta_csum_task *task)
+{
+	pthread_mutex_lock(&mc->lock);
+	list_add_tail(&task->list, &mc->tasks);
+	mc->nr_tasks++;
+	pthread_cond_signal(&mc->task_cond);
+	pthread_mutex_unlock(&mc->lock);
+}
+
+static void meta_csum_wait_tasks(struct meta_csum_changer *mc)
+{
+	pthread_mutex_lock(&mc->lock);
+	while (mc->nr_tasks > 0)
+		pthread_cond_wait(&mc->done_cond, &mc->lock);
+	pthread_mutex_unlock(&mc->lock);
+}
+
+static int cmp_meta_csum_io(const void *a, const void *b)
+{
+	const struct meta_csum_io *io1 = a;
+	const struct meta_csum_io *io2 = b;
+
+	if (io1->physical < io2->physical)
+		return -1;
+	if (io1->physical > io2->physical)
+		return 1;
+	return 0;
+}
+
+/*
+ * Queue the reads of the first copies (@all_copies false) or the writes of all
+ * the copies of the blocks to be rewritten, one task per device.
+ */
+static void meta_csum_queue_io(struct meta_csum_changer *mc,
+			       enum meta_csum_task_type type, bool all_copies)
+{
+	struct meta_csum_task *task = mc->task_buf;
+	int i;
+
+	for (i = 0; i < mc->nr_devs; i++)
+		mc->devs[i].nr_ios = 0;
+	for (i = 0; i < mc->nr_blocks; i++) {
+		struct meta_csum_block *block = &mc->blocks[i];
+		const int nr_stripes = all_copies ? block->nr_stripes : 1;
+
+		if (block->state != META_CSUM_REWRITE)
+			continue;
+		for (int stripe = 0; stripe < nr_stripes; stripe++) {
+			struct meta_csum_dev *mdev = &mc->devs[block->devs[stripe]];
+
+			mdev->ios[mdev->nr_ios].physical = block->physical[stripe];
+			mdev->ios[mdev->nr_ios].block = block;
+			mdev->nr_ios++;
+		}
+	}
+	for (i = 0; i < mc->nr_devs; i++) {
+		struct meta_csum_dev *mdev = &mc->devs[i];
+
+		if (!mdev->nr_ios)
+			continue;
+		qsort(mdev->ios, mdev->nr_ios, sizeof(struct meta_csum_io),
+		      cmp_meta_csum_io);
+		task->type = type;
+		task->mdev = mdev;
+		meta_csum_queue_task(mc, task);
+		task++;
+	}
+}
+
+/* Rewrite the csums of the collected tree blocks */
+static int meta_csum_flush(struct meta_csum_changer *mc)
+{
+	const int slice = DIV_ROUND_UP(mc->nr_blocks, mc->nr_threads);
+	int ret;
+	int i;
+
+	meta_csum_queue_io(mc, META_CSUM_READ, false);
+	meta_csum_wait_tasks(mc);
+
+	for (i = 0; i < mc->nr_threads && i * slice < mc->nr_blocks; i++) {
+		struct meta_csum_task *task = &mc->task_buf[i];
+
+		task->type = META_CSUM_HASH;
+		task->start = i * slice;
+		task->end = min(mc->nr_blocks, (i + 1) * slice);
+		meta_csum_queue_task(mc, task);
+	}
+	meta_csum_wait_tasks(mc);
+
+	meta_csum_queue_io(mc, META_CSUM_WRITE, true);
+	meta_csum_wait_tasks(mc);
+	if (mc->ret < 0)
+		return mc->ret;
+
+	for (i = 0; i < mc->nr_blocks; i++) {
+		struct meta_csum_block *block = &mc->blocks[i];
+
+		if (block->state != META_CSUM_FALLBACK)
+			continue;
+		ret = rewrite_tree_block_csum(mc->fs_info, block->logical,
+					      mc->new_csum_type);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to rewrite csum for tree block %llu: %m",
+			      block->logical);
+			return ret;
+		}
+	}
+	mc->nr_blocks = 0;
+	return 0;
+}
+
+/*
+ * Add the tree block at @logical to the batch, mapped to the devices if it
+ * can be handled by the threads.
+ */
+static int meta_csum_add_block(struct meta_csum_changer *mc, u64 logical)
+{
+	struct btrfs_fs_info *fs_info = mc->fs_info;
+	struct meta_csum_block *block = &mc->blocks[mc->nr_blocks];
+	struct btrfs_multi_bio *multi = NULL;
+	u64 *raid_map = NULL;
+	u64 len = fs_info->nodesize;
+	int ret;
+
+	block->logical = logical;
+	block->data = mc->data + (size_t)mc->nr_blocks * fs_info->nodesize;
+	block->state = META_CSUM_FALLBACK;
+	block->nr_stripes = 0;
+	mc->nr_blocks++;
+
+	/* RAID56 needs the parity updated, zoned devices can't be overwritten */
+	if (fs_info->zoned || fs_info->image)
+		goto out;
+	ret = btrfs_map_block(fs_info, WRITE, logical, &len, &multi, 0,
+			      &raid_map);
+	if (ret)
+		goto out;
+	if (raid_map || len < fs_info->nodesize ||
+	    multi->num_stripes > META_CSUM_MAX_STRIPES)
+		goto out_free;
+
+	for (int i = 0; i < multi->num_stripes; i++) {
+		int dev;
+
+		for (dev = 0; dev < mc->nr_devs; dev++) {
+			if (mc->devs[dev].dev == multi->stripes[i].dev)
+				break;
+		}
+		if (dev == mc->nr_devs || multi->stripes[i].dev->fd <= 0)
+			goto out_free;
+		block->devs[i] = dev;
+		block->physical[i] = multi->stripes[i].physical;
+	}
+	block->nr_stripes = multi->num_stripes;
+	block->state = META_CSUM_REWRITE;
+out_free:
+	kfree(multi);
+	free(raid_map);
+out:
+	if (mc->nr_blocks == mc->max_blocks)
+		return meta_csum_flush(mc);
+	return 0;
+}
+
 static int change_meta_csums(struct btrfs_fs_info *fs_info, u16 new_csum_type)
 {
 	struct btrfs_root *extent_root = btrfs_extent_root(fs_info, 0);
+	struct meta_csum_changer mc;
 	struct btrfs_path path = { 0 };
 	struct btrfs_key key;
 	u64 super_flags;
@@ -572,6 +1390,13 @@ static int change_meta_csums(struct btrfs_fs_info *fs_info, u16 new_csum_type)
 	 */
 	fs_info->skip_csum_check = true;
 
+	ret = meta_csum_changer_init(&mc, fs_info, new_csum_type);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to prepare the metadata csum change: %m");
+		goto out;
+	}
+
 	key.objectid = 0;
 	key.type = 0;
 	key.offset = 0;
@@ -580,7 +1405,7 @@ static int change_meta_csums(struct btrfs_fs_info *fs_info, u16 new_csum_type)
 	if (ret < 0) {
 		errno = -ret;
 		error("failed to get the first tree block of extent tree: %m");
-		return ret;
+		goto out;
 	}
 	assert(ret > 0);
 	while (true) {
@@ -597,26 +1422,24 @@ static int change_meta_csums(struct btrfs_fs_info *fs_info, u16 new_csum_type)
 			    BTRFS_EXTENT_FLAG_DATA)
 				goto next;
 		}
-		ret = rewrite_tree_block_csum(fs_info, key.objectid, new_csum_type);
-		if (ret < 0) {
-			errno = -ret;
-			error("failed to rewrite csum for tree block %llu: %m",
-			      key.offset);
+		ret = meta_csum_add_block(&mc, key.objectid);
+		if (ret < 0)
 			goto out;
-		}
 next:
 		ret = btrfs_next_extent_item(extent_root, &path, U64_MAX);
 		if (ret < 0) {
 			errno = -ret;
 			error("failed to get next extent item: %m");
+			goto out;
 		}
 		if (ret > 0) {
-			ret = 0;
+			ret = meta_csum_flush(&mc);
 			goto out;
 		}
 	}
 out:
 	btrfs_release_path(&path);
+	meta_csum_changer_free(&mc);
 
 	/*
 	 * Finish the change by clearing the csum change flag, update the superblock